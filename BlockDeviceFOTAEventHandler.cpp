@@ -22,34 +22,182 @@
 #include "mbed-trace/mbed_trace.h"
 
 #include <assert.h>
+#include <string.h>
 
 #define TRACE_GROUP "FOTA"
 
+#if MBED_CONF_APP_FOTA_TRACE_FRAGMENTS
+#define tr_fragment(...) tr_debug(__VA_ARGS__)
+#else
+#define tr_fragment(...)
+#endif
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+BlockDeviceFOTAEventHandler::BlockDeviceFOTAEventHandler(mbed::BlockDevice &bd,
+        events::EventQueue &queue) : BlockDeviceFOTAEventHandler(bd, queue, queue) {
+}
+
 BlockDeviceFOTAEventHandler::BlockDeviceFOTAEventHandler(mbed::BlockDevice &bd,
-        events::EventQueue &queue) : _bd(bd), _queue(queue) {
+        events::EventQueue &queue, events::EventQueue &flash_queue) : _queue(queue),
+        _flash_queue(flash_queue),
+        _default_slot(bd, queue, flash_queue),
+        _slot(&_default_slot),
+        _delta(_session_buffers.delta_window, _stream_stash),
+        _decompressor(_session_buffers.lz_history, _stream_stash),
+        _decryptor(_session_buffers.keystream),
+        _receiver(_fragment_window) {
+    bool added = add_slot(FOTASlotRegistry::DEFAULT_IMAGE_ID, _default_slot);
+    assert(added);
+    (void) added;
+    _delta.set_output_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_transform_output));
+    _decompressor.set_output_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_transform_output));
+    _receiver.set_output_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_fragment_output));
+    _receiver.set_placement_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_fragment_placement));
+    _decryptor.set_output_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_decrypted_output));
 }
 
 BlockDeviceFOTAEventHandler::~BlockDeviceFOTAEventHandler() {
-    if(_bd_eraser) {
-        delete _bd_eraser;
+    _queue.cancel(_transform_event_id);
+    _queue.cancel(_keystream_event_id);
+}
+
+bool BlockDeviceFOTAEventHandler::add_slot(uint8_t image_id, FOTASlot &slot) {
+    if(!_slots.add(image_id, slot)) {
+        return false;
     }
+
+    /* Only the selected slot is written to, so all of them can report to the handler */
+    PagedBlockDeviceWriter &writer = slot.get_writer();
+    writer.set_backpressure_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_backpressure_changed));
+    writer.set_error_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_program_error));
+    writer.set_program_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_page_programmed));
+    slot.set_erase_callback(
+            mbed::callback(this, &BlockDeviceFOTAEventHandler::on_bd_erased));
+
+    return true;
 }
 
 FOTAService::StatusCode_t BlockDeviceFOTAEventHandler::on_binary_stream_written(
         FOTAService &svc, mbed::Span<const uint8_t> buffer) {
 
-    tr_info("bsc written, programming %llu bytes at address %llu",
-            (unsigned long long) buffer.size(), _addr);
-    int err = _bd.program(buffer.data(), _addr, buffer.size());
-    if(err) {
-        tr_error("programming block device failed: 0x%X", err);
-        return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+    /* The verifier hasn't caught up with the checkpoint yet, XON hasn't been sent */
+    if(_replaying) {
+        tr_warn("binary stream written before the fota session resumed");
+        return FOTAService::FOTA_STATUS_UNSPECIFIED_ERROR;
     }
 
-    _addr += buffer.size();
+    if(_transform) {
+        tr_fragment("bsc written, stashing %llu bytes",
+                (unsigned long long) buffer.size());
+        int err = _transform->feed(buffer);
+        if(err) {
+            tr_error("transforming binary stream failed: %d", err);
+            return get_transform_error_status(err);
+        }
+        _bytes_received += buffer.size();
+
+        /* Otherwise, it is picked up by the pending event */
+        if(_transform_event_id == 0) {
+            pump_transform();
+        }
+
+        return FOTAService::FOTA_STATUS_OK;
+    }
+
+    return write_image_data(buffer);
+
+}
+
+FOTAService::StatusCode_t BlockDeviceFOTAEventHandler::write_image_data(mbed::Span<const uint8_t> data) {
+    PagedBlockDeviceWriter &writer = _slot->get_writer();
+
+    /* Anything already held has to be written first, to keep the stream in order */
+    if(_held_size == 0) {
+        tr_fragment("bsc written, buffering %llu bytes at address %llu",
+                (unsigned long long) data.size(), writer.get_address());
+        int err = writer.write(data);
+        if(err == mbed::BD_ERROR_OK) {
+            _bytes_received += data.size();
+            update_verifier(data);
+            _slot->erase_ahead();
+            return FOTAService::FOTA_STATUS_OK;
+        }
+
+        if(err != PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL) {
+            tr_error("programming block device failed: 0x%X", err);
+            return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+        }
+    }
+
+    /* Data still in flight when XOFF was sent, the stash isn't used as the stream isn't transformed */
+    if((_held_size + data.size()) > sizeof(_stream_stash)) {
+        tr_error("staging buffers full, %llu bytes dropped", (unsigned long long) data.size());
+        return FOTAService::FOTA_STATUS_OUT_OF_MEMORY;
+    }
+
+    tr_fragment("staging buffers full, holding %llu bytes", (unsigned long long) data.size());
+    memcpy(_stream_stash + _held_size, data.data(), data.size());
+    _held_size += data.size();
+
+    update_flow_control();
 
     return FOTAService::FOTA_STATUS_OK;
+}
+
+FOTAService::StatusCode_t BlockDeviceFOTAEventHandler::write_held_data(bool now) {
+    if(_held_size == 0) {
+        return FOTAService::FOTA_STATUS_OK;
+    }
+
+    PagedBlockDeviceWriter &writer = _slot->get_writer();
+
+    /* The end of the session can't wait for the flash queue, pages are programmed on the spot to make room */
+    if(now && !_slot->finish_erase(writer.get_address() + _held_size)) {
+        return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+    }
+
+    while(_held_size != 0) {
+        if(now && (writer.get_free_size() < _held_size) && writer.program_full_pages()) {
+            tr_error("programming block device failed: 0x%X", writer.get_error());
+            return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+        }
+
+        size_t size = _held_size;
+        if(size > writer.get_free_size()) {
+            size = writer.get_free_size();
+        }
+        if(size == 0) {
+            return FOTAService::FOTA_STATUS_OK;
+        }
+
+        mbed::Span<const uint8_t> data = mbed::make_const_Span(_stream_stash, size);
+        int err = writer.write(data);
+        if(err) {
+            tr_error("programming block device failed: 0x%X", err);
+            return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+        }
+
+        _bytes_received += size;
+        update_verifier(data);
 
+        _held_size -= size;
+        memmove(_stream_stash, _stream_stash + size, _held_size);
+    }
+
+    _slot->erase_ahead();
+    update_flow_control();
+
+    return FOTAService::FOTA_STATUS_OK;
 }
 
 GattAuthCallbackReply_t BlockDeviceFOTAEventHandler::on_control_written(
@@ -69,36 +217,161 @@ GattAuthCallbackReply_t BlockDeviceFOTAEventHandler::on_control_written(
          * service itself will reject another FOTA_START control write
          */
         tr_info("fota session started");
-        svc.start_fota_session();
+        end_decryption();
+        start_new_session(svc, nullptr);
+        break;
+    }
 
-        /* We will do a "delayed start" */
-        svc.set_xoff();
+    case FOTA_OP_CODE_START_ENCRYPTED:
+    {
+        int err = _decryptor.start(buffer.subspan(1));
+        if(err) {
+            tr_error("can't decrypt the image with the given key: %d", err);
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
+
+        tr_info("fota encrypted session started");
+        _decrypt_failed = false;
+        start_new_session(svc, nullptr);
+        schedule_keystream();
+        break;
+    }
 
-        /* Initiate erase of the update block device */
-        if(_bd_eraser != nullptr) {
-            delete _bd_eraser;
+    case FOTA_OP_CODE_START_DELTA:
+    {
+        /* Patches are against the running application */
+        if((_delta_source == nullptr) || (_slot != &_default_slot)) {
+            return (GattAuthCallbackReply_t) FOTAService::AUTH_CALLBACK_REPLY_ATTERR_UNSUPPORTED_OPCODE;
         }
-        _bd_eraser = new PeriodicBlockDeviceEraser(_bd, _queue);
-        tr_info("erasing fota bd, size: %llu", (unsigned long long) _bd.size());
-        int err = _bd_eraser->start_erase(0, _bd.size(),
-                mbed::callback(this, &BlockDeviceFOTAEventHandler::on_bd_erased));
 
+        tr_info("fota delta session started");
+        end_decryption();
+        _delta.reset(*_delta_source);
+        start_new_session(svc, &_delta);
+        break;
+    }
+
+    case FOTA_OP_CODE_START_COMPRESSED:
+    {
+        tr_info("fota compressed session started");
+        end_decryption();
+        _decompressor.reset();
+        start_new_session(svc, &_decompressor);
+        break;
+    }
+
+    case FOTA_OP_CODE_RESUME:
+    {
+        fota_checkpoint_t checkpoint;
+        if((_slot != &_default_slot) || (_checkpoint_store == nullptr) || !_checkpoint_store->load(checkpoint)) {
+            tr_warn("no fota session to resume");
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
+
+        /* Encrypted sessions are resumed with the wrapped key, the checkpointed data is decrypted again to verify it */
+        if(buffer.size() > 1) {
+            int err = _decryptor.start(buffer.subspan(1));
+            if(err) {
+                tr_error("can't decrypt the image with the given key: %d", err);
+                return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+            }
+            _decrypt_failed = false;
+        } else {
+            end_decryption();
+        }
+
+        bd_size_t image_end = _default_slot.get_bd().size() - _default_slot.get_trailer_size();
+        if(checkpoint.committed >= image_end) {
+            tr_error("checkpoint doesn't match the update BlockDevice, discarding it");
+            clear_checkpoint();
+            end_decryption();
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
+
+        tr_info("resuming fota session at %lu", (unsigned long) checkpoint.committed);
+
+        int err = _default_slot.get_writer().resume(checkpoint.committed, checkpoint.crc_state);
         assert(!err);
+
+        _transform = nullptr;
+
+        /* Reading back up to the whole slot takes too long for the GATT callback, XON is sent once it's checked */
+        start_replay(checkpoint);
+        start_session(svc, checkpoint.committed);
+        schedule_keystream();
+        break;
+    }
+
+    case FOTA_OP_CODE_SYNC:
+    {
+        if(_ext_svc == nullptr) {
+            return (GattAuthCallbackReply_t) FOTAService::AUTH_CALLBACK_REPLY_ATTERR_UNSUPPORTED_OPCODE;
+        }
+
+        publish_fragment_status();
+        publish_transfer_status();
+        publish_session_stats();
+        break;
+    }
+
+    case FOTA_OP_CODE_SELECT_SLOT:
+    {
+        FOTASlot *slot = (buffer.size() >= 2) ? _slots.find(buffer[1]) : nullptr;
+        if((slot == nullptr) || _session_active) {
+            tr_warn("can't select the fota slot of image %u", (buffer.size() >= 2) ? buffer[1] : 0);
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
+
+        tr_info("fota slot of image %u selected", buffer[1]);
+        _slot = slot;
+        _image_id = buffer[1];
+        break;
+    }
+
+    case FOTA_OP_CODE_PREPARE_SLOT:
+    {
+        FOTASlot *slot = (buffer.size() >= 2) ? _slots.find(buffer[1]) : nullptr;
+        if((slot == nullptr) || (_session_active && (slot == _slot))) {
+            tr_warn("can't prepare the fota slot of image %u", (buffer.size() >= 2) ? buffer[1] : 0);
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
+
+        /* The checkpoint refers to what is about to be erased */
+        if(slot == &_default_slot) {
+            clear_checkpoint();
+        }
+
+        tr_info("preparing the fota slot of image %u", buffer[1]);
+        slot->prepare();
         break;
     }
 
     case FOTAService::FOTA_STOP:
     {
+        cancel_replay();
+        _session_active = false;
+        _held_size = 0;
         svc.stop_fota_session();
         tr_info("fota session cancelled");
-        // TODO do we need to do anything here to handle cancelled FOTA?
+        /* The partial page isn't flushed, it would only be padded: a new
+         * session starts over and a resumed one carries on from the last
+         * checkpoint, which is always on a page boundary
+         */
+        end_decryption();
+        end_session_stats();
         break;
     }
 
     case FOTAService::FOTA_COMMIT:
     {
         tr_info("fota commit");
+        _session_active = false;
         svc.stop_fota_session();
+        FOTAService::StatusCode_t status = finish_session();
+        if(status != FOTAService::FOTA_STATUS_OK) {
+            svc.notify_status(status);
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
         break;
     }
 
@@ -112,12 +385,739 @@ GattAuthCallbackReply_t BlockDeviceFOTAEventHandler::on_control_written(
     return AUTH_CALLBACK_REPLY_SUCCESS;
 }
 
+FOTAService::StatusCode_t BlockDeviceFOTAEventHandler::finish_session() {
+    FOTAService::StatusCode_t status;
+    if(_replaying) {
+        /* Nothing was sent since the checkpoint, which is kept for the next attempt */
+        tr_error("fota session committed before it resumed");
+        cancel_replay();
+        status = FOTAService::FOTA_STATUS_VALIDATION_FAILURE;
+    } else {
+        status = finish_transform();
+    }
+
+    /* Data held while the staging buffers were full is part of the image */
+    if(status == FOTAService::FOTA_STATUS_OK) {
+        status = write_held_data(true);
+    }
+
+    if((status == FOTAService::FOTA_STATUS_OK) && !_slot->flush()) {
+        status = FOTAService::FOTA_STATUS_MEMORY_ERROR;
+    }
+
+    /* The keystream and key mustn't outlive the session, whether it succeeded or not */
+    end_decryption();
+    end_session_stats();
+
+    if(status != FOTAService::FOTA_STATUS_OK) {
+        return status;
+    }
+
+    /* The image is either complete or rejected, there is nothing left to resume */
+    clear_checkpoint();
+    if(_slot->get_verify_image() && !_verifier.verify()) {
+        tr_error("image verification failed (%s)",
+                _verifier.is_complete() ? "hash mismatch" : "incomplete or malformed image");
+        return FOTAService::FOTA_STATUS_VALIDATION_FAILURE;
+    }
+
+    return FOTAService::FOTA_STATUS_OK;
+}
+
+void BlockDeviceFOTAEventHandler::start_new_session(FOTAService &svc, StreamTransform *transform) {
+    int err = _slot->get_writer().reset(0);
+    assert(!err);
+
+    _verifier.reset();
+
+    /* A new session invalidates whatever was saved for the previous one */
+    cancel_replay();
+    clear_checkpoint();
+
+    _transform = transform;
+    start_session(svc, 0);
+}
+
+void BlockDeviceFOTAEventHandler::start_session(FOTAService &svc, bd_addr_t addr) {
+    svc.start_fota_session();
+
+    /*
+     * Fragment indexes restart from 0 at the start (or resume) offset, and
+     * the fragment size is fixed for the session from the current MTU
+     */
+    _receiver.reset(_ext_svc ? _ext_svc->get_max_fragment_size() : MBED_CONF_APP_FOTA_FRAGMENT_SIZE);
+    _session_active = true;
+
+    _session_timer.reset();
+    _session_timer.start();
+    _xoff_time = std::chrono::microseconds(0);
+    _xoff_count = 0;
+    _bytes_received = 0;
+    _held_size = 0;
+    _fragment_gaps = 0;
+    _invalid_fragments = 0;
+    _fragments_received = false;
+
+    /* No credit until the slot is ready */
+    _credit_limit = 0;
+    publish_stream_credit();
+
+    tr_info("fragment size: %u, window: %u", (unsigned) _receiver.get_fragment_size(),
+            (unsigned) _receiver.get_window());
+    publish_fragment_status();
+
+    _queue.cancel(_transform_event_id);
+    _transform_event_id = 0;
+
+    /* We will do a "delayed start", unless the slot has already been prepared */
+    send_flow_control(true);
+
+    _slot->begin(addr);
+    update_flow_control();
+}
+
 void BlockDeviceFOTAEventHandler::on_bd_erased(int result) {
     if(result != mbed::BD_ERROR_OK) {
-        tr_error("error when erasing block device: 0x%X", -result);
+        if(_fota_svc) {
+            _fota_svc->notify_status(FOTAService::FOTA_STATUS_MEMORY_ERROR);
+        }
+        return;
+    }
+
+    /* The selected slot may be ready for the transfer to start */
+    update_flow_control();
+}
+
+void BlockDeviceFOTAEventHandler::on_backpressure_changed(bool backpressured) {
+    tr_debug("staging buffers %s", backpressured ? "full" : "drained");
+
+    /* Carry on transforming the stream now there is room for its output */
+    if(!backpressured && _transform && (_transform_event_id == 0)) {
+        pump_transform();
+        return;
+    }
+
+    update_flow_control();
+}
+
+void BlockDeviceFOTAEventHandler::on_program_error(int result) {
+    tr_error("programming block device failed: 0x%X", result);
+    if(_fota_svc) {
         _fota_svc->notify_status(FOTAService::FOTA_STATUS_MEMORY_ERROR);
+    }
+}
+
+void BlockDeviceFOTAEventHandler::update_flow_control() {
+    update_stream_credit();
+
+    /* Erasing may carry on after the session is stopped */
+    if(!_fota_svc || !_session_active) {
+        return;
+    }
+
+    /* Keep half of the stash free for fragments still in flight */
+    bool xoff = _replaying || !_slot->is_ready() || _slot->get_writer().is_backpressured() || (_held_size != 0) ||
+            (_transform && (_transform->get_stash_fill() > (_transform->get_stash_size() / 2)));
+    if(xoff == _xoff) {
+        return;
+    }
+
+    send_flow_control(xoff);
+}
+
+void BlockDeviceFOTAEventHandler::send_flow_control(bool xoff) {
+    std::chrono::microseconds now = _session_timer.elapsed_time();
+    if(xoff) {
+        _xoff_since = now;
+        _xoff_count++;
+        _fota_svc->set_xoff();
     } else {
-        tr_info("successfully erased the update BlockDevice");
+        if(_xoff) {
+            _xoff_time += now - _xoff_since;
+        }
         _fota_svc->set_xon();
     }
+
+    _xoff = xoff;
+}
+
+void BlockDeviceFOTAEventHandler::update_stream_credit() {
+    if(!_session_active || (_ext_svc == nullptr)) {
+        return;
+    }
+
+    /* Whatever fits in the staging buffers can be sent without stalling the link */
+    uint32_t limit = _bytes_received;
+    if(_slot->is_ready() && !_replaying) {
+        if(_transform) {
+            limit += _transform->get_stash_size() - _transform->get_stash_fill();
+        } else {
+            bd_size_t free_size = _slot->get_writer().get_free_size();
+            limit += (free_size > _held_size) ? (free_size - _held_size) : 0;
+        }
+    }
+
+    /* Credit already granted can't be taken back */
+    if(limit > _credit_limit) {
+        _credit_limit = limit;
+    }
+
+    if(_credit_limit == _credit_notified) {
+        return;
+    }
+
+    /* Batch small grants, unless the client is about to run out */
+    if(((_credit_limit - _credit_notified) < MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE) &&
+            (_credit_notified > (_bytes_received + MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE))) {
+        return;
+    }
+
+    publish_stream_credit();
+}
+
+void BlockDeviceFOTAEventHandler::publish_stream_credit() {
+    if(_ext_svc == nullptr) {
+        return;
+    }
+
+    fota_stream_credit_t credit;
+    credit.limit = _credit_limit;
+    _ext_svc->set_stream_credit(credit);
+    _credit_notified = _credit_limit;
+}
+
+void BlockDeviceFOTAEventHandler::set_checkpoint_store(FOTACheckpointStore *store) {
+    _checkpoint_store = store;
+    publish_session_info();
+}
+
+void BlockDeviceFOTAEventHandler::set_extension_service(FOTAExtensionService *svc) {
+    _ext_svc = svc;
+    if(_ext_svc) {
+        _ext_svc->set_event_handler(this);
+    }
+    publish_session_info();
+    publish_fragment_status();
+}
+
+void BlockDeviceFOTAEventHandler::on_page_programmed(bd_addr_t addr, uint32_t crc_state) {
+    /* The page is free to hold more of the stream, starting with what was held back */
+    FOTAService::StatusCode_t status = write_held_data();
+    if((status != FOTAService::FOTA_STATUS_OK) && _fota_svc) {
+        _fota_svc->notify_status(status);
+    }
+    if(_session_active && !_replaying && (_receiver.resume() == 0)) {
+        publish_fragment_progress();
+    }
+    update_stream_credit();
+
+    if((_checkpoint_store == nullptr) || (MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL == 0)) {
+        return;
+    }
+
+    /* Delta and compressed sessions can't be resumed, the stream offset isn't tracked */
+    if(_transform) {
+        return;
+    }
+
+    /* Checkpoints don't record which slot they are for, only image 0 is resumable */
+    if(_slot != &_default_slot) {
+        return;
+    }
+
+    /* A resumed session erases everything from the checkpoint onwards, so
+     * checkpoints must fall on a sector boundary. Padding programmed when
+     * flushing (past the write address) is not part of the image.
+     */
+    if(((addr % MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL) != 0) ||
+            ((addr % _default_slot.get_bd().get_erase_size()) != 0) ||
+            (addr > _default_slot.get_writer().get_address())) {
+        return;
+    }
+
+    fota_checkpoint_t checkpoint;
+    if(!get_header_hash(checkpoint.header_hash)) {
+        return;
+    }
+    checkpoint.committed = addr;
+    checkpoint.crc_state = crc_state;
+
+    int err = _checkpoint_store->save(checkpoint);
+    if(err) {
+        tr_error("saving fota checkpoint failed: 0x%X", -err);
+        return;
+    }
+
+    tr_debug("saved fota checkpoint at %llu", addr);
+    publish_session_info();
+}
+
+void BlockDeviceFOTAEventHandler::start_replay(const fota_checkpoint_t &checkpoint) {
+    cancel_replay();
+
+    _replay_checkpoint = checkpoint;
+    _replay_addr = 0;
+    PagedBlockDeviceWriter::CRC_t ct;
+    ct.compute_partial_start(&_replay_crc_state);
+
+    _verifier.reset();
+    _replaying = true;
+
+    schedule_replay_read();
+}
+
+void BlockDeviceFOTAEventHandler::schedule_replay_read() {
+    bd_size_t size = _replay_checkpoint.committed - _replay_addr;
+    if(size > sizeof(_replay_buffer)) {
+        size = sizeof(_replay_buffer);
+    }
+
+    int id = _flash_queue.call(this, &BlockDeviceFOTAEventHandler::read_replay_chunk,
+            _replay_epoch, _replay_addr, size);
+    if(id == 0) {
+        tr_error("failed to schedule checkpoint replay event");
+        finish_replay(FOTAService::FOTA_STATUS_OUT_OF_MEMORY);
+    }
+}
+
+void BlockDeviceFOTAEventHandler::read_replay_chunk(uint32_t epoch, bd_addr_t addr, bd_size_t size) {
+    /* A page at a time, so erase and program operations aren't held up either */
+    int err = _default_slot.get_bd().read(_replay_buffer, addr, size);
+    if(_queue.call(this, &BlockDeviceFOTAEventHandler::on_replay_read, epoch, size, err) == 0) {
+        tr_error("failed to post checkpoint replay event");
+    }
+}
+
+void BlockDeviceFOTAEventHandler::on_replay_read(uint32_t epoch, bd_size_t size, int err) {
+    if(epoch != _replay_epoch) {
+        return;
+    }
+
+    if(err) {
+        tr_error("error when reading block device: 0x%X", -err);
+        finish_replay(FOTAService::FOTA_STATUS_MEMORY_ERROR);
+        return;
+    }
+
+    PagedBlockDeviceWriter::CRC_t ct;
+    ct.compute_partial(_replay_buffer, size, &_replay_crc_state);
+    update_verifier(mbed::make_const_Span(_replay_buffer, size));
+    _replay_addr += size;
+
+    if(_replay_addr < _replay_checkpoint.committed) {
+        schedule_replay_read();
+        return;
+    }
+
+    uint8_t header_hash[sizeof(_replay_checkpoint.header_hash)];
+    if((_replay_crc_state != _replay_checkpoint.crc_state) || !get_header_hash(header_hash) ||
+            (memcmp(header_hash, _replay_checkpoint.header_hash, sizeof(header_hash)) != 0)) {
+        finish_replay(FOTAService::FOTA_STATUS_VALIDATION_FAILURE);
+        return;
+    }
+
+    finish_replay(FOTAService::FOTA_STATUS_OK);
+}
+
+void BlockDeviceFOTAEventHandler::finish_replay(FOTAService::StatusCode_t status) {
+    _replaying = false;
+
+    if(status == FOTAService::FOTA_STATUS_OK) {
+        tr_info("fota session resumed at %lu", (unsigned long) _replay_checkpoint.committed);
+        update_flow_control();
+        return;
+    }
+
+    if(status == FOTAService::FOTA_STATUS_VALIDATION_FAILURE) {
+        tr_error("checkpoint doesn't match the update BlockDevice, discarding it");
+        clear_checkpoint();
+    }
+
+    _session_active = false;
+    _fota_svc->stop_fota_session();
+    end_decryption();
+    end_session_stats();
+    _fota_svc->notify_status(status);
+}
+
+void BlockDeviceFOTAEventHandler::cancel_replay() {
+    _replay_epoch++;
+    _replaying = false;
+}
+
+void BlockDeviceFOTAEventHandler::clear_checkpoint() {
+    if(_checkpoint_store == nullptr) {
+        return;
+    }
+
+    int err = _checkpoint_store->clear();
+    if(err) {
+        tr_error("clearing fota checkpoint failed: 0x%X", -err);
+    }
+
+    publish_session_info();
+}
+
+void BlockDeviceFOTAEventHandler::publish_fragment_status() {
+    if(_ext_svc == nullptr) {
+        return;
+    }
+
+    fota_fragment_status_t status;
+    status.next_index = _receiver.get_next_index();
+    status.fragment_size = _receiver.get_fragment_size();
+    status.window = _receiver.get_window();
+    status.missing = _receiver.get_missing();
+
+    _ext_svc->set_fragment_status(status);
+    _fragment_status_index = status.next_index;
+}
+
+void BlockDeviceFOTAEventHandler::publish_transfer_status() {
+    if(_ext_svc == nullptr) {
+        return;
+    }
+
+    fota_transfer_status_t status;
+    status.size = _slot->get_writer().get_address();
+    status.crc = _slot->get_writer().get_written_crc();
+
+    _ext_svc->set_transfer_status(status);
+}
+
+void BlockDeviceFOTAEventHandler::get_session_stats(fota_session_stats_t &stats) {
+    std::chrono::microseconds now = _session_timer.elapsed_time();
+    PagedBlockDeviceWriter &writer = _slot->get_writer();
+    PagedBlockDeviceWriter::program_stats_t program_stats = writer.get_program_stats();
+
+    stats.duration_ms = duration_cast<milliseconds>(now).count();
+    stats.bytes_received = _bytes_received;
+    stats.bytes_programmed = writer.get_programmed_address();
+    stats.program_count = program_stats.count;
+    stats.program_min_us = program_stats.min.count();
+    stats.program_avg_us = program_stats.count ? (program_stats.total / program_stats.count).count() : 0;
+    stats.program_max_us = program_stats.max.count();
+    stats.erase_count = _slot->get_erased_sectors();
+    stats.erase_ms = duration_cast<milliseconds>(_slot->get_erase_time()).count();
+
+    /* Include the XOFF in progress, if any */
+    std::chrono::microseconds xoff_time = _xoff_time;
+    if(_xoff) {
+        xoff_time += now - _xoff_since;
+    }
+    stats.xoff_count = _xoff_count;
+    stats.xoff_ms = duration_cast<milliseconds>(xoff_time).count();
+
+    stats.fragment_gaps = _fragment_gaps;
+    stats.invalid_fragments = _invalid_fragments;
+}
+
+void BlockDeviceFOTAEventHandler::publish_session_stats() {
+    if(_ext_svc == nullptr) {
+        return;
+    }
+
+    fota_session_stats_t stats;
+    get_session_stats(stats);
+    _ext_svc->set_session_stats(stats);
+}
+
+void BlockDeviceFOTAEventHandler::end_session_stats() {
+    _session_timer.stop();
+
+    fota_session_stats_t stats;
+    get_session_stats(stats);
+    tr_info("fota session: %lu bytes in %lu ms, %lu programs (%lu/%lu/%lu us), "
+            "%lu sectors erased in %lu ms, %u xoffs (%lu ms)",
+            (unsigned long) stats.bytes_received, (unsigned long) stats.duration_ms,
+            (unsigned long) stats.program_count, (unsigned long) stats.program_min_us,
+            (unsigned long) stats.program_avg_us, (unsigned long) stats.program_max_us,
+            (unsigned long) stats.erase_count, (unsigned long) stats.erase_ms,
+            (unsigned) stats.xoff_count, (unsigned long) stats.xoff_ms);
+
+    if(_ext_svc) {
+        _ext_svc->set_session_stats(stats);
+    }
+}
+
+void BlockDeviceFOTAEventHandler::publish_session_info() {
+    if(_ext_svc == nullptr) {
+        return;
+    }
+
+    fota_session_info_t info;
+    memset(&info, 0, sizeof(info));
+
+    fota_checkpoint_t checkpoint;
+    if((_checkpoint_store != nullptr) && _checkpoint_store->load(checkpoint)) {
+        PagedBlockDeviceWriter::CRC_t ct;
+        uint32_t crc = checkpoint.crc_state;
+        ct.compute_partial_stop(&crc);
+
+        info.resume_offset = checkpoint.committed;
+        info.resume_crc = crc;
+        memcpy(info.header_hash, checkpoint.header_hash, sizeof(info.header_hash));
+    }
+
+    _ext_svc->set_session_info(info);
+}
+
+bool BlockDeviceFOTAEventHandler::get_header_hash(uint8_t *hash) {
+    if(!_verifier.has_header()) {
+        return false;
+    }
+
+    mbedtls_sha256_ret((const unsigned char *) &_verifier.get_header(),
+            sizeof(struct image_header), hash, 0);
+    return true;
+}
+
+void BlockDeviceFOTAEventHandler::on_fragment_written(FOTAExtensionService &svc,
+        uint16_t index, mbed::Span<const uint8_t> data) {
+    if(!_session_active) {
+        tr_warn("fragment %u written outside of a fota session", index);
+        return;
+    }
+
+    /* Reported missing once the session resumes, so it is sent again */
+    if(_replaying) {
+        tr_warn("fragment %u written before the fota session resumed", index);
+        return;
+    }
+
+    tr_fragment("fragment %u written, next expected is %u", index, _receiver.get_next_index());
+    int err = _receiver.receive(index, data);
+    if(err == SelectiveRepeatReceiver::RECEIVE_ERROR_INVALID_FRAGMENT) {
+        tr_error("invalid fragment %u (%llu bytes)", index, (unsigned long long) data.size());
+        _invalid_fragments++;
+        _fota_svc->notify_status(FOTAService::FOTA_STATUS_UNSPECIFIED_ERROR);
+        return;
+    }
+    _fragments_received = true;
+
+    /* Output errors have already been reported */
+    if(err) {
+        return;
+    }
+
+    /* Tell the client what to resend as soon as a fragment goes missing, and
+     * let it send more as the window slides, as fragments past it are dropped
+     */
+    if(_receiver.check_new_gap()) {
+        _fragment_gaps++;
+        publish_fragment_status();
+    } else {
+        publish_fragment_progress();
+    }
+}
+
+void BlockDeviceFOTAEventHandler::on_max_fragment_size_changed(FOTAExtensionService &svc) {
+    /* The fragment size of the session still fits, larger fragments are rejected as invalid */
+    uint16_t size = svc.get_max_fragment_size();
+    if(!_session_active || (size >= _receiver.get_fragment_size())) {
+        return;
+    }
+
+    /* Fragments already in flight are too large to be placed, the stream starts over at the new size */
+    if(!_fragments_received) {
+        tr_info("fragment size reduced to %u", size);
+        _receiver.reset(size);
+        publish_fragment_status();
+        return;
+    }
+
+    /* Fragments are placed at their index times the fragment size, so the
+     * client can't carry on at another one. The checkpoint is kept, the
+     * session can be resumed at the new size.
+     */
+    tr_error("fragment size reduced from %u to %u during the fota session",
+            (unsigned) _receiver.get_fragment_size(), size);
+    _session_active = false;
+    _held_size = 0;
+    _fota_svc->stop_fota_session();
+    end_decryption();
+    end_session_stats();
+    _fota_svc->notify_status(FOTAService::FOTA_STATUS_UNSPECIFIED_ERROR);
+}
+
+void BlockDeviceFOTAEventHandler::publish_fragment_progress() {
+    if((uint16_t) (_receiver.get_next_index() - _fragment_status_index) >= ((_receiver.get_window() + 1) / 2)) {
+        publish_fragment_status();
+    }
+}
+
+int BlockDeviceFOTAEventHandler::on_fragment_output(mbed::Span<const uint8_t> data) {
+    /* Fragments that don't fit in the staging buffers yet are kept by the receiver */
+    if((_transform == nullptr) &&
+            ((_held_size != 0) || ((bd_size_t) data.size() > _slot->get_writer().get_free_size()))) {
+        return SelectiveRepeatReceiver::RECEIVE_ERROR_OUTPUT_BUSY;
+    }
+
+    /* In order fragments go through the same path as the binary stream */
+    FOTAService::StatusCode_t status = on_binary_stream_written(*_fota_svc, data);
+    if(status != FOTAService::FOTA_STATUS_OK) {
+        _fota_svc->notify_status(status);
+        return status;
+    }
+
+    return 0;
+}
+
+mbed::Span<uint8_t> BlockDeviceFOTAEventHandler::on_fragment_placement(size_t offset, size_t size) {
+    /* Fragments are only placed where they will be programmed from if they are part of the image itself */
+    if(_transform) {
+        return mbed::Span<uint8_t>();
+    }
+
+    /* Data held while the staging buffers were full goes in before them */
+    return _slot->get_writer().reserve(_held_size + offset, size);
+}
+
+int BlockDeviceFOTAEventHandler::on_transform_output(mbed::Span<const uint8_t> data) {
+    int err = _slot->get_writer().write(data);
+    if(err) {
+        tr_error("programming block device failed: 0x%X", err);
+        return err;
+    }
+
+    update_verifier(data);
+
+    return mbed::BD_ERROR_OK;
+}
+
+void BlockDeviceFOTAEventHandler::on_decrypted_output(mbed::Span<const uint8_t> data) {
+    _verifier.update(data);
+}
+
+void BlockDeviceFOTAEventHandler::update_verifier(mbed::Span<const uint8_t> data) {
+    if(!_decryptor.is_active()) {
+        _verifier.update(data);
+        return;
+    }
+
+    /* The image hash is over the plaintext, the decryptor passes it on to the verifier */
+    int err = _decryptor.update(data);
+    if(err && !_decrypt_failed) {
+        tr_error("decrypting the image failed: %d, it won't verify", err);
+        _decrypt_failed = true;
+    }
+
+    /* Replace the keystream just used while the data is programmed */
+    schedule_keystream();
+}
+
+void BlockDeviceFOTAEventHandler::schedule_keystream() {
+    if(!_decryptor.is_active() || (_keystream_event_id != 0) ||
+            (_decryptor.get_precompute_space() < MCUbootImageDecryptor::BLOCK_SIZE)) {
+        return;
+    }
+
+    _keystream_event_id = _queue.call(this, &BlockDeviceFOTAEventHandler::precompute_keystream);
+    if(_keystream_event_id == 0) {
+        tr_error("failed to schedule keystream event");
+    }
+}
+
+void BlockDeviceFOTAEventHandler::precompute_keystream() {
+    _keystream_event_id = 0;
+
+    /* A page at a time, so BLE events aren't held up */
+    _decryptor.precompute(MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE);
+    schedule_keystream();
+}
+
+void BlockDeviceFOTAEventHandler::end_decryption() {
+    _queue.cancel(_keystream_event_id);
+    _keystream_event_id = 0;
+
+    if(_decryptor.is_active()) {
+        tr_info("image decrypted, %lu keystream blocks generated on demand",
+                (unsigned long) _decryptor.get_stalled_blocks());
+        _decryptor.stop();
+    }
+}
+
+void BlockDeviceFOTAEventHandler::pump_transform() {
+    _transform_event_id = 0;
+
+    /* Output is only produced while the staging buffers have room for it */
+    if(_slot->get_writer().is_backpressured()) {
+        update_flow_control();
+        return;
+    }
+
+    int produced = _transform->run(get_transform_budget());
+    if(produced < 0) {
+        tr_error("transforming binary stream failed: %d", produced);
+        if(_fota_svc) {
+            _fota_svc->notify_status(get_transform_error_status(produced));
+        }
+        return;
+    }
+
+    _slot->erase_ahead();
+
+    /* Long copies are split over several events so BLE events aren't held up */
+    if(_transform->has_pending_output() && !_slot->get_writer().is_backpressured()) {
+        _transform_event_id = _queue.call(this, &BlockDeviceFOTAEventHandler::pump_transform);
+        if(_transform_event_id == 0) {
+            tr_error("failed to schedule binary stream transform event");
+        }
+    }
+
+    update_flow_control();
+}
+
+FOTAService::StatusCode_t BlockDeviceFOTAEventHandler::finish_transform() {
+    if(_transform == nullptr) {
+        return FOTAService::FOTA_STATUS_OK;
+    }
+
+    _queue.cancel(_transform_event_id);
+    _transform_event_id = 0;
+
+    /* With the rest of the new image erased, pages can be programmed on the spot to make room */
+    if(!_slot->finish_erase(_transform->get_output_total())) {
+        return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+    }
+
+    while(_transform->has_pending_output()) {
+        PagedBlockDeviceWriter &writer = _slot->get_writer();
+        if((writer.get_free_size() < MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE) && writer.program_full_pages()) {
+            tr_error("programming block device failed: 0x%X", writer.get_error());
+            return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+        }
+
+        int produced = _transform->run(get_transform_budget());
+        if(produced < 0) {
+            tr_error("transforming binary stream failed: %d", produced);
+            return get_transform_error_status(produced);
+        }
+    }
+
+    if(!_transform->is_complete()) {
+        tr_error("binary stream incomplete, %lu of %lu bytes output",
+                (unsigned long) _transform->get_output_size(), (unsigned long) _transform->get_output_total());
+        return FOTAService::FOTA_STATUS_VALIDATION_FAILURE;
+    }
+
+    tr_info("binary stream transformed, %lu bytes output", (unsigned long) _transform->get_output_size());
+    return FOTAService::FOTA_STATUS_OK;
+}
+
+size_t BlockDeviceFOTAEventHandler::get_transform_budget() {
+    /* Output goes straight to the staging buffers, so no more is produced than fits */
+    bd_size_t free_size = _slot->get_writer().get_free_size();
+    return (free_size < MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE) ? free_size : MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE;
+}
+
+FOTAService::StatusCode_t BlockDeviceFOTAEventHandler::get_transform_error_status(int err) {
+    switch(err) {
+    case StreamTransform::TRANSFORM_ERROR_STASH_FULL:
+        return FOTAService::FOTA_STATUS_OUT_OF_MEMORY;
+    case StreamTransform::TRANSFORM_ERROR_INVALID_STREAM:
+        return FOTAService::FOTA_STATUS_VALIDATION_FAILURE;
+    default:
+        return FOTAService::FOTA_STATUS_MEMORY_ERROR;
+    }
 }
@@ -23,42 +23,525 @@
 #include "ble-service-fota/FOTAService.h"
 
 #include "blockdevice/BlockDevice.h"
+#include "drivers/Timer.h"
 #include "events/EventQueue.h"
 
-#include "PeriodicBlockDeviceEraser.h"
+#include "FOTASlot.h"
+#include "FOTASlotRegistry.h"
+#include "MCUbootImageVerifier.h"
+#include "MCUbootImageDecryptor.h"
+#include "FOTACheckpointStore.h"
+#include "FOTAExtensionService.h"
+#include "DeltaPatchApplier.h"
+#include "LZDecompressor.h"
+#include "SelectiveRepeatReceiver.h"
+
+#ifndef MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL
+#define MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL 0x10000
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_DELTA_WINDOW_SIZE
+#define MBED_CONF_APP_FOTA_DELTA_WINDOW_SIZE 256
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_COMPRESSION_WINDOW_SIZE
+#define MBED_CONF_APP_FOTA_COMPRESSION_WINDOW_SIZE 4096
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_FRAGMENT_WINDOW
+#define MBED_CONF_APP_FOTA_FRAGMENT_WINDOW 16
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_STREAM_STASH_SIZE
+#define MBED_CONF_APP_FOTA_STREAM_STASH_SIZE 1024
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_KEYSTREAM_SIZE
+#define MBED_CONF_APP_FOTA_KEYSTREAM_SIZE 512
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_TRACE_FRAGMENTS
+#define MBED_CONF_APP_FOTA_TRACE_FRAGMENTS 0
+#endif
+
+static_assert((MBED_CONF_APP_FOTA_FRAGMENT_WINDOW >= 1) &&
+        (MBED_CONF_APP_FOTA_FRAGMENT_WINDOW <= SelectiveRepeatReceiver::MAX_WINDOW),
+        "fota-fragment-window must be between 1 and the receiver's largest window");
+
+static_assert((MBED_CONF_APP_FOTA_KEYSTREAM_SIZE >= MCUbootImageDecryptor::BLOCK_SIZE) &&
+        ((MBED_CONF_APP_FOTA_KEYSTREAM_SIZE % MCUbootImageDecryptor::BLOCK_SIZE) == 0),
+        "fota-keystream-size must be a multiple of the AES block size");
 
 /**
  * FOTAService EventHandler that writes data to the given BlockDevice
+ *
+ * The BlockDevice is erased just ahead of the write address (see FOTASlot),
+ * and the MCUboot image hash is checked as the image streams in, so a
+ * corrupt transfer is rejected on FOTA_COMMIT rather than after a reboot.
+ * Other kinds of sessions are started with the vendor-specific op codes
+ * below, each documented with its op code.
  */
-class BlockDeviceFOTAEventHandler : public FOTAService::EventHandler
+class BlockDeviceFOTAEventHandler : public FOTAService::EventHandler,
+        public FOTAExtensionService::EventHandler
 {
 
+public:
+
+    /**
+     * Vendor-specific control op code, resumes the last checkpointed session
+     *
+     * With a checkpoint store set, progress of image 0 is saved every
+     * MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL programmed bytes. After a dropped
+     * connection, the client reads the resume offset from the extension
+     * service and writes this instead of FOTA_START, then sends the image
+     * from that offset. The session stays in XOFF while the data already
+     * written is read back from the flash queue and checked against the
+     * checkpoint, and ends with an error status if it doesn't match.
+     * Checkpoints are only kept for image 0. An encrypted session is
+     * resumed by following this with the wrapped key too.
+     */
+    static constexpr uint8_t FOTA_OP_CODE_RESUME = 0x80;
+
+    /**
+     * Vendor-specific control op code, starts a session that streams a delta patch
+     *
+     * The patch (see DeltaPatchApplier) is against the image in the delta
+     * source (eg: the primary slot). The new image is rebuilt into the
+     * BlockDevice and verified the same way as a full image. Delta sessions
+     * only apply to image 0.
+     */
+    static constexpr uint8_t FOTA_OP_CODE_START_DELTA = 0x81;
+
+    /**
+     * Vendor-specific control op code, starts a session that streams a compressed image
+     *
+     * The image is decompressed (see LZDecompressor) as it streams in, and
+     * verified the same way as an image sent as is.
+     */
+    static constexpr uint8_t FOTA_OP_CODE_START_COMPRESSED = 0x82;
+
+    /**
+     * Vendor-specific control op code, notifies the fragment status and updates the transfer status
+     *
+     * eg: to check the last fragments made it, and that the size and CRC32
+     * of the image written so far match, before committing.
+     */
+    static constexpr uint8_t FOTA_OP_CODE_SYNC = 0x83;
+
+    /**
+     * Vendor-specific control op code, followed by the image ID the next session writes to
+     * @note The BlockDevice given to the constructor is image 0, see add_slot for the others
+     */
+    static constexpr uint8_t FOTA_OP_CODE_SELECT_SLOT = 0x84;
+
+    /**
+     * Vendor-specific control op code, followed by the image ID of a slot to erase ahead of its session
+     *
+     * The slot is erased in the background, eg: while an image is sent to
+     * another slot, so its own session can start without waiting for the erase.
+     */
+    static constexpr uint8_t FOTA_OP_CODE_PREPARE_SLOT = 0x85;
+
+    /**
+     * Vendor-specific control op code, followed by the wrapped key, starts a session that streams an encrypted image
+     *
+     * The wrapped key is the value of the ENC_KW128 TLV of an image
+     * encrypted by imgtool. The image is written as is, for MCUboot to
+     * decrypt while installing it, and decrypted on the way to the hash
+     * verification (see MCUbootImageDecryptor).
+     */
+    static constexpr uint8_t FOTA_OP_CODE_START_ENCRYPTED = 0x86;
+
 public:
 
     BlockDeviceFOTAEventHandler(mbed::BlockDevice& bd, events::EventQueue& queue);
 
+    /**
+     * Construct a handler that erases and programs the BlockDevice from flash_queue
+     *
+     * flash_queue may be dispatched by a lower priority thread than queue, so
+     * erase and program operations don't delay BLE events. Their completion
+     * is posted back to queue, where all the handler's callbacks run.
+     */
+    BlockDeviceFOTAEventHandler(mbed::BlockDevice& bd, events::EventQueue& queue,
+            events::EventQueue& flash_queue);
+
     ~BlockDeviceFOTAEventHandler();
 
     /* Handler overrides for FOTAService */
     FOTAService::StatusCode_t on_binary_stream_written(FOTAService &svc, mbed::Span<const uint8_t> buffer) override;
     virtual GattAuthCallbackReply_t on_control_written(FOTAService &svc, mbed::Span<const uint8_t> buffer) override;
 
-    /* Callback for PeriodicBlocKDeviceEraser */
+    /* Handler override for FOTAExtensionService */
+    void on_fragment_written(FOTAExtensionService &svc, uint16_t index, mbed::Span<const uint8_t> data) override;
+    void on_max_fragment_size_changed(FOTAExtensionService &svc) override;
+
+    /* Callback for FOTASlot */
     void on_bd_erased(int result);
 
+    /* Callbacks for PagedBlockDeviceWriter */
+    void on_backpressure_changed(bool backpressured);
+    void on_program_error(int result);
+    void on_page_programmed(bd_addr_t addr, uint32_t crc_state);
+
+    /* Callback for the StreamTransform of delta and compressed sessions */
+    int on_transform_output(mbed::Span<const uint8_t> data);
+
+    /* Callbacks for SelectiveRepeatReceiver */
+    int on_fragment_output(mbed::Span<const uint8_t> data);
+    mbed::Span<uint8_t> on_fragment_placement(size_t offset, size_t size);
+
+    /* Callback for MCUbootImageDecryptor */
+    void on_decrypted_output(mbed::Span<const uint8_t> data);
+
+    /* Checkpoint replay, read_replay_chunk() runs from the flash queue */
+    void read_replay_chunk(uint32_t epoch, bd_addr_t addr, bd_size_t size);
+    void on_replay_read(uint32_t epoch, bd_size_t size, int err);
+
+    /**
+     * Add a slot the images with the given ID are written to (eg: a
+     * co-processor image or an asset partition)
+     * @retval true on success, false if the ID is already used or there are already
+     * MBED_CONF_APP_FOTA_MAX_SLOTS slots
+     */
+    bool add_slot(uint8_t image_id, FOTASlot &slot);
+
+    /**
+     * Image ID the current (or next) session writes to
+     */
+    uint8_t get_selected_image_id() const {
+        return _image_id;
+    }
+
+    /**
+     * Set the store used to persist session checkpoints (optional, see FOTA_OP_CODE_RESUME)
+     * @note The store must already be initialized
+     */
+    void set_checkpoint_store(FOTACheckpointStore *store);
+
+    /**
+     * Set the service the resumable session info is published through, and
+     * indexed fragments are received from (optional)
+     *
+     * The binary stream of any session can also be sent as indexed fragments,
+     * sized from the ATT MTU at the start of the session. These are
+     * reordered, and the missing ones are notified so only those are resent.
+     * The fragment status is also notified every half window received in
+     * order, so the client can keep a window of fragments in flight.
+     * Fragments of an image sent as is are reordered directly in the
+     * writer's page buffers, so they are only copied once.
+     */
+    void set_extension_service(FOTAExtensionService *svc);
+
+    /**
+     * Set the BlockDevice delta patches are applied against (optional, see FOTA_OP_CODE_START_DELTA)
+     * @note Delta sessions are rejected until this is set
+     */
+    void set_delta_source(mbed::BlockDevice *source) {
+        _delta_source = source;
+    }
+
+    /**
+     * Set the AES-128 key-encryption key the keys of encrypted images are wrapped with (optional)
+     * @note Encrypted sessions are rejected until this is set. Their keystream
+     * is then precomputed from events while pages are programmed
+     * @retval false if the key isn't 16 bytes long
+     */
+    bool set_encryption_kek(mbed::Span<const uint8_t> kek) {
+        return _decryptor.set_kek(kek);
+    }
+
+    /**
+     * Performance counters of the current (or last) session
+     *
+     * They are also published through the extension service on
+     * FOTA_OP_CODE_SYNC and at the end of the session. Per-fragment tracing
+     * is compiled out unless MBED_CONF_APP_FOTA_TRACE_FRAGMENTS is set, as
+     * printing it slows the transfer down.
+     */
+    void get_session_stats(fota_session_stats_t &stats);
+
+    /**
+     * Whether a session has been started and not stopped or committed yet
+     */
+    bool is_session_active() const {
+        return _session_active;
+    }
+
+protected:
+
+    /**
+     * Start a session from the beginning of the image
+     * @param[in] transform Stage the binary stream goes through, nullptr if it is the image itself
+     */
+    void start_new_session(FOTAService &svc, StreamTransform *transform);
+
+    /**
+     * Start a session, erasing the selected slot from the given address
+     */
+    void start_session(FOTAService &svc, bd_addr_t addr);
+
+    /**
+     * Write image data to the staging buffers, or hold on to it in the stash
+     * while they are full
+     * @retval FOTA_STATUS_OK on success, or the status to report to the client
+     */
+    FOTAService::StatusCode_t write_image_data(mbed::Span<const uint8_t> data);
+
+    /**
+     * Write as much of the data held while the staging buffers were full as now fits
+     * @param[in] now Program pages synchronously until all of it is written
+     * @retval FOTA_STATUS_OK on success, or the status to report to the client
+     */
+    FOTAService::StatusCode_t write_held_data(bool now = false);
+
+    /**
+     * Transform the next page worth of stashed data, and schedule another
+     * event if there is more to do
+     */
+    void pump_transform();
+
+    /**
+     * Synchronously transform whatever is left of the stashed data
+     * @retval FOTA_STATUS_OK on success, or the status to report to the client
+     */
+    FOTAService::StatusCode_t finish_transform();
+
+    /**
+     * Complete the image on FOTA_COMMIT and tear the session down, whatever the outcome
+     * @retval FOTA_STATUS_OK if the image is complete and verified, or the status to report to the client
+     */
+    FOTAService::StatusCode_t finish_session();
+
+    /**
+     * Maximum output of the next StreamTransform run, as much as fits in the staging buffers
+     */
+    size_t get_transform_budget();
+
+    /**
+     * Status reported to the client for a StreamTransform error
+     */
+    static FOTAService::StatusCode_t get_transform_error_status(int err);
+
+    /**
+     * Feed the next bytes of the image to the verifier, decrypting them first in encrypted sessions
+     */
+    void update_verifier(mbed::Span<const uint8_t> data);
+
+    /**
+     * Generate keystream ahead of the data from an event, if there is room for it
+     */
+    void schedule_keystream();
+
+    /**
+     * Precompute a page worth of keystream, and schedule another event if there is more room
+     */
+    void precompute_keystream();
+
+    /**
+     * Stop decrypting at the end of an encrypted session
+     */
+    void end_decryption();
+
+    /**
+     * Start reading back the data covered by a checkpoint, checking it
+     * against the checkpoint CRC and feeding it through the image verifier
+     *
+     * The session is held in XOFF until finish_replay() is called.
+     */
+    void start_replay(const fota_checkpoint_t &checkpoint);
+
+    /**
+     * Read the next chunk of the checkpointed data from the flash queue
+     */
+    void schedule_replay_read();
+
+    /**
+     * Carry on with the resumed session, or end it with the given status
+     * @note The checkpoint is only discarded if the data doesn't match it
+     */
+    void finish_replay(FOTAService::StatusCode_t status);
+
+    /**
+     * Drop the replay in progress, if any
+     */
+    void cancel_replay();
+
+    /**
+     * Discard the saved checkpoint, if any
+     */
+    void clear_checkpoint();
+
+    /**
+     * Update the session info characteristic from the latest checkpoint
+     */
+    void publish_session_info();
+
+    /**
+     * Notify the fragment status characteristic
+     */
+    void publish_fragment_status();
+
+    /**
+     * Notify the fragment status characteristic once the window has slid by half since it was last notified
+     */
+    void publish_fragment_progress();
+
+    /**
+     * Update the transfer status characteristic from what has been written so far
+     */
+    void publish_transfer_status();
+
+    /**
+     * Update the session stats characteristic
+     */
+    void publish_session_stats();
+
+    /**
+     * Stop timing the session and publish its final stats
+     */
+    void end_session_stats();
+
+    /**
+     * Compute the SHA-256 of the image header streamed so far
+     * @retval false if the header hasn't been received yet
+     */
+    bool get_header_hash(uint8_t *hash);
+
+    /**
+     * Send XOFF/XON to the client depending on whether the handler is
+     * ready to accept more data
+     */
+    void update_flow_control();
+
+    /**
+     * Send XOFF or XON to the client, accounting for the time spent in XOFF
+     */
+    void send_flow_control(bool xoff);
+
+    /**
+     * Grant the client credit for the free space in the staging buffers,
+     * notifying it once it is worth a round trip
+     */
+    void update_stream_credit();
+
+    /**
+     * Notify the client of the credit granted so far
+     */
+    void publish_stream_credit();
+
 protected:
 
-    mbed::BlockDevice &_bd;
     events::EventQueue &_queue;
 
-    /* BlockDevice eraser that handles non-blocking, periodic erase operations */
-    PeriodicBlockDeviceEraser *_bd_eraser = nullptr;
+    /* Queue erase and program operations run from, may be the same as _queue */
+    events::EventQueue &_flash_queue;
+
+    /* Slot of image 0, on the BlockDevice given to the constructor */
+    FOTASlot _default_slot;
+
+    FOTASlotRegistry _slots;
+
+    /* Slot the current (or next) session writes to, and its image ID */
+    FOTASlot *_slot;
+    uint8_t _image_id = FOTASlotRegistry::DEFAULT_IMAGE_ID;
+
+    /* Streaming verification of the image hash */
+    MCUbootImageVerifier _verifier;
+
+    /* Buffers of the different kinds of session. Only one kind runs at a
+     * time, and starting a session ends whatever used them before, so they
+     * only take as much RAM as the largest one.
+     */
+    union {
+        /* Window COPY ops read the delta source through */
+        uint8_t delta_window[MBED_CONF_APP_FOTA_DELTA_WINDOW_SIZE];
+
+        /* Most recent output of the decompressor, matches are copied from it */
+        uint8_t lz_history[MBED_CONF_APP_FOTA_COMPRESSION_WINDOW_SIZE];
+
+        /* Keystream of encrypted sessions, generated ahead of the data */
+        uint8_t keystream[MBED_CONF_APP_FOTA_KEYSTREAM_SIZE];
+    } _session_buffers;
+
+    /* Binary stream data received but not transformed yet, shared as only one transform is used per session */
+    uint8_t _stream_stash[MBED_CONF_APP_FOTA_STREAM_STASH_SIZE];
+
+    /* Image data held in the stash while the staging buffers are full, in sessions without a transform */
+    size_t _held_size = 0;
 
-    /* Address pointer */
-    bd_addr_t _addr = 0;
+    DeltaPatchApplier _delta;
+
+    LZDecompressor _decompressor;
+
+    mbed::BlockDevice *_delta_source = nullptr;
+
+    MCUbootImageDecryptor _decryptor;
+
+    int _keystream_event_id = 0;
+
+    /* Set once decrypting the image failed, so it is only reported once */
+    bool _decrypt_failed = false;
+
+    /* Checkpoint of the session being resumed, and how much of it has been checked */
+    fota_checkpoint_t _replay_checkpoint;
+    bd_addr_t _replay_addr = 0;
+    uint32_t _replay_crc_state = 0;
+
+    /* Incremented when a replay is started or cancelled, so reads still in the queues are dropped */
+    uint32_t _replay_epoch = 0;
+
+    /* Set while the checkpointed data is read back, before the session resumes */
+    bool _replaying = false;
+
+    /* Checkpointed data read back, not the stash as a read may complete after a new session started using it */
+    uint8_t _replay_buffer[MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE];
+
+    /* Indexed fragments waiting for the ones before them */
+    uint8_t _fragment_window[MBED_CONF_APP_FOTA_FRAGMENT_WINDOW * MBED_CONF_APP_FOTA_FRAGMENT_SIZE];
+
+    SelectiveRepeatReceiver _receiver;
+
+    /* Stage the binary stream goes through in the current session, if any */
+    StreamTransform *_transform = nullptr;
+
+    int _transform_event_id = 0;
+
+    /* Flow control state last sent to the client */
+    bool _xoff = false;
+
+    /* Session timing, started with each session */
+    mbed::Timer _session_timer;
+
+    /* When XOFF was last sent, and how long XOFF lasted before that */
+    std::chrono::microseconds _xoff_since = std::chrono::microseconds(0);
+    std::chrono::microseconds _xoff_time = std::chrono::microseconds(0);
+    uint16_t _xoff_count = 0;
+
+    uint32_t _bytes_received = 0;
+
+    /* Stream credit granted to the client, and the last value it was notified of */
+    uint32_t _credit_limit = 0;
+    uint32_t _credit_notified = 0;
+
+    /* Next fragment index of the fragment status last published */
+    uint16_t _fragment_status_index = 0;
+
+    uint16_t _fragment_gaps = 0;
+    uint16_t _invalid_fragments = 0;
+
+    /* Set once a fragment was placed at the session's fragment size */
+    bool _fragments_received = false;
 
     FOTAService *_fota_svc = nullptr;
 
+    /* Set between the start of a session and FOTA_STOP or FOTA_COMMIT */
+    bool _session_active = false;
+
+    FOTACheckpointStore *_checkpoint_store = nullptr;
+
+    FOTAExtensionService *_ext_svc = nullptr;
+
 };
 
 
@@ -0,0 +1,194 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "DeltaPatchApplier.h"
+
+#include <string.h>
+
+#define HEADER_SIZE      8
+#define COPY_OP_SIZE     9
+#define INSERT_OP_SIZE   5
+
+DeltaPatchApplier::DeltaPatchApplier(mbed::Span<uint8_t> window, mbed::Span<uint8_t> stash) :
+        StreamTransform(stash), _window(window) {
+}
+
+void DeltaPatchApplier::reset(mbed::BlockDevice &source) {
+    reset_stream();
+    _source = &source;
+    _state = STATE_HEADER;
+    _copy_src = 0;
+    _op_remaining = 0;
+}
+
+int DeltaPatchApplier::run(size_t budget) {
+    size_t produced = 0;
+
+    while((_error == TRANSFORM_ERROR_OK) && (produced < budget)) {
+
+        size_t chunk = budget - produced;
+        if(chunk > _op_remaining) {
+            chunk = _op_remaining;
+        }
+
+        if(_state == STATE_COPY) {
+            if(chunk > (size_t) _window.size()) {
+                chunk = _window.size();
+            }
+
+            int err = _source->read(_window.data(), _copy_src, chunk);
+            if(err) {
+                _error = err;
+                break;
+            }
+
+            _copy_src += chunk;
+            output(mbed::make_const_Span(_window.data(), chunk));
+
+        } else if(_state == STATE_INSERT) {
+            if(chunk > get_stash_fill()) {
+                chunk = get_stash_fill();
+            }
+
+            if(chunk == 0) {
+                /* Waiting for more literals */
+                break;
+            }
+
+            const uint8_t *literals = stash_data();
+            consume(chunk);
+            output(mbed::make_const_Span(literals, chunk));
+
+        } else if((_state == STATE_HEADER) || (_state == STATE_OP)) {
+            if(!parse()) {
+                break;
+            }
+            continue;
+
+        } else {
+            /* Done, or invalid */
+            break;
+        }
+
+        produced += chunk;
+    }
+
+    if(_error) {
+        return _error;
+    }
+
+    return produced;
+}
+
+bool DeltaPatchApplier::has_pending_output() const {
+    switch(_state) {
+    case STATE_COPY:
+        return _error == TRANSFORM_ERROR_OK;
+    case STATE_INSERT:
+        return get_stash_fill() != 0;
+    case STATE_HEADER:
+        return get_stash_fill() >= HEADER_SIZE;
+    case STATE_OP:
+        if(get_stash_fill() == 0) {
+            return false;
+        }
+        /* Unknown ops are pending too, so that run() reports them */
+        return get_stash_fill() >= ((stash_data()[0] == OP_COPY) ? COPY_OP_SIZE : INSERT_OP_SIZE)
+                || ((stash_data()[0] != OP_COPY) && (stash_data()[0] != OP_INSERT));
+    default:
+        return false;
+    }
+}
+
+bool DeltaPatchApplier::parse() {
+    size_t available = get_stash_fill();
+
+    if(_state == STATE_HEADER) {
+        if(available < HEADER_SIZE) {
+            return false;
+        }
+
+        if(read_u32(0) != PATCH_MAGIC) {
+            _state = STATE_INVALID;
+            _error = TRANSFORM_ERROR_INVALID_STREAM;
+            return false;
+        }
+
+        _output_total = read_u32(4);
+        consume(HEADER_SIZE);
+        _state = (_output_total == 0) ? STATE_DONE : STATE_OP;
+        return true;
+    }
+
+    if(available < 1) {
+        return false;
+    }
+
+    uint8_t op = stash_data()[0];
+    uint32_t length;
+    if(op == OP_COPY) {
+        if(available < COPY_OP_SIZE) {
+            return false;
+        }
+        _copy_src = read_u32(1);
+        length = read_u32(5);
+
+        /* The copy must lie within the source */
+        if((_copy_src > _source->size()) || (length > (_source->size() - _copy_src))) {
+            length = (uint32_t) -1;
+        }
+        consume(COPY_OP_SIZE);
+        _state = STATE_COPY;
+
+    } else if(op == OP_INSERT) {
+        if(available < INSERT_OP_SIZE) {
+            return false;
+        }
+        length = read_u32(1);
+        consume(INSERT_OP_SIZE);
+        _state = STATE_INSERT;
+
+    } else {
+        length = (uint32_t) -1;
+    }
+
+    /* Ops can't output past the end of the new image */
+    if(length > (_output_total - _output_size)) {
+        _state = STATE_INVALID;
+        _error = TRANSFORM_ERROR_INVALID_STREAM;
+        return false;
+    }
+
+    _op_remaining = length;
+    if(_op_remaining == 0) {
+        _state = STATE_OP;
+    }
+
+    return true;
+}
+
+int DeltaPatchApplier::output(mbed::Span<const uint8_t> data) {
+    _op_remaining -= data.size();
+
+    if(_op_remaining == 0) {
+        _state = ((_output_size + data.size()) == _output_total) ? STATE_DONE : STATE_OP;
+    }
+
+    return emit(data);
+}
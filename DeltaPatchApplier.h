@@ -0,0 +1,109 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef DELTAPATCHAPPLIER_H_
+#define DELTAPATCHAPPLIER_H_
+
+#include "StreamTransform.h"
+
+#include "blockdevice/BlockDevice.h"
+#include "platform/Span.h"
+
+#include <stdint.h>
+
+/**
+ * Rebuilds an image from a delta patch against a source image, as the
+ * patch is streamed in.
+ *
+ * Patch format (all integers little-endian):
+ *
+ *   header:  magic "FDLT" (4 bytes), size of the new image (uint32)
+ *   COPY:    0x01, source offset (uint32), length (uint32)
+ *   INSERT:  0x02, length (uint32), followed by length literal bytes
+ *
+ * Ops are applied in order until the new image is complete. COPY ops read
+ * the source BlockDevice (eg: the primary slot) through a small window
+ * buffer. INSERT literals are passed on straight from the patch. A long
+ * COPY is spread over as many run() calls as its length needs.
+ *
+ * @note The source BlockDevice must have a read size of 1
+ */
+class DeltaPatchApplier : public StreamTransform
+{
+public:
+
+    static constexpr uint32_t PATCH_MAGIC = 0x544C4446; /* "FDLT" */
+
+    static constexpr uint8_t OP_COPY = 0x01;
+    static constexpr uint8_t OP_INSERT = 0x02;
+
+public:
+
+    /**
+     * Construct an applier
+     * @param[in] window Buffer COPY data is read from the source into
+     * @param[in] stash Buffer for patch data that hasn't been applied yet
+     */
+    DeltaPatchApplier(mbed::Span<uint8_t> window, mbed::Span<uint8_t> stash);
+
+    /**
+     * Start applying a new patch against the given source
+     */
+    void reset(mbed::BlockDevice &source);
+
+    int run(size_t budget) override;
+
+    bool has_pending_output() const override;
+
+    bool is_complete() const override {
+        return _state == STATE_DONE;
+    }
+
+protected:
+
+    enum state_t {
+        STATE_HEADER,
+        STATE_OP,
+        STATE_COPY,
+        STATE_INSERT,
+        STATE_DONE,
+        STATE_INVALID
+    };
+
+    /** Parse the header or op at the start of the stash, if it's all there */
+    bool parse();
+
+    /** Pass output on, and move to the next op once the current one is done */
+    int output(mbed::Span<const uint8_t> data);
+
+protected:
+
+    mbed::BlockDevice *_source = nullptr;
+
+    mbed::Span<uint8_t> _window;
+
+    state_t _state = STATE_HEADER;
+
+    /* Current op */
+    uint32_t _copy_src = 0;
+    uint32_t _op_remaining = 0;
+
+};
+
+#endif /* DELTAPATCHAPPLIER_H_ */
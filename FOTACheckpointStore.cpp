@@ -0,0 +1,155 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "FOTACheckpointStore.h"
+
+#include "drivers/MbedCRC.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/* Records are padded up to the program size, this bounds the padded size */
+#define MAX_SLOT_SIZE 256
+
+FOTACheckpointStore::FOTACheckpointStore(mbed::BlockDevice &bd) : _bd(bd) {
+}
+
+int FOTACheckpointStore::init() {
+    _next_addr = _bd.size();
+    _has_latest = false;
+
+    if(slot_size() > MAX_SLOT_SIZE) {
+        return mbed::BD_ERROR_DEVICE_ERROR;
+    }
+
+    for(bd_addr_t addr = 0; (addr + slot_size()) <= _bd.size(); addr += slot_size()) {
+        uint8_t slot[MAX_SLOT_SIZE];
+        int err = _bd.read(slot, addr, slot_size());
+        if(err) {
+            return err;
+        }
+
+        record_t record;
+        memcpy(&record, slot, sizeof(record));
+
+        /* The first blank slot marks the end of the log */
+        if(is_blank(record)) {
+            _next_addr = addr;
+            break;
+        }
+
+        /* Invalid records (eg: interrupted while programming) are skipped */
+        if(is_valid(record)) {
+            _latest = record;
+            _has_latest = true;
+        }
+    }
+
+    return mbed::BD_ERROR_OK;
+}
+
+bool FOTACheckpointStore::load(fota_checkpoint_t &checkpoint) const {
+    if(!_has_latest) {
+        return false;
+    }
+
+    checkpoint = _latest.checkpoint;
+    return true;
+}
+
+int FOTACheckpointStore::save(const fota_checkpoint_t &checkpoint) {
+
+    /* Start the log over once it is full */
+    if((_next_addr + slot_size()) > _bd.size()) {
+        int err = clear();
+        if(err) {
+            return err;
+        }
+    }
+
+    record_t record;
+    record.magic = RECORD_MAGIC;
+    record.checkpoint = checkpoint;
+    record.crc = record_crc(record);
+
+    uint8_t slot[MAX_SLOT_SIZE];
+    int erase_value = _bd.get_erase_value();
+    memset(slot, (erase_value == -1) ? 0xFF : erase_value, slot_size());
+    memcpy(slot, &record, sizeof(record));
+
+    int err = _bd.program(slot, _next_addr, slot_size());
+    if(err) {
+        return err;
+    }
+
+    _next_addr += slot_size();
+    _latest = record;
+    _has_latest = true;
+
+    return mbed::BD_ERROR_OK;
+}
+
+int FOTACheckpointStore::clear() {
+    /* Nothing to do if the log is already empty */
+    if((_next_addr == 0) && !_has_latest) {
+        return mbed::BD_ERROR_OK;
+    }
+
+    int err = _bd.erase(0, _bd.size());
+    if(err) {
+        return err;
+    }
+
+    _next_addr = 0;
+    _has_latest = false;
+
+    return mbed::BD_ERROR_OK;
+}
+
+bd_size_t FOTACheckpointStore::slot_size() const {
+    bd_size_t align = _bd.get_program_size();
+    if(_bd.get_read_size() > align) {
+        align = _bd.get_read_size();
+    }
+
+    return ((sizeof(record_t) + align - 1) / align) * align;
+}
+
+bool FOTACheckpointStore::is_valid(const record_t &record) const {
+    return (record.magic == RECORD_MAGIC) && (record.crc == record_crc(record));
+}
+
+bool FOTACheckpointStore::is_blank(const record_t &record) const {
+    int erase_value = _bd.get_erase_value();
+    const uint8_t *bytes = (const uint8_t *) &record;
+    for(size_t i = 0; i < sizeof(record); i++) {
+        if(bytes[i] != ((erase_value == -1) ? 0xFF : erase_value)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t FOTACheckpointStore::record_crc(const record_t &record) const {
+    mbed::MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
+    ct.compute(&record, offsetof(record_t, crc), &crc);
+    return crc;
+}
@@ -0,0 +1,117 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef FOTACHECKPOINTSTORE_H_
+#define FOTACHECKPOINTSTORE_H_
+
+#include "blockdevice/BlockDevice.h"
+#include "platform/mbed_toolchain.h"
+
+#include <stdint.h>
+
+/**
+ * Progress checkpoint of an interrupted FOTA session
+ */
+MBED_PACKED(struct) fota_checkpoint_t {
+    /* SHA-256 of the MCUboot image header, identifies the image being transferred */
+    uint8_t header_hash[32];
+
+    /* Number of bytes durably programmed to the update BlockDevice */
+    uint32_t committed;
+
+    /* Intermediate (not finalized) CRC32 state over the committed bytes */
+    uint32_t crc_state;
+};
+
+/**
+ * Persists FOTA checkpoints in a reserved region of a block device
+ *
+ * Checkpoints are appended as records to a log so that most saves only
+ * program a few bytes. The region is only erased once the log is full
+ * or when the checkpoint is cleared. The most recent valid record wins.
+ */
+class FOTACheckpointStore
+{
+public:
+
+    static constexpr uint32_t RECORD_MAGIC = 0x464F5443; /* "FOTC" */
+
+public:
+
+    FOTACheckpointStore(mbed::BlockDevice& bd);
+
+    /**
+     * Scan the log for the most recent checkpoint
+     *
+     * @note The BlockDevice must already be initialized
+     *
+     * @retval 0 on success, or the BlockDevice error code
+     */
+    int init();
+
+    /**
+     * Load the most recent checkpoint
+     * @retval true if a valid checkpoint was found
+     */
+    bool load(fota_checkpoint_t &checkpoint) const;
+
+    /**
+     * Append a checkpoint to the log
+     * @retval 0 on success, or the BlockDevice error code
+     */
+    int save(const fota_checkpoint_t &checkpoint);
+
+    /**
+     * Discard any saved checkpoint
+     * @retval 0 on success, or the BlockDevice error code
+     */
+    int clear();
+
+protected:
+
+    MBED_PACKED(struct) record_t {
+        uint32_t magic;
+        fota_checkpoint_t checkpoint;
+        /* CRC32 of the fields above */
+        uint32_t crc;
+    };
+
+    /** Size of each record slot, rounded up to the program size */
+    bd_size_t slot_size() const;
+
+    bool is_valid(const record_t &record) const;
+
+    bool is_blank(const record_t &record) const;
+
+    uint32_t record_crc(const record_t &record) const;
+
+protected:
+
+    mbed::BlockDevice& _bd;
+
+    /* Address of the next free record slot */
+    bd_addr_t _next_addr = 0;
+
+    /* Most recent valid record */
+    record_t _latest;
+    bool _has_latest = false;
+
+};
+
+#endif /* FOTACHECKPOINTSTORE_H_ */
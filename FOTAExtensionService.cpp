@@ -0,0 +1,209 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "FOTAExtensionService.h"
+
+#include <string.h>
+
+const char FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE[] = "53880100-65fd-4651-ba8e-91527f06c887";
+const char FOTAExtensionService::UUID_SESSION_INFO_CHAR[] = "53880101-65fd-4651-ba8e-91527f06c887";
+const char FOTAExtensionService::UUID_FRAGMENT_STREAM_CHAR[] = "53880102-65fd-4651-ba8e-91527f06c887";
+const char FOTAExtensionService::UUID_FRAGMENT_STATUS_CHAR[] = "53880103-65fd-4651-ba8e-91527f06c887";
+const char FOTAExtensionService::UUID_TRANSFER_STATUS_CHAR[] = "53880104-65fd-4651-ba8e-91527f06c887";
+const char FOTAExtensionService::UUID_SESSION_STATS_CHAR[] = "53880105-65fd-4651-ba8e-91527f06c887";
+const char FOTAExtensionService::UUID_STREAM_CREDIT_CHAR[] = "53880106-65fd-4651-ba8e-91527f06c887";
+
+/* ATT write command opcode and handle */
+#define ATT_WRITE_HEADER_SIZE   3
+
+/* L2CAP basic header */
+#define L2CAP_HEADER_SIZE       4
+
+FOTAExtensionService::FOTAExtensionService(BLE &ble, ChainableGapEventHandler &chainable_gap_eh,
+        ChainableGattServerEventHandler &chainable_gatt_server_eh) : _ble(ble),
+        _chainable_gap_eh(chainable_gap_eh),
+        _chainable_gatt_server_eh(chainable_gatt_server_eh),
+        _session_info_char(UUID(UUID_SESSION_INFO_CHAR), (uint8_t *) &_session_info,
+                sizeof(_session_info), sizeof(_session_info),
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ,
+                nullptr, 0, false),
+        _fragment_stream_char(UUID(UUID_FRAGMENT_STREAM_CHAR), _fragment,
+                0, sizeof(_fragment),
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE,
+                nullptr, 0, true),
+        _fragment_status_char(UUID(UUID_FRAGMENT_STATUS_CHAR), (uint8_t *) &_fragment_status,
+                sizeof(_fragment_status), sizeof(_fragment_status),
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ |
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY,
+                nullptr, 0, false),
+        _transfer_status_char(UUID(UUID_TRANSFER_STATUS_CHAR), (uint8_t *) &_transfer_status,
+                sizeof(_transfer_status), sizeof(_transfer_status),
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ,
+                nullptr, 0, false),
+        _session_stats_char(UUID(UUID_SESSION_STATS_CHAR), (uint8_t *) &_session_stats,
+                sizeof(_session_stats), sizeof(_session_stats),
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ,
+                nullptr, 0, false),
+        _stream_credit_char(UUID(UUID_STREAM_CREDIT_CHAR), (uint8_t *) &_stream_credit,
+                sizeof(_stream_credit), sizeof(_stream_credit),
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ |
+                GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY,
+                nullptr, 0, false) {
+    memset(&_session_info, 0, sizeof(_session_info));
+    memset(&_fragment_status, 0, sizeof(_fragment_status));
+    memset(&_transfer_status, 0, sizeof(_transfer_status));
+    memset(&_session_stats, 0, sizeof(_session_stats));
+    memset(&_stream_credit, 0, sizeof(_stream_credit));
+    _fragment_status.fragment_size = MBED_CONF_APP_FOTA_FRAGMENT_SIZE;
+}
+
+ble_error_t FOTAExtensionService::init() {
+    GattCharacteristic *characteristics[] = {
+            &_session_info_char,
+            &_fragment_stream_char,
+            &_fragment_status_char,
+            &_transfer_status_char,
+            &_session_stats_char,
+            &_stream_credit_char
+    };
+
+    GattService service(UUID(UUID_FOTA_EXTENSION_SERVICE), characteristics,
+            sizeof(characteristics) / sizeof(characteristics[0]));
+
+    ble_error_t error = _ble.gattServer().addService(service);
+    if(error == BLE_ERROR_NONE) {
+        _chainable_gap_eh.addEventHandler(this);
+        _chainable_gatt_server_eh.addEventHandler(this);
+        _initialized = true;
+    }
+
+    return error;
+}
+
+ble_error_t FOTAExtensionService::set_session_info(const fota_session_info_t &info) {
+    _session_info = info;
+
+    if(!_initialized) {
+        /* The initial value is picked up when the service is added */
+        return BLE_ERROR_NONE;
+    }
+
+    return _ble.gattServer().write(_session_info_char.getValueHandle(),
+            (const uint8_t *) &_session_info, sizeof(_session_info));
+}
+
+ble_error_t FOTAExtensionService::set_fragment_status(const fota_fragment_status_t &status) {
+    _fragment_status = status;
+
+    if(!_initialized) {
+        return BLE_ERROR_NONE;
+    }
+
+    return _ble.gattServer().write(_fragment_status_char.getValueHandle(),
+            (const uint8_t *) &_fragment_status, sizeof(_fragment_status));
+}
+
+ble_error_t FOTAExtensionService::set_transfer_status(const fota_transfer_status_t &status) {
+    _transfer_status = status;
+
+    if(!_initialized) {
+        return BLE_ERROR_NONE;
+    }
+
+    return _ble.gattServer().write(_transfer_status_char.getValueHandle(),
+            (const uint8_t *) &_transfer_status, sizeof(_transfer_status));
+}
+
+ble_error_t FOTAExtensionService::set_session_stats(const fota_session_stats_t &stats) {
+    _session_stats = stats;
+
+    if(!_initialized) {
+        return BLE_ERROR_NONE;
+    }
+
+    return _ble.gattServer().write(_session_stats_char.getValueHandle(),
+            (const uint8_t *) &_session_stats, sizeof(_session_stats));
+}
+
+ble_error_t FOTAExtensionService::set_stream_credit(const fota_stream_credit_t &credit) {
+    _stream_credit = credit;
+
+    if(!_initialized) {
+        return BLE_ERROR_NONE;
+    }
+
+    return _ble.gattServer().write(_stream_credit_char.getValueHandle(),
+            (const uint8_t *) &_stream_credit, sizeof(_stream_credit));
+}
+
+void FOTAExtensionService::onDataWritten(const GattWriteCallbackParams &params) {
+    if(params.handle != _fragment_stream_char.getValueHandle()) {
+        return;
+    }
+
+    if((params.len <= FRAGMENT_HEADER_SIZE) || (_handler == nullptr)) {
+        return;
+    }
+
+    uint16_t index = params.data[0] | (params.data[1] << 8);
+    _handler->on_fragment_written(*this, index,
+            mbed::make_const_Span(params.data + FRAGMENT_HEADER_SIZE, params.len - FRAGMENT_HEADER_SIZE));
+}
+
+uint16_t FOTAExtensionService::get_max_fragment_size() const {
+    size_t overhead = ATT_WRITE_HEADER_SIZE + FRAGMENT_HEADER_SIZE;
+    size_t size = _att_mtu - overhead;
+
+    /* Whole LL packets, including the L2CAP header of the first one */
+    size_t pdu_size = size + overhead + L2CAP_HEADER_SIZE;
+    if(pdu_size > _data_length) {
+        size = ((pdu_size / _data_length) * _data_length) - overhead - L2CAP_HEADER_SIZE;
+    }
+
+    if(size > MBED_CONF_APP_FOTA_FRAGMENT_SIZE) {
+        size = MBED_CONF_APP_FOTA_FRAGMENT_SIZE;
+    }
+
+    return size;
+}
+
+void FOTAExtensionService::onAttMtuChange(ble::connection_handle_t connectionHandle, uint16_t attMtuSize) {
+    uint16_t previous = get_max_fragment_size();
+    _att_mtu = attMtuSize;
+    check_max_fragment_size(previous);
+}
+
+void FOTAExtensionService::onDataLengthChange(ble::connection_handle_t connectionHandle,
+        uint16_t txSize, uint16_t rxSize) {
+    uint16_t previous = get_max_fragment_size();
+    _data_length = rxSize;
+    check_max_fragment_size(previous);
+}
+
+void FOTAExtensionService::onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) {
+    /* The next connection starts over with the defaults */
+    _att_mtu = DEFAULT_ATT_MTU;
+    _data_length = DEFAULT_DATA_LENGTH;
+}
+
+void FOTAExtensionService::check_max_fragment_size(uint16_t previous) {
+    if((_handler != nullptr) && (get_max_fragment_size() != previous)) {
+        _handler->on_max_fragment_size_changed(*this);
+    }
+}
@@ -0,0 +1,298 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef FOTAEXTENSIONSERVICE_H_
+#define FOTAEXTENSIONSERVICE_H_
+
+#include "ble/BLE.h"
+#include "ble/Gap.h"
+#include "ble/GattServer.h"
+#include "ble/gap/ChainableGapEventHandler.h"
+#include "ble/gatt/ChainableGattServerEventHandler.h"
+
+#include "platform/Span.h"
+#include "platform/mbed_toolchain.h"
+
+#include <stdint.h>
+
+#ifndef MBED_CONF_APP_FOTA_FRAGMENT_SIZE
+#define MBED_CONF_APP_FOTA_FRAGMENT_SIZE 242
+#endif
+
+/**
+ * State of the last interrupted FOTA session, as read by the client
+ *
+ * All fields are little-endian. A resume_offset of 0 means there is
+ * nothing to resume.
+ */
+MBED_PACKED(struct) fota_session_info_t {
+    /* Offset the client should resume sending the image from */
+    uint32_t resume_offset;
+
+    /* CRC32 (ANSI) of the first resume_offset bytes of the image */
+    uint32_t resume_crc;
+
+    /* SHA-256 of the MCUboot image header of the interrupted image */
+    uint8_t header_hash[32];
+};
+
+/**
+ * Receive state of the indexed fragment stream, as read or notified to the client
+ *
+ * All fields are little-endian.
+ */
+MBED_PACKED(struct) fota_fragment_status_t {
+    /* Index of the next fragment expected in order */
+    uint16_t next_index;
+
+    /* Payload size of every fragment but the last, fixed once the first fragment is received */
+    uint16_t fragment_size;
+
+    /* Number of fragments accepted ahead of next_index */
+    uint8_t window;
+
+    /* Bit i is set if fragment next_index + i is missing while a later one was received */
+    uint32_t missing;
+};
+
+/**
+ * What has been written to the update BlockDevice, as read by the client
+ *
+ * The client compares this with the image it sent before committing, so a
+ * corrupted transfer is caught without reading the BlockDevice back. It is
+ * refreshed when the client writes FOTA_OP_CODE_SYNC. All fields are
+ * little-endian.
+ */
+MBED_PACKED(struct) fota_transfer_status_t {
+    /* Number of image bytes written since the start of the image */
+    uint32_t size;
+
+    /* CRC32 (ANSI) of those bytes */
+    uint32_t crc;
+};
+
+/**
+ * Performance counters of the current (or last) FOTA session, as read by the client
+ *
+ * Refreshed when the client writes FOTA_OP_CODE_SYNC and at the end of the
+ * session. Times are measured on the device. All fields are little-endian.
+ */
+MBED_PACKED(struct) fota_session_stats_t {
+    /* Time since the session started, in ms */
+    uint32_t duration_ms;
+
+    /* Bytes of the binary (or fragment) stream received in order */
+    uint32_t bytes_received;
+
+    /* Bytes programmed to the update BlockDevice, from the start of the image */
+    uint32_t bytes_programmed;
+
+    /* Number and duration of program operations, in us */
+    uint32_t program_count;
+    uint32_t program_min_us;
+    uint32_t program_avg_us;
+    uint32_t program_max_us;
+
+    /* Sectors erased (blank ones are skipped) and the time it took, in ms */
+    uint32_t erase_count;
+    uint32_t erase_ms;
+
+    /* Number of times XOFF was sent, and time spent in XOFF, in ms */
+    uint16_t xoff_count;
+    uint32_t xoff_ms;
+
+    /* Gaps in the fragment stream (lost or reordered fragments), and rejected fragments */
+    uint16_t fragment_gaps;
+    uint16_t invalid_fragments;
+};
+
+/**
+ * Credit granted to the client for the binary stream, as notified to the client
+ *
+ * The client may have sent up to limit bytes of the binary stream since the
+ * session started (or resumed). It is sized from the free space in the
+ * staging buffers, so data sent within the credit is never stalled or
+ * dropped, and it never decreases during a session. It is notified when it
+ * grows by at least a page, or as soon as the client has less than a page left.
+ * The limit is little-endian.
+ */
+MBED_PACKED(struct) fota_stream_credit_t {
+    uint32_t limit;
+};
+
+/**
+ * Vendor-specific characteristics that complement the FOTAService
+ *
+ * The FOTAService comes from an external library, anything the demo needs
+ * on top of it is exposed through this companion service.
+ *
+ * Besides the FOTAService binary stream, the image can be sent through the
+ * fragment stream characteristic. Each write is a 16-bit fragment index
+ * followed by the fragment. Fragments may arrive out of order, and the
+ * fragment status characteristic is notified with the missing ones so
+ * only those are resent (see SelectiveRepeatReceiver). Fragments past the
+ * window are dropped, so the client keeps at most a window in flight, and
+ * the fragment status is also notified as the window slides.
+ *
+ * The fragment size is picked when the session starts, as the largest
+ * that fits the negotiated ATT MTU and the LL data length (see
+ * get_max_fragment_size()). The event handler is told when that changes
+ * (eg: on an MTU renegotiation), as fragments already received were placed
+ * by their index at the session's fragment size, which may no longer fit.
+ */
+class FOTAExtensionService : private ble::GattServer::EventHandler, private ble::Gap::EventHandler
+{
+public:
+
+    static const char UUID_FOTA_EXTENSION_SERVICE[];
+    static const char UUID_SESSION_INFO_CHAR[];
+    static const char UUID_FRAGMENT_STREAM_CHAR[];
+    static const char UUID_FRAGMENT_STATUS_CHAR[];
+    static const char UUID_TRANSFER_STATUS_CHAR[];
+    static const char UUID_SESSION_STATS_CHAR[];
+    static const char UUID_STREAM_CREDIT_CHAR[];
+
+    /** Size of the fragment index at the start of each fragment stream write */
+    static constexpr size_t FRAGMENT_HEADER_SIZE = 2;
+
+    /** ATT MTU and LL data length until larger ones are negotiated */
+    static constexpr uint16_t DEFAULT_ATT_MTU = 23;
+    static constexpr uint16_t DEFAULT_DATA_LENGTH = 27;
+
+    /**
+     * Handler for writes to the fragment stream characteristic
+     */
+    class EventHandler
+    {
+    public:
+        virtual ~EventHandler() { }
+
+        virtual void on_fragment_written(FOTAExtensionService &svc, uint16_t index,
+                mbed::Span<const uint8_t> data) = 0;
+
+        /** The value of get_max_fragment_size() changed */
+        virtual void on_max_fragment_size_changed(FOTAExtensionService &svc) = 0;
+    };
+
+public:
+
+    FOTAExtensionService(BLE &ble, ChainableGapEventHandler &chainable_gap_eh,
+            ChainableGattServerEventHandler &chainable_gatt_server_eh);
+
+    /**
+     * Register the service with the GattServer
+     */
+    ble_error_t init();
+
+    /**
+     * Update the value of the session info characteristic
+     */
+    ble_error_t set_session_info(const fota_session_info_t &info);
+
+    /**
+     * Update the value of the fragment status characteristic, and notify it
+     */
+    ble_error_t set_fragment_status(const fota_fragment_status_t &status);
+
+    /**
+     * Update the value of the transfer status characteristic
+     */
+    ble_error_t set_transfer_status(const fota_transfer_status_t &status);
+
+    /**
+     * Update the value of the session stats characteristic
+     */
+    ble_error_t set_session_stats(const fota_session_stats_t &stats);
+
+    /**
+     * Update the value of the stream credit characteristic, and notify it
+     */
+    ble_error_t set_stream_credit(const fota_stream_credit_t &credit);
+
+    void set_event_handler(EventHandler *handler) {
+        _handler = handler;
+    }
+
+    /**
+     * Largest fragment a fragment stream write can carry on the current connection
+     *
+     * The ATT write command must fit the MTU. If it doesn't fit a single LL
+     * packet, it is rounded down to fill whole packets, as a packet carrying
+     * just the tail of a write costs as much air time as a full one.
+     */
+    uint16_t get_max_fragment_size() const;
+
+protected:
+
+    /* GattServer::EventHandler */
+    void onDataWritten(const GattWriteCallbackParams &params) override;
+    void onAttMtuChange(ble::connection_handle_t connectionHandle, uint16_t attMtuSize) override;
+
+    /* Gap::EventHandler */
+    void onDataLengthChange(ble::connection_handle_t connectionHandle,
+            uint16_t txSize, uint16_t rxSize) override;
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override;
+
+    /** Tell the event handler if the max fragment size isn't the given one anymore */
+    void check_max_fragment_size(uint16_t previous);
+
+protected:
+
+    BLE &_ble;
+
+    ChainableGapEventHandler &_chainable_gap_eh;
+
+    ChainableGattServerEventHandler &_chainable_gatt_server_eh;
+
+    EventHandler *_handler = nullptr;
+
+    fota_session_info_t _session_info;
+
+    GattCharacteristic _session_info_char;
+
+    uint8_t _fragment[FRAGMENT_HEADER_SIZE + MBED_CONF_APP_FOTA_FRAGMENT_SIZE];
+
+    GattCharacteristic _fragment_stream_char;
+
+    fota_fragment_status_t _fragment_status;
+
+    GattCharacteristic _fragment_status_char;
+
+    fota_transfer_status_t _transfer_status;
+
+    GattCharacteristic _transfer_status_char;
+
+    fota_session_stats_t _session_stats;
+
+    GattCharacteristic _session_stats_char;
+
+    fota_stream_credit_t _stream_credit;
+
+    GattCharacteristic _stream_credit_char;
+
+    bool _initialized = false;
+
+    uint16_t _att_mtu = DEFAULT_ATT_MTU;
+
+    /* Largest LL payload the peer sends us */
+    uint16_t _data_length = DEFAULT_DATA_LENGTH;
+
+};
+
+#endif /* FOTAEXTENSIONSERVICE_H_ */
@@ -0,0 +1,165 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "FOTALinkManager.h"
+
+#include "mbed-trace/mbed_trace.h"
+
+#define TRACE_GROUP "FOTA"
+
+FOTALinkManager::FOTALinkManager(BLE &ble, events::EventQueue &queue,
+        ChainableGapEventHandler &chainable_gap_eh) : _ble(ble), _queue(queue),
+        _chainable_gap_eh(chainable_gap_eh) {
+}
+
+FOTALinkManager::~FOTALinkManager() {
+    _queue.cancel(_idle_event_id);
+}
+
+void FOTALinkManager::init() {
+    _chainable_gap_eh.addEventHandler(this);
+}
+
+void FOTALinkManager::set_session_active(bool active) {
+    _session_active = active;
+
+    if(active) {
+        on_activity();
+    } else if(_fast) {
+        request_low_power_profile();
+    }
+}
+
+void FOTALinkManager::on_activity() {
+    _last_activity = rtos::Kernel::Clock::now();
+
+    if(_session_active && !_fast) {
+        request_fast_profile();
+    }
+}
+
+void FOTALinkManager::onConnectionComplete(const ble::ConnectionCompleteEvent &event) {
+    if(event.getStatus() != BLE_ERROR_NONE) {
+        return;
+    }
+
+    _connection_handle = event.getConnectionHandle();
+    _connected = true;
+}
+
+void FOTALinkManager::onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) {
+    /* The session (if any) can only be resumed on a new connection */
+    _connected = false;
+    _session_active = false;
+    _fast = false;
+    _queue.cancel(_idle_event_id);
+    _idle_event_id = 0;
+}
+
+void FOTALinkManager::onUpdateConnectionParametersRequest(
+        const ble::UpdateConnectionParametersRequestEvent &event) {
+    ble::conn_interval_t min_interval = event.getMinConnectionInterval();
+    ble::conn_interval_t max_interval = event.getMaxConnectionInterval();
+    ble::slave_latency_t latency = event.getSlaveLatency();
+
+    /* Don't let the central slow the link down in the middle of a transfer */
+    if(_fast) {
+        ble::conn_interval_t fast_max(MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MAX);
+        if(max_interval > fast_max) {
+            max_interval = fast_max;
+        }
+        if(min_interval > max_interval) {
+            min_interval = max_interval;
+        }
+        latency = ble::slave_latency_t(0);
+    }
+
+    _ble.gap().acceptConnectionParametersUpdate(event.getConnectionHandle(),
+            min_interval, max_interval, latency, event.getSupervisionTimeout());
+}
+
+void FOTALinkManager::request_fast_profile() {
+    _fast = true;
+
+    if(!_connected) {
+        return;
+    }
+
+    tr_info("requesting fast link profile");
+
+    ble_error_t error = _ble.gap().updateConnectionParameters(_connection_handle,
+            ble::conn_interval_t(MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MIN),
+            ble::conn_interval_t(MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MAX),
+            ble::slave_latency_t(0),
+            ble::supervision_timeout_t(ble::millisecond_t(MBED_CONF_APP_FOTA_LINK_FAST_SUPERVISION_TIMEOUT_MS)));
+    if(error) {
+        tr_warn("error requesting connection parameters: 0x%02X", error);
+    }
+
+    if(_ble.gap().isFeatureSupported(ble::controller_supported_features_t::LE_2M_PHY)) {
+        ble::phy_set_t phys(/* 1M */ false, /* 2M */ true, /* coded */ false);
+        error = _ble.gap().setPhy(_connection_handle, &phys, &phys, ble::coded_symbol_per_bit_t::UNDEFINED);
+        if(error) {
+            tr_warn("error requesting the 2M PHY: 0x%02X", error);
+        }
+    }
+
+    if(_idle_event_id == 0) {
+        _idle_event_id = _queue.call_in(std::chrono::milliseconds(MBED_CONF_APP_FOTA_LINK_IDLE_TIMEOUT_MS),
+                mbed::callback(this, &FOTALinkManager::check_idle));
+    }
+}
+
+void FOTALinkManager::request_low_power_profile() {
+    _fast = false;
+    _queue.cancel(_idle_event_id);
+    _idle_event_id = 0;
+
+    if(!_connected) {
+        return;
+    }
+
+    tr_info("requesting low-power link profile");
+
+    /* The PHY is left as is, the 2M PHY keeps the radio on for less time */
+    ble_error_t error = _ble.gap().updateConnectionParameters(_connection_handle,
+            ble::conn_interval_t(MBED_CONF_APP_FOTA_LINK_IDLE_INTERVAL_MIN),
+            ble::conn_interval_t(MBED_CONF_APP_FOTA_LINK_IDLE_INTERVAL_MAX),
+            ble::slave_latency_t(MBED_CONF_APP_FOTA_LINK_IDLE_SLAVE_LATENCY),
+            ble::supervision_timeout_t(ble::millisecond_t(MBED_CONF_APP_FOTA_LINK_IDLE_SUPERVISION_TIMEOUT_MS)));
+    if(error) {
+        tr_warn("error requesting connection parameters: 0x%02X", error);
+    }
+}
+
+void FOTALinkManager::check_idle() {
+    _idle_event_id = 0;
+
+    auto idle = rtos::Kernel::Clock::now() - _last_activity;
+    auto timeout = std::chrono::milliseconds(MBED_CONF_APP_FOTA_LINK_IDLE_TIMEOUT_MS);
+    if(idle >= timeout) {
+        tr_info("fota link idle");
+        request_low_power_profile();
+        return;
+    }
+
+    /* Check again once the timeout would expire */
+    _idle_event_id = _queue.call_in(std::chrono::duration_cast<std::chrono::milliseconds>(timeout - idle),
+            mbed::callback(this, &FOTALinkManager::check_idle));
+}
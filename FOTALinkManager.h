@@ -0,0 +1,140 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef FOTALINKMANAGER_H_
+#define FOTALINKMANAGER_H_
+
+#include "ble/BLE.h"
+#include "ble/Gap.h"
+#include "ble/gap/ChainableGapEventHandler.h"
+
+#include "events/EventQueue.h"
+#include "rtos/Kernel.h"
+
+/* Connection intervals are in units of 1.25 ms */
+#ifndef MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MIN
+#define MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MIN 6
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MAX
+#define MBED_CONF_APP_FOTA_LINK_FAST_INTERVAL_MAX 12
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_FAST_SUPERVISION_TIMEOUT_MS
+#define MBED_CONF_APP_FOTA_LINK_FAST_SUPERVISION_TIMEOUT_MS 4000
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_IDLE_INTERVAL_MIN
+#define MBED_CONF_APP_FOTA_LINK_IDLE_INTERVAL_MIN 80
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_IDLE_INTERVAL_MAX
+#define MBED_CONF_APP_FOTA_LINK_IDLE_INTERVAL_MAX 160
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_IDLE_SLAVE_LATENCY
+#define MBED_CONF_APP_FOTA_LINK_IDLE_SLAVE_LATENCY 4
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_IDLE_SUPERVISION_TIMEOUT_MS
+#define MBED_CONF_APP_FOTA_LINK_IDLE_SUPERVISION_TIMEOUT_MS 6000
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_LINK_IDLE_TIMEOUT_MS
+#define MBED_CONF_APP_FOTA_LINK_IDLE_TIMEOUT_MS 10000
+#endif
+
+/**
+ * Switches the connection between a fast profile while a FOTA session is
+ * active and a low-power profile otherwise
+ *
+ * The fast profile requests a short connection interval, no slave latency
+ * and the 2M PHY (if the controller supports it), so the transfer doesn't
+ * depend on the defaults of the central. The data length is negotiated by
+ * the stack when the connection is established.
+ *
+ * The low-power profile is requested once the session ends, or when no
+ * FOTA traffic has been seen for MBED_CONF_APP_FOTA_LINK_IDLE_TIMEOUT_MS.
+ * Connection parameter update requests from the central are accepted, but
+ * clamped to the fast profile while it is in use.
+ */
+class FOTALinkManager : private ble::Gap::EventHandler
+{
+public:
+
+    FOTALinkManager(BLE &ble, events::EventQueue &queue, ChainableGapEventHandler &chainable_gap_eh);
+
+    ~FOTALinkManager();
+
+    void init();
+
+    /**
+     * Set whether a FOTA session is in progress, switching profiles if it changed
+     */
+    void set_session_active(bool active);
+
+    /**
+     * Note FOTA traffic, so the idle timeout starts over
+     *
+     * If the link went idle in the middle of the session, the fast profile
+     * is requested again.
+     */
+    void on_activity();
+
+    bool is_fast() const {
+        return _fast;
+    }
+
+protected:
+
+    /* Gap::EventHandler */
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override;
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override;
+    void onUpdateConnectionParametersRequest(const ble::UpdateConnectionParametersRequestEvent &event) override;
+
+    /** Request the fast profile */
+    void request_fast_profile();
+
+    /** Request the low-power profile */
+    void request_low_power_profile();
+
+    /** Fall back to the low-power profile if the link has been idle long enough */
+    void check_idle();
+
+protected:
+
+    BLE &_ble;
+    events::EventQueue &_queue;
+    ChainableGapEventHandler &_chainable_gap_eh;
+
+    ble::connection_handle_t _connection_handle = 0;
+    bool _connected = false;
+
+    bool _session_active = false;
+
+    /* Set while the fast profile is requested */
+    bool _fast = false;
+
+    rtos::Kernel::Clock::time_point _last_activity;
+
+    int _idle_event_id = 0;
+
+};
+
+#endif /* FOTALINKMANAGER_H_ */
@@ -0,0 +1,262 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "FOTASlot.h"
+
+#include "drivers/Timer.h"
+#include "mbed-trace/mbed_trace.h"
+
+#include <assert.h>
+
+#define TRACE_GROUP "FOTA"
+
+FOTASlot::FOTASlot(mbed::BlockDevice &bd, events::EventQueue &queue,
+        events::EventQueue &flash_queue) : _bd(bd), _queue(queue), _flash_queue(flash_queue),
+        _bd_eraser(bd, flash_queue),
+        _writer(bd, flash_queue, _page_pool, MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE) {
+    _writer.set_high_watermark(MBED_CONF_APP_FOTA_PAGE_BUFFER_HIGH_WATERMARK);
+    _writer.set_verify(MBED_CONF_APP_FOTA_VERIFY_PAGES);
+    _bd_eraser.set_blank_check(MBED_CONF_APP_FOTA_ERASE_BLANK_CHECK);
+    _bd_eraser.set_time_budget(std::chrono::milliseconds(MBED_CONF_APP_FOTA_ERASE_SLICE_BUDGET_MS),
+            std::chrono::milliseconds(MBED_CONF_APP_FOTA_ERASE_YIELD_MS));
+    if(&_flash_queue != &_queue) {
+        _writer.set_callback_queue(&_queue);
+        _bd_eraser.set_callback_queue(&_queue);
+    }
+}
+
+FOTASlot::~FOTASlot() {
+}
+
+void FOTASlot::prepare() {
+    _prepared = true;
+    start_erase(0);
+}
+
+void FOTASlot::begin(bd_addr_t addr) {
+    bool prepared = _prepared;
+    _prepared = false;
+
+    if(prepared && (addr == 0)) {
+        /* Carry on with the erase, it now stays ahead of the write address */
+        tr_info("fota bd already erased up to %llu", _erased_addr);
+        _writer.set_program_limit((_erased_addr == _erase_limit) ? _bd.size() : _erased_addr);
+        erase_ahead();
+        return;
+    }
+
+    start_erase(addr);
+}
+
+void FOTASlot::start_erase(bd_addr_t addr) {
+    /* The page buffer size was only checked against the configured program size. This
+     * is checked here rather than on construction, as the BlockDevice may only be
+     * initialized after the slot is constructed (see main.cpp)
+     */
+    assert((_bd.get_program_size() != 0) &&
+            ((MBED_CONF_APP_FOTA_BD_PROGRAM_SIZE % _bd.get_program_size()) == 0));
+
+    _erasing = true;
+
+    /* Nothing can be programmed until it has been erased */
+    _writer.set_program_limit(addr);
+    _erased_addr = addr;
+
+    /* Initiate erase of the update block device, dropping whatever erase was in progress */
+    _bd_eraser.cancel();
+    _erase_started = true;
+    _erase_in_progress = false;
+    _erased_sectors = 0;
+    _erase_time = std::chrono::microseconds(0);
+    _erasing_trailer = false;
+
+    bd_size_t trailer_size = get_trailer_size();
+    _erase_limit = _bd.size() - trailer_size;
+
+    if(trailer_size == 0) {
+        tr_info("erasing fota bd from %llu, size: %llu", addr, (unsigned long long) _bd.size());
+        erase_ahead();
+    } else {
+        /* MCUboot writes to the trailer at the end of the slot when the
+         * update is committed, so erase it up front. The first sectors
+         * are erased next, after which the transfer can start.
+         */
+        tr_info("erasing fota bd trailer, size: %llu", (unsigned long long) trailer_size);
+        _erasing_trailer = true;
+        _erase_in_progress = true;
+        int err = _bd_eraser.start_erase(_erase_limit, trailer_size,
+                mbed::callback(this, &FOTASlot::on_bd_erased));
+        assert(!err);
+    }
+}
+
+bd_size_t FOTASlot::get_trailer_size() const {
+    if(MBED_CONF_APP_FOTA_ERASE_AHEAD_SECTORS == 0) {
+        return 0;
+    }
+
+    bd_size_t erase_size = _bd.get_erase_size();
+    return ((MBED_CONF_APP_FOTA_TRAILER_ERASE_SIZE + erase_size - 1) / erase_size) * erase_size;
+}
+
+bool FOTASlot::flush() {
+    if(!finish_erase(_writer.get_address())) {
+        return false;
+    }
+
+    int err = _writer.flush();
+    if(err) {
+        tr_error("flushing staging buffers failed: 0x%X", err);
+        return false;
+    }
+
+    tr_info("flushed staging buffers, %llu bytes programmed",
+            (unsigned long long) _writer.get_programmed_address());
+    return true;
+}
+
+bool FOTASlot::finish_erase(bd_addr_t end) {
+    if(!_erase_started) {
+        return true;
+    }
+
+    if(_erase_in_progress) {
+        _bd_eraser.cancel();
+        _erase_in_progress = false;
+        count_eraser_stats();
+
+        if(_erasing_trailer) {
+            bd_addr_t addr = _bd_eraser.get_address();
+            int err = erase_now(addr, _bd.size() - addr);
+            if(err) {
+                tr_error("error when erasing block device: 0x%X", -err);
+                return false;
+            }
+            _erasing_trailer = false;
+        } else {
+            _erased_addr = _bd_eraser.get_address();
+        }
+    }
+
+    bd_size_t erase_size = _bd.get_erase_size();
+    end = ((end + erase_size - 1) / erase_size) * erase_size;
+    if(end > _erase_limit) {
+        end = _erase_limit;
+    }
+
+    if(end > _erased_addr) {
+        tr_info("erase fell behind, erasing %llu bytes synchronously",
+                (unsigned long long) (end - _erased_addr));
+        int err = erase_now(_erased_addr, end - _erased_addr);
+        if(err) {
+            tr_error("error when erasing block device: 0x%X", -err);
+            return false;
+        }
+        _erased_addr = end;
+    }
+
+    _writer.set_program_limit((_erased_addr == _erase_limit) ? _bd.size() : _erased_addr);
+
+    return true;
+}
+
+int FOTASlot::erase_now(bd_addr_t addr, bd_size_t size) {
+    mbed::Timer timer;
+    timer.start();
+    int err = _bd.erase(addr, size);
+    timer.stop();
+
+    _erase_time += timer.elapsed_time();
+    _erased_sectors += size / _bd.get_erase_size();
+    return err;
+}
+
+void FOTASlot::count_eraser_stats() {
+    _erase_time += _bd_eraser.get_erase_time();
+    _erased_sectors += _bd_eraser.get_erased_sectors();
+}
+
+void FOTASlot::erase_ahead() {
+    if(!_erase_started || _erase_in_progress) {
+        return;
+    }
+
+    bd_addr_t target = _erase_limit;
+    if(MBED_CONF_APP_FOTA_ERASE_AHEAD_SECTORS != 0) {
+        /* A prepared slot is erased in steps too, so its session can start before it's all erased */
+        bd_size_t erase_size = _bd.get_erase_size();
+        bd_addr_t write_sector = ((_writer.get_address() + erase_size - 1) / erase_size) * erase_size;
+        target = (_prepared ? _erased_addr : write_sector) +
+                (MBED_CONF_APP_FOTA_ERASE_AHEAD_SECTORS * erase_size);
+        if(target > _erase_limit) {
+            target = _erase_limit;
+        }
+    }
+
+    if(target <= _erased_addr) {
+        return;
+    }
+
+    _erase_target = target;
+    _erase_in_progress = true;
+    int err = _bd_eraser.start_erase(_erased_addr, target - _erased_addr,
+            mbed::callback(this, &FOTASlot::on_bd_erased));
+    assert(!err);
+}
+
+void FOTASlot::on_bd_erased(int result) {
+    _erase_in_progress = false;
+    count_eraser_stats();
+
+    if(result != mbed::BD_ERROR_OK) {
+        tr_error("error when erasing block device: 0x%X", -result);
+        if(_erase_cb) {
+            _erase_cb(result);
+        }
+        return;
+    }
+
+    if(_bd_eraser.get_skipped_sectors()) {
+        tr_debug("%llu sectors were already blank, skipped erasing them",
+                (unsigned long long) _bd_eraser.get_skipped_sectors());
+    }
+
+    if(_erasing_trailer) {
+        tr_debug("erased the update BlockDevice trailer");
+        _erasing_trailer = false;
+    } else {
+        tr_debug("erased the update BlockDevice up to %llu (%lu us per sector)", _erase_target,
+                (unsigned long) _bd_eraser.get_average_erase_time().count());
+        _erased_addr = _erase_target;
+
+        /* The trailer region past the erase limit is already erased */
+        _writer.set_program_limit((_erased_addr == _erase_limit) ? _bd.size() : _erased_addr);
+
+        if(_erasing) {
+            tr_info("successfully erased the start of the update BlockDevice");
+            _erasing = false;
+        }
+    }
+
+    erase_ahead();
+
+    if(_erase_cb) {
+        _erase_cb(result);
+    }
+}
@@ -0,0 +1,277 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef FOTASLOT_H_
+#define FOTASLOT_H_
+
+#include "blockdevice/BlockDevice.h"
+#include "events/EventQueue.h"
+#include "platform/Callback.h"
+
+#include "PagedBlockDeviceWriter.h"
+#include "PeriodicBlockDeviceEraser.h"
+
+#ifndef MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE
+#define MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE 256
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_PAGE_BUFFER_COUNT
+#define MBED_CONF_APP_FOTA_PAGE_BUFFER_COUNT 4
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_PAGE_BUFFER_HIGH_WATERMARK
+#define MBED_CONF_APP_FOTA_PAGE_BUFFER_HIGH_WATERMARK (MBED_CONF_APP_FOTA_PAGE_BUFFER_COUNT - 1)
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_BD_PROGRAM_SIZE
+#define MBED_CONF_APP_FOTA_BD_PROGRAM_SIZE 4
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_VERIFY_IMAGE
+#define MBED_CONF_APP_FOTA_VERIFY_IMAGE 1
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_VERIFY_PAGES
+#define MBED_CONF_APP_FOTA_VERIFY_PAGES 0
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_ERASE_AHEAD_SECTORS
+#define MBED_CONF_APP_FOTA_ERASE_AHEAD_SECTORS 8
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_ERASE_BLANK_CHECK
+#define MBED_CONF_APP_FOTA_ERASE_BLANK_CHECK 1
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_ERASE_SLICE_BUDGET_MS
+#define MBED_CONF_APP_FOTA_ERASE_SLICE_BUDGET_MS 20
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_ERASE_YIELD_MS
+#define MBED_CONF_APP_FOTA_ERASE_YIELD_MS 2
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_TRAILER_ERASE_SIZE
+#define MBED_CONF_APP_FOTA_TRAILER_ERASE_SIZE 0x2000
+#endif
+
+static_assert((MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE % MBED_CONF_APP_FOTA_BD_PROGRAM_SIZE) == 0,
+        "fota-page-buffer-size must be a multiple of fota-bd-program-size");
+
+static_assert((MBED_CONF_APP_FOTA_PAGE_BUFFER_HIGH_WATERMARK >= 1) &&
+        (MBED_CONF_APP_FOTA_PAGE_BUFFER_HIGH_WATERMARK <= MBED_CONF_APP_FOTA_PAGE_BUFFER_COUNT),
+        "fota-page-buffer-high-watermark must be between 1 and fota-page-buffer-count");
+
+/**
+ * An update target: a BlockDevice images are written to, with its own
+ * erase state and write cursor (the writer and its staging buffers)
+ *
+ * Rather than erasing the whole BlockDevice before the transfer starts, only
+ * the first few sectors (and the region MCUboot writes its trailer to) are
+ * erased before the slot is ready. The rest is erased a configurable number
+ * of sectors ahead of the write address while data streams in.
+ *
+ * A slot can also be prepared ahead of its session, eg: while an image is
+ * transferred to another slot. It is then erased in the background up to
+ * the trailer region, and a session started from the beginning of the slot
+ * picks up where the erase got to rather than starting over.
+ *
+ * The erase callback is called (on the queue) whenever erasing a region
+ * completes, or fails.
+ *
+ * The eraser and staging buffers are members, sized at compile time, so
+ * a slot never allocates. The BlockDevice's program size must divide
+ * MBED_CONF_APP_FOTA_BD_PROGRAM_SIZE, which the page buffer size is checked
+ * against at compile time.
+ */
+class FOTASlot
+{
+public:
+
+    using EraseCallback_t = mbed::Callback<void(int)>;
+
+public:
+
+    /**
+     * @param[in] queue Queue the slot's callbacks run from
+     * @param[in] flash_queue Queue erase and program operations run from, may be the same as queue
+     * @note The BlockDevice only needs to be initialized once the slot is prepared or a session begins
+     */
+    FOTASlot(mbed::BlockDevice &bd, events::EventQueue &queue, events::EventQueue &flash_queue);
+
+    ~FOTASlot();
+
+    void set_erase_callback(EraseCallback_t cb) {
+        _erase_cb = cb;
+    }
+
+    /**
+     * Whether images written to the slot are MCUboot images, whose hash is checked on commit
+     */
+    void set_verify_image(bool verify) {
+        _verify_image = verify;
+    }
+
+    bool get_verify_image() const {
+        return _verify_image;
+    }
+
+    /**
+     * Start erasing the slot in the background, ahead of a session
+     */
+    void prepare();
+
+    /**
+     * Start a session at the given address (the writer must already be reset
+     * or resumed there), erasing the slot from there on
+     *
+     * If the slot was prepared and the session starts at its beginning, the
+     * erase already in progress carries on.
+     */
+    void begin(bd_addr_t addr);
+
+    /**
+     * Start erasing the next sectors ahead of the write address, if needed
+     */
+    void erase_ahead();
+
+    /**
+     * Stop erasing ahead and synchronously erase anything that still needs
+     * to be erased up to the given address
+     * @retval true on success, false if erasing the block device failed
+     */
+    bool finish_erase(bd_addr_t end);
+
+    /**
+     * Erase what is left and program everything left in the staging buffers
+     * @retval true on success, false if erasing or programming the block device failed
+     */
+    bool flush();
+
+    /**
+     * Whether the start of the slot has been erased, so data can be accepted
+     */
+    bool is_ready() const {
+        return !_erasing;
+    }
+
+    /**
+     * Whether the slot is being (or has been) prepared and no session has started since
+     */
+    bool is_prepared() const {
+        return _prepared;
+    }
+
+    /**
+     * Size of the trailer region erased up front, 0 if the whole
+     * BlockDevice is erased before the transfer starts
+     */
+    bd_size_t get_trailer_size() const;
+
+    mbed::BlockDevice &get_bd() {
+        return _bd;
+    }
+
+    PagedBlockDeviceWriter &get_writer() {
+        return _writer;
+    }
+
+    /**
+     * Number of sectors erased since the slot last started erasing (not
+     * counting those that were already blank)
+     */
+    bd_size_t get_erased_sectors() const {
+        return _erased_sectors;
+    }
+
+    /**
+     * Time spent erasing those sectors
+     */
+    std::chrono::microseconds get_erase_time() const {
+        return _erase_time;
+    }
+
+protected:
+
+    /**
+     * Start erasing from the given address, trailer first
+     */
+    void start_erase(bd_addr_t addr);
+
+    /**
+     * Synchronously erase a region, counting it in the erase stats
+     */
+    int erase_now(bd_addr_t addr, bd_size_t size);
+
+    /** Add the eraser's last (possibly cancelled) operation to the erase stats */
+    void count_eraser_stats();
+
+    /* Callback for PeriodicBlockDeviceEraser */
+    void on_bd_erased(int result);
+
+protected:
+
+    mbed::BlockDevice &_bd;
+    events::EventQueue &_queue;
+    events::EventQueue &_flash_queue;
+
+    /* BlockDevice eraser that handles non-blocking, periodic erase operations */
+    PeriodicBlockDeviceEraser _bd_eraser;
+
+    /* Ring of staging buffers used to coalesce binary stream fragments into whole pages */
+    uint8_t _page_pool[MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE * MBED_CONF_APP_FOTA_PAGE_BUFFER_COUNT];
+
+    /* Writer that programs the staging buffers from queued events */
+    PagedBlockDeviceWriter _writer;
+
+    EraseCallback_t _erase_cb = nullptr;
+
+    bool _verify_image = MBED_CONF_APP_FOTA_VERIFY_IMAGE;
+
+    /* Set once the slot has started being erased */
+    bool _erase_started = false;
+
+    /* Set until the start of the slot has been erased */
+    bool _erasing = false;
+
+    /* Set while the slot is erased ahead of its session */
+    bool _prepared = false;
+
+    /* Set while the eraser is running */
+    bool _erase_in_progress = false;
+
+    /* Set while the trailer region is being erased */
+    bool _erasing_trailer = false;
+
+    /* Everything below this address has been erased */
+    bd_addr_t _erased_addr = 0;
+
+    /* End of the region currently being erased */
+    bd_addr_t _erase_target = 0;
+
+    /* Erasing ahead stops at this address (the start of the trailer region) */
+    bd_addr_t _erase_limit = 0;
+
+    /* Sectors erased since erasing last started, and the time it took */
+    bd_size_t _erased_sectors = 0;
+    std::chrono::microseconds _erase_time = std::chrono::microseconds(0);
+
+};
+
+#endif /* FOTASLOT_H_ */
@@ -0,0 +1,42 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "FOTASlotRegistry.h"
+
+bool FOTASlotRegistry::add(uint8_t image_id, FOTASlot &slot) {
+    if((_count == MAX_SLOTS) || (find(image_id) != nullptr)) {
+        return false;
+    }
+
+    _entries[_count].image_id = image_id;
+    _entries[_count].slot = &slot;
+    _count++;
+
+    return true;
+}
+
+FOTASlot *FOTASlotRegistry::find(uint8_t image_id) const {
+    for(size_t i = 0; i < _count; i++) {
+        if(_entries[i].image_id == image_id) {
+            return _entries[i].slot;
+        }
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,89 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef FOTASLOTREGISTRY_H_
+#define FOTASLOTREGISTRY_H_
+
+#include "FOTASlot.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef MBED_CONF_APP_FOTA_MAX_SLOTS
+#define MBED_CONF_APP_FOTA_MAX_SLOTS 3
+#endif
+
+/**
+ * Maps image IDs to the slots their images are written to
+ *
+ * Image ID 0 is the application image, other IDs are board specific (eg: a
+ * co-processor image or an asset partition).
+ */
+class FOTASlotRegistry
+{
+public:
+
+    static constexpr size_t MAX_SLOTS = MBED_CONF_APP_FOTA_MAX_SLOTS;
+
+    /** Image ID of the application image */
+    static constexpr uint8_t DEFAULT_IMAGE_ID = 0;
+
+public:
+
+    /**
+     * Register the slot images with the given ID are written to
+     * @retval true on success, false if the ID is already registered or the registry is full
+     */
+    bool add(uint8_t image_id, FOTASlot &slot);
+
+    /**
+     * Slot images with the given ID are written to
+     * @retval nullptr if no slot is registered for the ID
+     */
+    FOTASlot *find(uint8_t image_id) const;
+
+    size_t get_count() const {
+        return _count;
+    }
+
+    /**
+     * Slot registered in the given position, in registration order
+     */
+    FOTASlot &get_slot(size_t index) const {
+        return *_entries[index].slot;
+    }
+
+    uint8_t get_image_id(size_t index) const {
+        return _entries[index].image_id;
+    }
+
+protected:
+
+    struct entry_t {
+        uint8_t image_id;
+        FOTASlot *slot;
+    };
+
+    entry_t _entries[MAX_SLOTS];
+
+    size_t _count = 0;
+
+};
+
+#endif /* FOTASLOTREGISTRY_H_ */
@@ -0,0 +1,303 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "LZDecompressor.h"
+
+#include <string.h>
+
+#define HEADER_SIZE         12
+#define OFFSET_SIZE         2
+#define LENGTH_EXTENDED     15
+
+LZDecompressor::LZDecompressor(mbed::Span<uint8_t> history, mbed::Span<uint8_t> stash) :
+        StreamTransform(stash), _history(history) {
+}
+
+void LZDecompressor::reset() {
+    reset_stream();
+    _history_pos = 0;
+    _state = STATE_HEADER;
+    _window_size = 0;
+    _literal_length = 0;
+    _match_length = 0;
+    _match_offset = 0;
+
+    /* The history is indexed with a mask */
+    if((_history.size() == 0) || ((_history.size() & (_history.size() - 1)) != 0)) {
+        invalidate();
+    }
+}
+
+int LZDecompressor::run(size_t budget) {
+    size_t produced = 0;
+
+    while((_error == TRANSFORM_ERROR_OK) && (produced < budget)) {
+        size_t produced_now;
+
+        if(_state == STATE_LITERALS) {
+            produced_now = output_literals(budget - produced);
+            if(produced_now == 0) {
+                /* Waiting for more literals */
+                break;
+            }
+        } else if(_state == STATE_MATCH) {
+            produced_now = output_match(budget - produced);
+        } else if((_state == STATE_DONE) || (_state == STATE_INVALID)) {
+            break;
+        } else {
+            if(!parse()) {
+                break;
+            }
+            continue;
+        }
+
+        produced += produced_now;
+    }
+
+    if(_error) {
+        return _error;
+    }
+
+    return produced;
+}
+
+bool LZDecompressor::has_pending_output() const {
+    if(_error) {
+        return false;
+    }
+
+    switch(_state) {
+    case STATE_HEADER:
+        return get_stash_fill() >= HEADER_SIZE;
+    case STATE_TOKEN:
+    case STATE_LITERAL_LENGTH:
+    case STATE_MATCH_LENGTH:
+        return get_stash_fill() >= 1;
+    case STATE_LITERALS:
+        return get_stash_fill() >= 1;
+    case STATE_OFFSET:
+        return get_stash_fill() >= OFFSET_SIZE;
+    case STATE_MATCH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool LZDecompressor::parse() {
+    switch(_state) {
+    case STATE_HEADER:
+    {
+        if(get_stash_fill() < HEADER_SIZE) {
+            return false;
+        }
+
+        if((read_u32(0) != STREAM_MAGIC) || (read_u32(8) > _history.size())) {
+            invalidate();
+            return false;
+        }
+
+        _output_total = read_u32(4);
+        _window_size = read_u32(8);
+        consume(HEADER_SIZE);
+        _state = (_output_total == 0) ? STATE_DONE : STATE_TOKEN;
+        return true;
+    }
+
+    case STATE_TOKEN:
+    {
+        if(get_stash_fill() < 1) {
+            return false;
+        }
+
+        uint8_t token = stash_data()[0];
+        consume(1);
+        _literal_length = token >> 4;
+        _match_length = token & 0x0F;
+
+        if(_literal_length == LENGTH_EXTENDED) {
+            _state = STATE_LITERAL_LENGTH;
+        } else {
+            _state = STATE_LITERALS;
+            if(_literal_length == 0) {
+                end_literals();
+            }
+        }
+        return true;
+    }
+
+    case STATE_LITERAL_LENGTH:
+    {
+        if(get_stash_fill() < 1) {
+            return false;
+        }
+
+        if(parse_length(_literal_length)) {
+            _state = STATE_LITERALS;
+            if(_literal_length == 0) {
+                end_literals();
+            }
+        }
+        return true;
+    }
+
+    case STATE_OFFSET:
+    {
+        if(get_stash_fill() < OFFSET_SIZE) {
+            return false;
+        }
+
+        _match_offset = read_u16(0);
+        consume(OFFSET_SIZE);
+
+        if(_match_length == LENGTH_EXTENDED) {
+            _state = STATE_MATCH_LENGTH;
+        } else {
+            begin_match();
+        }
+        return true;
+    }
+
+    case STATE_MATCH_LENGTH:
+    {
+        if(get_stash_fill() < 1) {
+            return false;
+        }
+
+        if(parse_length(_match_length)) {
+            begin_match();
+        }
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+bool LZDecompressor::parse_length(uint32_t &length) {
+    uint8_t extra = stash_data()[0];
+    consume(1);
+
+    /* Lengths can't take the output past its end */
+    if((length + extra) > _output_total) {
+        invalidate();
+        return false;
+    }
+
+    length += extra;
+    return extra != 0xFF;
+}
+
+void LZDecompressor::end_literals() {
+    if(_output_size == _output_total) {
+        _state = STATE_DONE;
+    } else {
+        _state = STATE_OFFSET;
+    }
+}
+
+void LZDecompressor::begin_match() {
+    _match_length += MIN_MATCH;
+
+    if((_match_offset == 0) || (_match_offset > _window_size) || (_match_offset > _output_size) ||
+            (_match_length > (_output_total - _output_size))) {
+        invalidate();
+        return;
+    }
+
+    _state = STATE_MATCH;
+}
+
+size_t LZDecompressor::output_literals(size_t size) {
+    if(_literal_length > (_output_total - _output_size)) {
+        invalidate();
+        return 0;
+    }
+
+    if(size > _literal_length) {
+        size = _literal_length;
+    }
+    if(size > get_stash_fill()) {
+        size = get_stash_fill();
+    }
+    if(size == 0) {
+        return 0;
+    }
+
+    const uint8_t *literals = stash_data();
+    consume(size);
+
+    /* Keep the most recent output for matches to copy from */
+    size_t mask = _history.size() - 1;
+    for(size_t copied = 0; copied < size; ) {
+        size_t chunk = _history.size() - _history_pos;
+        if(chunk > (size - copied)) {
+            chunk = size - copied;
+        }
+        memcpy(_history.data() + _history_pos, literals + copied, chunk);
+        _history_pos = (_history_pos + chunk) & mask;
+        copied += chunk;
+    }
+
+    emit(mbed::make_const_Span(literals, size));
+
+    _literal_length -= size;
+    if(_literal_length == 0) {
+        end_literals();
+    }
+
+    return size;
+}
+
+size_t LZDecompressor::output_match(size_t size) {
+    if(size > _match_length) {
+        size = _match_length;
+    }
+
+    /* Copy byte by byte, matches may overlap the bytes they produce */
+    size_t mask = _history.size() - 1;
+    size_t produced = 0;
+    while(produced < size) {
+        size_t start = _history_pos;
+        size_t chunk = _history.size() - start;
+        if(chunk > (size - produced)) {
+            chunk = size - produced;
+        }
+
+        for(size_t i = 0; i < chunk; i++) {
+            _history[start + i] = _history[(start + i - _match_offset) & mask];
+        }
+        _history_pos = (start + chunk) & mask;
+        produced += chunk;
+        _match_length -= chunk;
+
+        int err = emit(mbed::make_const_Span(_history.data() + start, chunk));
+
+        if(_match_length == 0) {
+            _state = (_output_size == _output_total) ? STATE_DONE : STATE_TOKEN;
+        }
+
+        if(err) {
+            break;
+        }
+    }
+
+    return produced;
+}
@@ -0,0 +1,139 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef LZDECOMPRESSOR_H_
+#define LZDECOMPRESSOR_H_
+
+#include "StreamTransform.h"
+
+#include "platform/Span.h"
+
+#include <stdint.h>
+
+/**
+ * Streaming decompressor for images compressed with a small-window,
+ * LZ4-style format (see scripts/compress_image.py).
+ *
+ * Format (all integers little-endian):
+ *
+ *   header:    magic "FLZ1" (4 bytes), uncompressed size (uint32),
+ *              largest match offset used (uint32)
+ *   sequences: token, [literal length bytes], literals,
+ *              match offset (uint16), [match length bytes]
+ *
+ * The high nibble of the token is the literal count and the low nibble is
+ * the match length minus MIN_MATCH. A nibble of 15 is followed by bytes
+ * that are added to it, up to and including the first one that isn't 255.
+ * The stream ends when the uncompressed size has been output, so the last
+ * sequence may stop after its literals.
+ *
+ * Matches are copied from a history buffer of the most recent output. Its
+ * size bounds the match offsets the stream can use, and is the only RAM
+ * needed besides the stash.
+ */
+class LZDecompressor : public StreamTransform
+{
+public:
+
+    static constexpr uint32_t STREAM_MAGIC = 0x315A4C46; /* "FLZ1" */
+
+    static constexpr uint32_t MIN_MATCH = 4;
+
+public:
+
+    /**
+     * Construct a decompressor
+     * @param[in] history Buffer for the most recent output, its size must be a power of 2
+     * @param[in] stash Buffer for compressed data that hasn't been decompressed yet
+     */
+    LZDecompressor(mbed::Span<uint8_t> history, mbed::Span<uint8_t> stash);
+
+    /**
+     * Start decompressing a new stream
+     */
+    void reset();
+
+    int run(size_t budget) override;
+
+    bool has_pending_output() const override;
+
+    bool is_complete() const override {
+        return _state == STATE_DONE;
+    }
+
+protected:
+
+    enum state_t {
+        STATE_HEADER,
+        STATE_TOKEN,
+        STATE_LITERAL_LENGTH,
+        STATE_LITERALS,
+        STATE_OFFSET,
+        STATE_MATCH_LENGTH,
+        STATE_MATCH,
+        STATE_DONE,
+        STATE_INVALID
+    };
+
+    /**
+     * Parse the next header, token, length or offset field, if it's all there
+     * @retval true if the state machine moved on
+     */
+    bool parse();
+
+    /** Read an extended length byte, returns true once the length is complete */
+    bool parse_length(uint32_t &length);
+
+    /** Move on once the literals of a sequence are done */
+    void end_literals();
+
+    /** Validate the match and start copying it */
+    void begin_match();
+
+    /** Copy literals into the history, and output them */
+    size_t output_literals(size_t size);
+
+    /** Copy a match within the history, and output it */
+    size_t output_match(size_t size);
+
+    void invalidate() {
+        _state = STATE_INVALID;
+        _error = TRANSFORM_ERROR_INVALID_STREAM;
+    }
+
+protected:
+
+    mbed::Span<uint8_t> _history;
+
+    /* Position in the history the next output byte goes to */
+    size_t _history_pos = 0;
+
+    state_t _state = STATE_HEADER;
+
+    /* Largest match offset the stream uses */
+    uint32_t _window_size = 0;
+
+    /* Current sequence */
+    uint32_t _literal_length = 0;
+    uint32_t _match_length = 0;
+    uint32_t _match_offset = 0;
+
+};
+
+#endif /* LZDECOMPRESSOR_H_ */
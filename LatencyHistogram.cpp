@@ -0,0 +1,44 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "LatencyHistogram.h"
+
+#include <string.h>
+
+constexpr std::chrono::microseconds LatencyHistogram::FIRST_BUCKET_LIMIT;
+
+void LatencyHistogram::record(std::chrono::microseconds latency) {
+    size_t bucket = 0;
+    while((bucket < (BUCKET_COUNT - 1)) && (latency >= get_bucket_limit(bucket))) {
+        bucket++;
+    }
+
+    _counts[bucket]++;
+    _total++;
+
+    if(latency > _max) {
+        _max = latency;
+    }
+}
+
+void LatencyHistogram::reset() {
+    memset(_counts, 0, sizeof(_counts));
+    _total = 0;
+    _max = std::chrono::microseconds(0);
+}
@@ -0,0 +1,81 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef LATENCYHISTOGRAM_H_
+#define LATENCYHISTOGRAM_H_
+
+#include <chrono>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Histogram of latencies with power of two buckets
+ *
+ * The first bucket counts latencies below FIRST_BUCKET_LIMIT, and each one
+ * after it covers twice the range of the previous one. The last bucket
+ * counts everything above that.
+ */
+class LatencyHistogram
+{
+public:
+
+    static constexpr size_t BUCKET_COUNT = 10;
+
+    static constexpr std::chrono::microseconds FIRST_BUCKET_LIMIT = std::chrono::microseconds(250);
+
+public:
+
+    /**
+     * Count a latency in its bucket
+     */
+    void record(std::chrono::microseconds latency);
+
+    void reset();
+
+    uint32_t get_count(size_t bucket) const {
+        return _counts[bucket];
+    }
+
+    uint32_t get_total() const {
+        return _total;
+    }
+
+    std::chrono::microseconds get_max() const {
+        return _max;
+    }
+
+    /**
+     * Latencies in the given bucket are below this limit, except for the last bucket
+     */
+    static std::chrono::microseconds get_bucket_limit(size_t bucket) {
+        return FIRST_BUCKET_LIMIT * (1 << bucket);
+    }
+
+protected:
+
+    uint32_t _counts[BUCKET_COUNT] = { 0 };
+
+    uint32_t _total = 0;
+
+    std::chrono::microseconds _max = std::chrono::microseconds(0);
+
+};
+
+#endif /* LATENCYHISTOGRAM_H_ */
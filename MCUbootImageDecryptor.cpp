@@ -0,0 +1,241 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#include "MCUbootImageDecryptor.h"
+
+#include "mbedtls/platform_util.h"
+
+#include <string.h>
+
+/* Initial value of RFC 3394 key wrap, checked after unwrapping */
+static const uint8_t KW_IV[8] = { 0xA6, 0xA6, 0xA6, 0xA6, 0xA6, 0xA6, 0xA6, 0xA6 };
+
+MCUbootImageDecryptor::MCUbootImageDecryptor(mbed::Span<uint8_t> keystream) : _keystream(keystream) {
+    mbedtls_aes_init(&_aes);
+}
+
+MCUbootImageDecryptor::~MCUbootImageDecryptor() {
+    mbedtls_aes_free(&_aes);
+    mbedtls_platform_zeroize(_kek, sizeof(_kek));
+}
+
+bool MCUbootImageDecryptor::set_kek(mbed::Span<const uint8_t> kek) {
+    if((size_t) kek.size() != KEY_SIZE) {
+        return false;
+    }
+
+    memcpy(_kek, kek.data(), KEY_SIZE);
+    _has_kek = true;
+    return true;
+}
+
+int MCUbootImageDecryptor::start(mbed::Span<const uint8_t> wrapped_key) {
+    stop();
+
+    if(!_has_kek) {
+        return DECRYPT_ERROR_NO_KEK;
+    }
+
+    if((size_t) wrapped_key.size() != WRAPPED_KEY_SIZE) {
+        return DECRYPT_ERROR_INVALID_KEY;
+    }
+
+    uint8_t key[KEY_SIZE];
+    bool unwrapped = unwrap_key(wrapped_key.data(), key);
+    if(unwrapped) {
+        mbedtls_aes_setkey_enc(&_aes, key, KEY_SIZE * 8);
+    }
+    mbedtls_platform_zeroize(key, sizeof(key));
+
+    if(!unwrapped) {
+        return DECRYPT_ERROR_INVALID_KEY;
+    }
+
+    _ks_pos = 0;
+    _ks_fill = 0;
+    _next_block = 0;
+    _offset = 0;
+    _has_header = false;
+    _body_start = 0;
+    _body_end = 0;
+    _stalled_blocks = 0;
+    _error = DECRYPT_ERROR_OK;
+    _active = true;
+
+    return DECRYPT_ERROR_OK;
+}
+
+void MCUbootImageDecryptor::stop() {
+    /* Nothing was generated since the last stop */
+    if(!_active) {
+        return;
+    }
+
+    _active = false;
+
+    /* Don't leave keystream of the image key behind */
+    mbedtls_platform_zeroize(_keystream.data(), _keystream.size());
+    _ks_fill = 0;
+}
+
+int MCUbootImageDecryptor::update(mbed::Span<const uint8_t> data) {
+    if(!_active) {
+        return DECRYPT_ERROR_OK;
+    }
+
+    while(!data.empty() && !_error) {
+        size_t chunk = data.size();
+
+        if(!_has_header) {
+            /* The header is passed through as it is collected */
+            if(chunk > (sizeof(_header) - _offset)) {
+                chunk = sizeof(_header) - _offset;
+            }
+            memcpy(_header + _offset, data.data(), chunk);
+            _output_cb(data.first(chunk));
+
+            if((_offset + chunk) == sizeof(_header)) {
+                struct image_header header;
+                memcpy(&header, _header, sizeof(header));
+                if(!(header.ih_flags & IMAGE_F_ENCRYPTED_AES128) ||
+                        (header.ih_hdr_size < sizeof(struct image_header))) {
+                    _error = DECRYPT_ERROR_NOT_ENCRYPTED;
+                }
+                _body_start = header.ih_hdr_size;
+                _body_end = _body_start + header.ih_img_size;
+                _has_header = true;
+            }
+        } else if((_offset < _body_start) || (_offset >= _body_end)) {
+            /* Header padding and the TLV area aren't encrypted */
+            if((_offset < _body_start) && (chunk > (_body_start - _offset))) {
+                chunk = _body_start - _offset;
+            }
+            _output_cb(data.first(chunk));
+        } else {
+            if(chunk > (_body_end - _offset)) {
+                chunk = _body_end - _offset;
+            }
+            decrypt(data.first(chunk));
+        }
+
+        data = data.subspan(chunk);
+        _offset += chunk;
+    }
+
+    return _error;
+}
+
+size_t MCUbootImageDecryptor::precompute(size_t budget) {
+    if(!_active) {
+        return 0;
+    }
+
+    size_t generated = 0;
+    while((generated < budget) && (get_precompute_space() >= BLOCK_SIZE)) {
+        generate_block();
+        generated += BLOCK_SIZE;
+    }
+
+    return generated;
+}
+
+bool MCUbootImageDecryptor::unwrap_key(const uint8_t *wrapped_key, uint8_t *key) {
+    static constexpr size_t SEMIBLOCK_SIZE = 8;
+    static constexpr size_t SEMIBLOCKS = KEY_SIZE / SEMIBLOCK_SIZE;
+
+    mbedtls_aes_context kek;
+    mbedtls_aes_init(&kek);
+    mbedtls_aes_setkey_dec(&kek, _kek, KEY_SIZE * 8);
+
+    uint8_t a[SEMIBLOCK_SIZE];
+    memcpy(a, wrapped_key, SEMIBLOCK_SIZE);
+    memcpy(key, wrapped_key + SEMIBLOCK_SIZE, KEY_SIZE);
+
+    uint8_t b[BLOCK_SIZE];
+    for(int j = 5; j >= 0; j--) {
+        for(size_t i = SEMIBLOCKS; i >= 1; i--) {
+            /* A ^ t, t being small enough to only affect the last byte */
+            memcpy(b, a, SEMIBLOCK_SIZE);
+            b[SEMIBLOCK_SIZE - 1] ^= (uint8_t) ((SEMIBLOCKS * j) + i);
+            memcpy(b + SEMIBLOCK_SIZE, key + ((i - 1) * SEMIBLOCK_SIZE), SEMIBLOCK_SIZE);
+
+            mbedtls_aes_crypt_ecb(&kek, MBEDTLS_AES_DECRYPT, b, b);
+
+            memcpy(a, b, SEMIBLOCK_SIZE);
+            memcpy(key + ((i - 1) * SEMIBLOCK_SIZE), b + SEMIBLOCK_SIZE, SEMIBLOCK_SIZE);
+        }
+    }
+
+    mbedtls_platform_zeroize(b, sizeof(b));
+    mbedtls_aes_free(&kek);
+
+    uint8_t diff = 0;
+    for(size_t i = 0; i < SEMIBLOCK_SIZE; i++) {
+        diff |= a[i] ^ KW_IV[i];
+    }
+
+    return diff == 0;
+}
+
+void MCUbootImageDecryptor::generate_block() {
+    /* Blocks are always generated at a block boundary of the ring, so they never wrap */
+    size_t end = (_ks_pos + _ks_fill) % _keystream.size();
+
+    /* The counter is the big-endian block number in the body, in the last 4 bytes */
+    uint8_t counter[BLOCK_SIZE];
+    memset(counter, 0, sizeof(counter));
+    counter[12] = (uint8_t) (_next_block >> 24);
+    counter[13] = (uint8_t) (_next_block >> 16);
+    counter[14] = (uint8_t) (_next_block >> 8);
+    counter[15] = (uint8_t) _next_block;
+
+    mbedtls_aes_crypt_ecb(&_aes, MBEDTLS_AES_ENCRYPT, counter, _keystream.data() + end);
+    _next_block++;
+    _ks_fill += BLOCK_SIZE;
+}
+
+void MCUbootImageDecryptor::decrypt(mbed::Span<const uint8_t> data) {
+    while(!data.empty()) {
+        if(_ks_fill == 0) {
+            generate_block();
+            _stalled_blocks++;
+        }
+
+        /* Contiguous keystream available at the read position */
+        size_t chunk = _ks_fill;
+        if(chunk > (_keystream.size() - _ks_pos)) {
+            chunk = _keystream.size() - _ks_pos;
+        }
+        if(chunk > (size_t) data.size()) {
+            chunk = data.size();
+        }
+
+        /* Decrypted in place, the keystream is used up anyway */
+        uint8_t *out = _keystream.data() + _ks_pos;
+        for(size_t i = 0; i < chunk; i++) {
+            out[i] ^= data[i];
+        }
+        _output_cb(mbed::make_const_Span(out, chunk));
+
+        _ks_pos = (_ks_pos + chunk) % _keystream.size();
+        _ks_fill -= chunk;
+        data = data.subspan(chunk);
+    }
+}
@@ -0,0 +1,189 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#ifndef MCUBOOTIMAGEDECRYPTOR_H_
+#define MCUBOOTIMAGEDECRYPTOR_H_
+
+#include "platform/Callback.h"
+#include "platform/Span.h"
+
+#include "bootutil/image.h"
+#include "mbedtls/aes.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Decrypts an MCUboot image encrypted with an AES-KW wrapped key (imgtool
+ * sign --encrypt with a 128-bit key-encryption key) as it is streamed.
+ *
+ * The image body is encrypted with AES-128-CTR, the counter being the
+ * offset in the body in 16 byte blocks. The header and TLV area are not
+ * encrypted and are passed through as is. The image key is wrapped with
+ * the key-encryption key (RFC 3394) in the ENC_KW128 TLV, which comes after
+ * the body, so the client sends it up front.
+ *
+ * The keystream doesn't depend on the data, so it can be generated ahead of
+ * time into a ring buffer with precompute() (eg: while a page is being
+ * programmed), and the data is then decrypted by XORing it in place in the
+ * ring. Keystream is generated in whole AES blocks, on demand if none was
+ * precomputed.
+ */
+class MCUbootImageDecryptor
+{
+public:
+
+    static constexpr size_t BLOCK_SIZE = 16;
+
+    static constexpr size_t KEY_SIZE = 16;
+
+    /** Size of the ENC_KW128 TLV value: the wrapped key and its integrity check value */
+    static constexpr size_t WRAPPED_KEY_SIZE = KEY_SIZE + 8;
+
+    enum error_t {
+        DECRYPT_ERROR_OK = 0,
+        DECRYPT_ERROR_NO_KEK = -4301,
+        DECRYPT_ERROR_INVALID_KEY = -4302,
+        DECRYPT_ERROR_NOT_ENCRYPTED = -4303,
+    };
+
+    /** Callback for decrypted output */
+    typedef mbed::Callback<void(mbed::Span<const uint8_t>)> OutputCallback_t;
+
+public:
+
+    /**
+     * @param[in] keystream Ring buffer for precomputed keystream, must be a multiple of BLOCK_SIZE
+     */
+    MCUbootImageDecryptor(mbed::Span<uint8_t> keystream);
+
+    ~MCUbootImageDecryptor();
+
+    void set_output_callback(OutputCallback_t cb) {
+        _output_cb = cb;
+    }
+
+    /**
+     * Set the key-encryption key image keys are wrapped with
+     * @retval false if it isn't a 128-bit key
+     */
+    bool set_kek(mbed::Span<const uint8_t> kek);
+
+    bool has_kek() const {
+        return _has_kek;
+    }
+
+    /**
+     * Start decrypting a new image
+     * @param[in] wrapped_key Value of the image's ENC_KW128 TLV
+     * @retval 0 on success, DECRYPT_ERROR_NO_KEK if no key-encryption key is set,
+     * or DECRYPT_ERROR_INVALID_KEY if the key doesn't unwrap with it
+     */
+    int start(mbed::Span<const uint8_t> wrapped_key);
+
+    /**
+     * Stop decrypting, update() is then a no-op until the next start()
+     *
+     * @note The keystream buffer is cleared, and isn't touched again until
+     * the next successful start(), so it can be shared with buffers used
+     * while not decrypting
+     */
+    void stop();
+
+    bool is_active() const {
+        return _active;
+    }
+
+    /**
+     * Decrypt the next bytes of the image, passing them to the output callback
+     * @retval 0 on success, or DECRYPT_ERROR_NOT_ENCRYPTED (sticky) if the
+     * image header doesn't have the encrypted flag
+     */
+    int update(mbed::Span<const uint8_t> data);
+
+    /**
+     * Generate keystream ahead of the data
+     * @param[in] budget Maximum number of bytes to generate, rounded up to whole blocks
+     * @retval Number of bytes generated
+     */
+    size_t precompute(size_t budget);
+
+    /** Keystream generated ahead of the data and not used yet */
+    size_t get_precomputed() const {
+        return _ks_fill;
+    }
+
+    /** Room left in the keystream buffer */
+    size_t get_precompute_space() const {
+        return _keystream.size() - _ks_fill;
+    }
+
+    /** Number of keystream blocks generated on demand because none was precomputed */
+    uint32_t get_stalled_blocks() const {
+        return _stalled_blocks;
+    }
+
+protected:
+
+    /** RFC 3394 key unwrap of the image key with the key-encryption key */
+    bool unwrap_key(const uint8_t *wrapped_key, uint8_t *key);
+
+    /** Generate the keystream of the next block at the end of the ring */
+    void generate_block();
+
+    /** Decrypt body bytes by XORing them into the keystream ring, and output them */
+    void decrypt(mbed::Span<const uint8_t> data);
+
+protected:
+
+    mbed::Span<uint8_t> _keystream;
+
+    /* Precomputed keystream is [_ks_pos, _ks_pos + _ks_fill) in the ring */
+    size_t _ks_pos = 0;
+    size_t _ks_fill = 0;
+
+    /* Counter of the next keystream block to generate */
+    uint32_t _next_block = 0;
+
+    OutputCallback_t _output_cb = nullptr;
+
+    mbedtls_aes_context _aes;
+
+    uint8_t _kek[KEY_SIZE];
+    bool _has_kek = false;
+
+    bool _active = false;
+
+    int _error = DECRYPT_ERROR_OK;
+
+    /* Stream offset of the next byte */
+    uint32_t _offset = 0;
+
+    /* The header is collected until the encrypted body's bounds are known */
+    uint8_t _header[sizeof(struct image_header)];
+    bool _has_header = false;
+    uint32_t _body_start = 0;
+    uint32_t _body_end = 0;
+
+    uint32_t _stalled_blocks = 0;
+
+};
+
+#endif /* MCUBOOTIMAGEDECRYPTOR_H_ */
@@ -0,0 +1,193 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "MCUbootImageVerifier.h"
+
+#include <string.h>
+
+MCUbootImageVerifier::MCUbootImageVerifier() {
+    mbedtls_sha256_init(&_sha256);
+    reset();
+}
+
+MCUbootImageVerifier::~MCUbootImageVerifier() {
+    mbedtls_sha256_free(&_sha256);
+}
+
+void MCUbootImageVerifier::reset() {
+    _state = STATE_HEADER;
+    _offset = 0;
+    _field_fill = 0;
+    _hash_end = 0;
+    _tlv_end = 0;
+    _has_expected_hash = false;
+    memset(&_header, 0, sizeof(_header));
+    mbedtls_sha256_starts_ret(&_sha256, 0);
+}
+
+void MCUbootImageVerifier::update(mbed::Span<const uint8_t> data) {
+
+    while(!data.empty()) {
+        switch(_state) {
+        case STATE_HEADER:
+        {
+            /* The header is part of the hashed region */
+            size_t before = data.size();
+            const uint8_t *start = data.data();
+            bool complete = collect(data, sizeof(struct image_header));
+            mbedtls_sha256_update_ret(&_sha256, start, before - data.size());
+            if(complete) {
+                parse_header();
+            }
+            break;
+        }
+
+        case STATE_BODY:
+        {
+            size_t chunk = _hash_end - _offset;
+            if(chunk > (size_t) data.size()) {
+                chunk = data.size();
+            }
+            mbedtls_sha256_update_ret(&_sha256, data.data(), chunk);
+            consume(data, chunk);
+
+            if(_offset == _hash_end) {
+                mbedtls_sha256_finish_ret(&_sha256, _computed_hash);
+                _state = STATE_TLV_INFO;
+            }
+            break;
+        }
+
+        case STATE_TLV_INFO:
+        {
+            if(collect(data, sizeof(struct image_tlv_info))) {
+                parse_tlv_info();
+            }
+            break;
+        }
+
+        case STATE_TLV_HEADER:
+        {
+            if(collect(data, sizeof(struct image_tlv))) {
+                parse_tlv_header();
+            }
+            break;
+        }
+
+        case STATE_TLV_VALUE:
+        {
+            if(collect(data, _tlv_len)) {
+                if((_tlv_type == IMAGE_TLV_SHA256) && (_tlv_len == HASH_SIZE)) {
+                    memcpy(_expected_hash, _field, HASH_SIZE);
+                    _has_expected_hash = true;
+                }
+                _state = (_offset >= _tlv_end) ? STATE_DONE : STATE_TLV_HEADER;
+            }
+            break;
+        }
+
+        case STATE_DONE:
+        case STATE_INVALID:
+        default:
+            /* Anything past the end of the image (eg: padding) is ignored */
+            return;
+        }
+    }
+}
+
+bool MCUbootImageVerifier::verify() const {
+    if((_state != STATE_DONE) || !_has_expected_hash) {
+        return false;
+    }
+
+    return memcmp(_computed_hash, _expected_hash, HASH_SIZE) == 0;
+}
+
+bool MCUbootImageVerifier::collect(mbed::Span<const uint8_t> &data, size_t size) {
+    size_t chunk = size - _field_fill;
+    if(chunk > (size_t) data.size()) {
+        chunk = data.size();
+    }
+
+    /* Fields longer than the buffer (eg: signatures) are skipped rather than stored */
+    if(_field_fill < sizeof(_field)) {
+        size_t stored = sizeof(_field) - _field_fill;
+        memcpy(_field + _field_fill, data.data(), (chunk < stored) ? chunk : stored);
+    }
+
+    _field_fill += chunk;
+    consume(data, chunk);
+
+    if(_field_fill < size) {
+        return false;
+    }
+
+    _field_fill = 0;
+    return true;
+}
+
+void MCUbootImageVerifier::consume(mbed::Span<const uint8_t> &data, size_t size) {
+    data = data.subspan(size);
+    _offset += size;
+}
+
+void MCUbootImageVerifier::parse_header() {
+    memcpy(&_header, _field, sizeof(_header));
+
+    if((_header.ih_magic != IMAGE_MAGIC) || (_header.ih_hdr_size < sizeof(struct image_header))) {
+        _state = STATE_INVALID;
+        return;
+    }
+
+    _hash_end = _header.ih_hdr_size + _header.ih_img_size + _header.ih_protect_tlv_size;
+    _state = STATE_BODY;
+}
+
+void MCUbootImageVerifier::parse_tlv_info() {
+    struct image_tlv_info info;
+    memcpy(&info, _field, sizeof(info));
+
+    if((info.it_magic != IMAGE_TLV_INFO_MAGIC) || (info.it_tlv_tot < sizeof(info))) {
+        _state = STATE_INVALID;
+        return;
+    }
+
+    /* it_tlv_tot includes the info header itself */
+    _tlv_end = _hash_end + info.it_tlv_tot;
+    _state = (_offset >= _tlv_end) ? STATE_DONE : STATE_TLV_HEADER;
+}
+
+void MCUbootImageVerifier::parse_tlv_header() {
+    struct image_tlv tlv;
+    memcpy(&tlv, _field, sizeof(tlv));
+
+    _tlv_type = tlv.it_type;
+    _tlv_len = tlv.it_len;
+
+    if((_offset + _tlv_len) > _tlv_end) {
+        _state = STATE_INVALID;
+        return;
+    }
+
+    if(_tlv_len != 0) {
+        _state = STATE_TLV_VALUE;
+    } else {
+        _state = (_offset >= _tlv_end) ? STATE_DONE : STATE_TLV_HEADER;
+    }
+}
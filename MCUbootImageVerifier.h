@@ -0,0 +1,152 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef MCUBOOTIMAGEVERIFIER_H_
+#define MCUBOOTIMAGEVERIFIER_H_
+
+#include "platform/Span.h"
+
+#include "bootutil/image.h"
+#include "mbedtls/sha256.h"
+
+#include <stdint.h>
+
+/**
+ * Verifies an MCUboot image as it is streamed, without reading it back.
+ *
+ * The image header is parsed as it goes by, the header, image and protected
+ * TLV area are fed into a running SHA-256, and the unprotected TLV area is
+ * parsed to find the SHA-256 TLV. Once the whole image has been streamed,
+ * verify() compares the computed hash with the one in the TLV.
+ *
+ * @note This only checks the image hash. The signature is still checked
+ * by MCUboot before the update is installed.
+ */
+class MCUbootImageVerifier
+{
+public:
+
+    static constexpr size_t HASH_SIZE = 32;
+
+public:
+
+    MCUbootImageVerifier();
+
+    ~MCUbootImageVerifier();
+
+    /**
+     * Start verifying a new image
+     */
+    void reset();
+
+    /**
+     * Feed the next bytes of the image
+     */
+    void update(mbed::Span<const uint8_t> data);
+
+    /**
+     * Check the image once it has been completely streamed
+     * @retval true if the image was well-formed and its hash matches the SHA-256 TLV
+     */
+    bool verify() const;
+
+    /**
+     * Whether the header was parsed successfully
+     */
+    bool has_header() const {
+        return (_state != STATE_HEADER) && (_state != STATE_INVALID);
+    }
+
+    /**
+     * Whether the whole image (including its TLV area) has been streamed
+     */
+    bool is_complete() const {
+        return _state == STATE_DONE;
+    }
+
+    const struct image_header &get_header() const {
+        return _header;
+    }
+
+    /**
+     * Total size of the image, including its TLV area, once known (0 otherwise)
+     */
+    uint32_t get_image_size() const {
+        return _tlv_end;
+    }
+
+protected:
+
+    enum state_t {
+        STATE_HEADER,
+        STATE_BODY,
+        STATE_TLV_INFO,
+        STATE_TLV_HEADER,
+        STATE_TLV_VALUE,
+        STATE_DONE,
+        STATE_INVALID
+    };
+
+    /**
+     * Collect bytes into the field buffer until it holds size bytes
+     * @retval true once the field is complete
+     */
+    bool collect(mbed::Span<const uint8_t> &data, size_t size);
+
+    /** Advance past consumed bytes */
+    void consume(mbed::Span<const uint8_t> &data, size_t size);
+
+    void parse_header();
+
+    void parse_tlv_info();
+
+    void parse_tlv_header();
+
+protected:
+
+    state_t _state = STATE_HEADER;
+
+    /* Stream offset of the next byte */
+    uint32_t _offset = 0;
+
+    /* Buffer for fields that may be split across fragments */
+    uint8_t _field[sizeof(struct image_header)];
+    size_t _field_fill = 0;
+
+    struct image_header _header;
+
+    /* End of the hashed region (header, image and protected TLVs) */
+    uint32_t _hash_end = 0;
+
+    /* End of the TLV area */
+    uint32_t _tlv_end = 0;
+
+    /* TLV currently being parsed */
+    uint16_t _tlv_type = 0;
+    uint16_t _tlv_len = 0;
+
+    mbedtls_sha256_context _sha256;
+
+    uint8_t _computed_hash[HASH_SIZE];
+    uint8_t _expected_hash[HASH_SIZE];
+    bool _has_expected_hash = false;
+
+};
+
+#endif /* MCUBOOTIMAGEVERIFIER_H_ */
@@ -0,0 +1,434 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "PagedBlockDeviceWriter.h"
+
+#include "platform/ScopedLock.h"
+
+#include <string.h>
+
+/* Program limit offset when no limit is set */
+#define NO_PROGRAM_LIMIT UINT32_MAX
+
+PagedBlockDeviceWriter::PagedBlockDeviceWriter(mbed::BlockDevice &bd,
+        events::EventQueue &queue, mbed::Span<uint8_t> pool, bd_size_t page_size) :
+        _bd(bd), _queue(queue), _pool(pool), _page_size(page_size),
+        _written(0), _programmed(0), _program_limit(NO_PROGRAM_LIMIT),
+        _drain_event_id(0), _bd_error(mbed::BD_ERROR_OK) {
+    _program_stats = { 0 };
+
+    /* By default, leave one page of headroom for data still in flight */
+    size_t page_count = pool.size() / page_size;
+    _high_watermark = (page_count > 1) ? (page_count - 1) : 1;
+}
+
+PagedBlockDeviceWriter::~PagedBlockDeviceWriter() {
+    cancel_drain();
+}
+
+int PagedBlockDeviceWriter::reset(bd_addr_t addr) {
+
+    /* Make sure the pool holds a whole number of pages */
+    if((_pool.size() % _page_size) != 0) {
+        return 1;
+    }
+
+    /* Make sure the page size is a multiple of the BD program size */
+    if((_page_size % _bd.get_program_size()) != 0) {
+        return 1;
+    }
+
+    /* Make sure the start address is program-aligned */
+    if((addr % _bd.get_program_size()) != 0) {
+        return 1;
+    }
+
+    /* Wait for the page being programmed, if any. A drain event still
+     * queued finds nothing to program.
+     */
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
+
+    cancel_drain();
+    _epoch++;
+
+    _base_addr = addr;
+    _written = 0;
+    _programmed = 0;
+    _program_limit = NO_PROGRAM_LIMIT;
+    _backpressured = false;
+    _bd_error = mbed::BD_ERROR_OK;
+    _program_stats = { 0 };
+    _crc.compute_partial_start(&_crc_state);
+    _written_crc.compute_partial_start(&_written_crc_state);
+
+    return 0;
+}
+
+int PagedBlockDeviceWriter::resume(bd_addr_t addr, uint32_t crc_state) {
+    int err = reset(addr);
+    if(err) {
+        return err;
+    }
+
+    _crc_state = crc_state;
+    _written_crc_state = crc_state;
+
+    return 0;
+}
+
+uint32_t PagedBlockDeviceWriter::get_crc() {
+    uint32_t crc = _crc_state;
+    _crc.compute_partial_stop(&crc);
+    return crc;
+}
+
+PagedBlockDeviceWriter::program_stats_t PagedBlockDeviceWriter::get_program_stats() {
+    /* Pages may be programmed from another thread */
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
+    return _program_stats;
+}
+
+uint32_t PagedBlockDeviceWriter::get_written_crc() {
+    uint32_t crc = _written_crc_state;
+    _written_crc.compute_partial_stop(&crc);
+    return crc;
+}
+
+int PagedBlockDeviceWriter::write(mbed::Span<const uint8_t> data) {
+
+    if(_bd_error) {
+        return _bd_error;
+    }
+
+    /* Programming happens from queued events only, the caller holds on to the data meanwhile */
+    if((bd_size_t) data.size() > get_free_size()) {
+        if(has_programmable_page()) {
+            schedule_drain();
+        }
+        update_backpressure(true);
+        return WRITER_ERROR_RING_FULL;
+    }
+
+    while(!data.empty()) {
+        bd_addr_t write_addr = get_address();
+        bd_addr_t limit = ring_limit();
+        bd_size_t chunk = limit - write_addr;
+        bd_size_t contiguous = _pool.size() - (write_addr % _pool.size());
+        if(chunk > contiguous) {
+            chunk = contiguous;
+        }
+        if(chunk > (bd_size_t) data.size()) {
+            chunk = data.size();
+        }
+
+        /* Data placed in the ring ahead of time is already where it belongs */
+        if(ring_location(write_addr) != data.data()) {
+            memcpy(ring_location(write_addr), data.data(), chunk);
+        }
+        _written_crc.compute_partial(data.data(), chunk, &_written_crc_state);
+        data = data.subspan(chunk);
+
+        /* Publish the data to the queued events */
+        _written.store(_written.load(std::memory_order_relaxed) + chunk, std::memory_order_release);
+    }
+
+    if(has_programmable_page()) {
+        schedule_drain();
+    }
+
+    update_backpressure();
+
+    return mbed::BD_ERROR_OK;
+}
+
+mbed::Span<uint8_t> PagedBlockDeviceWriter::reserve(bd_size_t offset, bd_size_t size) {
+    bd_addr_t addr = get_address() + offset;
+
+    if((addr + size) > ring_limit()) {
+        return mbed::Span<uint8_t>();
+    }
+
+    if(((addr % _pool.size()) + size) > (bd_size_t) _pool.size()) {
+        return mbed::Span<uint8_t>();
+    }
+
+    return mbed::Span<uint8_t>(ring_location(addr), size);
+}
+
+int PagedBlockDeviceWriter::flush() {
+
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
+
+    cancel_drain();
+
+    int err = program_buffered_pages();
+    if(err) {
+        return err;
+    }
+
+    bd_addr_t write_addr = get_address();
+    if(write_addr > get_programmed_address()) {
+        /* Pad the partial page up to the program size */
+        bd_size_t program_size = _bd.get_program_size();
+        bd_addr_t padded_end = ((write_addr + program_size - 1) / program_size) * program_size;
+        int erase_value = _bd.get_erase_value();
+        memset(ring_location(write_addr), (erase_value == -1) ? 0xFF : erase_value,
+                padded_end - write_addr);
+        _written.store(padded_end - _base_addr, std::memory_order_release);
+
+        int err = program_page(padded_end);
+        if(err) {
+            return err;
+        }
+        if(_program_cb) {
+            _program_cb(get_programmed_address(), _crc_state);
+        }
+    }
+
+    update_backpressure();
+
+    return mbed::BD_ERROR_OK;
+}
+
+int PagedBlockDeviceWriter::program_full_pages() {
+
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
+
+    cancel_drain();
+
+    int err = program_buffered_pages();
+    if(err) {
+        return err;
+    }
+
+    update_backpressure();
+
+    return mbed::BD_ERROR_OK;
+}
+
+int PagedBlockDeviceWriter::program_buffered_pages() {
+    if(_bd_error) {
+        return _bd_error;
+    }
+
+    while(has_full_page()) {
+        int err = program_page(page_end());
+        if(err) {
+            return err;
+        }
+        if(_program_cb) {
+            _program_cb(get_programmed_address(), _crc_state);
+        }
+    }
+
+    return mbed::BD_ERROR_OK;
+}
+
+int PagedBlockDeviceWriter::program_page(bd_addr_t program_end) {
+    bd_addr_t program_addr = get_programmed_address();
+    const uint8_t *page = ring_location(program_addr);
+    bd_size_t size = program_end - program_addr;
+
+    _program_timer.reset();
+    _program_timer.start();
+
+    int err = _bd.program(page, program_addr, size);
+    if(err) {
+        _program_timer.stop();
+        _bd_error = err;
+        return err;
+    }
+
+    /* The page is still in the staging buffer, compare it with what was programmed */
+    if(_verify && !verify(page, program_addr, size)) {
+        _program_timer.stop();
+        _bd_error = WRITER_ERROR_VERIFY_FAILED;
+        return WRITER_ERROR_VERIFY_FAILED;
+    }
+
+    _program_timer.stop();
+    std::chrono::microseconds program_time = _program_timer.elapsed_time();
+    if((_program_stats.count == 0) || (program_time < _program_stats.min)) {
+        _program_stats.min = program_time;
+    }
+    if(program_time > _program_stats.max) {
+        _program_stats.max = program_time;
+    }
+    _program_stats.total += program_time;
+    _program_stats.count++;
+
+    _crc.compute_partial(page, size, &_crc_state);
+
+    /* Hand the page back to the writer */
+    _programmed.store(program_end - _base_addr, std::memory_order_release);
+
+    return mbed::BD_ERROR_OK;
+}
+
+bool PagedBlockDeviceWriter::verify(const uint8_t *data, bd_addr_t addr, bd_size_t size) {
+    if((VERIFY_CHUNK_SIZE % _bd.get_read_size()) != 0) {
+        return true;
+    }
+
+    uint8_t chunk[VERIFY_CHUNK_SIZE];
+    bd_size_t offset = 0;
+    while(offset < size) {
+        bd_size_t chunk_size = size - offset;
+        if(chunk_size > VERIFY_CHUNK_SIZE) {
+            chunk_size = VERIFY_CHUNK_SIZE;
+        }
+
+        /* Padded pages may end part way through a read unit */
+        if((chunk_size % _bd.get_read_size()) != 0) {
+            return true;
+        }
+
+        if(_bd.read(chunk, addr + offset, chunk_size) != mbed::BD_ERROR_OK) {
+            return false;
+        }
+
+        if(memcmp(chunk, data + offset, chunk_size) != 0) {
+            return false;
+        }
+
+        offset += chunk_size;
+    }
+
+    return true;
+}
+
+void PagedBlockDeviceWriter::set_program_limit(bd_addr_t limit) {
+    if(limit < _base_addr) {
+        _program_limit = 0;
+    } else if((limit - _base_addr) >= NO_PROGRAM_LIMIT) {
+        _program_limit = NO_PROGRAM_LIMIT;
+    } else {
+        _program_limit = limit - _base_addr;
+    }
+
+    if(has_programmable_page()) {
+        schedule_drain();
+    }
+}
+
+void PagedBlockDeviceWriter::drain() {
+    _drain_event_id = 0;
+
+    int err = mbed::BD_ERROR_OK;
+    bool programmed = false;
+    bd_addr_t program_addr;
+    uint32_t crc_state;
+    uint32_t epoch;
+
+    {
+        mbed::ScopedLock<PlatformMutex> lock(_mutex);
+
+        if(has_programmable_page()) {
+            err = program_page(page_end());
+            programmed = (err == mbed::BD_ERROR_OK);
+        }
+
+        program_addr = get_programmed_address();
+        crc_state = _crc_state;
+        epoch = _epoch;
+    }
+
+    if(err) {
+        /* The error is also returned by the next call to write or flush */
+        if(_callback_queue) {
+            _callback_queue->call(this, &PagedBlockDeviceWriter::deliver_error, epoch, err);
+        } else if(_error_cb) {
+            _error_cb(err);
+        }
+        return;
+    }
+
+    if(_callback_queue) {
+        /* Backpressure is updated on the writing thread */
+        if(programmed) {
+            _callback_queue->call(this, &PagedBlockDeviceWriter::deliver_program, epoch, program_addr, crc_state);
+        }
+    } else if(programmed && _program_cb) {
+        _program_cb(program_addr, crc_state);
+    }
+
+    /* Yield to other events between pages */
+    if(has_programmable_page()) {
+        schedule_drain();
+    }
+
+    if(_callback_queue == nullptr) {
+        update_backpressure();
+    }
+}
+
+void PagedBlockDeviceWriter::schedule_drain() {
+    /* Both the writer and queued events may get here, only one of them posts the event */
+    int expected = 0;
+    if(_drain_event_id.compare_exchange_strong(expected, -1)) {
+        int id = _queue.call(mbed::callback(this, &PagedBlockDeviceWriter::drain));
+
+        /* Unless the event already ran and cleared the id */
+        expected = -1;
+        _drain_event_id.compare_exchange_strong(expected, id);
+    }
+}
+
+void PagedBlockDeviceWriter::cancel_drain() {
+    /* -1 while the event is being posted */
+    int id = _drain_event_id.exchange(0);
+    if(id > 0) {
+        _queue.cancel(id);
+    }
+}
+
+void PagedBlockDeviceWriter::update_backpressure(bool full) {
+    bool backpressured = _backpressured;
+
+    if(!_backpressured && (full || (get_buffered_size() >= (_high_watermark * _page_size)))) {
+        backpressured = true;
+    } else if(_backpressured && !has_full_page()) {
+        backpressured = false;
+    }
+
+    if(backpressured != _backpressured) {
+        _backpressured = backpressured;
+        if(_backpressure_cb) {
+            _backpressure_cb(_backpressured);
+        }
+    }
+}
+
+void PagedBlockDeviceWriter::deliver_program(uint32_t epoch, bd_addr_t addr, uint32_t crc_state) {
+    if(epoch != _epoch) {
+        return;
+    }
+
+    if(_program_cb) {
+        _program_cb(addr, crc_state);
+    }
+
+    update_backpressure();
+}
+
+void PagedBlockDeviceWriter::deliver_error(uint32_t epoch, int err) {
+    if((epoch == _epoch) && _error_cb) {
+        _error_cb(err);
+    }
+}
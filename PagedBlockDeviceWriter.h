@@ -0,0 +1,440 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef PAGEDBLOCKDEVICEWRITER_H_
+#define PAGEDBLOCKDEVICEWRITER_H_
+
+#include "blockdevice/BlockDevice.h"
+#include "events/EventQueue.h"
+#include "drivers/MbedCRC.h"
+#include "drivers/Timer.h"
+#include "platform/PlatformMutex.h"
+#include "platform/Span.h"
+
+#include <atomic>
+
+/**
+ * This class coalesces sequential writes of arbitrary size into whole,
+ * page-aligned program operations on the given block device.
+ *
+ * Written data is copied into a ring of page buffers and the call returns
+ * right away. Full pages are then programmed one at a time from events
+ * posted to the given EventQueue, so a slow program operation never blocks
+ * the caller (eg: a GATT write callback).
+ *
+ * Data that arrives ahead of the rest of the stream (eg: a fragment
+ * received out of order) can be placed directly in the ring, at the
+ * location it will be programmed from (see reserve). Writing it once the
+ * data before it has been written then doesn't copy it again.
+ *
+ * Programming can be held back below a given address (eg: until that part
+ * of the block device has been erased) with set_program_limit.
+ *
+ * A running CRC32 is kept over everything that has been programmed, and
+ * another over everything written, so the transfer can be checked without
+ * reading the block device back. Optionally, each page can be read back and
+ * compared with the staging buffer right after it is programmed. The number
+ * and duration of program operations are tracked too (see get_program_stats).
+ *
+ * When the number of buffered pages reaches the high watermark, the
+ * backpressure callback is called with true. Once the ring is drained it is
+ * called again with false. This lets the caller pause the data source in
+ * step with how fast the flash actually accepts data.
+ *
+ * The queue pages are programmed from may be dispatched by another (eg:
+ * lower priority) thread than the one writing. The ring is then a single
+ * producer, single consumer ring: the writer only advances the write
+ * offset and the queued events only advance the program offset, so copying
+ * data in never waits for a program operation. If a callback queue is set,
+ * callbacks for pages programmed from queued events are posted to it, so
+ * they run on the writing thread. Calls that program synchronously (flush
+ * and program_full_pages) wait for the page being programmed, if any, and
+ * call the callbacks directly.
+ *
+ * Writing never programs a page itself. If the data doesn't fit in the
+ * ring, nothing is written and backpressure is asserted, so the caller can
+ * hold on to the data until enough pages have been programmed.
+ */
+class PagedBlockDeviceWriter
+{
+public:
+
+    using BackpressureCallback_t = mbed::Callback<void(bool)>;
+
+    using ErrorCallback_t = mbed::Callback<void(int)>;
+
+    using ProgramCallback_t = mbed::Callback<void(bd_addr_t, uint32_t)>;
+
+    using CRC_t = mbed::MbedCRC<POLY_32BIT_ANSI, 32, mbed::CrcMode::TABLE>;
+
+    /** A programmed page didn't read back as what was written */
+    static constexpr int WRITER_ERROR_VERIFY_FAILED = -4201;
+
+    /** The data doesn't fit in the ring until more pages are programmed, nothing was written */
+    static constexpr int WRITER_ERROR_RING_FULL = -4202;
+
+    /* Size of the chunks pages are read back in when verifying */
+    static constexpr bd_size_t VERIFY_CHUNK_SIZE = 64;
+
+    /**
+     * Program operations since the writer was last reset
+     */
+    struct program_stats_t {
+        uint32_t count;
+        std::chrono::microseconds min;
+        std::chrono::microseconds max;
+        std::chrono::microseconds total;
+    };
+
+public:
+
+    /**
+     * Construct a writer
+     * @param[in] bd BlockDevice to program
+     * @param[in] queue EventQueue to program full pages from
+     * @param[in] pool Ring of page buffers
+     * @param[in] page_size Size of each page in the pool
+     *
+     * @note The size of the pool must be a multiple of page_size
+     * @note page_size must be a multiple of the BlockDevice's program size
+     */
+    PagedBlockDeviceWriter(mbed::BlockDevice& bd, events::EventQueue& queue,
+            mbed::Span<uint8_t> pool, bd_size_t page_size);
+
+    ~PagedBlockDeviceWriter();
+
+    /**
+     * Reset the writer, discarding any buffered data
+     * @param[in] addr Address the next write will be programmed at
+     *
+     * @note addr must be a multiple of the BlockDevice's program size
+     *
+     * @retval 0 on success, 1 if any parameters are invalid
+     */
+    int reset(bd_addr_t addr = 0);
+
+    /**
+     * Reset the writer to continue a previously interrupted stream
+     * @param[in] addr Address the next write will be programmed at
+     * @param[in] crc_state CRC state (see get_crc_state) of the data already programmed before addr
+     *
+     * @retval 0 on success, 1 if any parameters are invalid
+     */
+    int resume(bd_addr_t addr, uint32_t crc_state);
+
+    /**
+     * Append data to the stream. Full pages are programmed asynchronously.
+     * @param[in] data Data to write
+     *
+     * @note Data already at its location in the ring (see reserve) isn't copied
+     *
+     * @retval 0 on success, WRITER_ERROR_RING_FULL if the data doesn't fit
+     * in the ring (see get_free_size), or the BlockDevice error code if
+     * programming any previously queued page failed
+     */
+    int write(mbed::Span<const uint8_t> data);
+
+    /**
+     * Location in the ring of the stream data that starts offset bytes
+     * past the write address
+     *
+     * Data copied there can be written later, once everything before it has
+     * been written, without being copied again. It is only kept until then
+     * if nothing else is written over it in the meantime.
+     *
+     * @retval The location, or an empty span if the range is split across
+     * the end of the ring or doesn't fit in the ring without waiting for
+     * pages to be programmed
+     */
+    mbed::Span<uint8_t> reserve(bd_size_t offset, bd_size_t size);
+
+    /**
+     * Synchronously program everything that is buffered, including any
+     * partially filled page.
+     *
+     * The partial page is padded up to the BlockDevice's program size with
+     * the erase value. This is meant to be called at the end of the stream,
+     * once it is flushed no more data should be written before calling reset.
+     *
+     * @note The program limit is ignored, the caller must make sure the whole
+     * buffered range can be programmed.
+     *
+     * @retval 0 on success, or the BlockDevice error code if programming failed
+     */
+    int flush();
+
+    /**
+     * Synchronously program every full page that is buffered, to make room
+     * in the ring when waiting for the queued events isn't an option (eg:
+     * when the stream is being finished). The partial page is kept.
+     *
+     * @note Like flush, the program limit is ignored
+     *
+     * @retval 0 on success, or the BlockDevice error code if programming failed
+     */
+    int program_full_pages();
+
+    /**
+     * Only program pages that end at or below the given address. Raising the
+     * limit resumes programming of any pages that were held back.
+     *
+     * @note reset() removes the limit
+     */
+    void set_program_limit(bd_addr_t limit);
+
+    /**
+     * Enable or disable reading back each page after it is programmed
+     *
+     * A page that doesn't match fails with WRITER_ERROR_VERIFY_FAILED, like
+     * any other program error.
+     *
+     * @note Pages are only verified if VERIFY_CHUNK_SIZE is a multiple of the
+     * BlockDevice's read size
+     */
+    void set_verify(bool enabled) {
+        _verify = enabled;
+    }
+
+    /**
+     * Set the number of buffered pages at which backpressure is asserted
+     */
+    void set_high_watermark(size_t pages) {
+        _high_watermark = pages;
+    }
+
+    /**
+     * Set the queue callbacks for pages programmed from queued events are posted to
+     *
+     * @note This is only needed if the queue given to the constructor is
+     * dispatched by another thread than the one writing
+     */
+    void set_callback_queue(events::EventQueue *queue) {
+        _callback_queue = queue;
+    }
+
+    void set_backpressure_callback(BackpressureCallback_t cb) {
+        _backpressure_cb = cb;
+    }
+
+    /**
+     * Set a callback executed after each page is programmed, with the
+     * address up to which data has been programmed and the CRC state (see
+     * get_crc_state) of the data up to that address
+     */
+    void set_program_callback(ProgramCallback_t cb) {
+        _program_cb = cb;
+    }
+
+    /**
+     * Set a callback executed when programming a queued page fails
+     */
+    void set_error_callback(ErrorCallback_t cb) {
+        _error_cb = cb;
+    }
+
+    bool is_backpressured() const {
+        return _backpressured;
+    }
+
+    /**
+     * Address at which the next byte written will be placed
+     */
+    bd_addr_t get_address() const {
+        return _base_addr + _written.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Address up to which data has actually been programmed
+     */
+    bd_addr_t get_programmed_address() const {
+        return _base_addr + _programmed.load(std::memory_order_acquire);
+    }
+
+    bd_size_t get_buffered_size() const {
+        return get_address() - get_programmed_address();
+    }
+
+    /**
+     * Number of bytes that can be written before the ring is full and
+     * write() fails with WRITER_ERROR_RING_FULL
+     */
+    bd_size_t get_free_size() const {
+        return ring_limit() - get_address();
+    }
+
+    bd_size_t get_page_size() const {
+        return _page_size;
+    }
+
+    int get_error() const {
+        return _bd_error;
+    }
+
+    /**
+     * Intermediate CRC32 state over the programmed data, can be passed to resume()
+     *
+     * @note While pages are programmed from another thread, use the state
+     * passed to the program callback instead
+     */
+    uint32_t get_crc_state() const {
+        return _crc_state;
+    }
+
+    /**
+     * Number and duration of the program operations since the last reset,
+     * including the time taken to verify each page
+     */
+    program_stats_t get_program_stats();
+
+    /**
+     * Finalized CRC32 (ANSI) of the data programmed since the stream started
+     */
+    uint32_t get_crc();
+
+    /**
+     * Finalized CRC32 (ANSI) of the data written since the stream started,
+     * including data that is still buffered but not the padding added by flush()
+     *
+     * @note For a resumed stream, this includes the data before the resume address
+     */
+    uint32_t get_written_crc();
+
+protected:
+
+    /** End address of the page that starts (or contains) the programmed address */
+    bd_addr_t page_end() const {
+        return ((get_programmed_address() / _page_size) + 1) * _page_size;
+    }
+
+    /** Location of the given address within the ring */
+    uint8_t *ring_location(bd_addr_t addr) const {
+        return _pool.data() + (addr % _pool.size());
+    }
+
+    /** The ring can hold data up to one pool size past the start of the oldest page */
+    bd_addr_t ring_limit() const {
+        bd_addr_t program_addr = get_programmed_address();
+        return (program_addr - (program_addr % _page_size)) + _pool.size();
+    }
+
+    bool has_full_page() const {
+        return get_address() >= page_end();
+    }
+
+    bool has_programmable_page() const {
+        return has_full_page() && (page_end() <= (_base_addr + _program_limit.load(std::memory_order_acquire)));
+    }
+
+    /**
+     * Compare a programmed region with the staging buffer it was programmed from
+     * @retval true if it matches (or it can't be read back in chunks)
+     */
+    bool verify(const uint8_t *data, bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Programs the oldest buffered page, program_end is where the page ends
+     * @note Must be called with the program mutex held, callbacks are left to the caller
+     */
+    int program_page(bd_addr_t program_end);
+
+    /**
+     * Programs every full page that is buffered
+     * @note Must be called with the program mutex held
+     */
+    int program_buffered_pages();
+
+    /** Queued event that programs one full page and reschedules itself */
+    void drain();
+
+    void schedule_drain();
+
+    void cancel_drain();
+
+    /** @param[in] full Whether a write didn't fit in the ring, which asserts backpressure regardless of the watermark */
+    void update_backpressure(bool full = false);
+
+    /** Callbacks posted to the callback queue, dropped if the writer was reset since */
+    void deliver_program(uint32_t epoch, bd_addr_t addr, uint32_t crc_state);
+    void deliver_error(uint32_t epoch, int err);
+
+protected:
+
+    mbed::BlockDevice& _bd;
+    events::EventQueue& _queue;
+
+    /* Ring of page buffers, indexed by address modulo its size */
+    mbed::Span<uint8_t> _pool;
+
+    bd_size_t _page_size;
+
+    /* Address the stream started at, offsets below are relative to it */
+    bd_addr_t _base_addr = 0;
+
+    /* Offset of the next byte to be written, only advanced by the writer */
+    std::atomic<uint32_t> _written;
+
+    /* Offset up to which data has been programmed, only advanced by queued events */
+    std::atomic<uint32_t> _programmed;
+
+    /* Pages are not programmed past this offset */
+    std::atomic<uint32_t> _program_limit;
+
+    std::atomic<int> _drain_event_id;
+
+    /* Serializes program operations and resets */
+    PlatformMutex _mutex;
+
+    events::EventQueue *_callback_queue = nullptr;
+
+    /* Incremented on reset, so callbacks still in the callback queue are dropped */
+    uint32_t _epoch = 0;
+
+    /* Number of buffered pages at which backpressure is asserted */
+    size_t _high_watermark;
+
+    bool _backpressured = false;
+
+    BackpressureCallback_t _backpressure_cb = nullptr;
+
+    ErrorCallback_t _error_cb = nullptr;
+
+    ProgramCallback_t _program_cb = nullptr;
+
+    CRC_t _crc;
+
+    /* Running CRC over the programmed data */
+    uint32_t _crc_state = 0;
+
+    /* Running CRC over the written data, only used by the writer */
+    CRC_t _written_crc;
+    uint32_t _written_crc_state = 0;
+
+    bool _verify = false;
+
+    /* Times program operations, only used with the program mutex held */
+    mbed::Timer _program_timer;
+
+    program_stats_t _program_stats;
+
+    /* Sticky error code from the last failed program operation */
+    std::atomic<int> _bd_error;
+
+};
+
+#endif /* PAGEDBLOCKDEVICEWRITER_H_ */
@@ -9,12 +9,14 @@
 
 #include "PeriodicBlockDeviceEraser.h"
 
+#include "platform/ScopedLock.h"
+
 PeriodicBlockDeviceEraser::PeriodicBlockDeviceEraser(mbed::BlockDevice &bd,
         events::EventQueue &queue) : _bd(bd), _queue(queue) {
 }
 
 PeriodicBlockDeviceEraser::~PeriodicBlockDeviceEraser() {
-    _queue.cancel(_erase_event_id);
+    cancel();
 }
 
 int PeriodicBlockDeviceEraser::start_erase(bd_addr_t addr, bd_size_t size,
@@ -30,8 +32,15 @@ int PeriodicBlockDeviceEraser::start_erase(bd_addr_t addr, bd_size_t size,
         return 1;
     }
 
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
+
+    _epoch++;
     _done = false;
     _bd_error = mbed::BD_ERROR_OK;
+    _skipped_sectors = 0;
+    _erased_sectors = 0;
+    _erase_time = std::chrono::microseconds(0);
+    _start_addr = addr;
     _addr = addr;
     _end_addr = addr + size;
     _erase_size = erase_size;
@@ -43,25 +52,166 @@ int PeriodicBlockDeviceEraser::start_erase(bd_addr_t addr, bd_size_t size,
     return 0;
 }
 
+void PeriodicBlockDeviceEraser::cancel() {
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
+
+    _queue.cancel(_erase_event_id);
+    _erase_event_id = 0;
+    if(_callback_queue && _cb_event_id) {
+        _callback_queue->cancel(_cb_event_id);
+        _cb_event_id = 0;
+    }
+    _epoch++;
+    _done = true;
+}
+
+std::chrono::microseconds PeriodicBlockDeviceEraser::get_estimated_time_remaining() const {
+    if(_done) {
+        return std::chrono::microseconds(0);
+    }
+
+    size_t regions = (_end_addr - _addr) / _erase_size;
+    std::chrono::microseconds remaining = _avg_erase_time * regions;
+
+    if(_slice_budget.count() > 0) {
+        size_t batch = get_batch_size();
+        size_t slices = (regions + batch - 1) / batch;
+        remaining += std::chrono::duration_cast<std::chrono::microseconds>(_yield_time) * slices;
+    }
+
+    return remaining;
+}
+
+size_t PeriodicBlockDeviceEraser::get_batch_size() const {
+    if((_slice_budget.count() == 0) || (_avg_erase_time.count() == 0)) {
+        return 1;
+    }
+
+    size_t batch = std::chrono::duration_cast<std::chrono::microseconds>(_slice_budget) / _avg_erase_time;
+    return (batch > 0) ? batch : 1;
+}
+
 void PeriodicBlockDeviceEraser::erase() {
-    _bd_error = _bd.erase(_addr, _erase_size);
+    mbed::ScopedLock<PlatformMutex> lock(_mutex);
 
-    /* If there was an error in erasing, stop now and report to the application */
-    if(_bd_error) {
-        if(_cb) {
-            _cb(_bd_error);
-        }
-        _done = true;
+    /* Cancelled while this event was waiting for the lock */
+    if(_done) {
         return;
     }
 
-    _addr += _erase_size;
+    size_t batch = get_batch_size();
+
+    _slice_timer.reset();
+    _slice_timer.start();
+
+    for(size_t i = 0; (i < batch) && (_addr < _end_addr); i++) {
+        std::chrono::microseconds erase_start = _slice_timer.elapsed_time();
+
+        if(_blank_check && is_blank(_addr, _erase_size)) {
+            _skipped_sectors += _erase_size / _bd.get_erase_size();
+        } else {
+            std::chrono::microseconds start = _slice_timer.elapsed_time();
+            _bd_error = _bd.erase(_addr, _erase_size);
+            _erase_time += _slice_timer.elapsed_time() - start;
+            _erased_sectors += _erase_size / _bd.get_erase_size();
+        }
+
+        /* If there was an error in erasing, stop now and report to the application */
+        if(_bd_error) {
+            _slice_timer.stop();
+            complete(_bd_error);
+            return;
+        }
+
+        _addr += _erase_size;
+
+        /* Track the duration of each erase to adapt the batch size */
+        std::chrono::microseconds erase_time = _slice_timer.elapsed_time() - erase_start;
+        if(_avg_erase_time.count() == 0) {
+            _avg_erase_time = erase_time;
+        } else {
+            _avg_erase_time = ((_avg_erase_time * 3) + erase_time) / 4;
+        }
+
+        /* Stop early if the erases took longer than expected */
+        if(_slice_timer.elapsed_time() >= _slice_budget) {
+            break;
+        }
+    }
+
+    _slice_timer.stop();
+
     if(_addr < _end_addr) {
-        _erase_event_id = _queue.call(mbed::callback(this, &PeriodicBlockDeviceEraser::erase));
+        if(_yield_time.count() > 0) {
+            _erase_event_id = _queue.call_in(_yield_time,
+                    mbed::callback(this, &PeriodicBlockDeviceEraser::erase));
+        } else {
+            _erase_event_id = _queue.call(mbed::callback(this, &PeriodicBlockDeviceEraser::erase));
+        }
     } else {
-        if(_cb) {
-            _cb(_bd_error);
+        complete(_bd_error);
+    }
+}
+
+void PeriodicBlockDeviceEraser::complete(int result) {
+    _done = true;
+
+    if(_callback_queue) {
+        _cb_event_id = _callback_queue->call(this, &PeriodicBlockDeviceEraser::deliver_complete, _epoch, result);
+    } else if(_cb) {
+        _cb(result);
+    }
+}
+
+void PeriodicBlockDeviceEraser::deliver_complete(uint32_t epoch, int result) {
+    /* _cb_event_id is left as is, cancelling an event that already ran has no effect */
+    if((epoch == _epoch) && _cb) {
+        _cb(result);
+    }
+}
+
+bool PeriodicBlockDeviceEraser::is_blank(bd_addr_t addr, bd_size_t size) {
+    int erase_value = _bd.get_erase_value();
+    if(erase_value == -1) {
+        return false;
+    }
+
+    /* Chunks must be readable in one go */
+    if((BLANK_CHECK_CHUNK_SIZE % _bd.get_read_size()) != 0) {
+        return false;
+    }
+
+    /* Compare a word at a time rather than byte by byte */
+    uint32_t chunk[BLANK_CHECK_CHUNK_SIZE / sizeof(uint32_t)];
+    uint32_t blank_word = 0x01010101UL * (uint8_t) erase_value;
+
+    bd_addr_t end = addr + size;
+    while(addr < end) {
+        bd_size_t chunk_size = end - addr;
+        if(chunk_size > BLANK_CHECK_CHUNK_SIZE) {
+            chunk_size = BLANK_CHECK_CHUNK_SIZE;
         }
-        _done = true;
+
+        /* If the region can't be read, fall back to erasing it */
+        if(_bd.read(chunk, addr, chunk_size) != mbed::BD_ERROR_OK) {
+            return false;
+        }
+
+        const uint8_t *bytes = (const uint8_t *) chunk;
+        size_t word_count = chunk_size / sizeof(uint32_t);
+        for(size_t i = 0; i < word_count; i++) {
+            if(chunk[i] != blank_word) {
+                return false;
+            }
+        }
+        for(size_t i = word_count * sizeof(uint32_t); i < chunk_size; i++) {
+            if(bytes[i] != (uint8_t) erase_value) {
+                return false;
+            }
+        }
+
+        addr += chunk_size;
     }
+
+    return true;
 }
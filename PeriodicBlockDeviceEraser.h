@@ -12,11 +12,28 @@
 
 #include "blockdevice/BlockDevice.h"
 #include "events/EventQueue.h"
+#include "drivers/Timer.h"
+#include "platform/PlatformMutex.h"
+
+#include <chrono>
 
 /**
  * This class encapsulates logic for erasing a given section of a block device
  * using periodic erase events. This prevents a large erase operation from
  * blocking the processor for a long periodic of time.
+ *
+ * Optionally, each region can be blank-checked before it is erased. Regions
+ * that already read back as the erase value are skipped, which saves both
+ * time and flash wear when the block device is already (mostly) erased.
+ *
+ * By default, one region is erased per event. In time-budget mode, each event
+ * (slice) erases as many regions as are expected to fit in the budget, based
+ * on the measured duration of previous erases, then yields for a set time.
+ *
+ * The queue may be dispatched by another (eg: lower priority) thread than
+ * the one starting the erase. The completion callback is then posted to a
+ * callback queue (see set_callback_queue), and cancel() waits for the slice
+ * in progress, if any.
  */
 class PeriodicBlockDeviceEraser
 {
@@ -24,6 +41,9 @@ public:
 
     using PeriodicBlockDeviceCallback_t = mbed::Callback<void(int)>;
 
+    /* Size of the chunks read back when blank-checking */
+    static constexpr bd_size_t BLANK_CHECK_CHUNK_SIZE = 256;
+
 public:
 
     PeriodicBlockDeviceEraser(mbed::BlockDevice& bd, events::EventQueue& queue);
@@ -52,6 +72,82 @@ public:
         return start_erase(addr, size, _bd.get_erase_size(), cb);
     }
 
+    /**
+     * Set the queue the completion callback is posted to, rather than being
+     * called from the erase event
+     */
+    void set_callback_queue(events::EventQueue *queue) {
+        _callback_queue = queue;
+    }
+
+    /**
+     * Enable or disable blank-checking each region before erasing it
+     *
+     * @note Blank-checking is only done if the BlockDevice has a known erase value
+     */
+    void set_blank_check(bool enabled) {
+        _blank_check = enabled;
+    }
+
+    /**
+     * Enable time-budget mode
+     * @param[in] slice_budget Maximum time to spend erasing per slice, 0 disables time-budget mode
+     * @param[in] yield_time Time to yield to other events between slices
+     *
+     * @note At least one region is erased per slice, even if it takes longer than the budget
+     */
+    void set_time_budget(std::chrono::milliseconds slice_budget, std::chrono::milliseconds yield_time) {
+        _slice_budget = slice_budget;
+        _yield_time = yield_time;
+    }
+
+    /**
+     * Number of bytes processed (erased or skipped) so far in the current erase operation
+     */
+    bd_size_t get_bytes_erased() const {
+        return _addr - _start_addr;
+    }
+
+    /**
+     * Estimated time until the current erase operation completes, based on the
+     * measured duration of previous erases
+     */
+    std::chrono::microseconds get_estimated_time_remaining() const;
+
+    /**
+     * Average time taken to erase one region
+     */
+    std::chrono::microseconds get_average_erase_time() const {
+        return _avg_erase_time;
+    }
+
+    /**
+     * Number of regions erased per slice in time-budget mode
+     */
+    size_t get_batch_size() const;
+
+    /**
+     * Number of BlockDevice sectors that were already blank and were not erased
+     * during the last erase operation
+     */
+    bd_size_t get_skipped_sectors() const {
+        return _skipped_sectors;
+    }
+
+    /**
+     * Number of BlockDevice sectors actually erased during the last erase operation
+     */
+    bd_size_t get_erased_sectors() const {
+        return _erased_sectors;
+    }
+
+    /**
+     * Time spent erasing (not counting blank checks) during the last erase operation
+     */
+    std::chrono::microseconds get_erase_time() const {
+        return _erase_time;
+    }
+
     bool is_done() const {
         return _done;
     }
@@ -60,10 +156,34 @@ public:
         return _bd_error;
     }
 
+    /**
+     * Everything between the start address and this address has been erased
+     */
+    bd_addr_t get_address() const {
+        return _addr;
+    }
+
+    /**
+     * Cancel an ongoing erase operation, the callback is not executed
+     */
+    void cancel();
+
 protected:
 
     void erase();
 
+    /** Report the end of the erase operation to the callback */
+    void complete(int result);
+
+    /** Completion posted to the callback queue, dropped if the operation was cancelled since */
+    void deliver_complete(uint32_t epoch, int result);
+
+    /**
+     * Check whether the given region reads back as the erase value
+     * @retval true if the whole region is blank
+     */
+    bool is_blank(bd_addr_t addr, bd_size_t size);
+
 protected:
 
     mbed::BlockDevice& _bd;
@@ -71,12 +191,25 @@ protected:
 
     int _erase_event_id = 0;
 
+    /* Serializes erase slices with starting and cancelling the operation */
+    PlatformMutex _mutex;
+
+    events::EventQueue *_callback_queue = nullptr;
+
+    int _cb_event_id = 0;
+
+    /* Incremented when an operation is started or cancelled */
+    uint32_t _epoch = 0;
+
     /* Callback executed when the erase function completes or encounters an error */
     PeriodicBlockDeviceCallback_t _cb = nullptr;
 
     /* Done flag */
     bool _done = false;
 
+    /* Start address location */
+    bd_addr_t _start_addr = 0;
+
     /* Current address location */
     bd_addr_t _addr = 0;
 
@@ -89,6 +222,26 @@ protected:
     /* Error code */
     int _bd_error = mbed::BD_ERROR_OK;
 
+    /* Blank-check regions before erasing them */
+    bool _blank_check = false;
+
+    /* Number of sectors skipped because they were already blank */
+    bd_size_t _skipped_sectors = 0;
+
+    /* Number of sectors erased, and the time it took */
+    bd_size_t _erased_sectors = 0;
+    std::chrono::microseconds _erase_time = std::chrono::microseconds(0);
+
+    /* Time-budget mode, disabled if the slice budget is 0 */
+    std::chrono::milliseconds _slice_budget = std::chrono::milliseconds(0);
+    std::chrono::milliseconds _yield_time = std::chrono::milliseconds(0);
+
+    /* Times each slice and the erases within it */
+    mbed::Timer _slice_timer;
+
+    /* Moving average of the time taken to erase one region */
+    std::chrono::microseconds _avg_erase_time = std::chrono::microseconds(0);
+
 };
 
 #endif /*_PERIODICBLOCKDEVICEERASER_H_ */
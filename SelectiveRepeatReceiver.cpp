@@ -0,0 +1,174 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "SelectiveRepeatReceiver.h"
+
+#include <string.h>
+
+SelectiveRepeatReceiver::SelectiveRepeatReceiver(mbed::Span<uint8_t> buffer) : _buffer(buffer) {
+}
+
+void SelectiveRepeatReceiver::reset(size_t fragment_size) {
+    _fragment_size = fragment_size;
+
+    /* Smaller fragments leave room for a larger window */
+    _window = (fragment_size != 0) ? (_buffer.size() / fragment_size) : 0;
+    if(_window > MAX_WINDOW) {
+        _window = MAX_WINDOW;
+    }
+
+    _next_index = 0;
+    _base_slot = 0;
+    _received = 0;
+    _placed = 0;
+    _has_end = false;
+    _end_index = 0;
+    _end_size = 0;
+    _new_gap = false;
+    _error = RECEIVE_ERROR_OK;
+}
+
+int SelectiveRepeatReceiver::receive(uint16_t index, mbed::Span<const uint8_t> data) {
+    if(_error) {
+        return _error;
+    }
+
+    if((_window == 0) || data.empty() || ((size_t) data.size() > _fragment_size)) {
+        return RECEIVE_ERROR_INVALID_FRAGMENT;
+    }
+
+    /* Old retransmissions and fragments too far ahead are dropped, the missing bitmap covers them */
+    uint16_t delta = index - _next_index;
+    if(delta >= _window) {
+        return RECEIVE_ERROR_OK;
+    }
+
+    if(_has_end && (delta > (uint16_t) (_end_index - _next_index))) {
+        return RECEIVE_ERROR_INVALID_FRAGMENT;
+    }
+
+    if((size_t) data.size() < _fragment_size) {
+        /* Only the last fragment is short, so there can't be any after it */
+        if((_has_end && (index != _end_index)) || ((_received >> delta) > 1)) {
+            return RECEIVE_ERROR_INVALID_FRAGMENT;
+        }
+        _has_end = true;
+        _end_index = index;
+        _end_size = data.size();
+    }
+
+    uint32_t bit = (uint32_t) 1 << delta;
+    if(_received & bit) {
+        /* Duplicate */
+        return RECEIVE_ERROR_OK;
+    }
+
+    /* Fast path, the next fragment in order is output without being copied */
+    bool deferred = false;
+    if((delta == 0) && (_received == 0)) {
+        int err = _output_cb(data);
+        if(err != RECEIVE_ERROR_OUTPUT_BUSY) {
+            _next_index++;
+            _base_slot = (_base_slot + 1) % _window;
+            if(err) {
+                _error = err;
+            }
+            return err;
+        }
+
+        /* Otherwise, it is stored like any other fragment until resume() */
+        deferred = true;
+    }
+
+    /* A fragment past the highest one received so far leaves a gap behind it,
+     * unless it is right after that one */
+    if((delta != 0) && ((_received >> delta) == 0) && ((_received & (bit >> 1)) == 0)) {
+        _new_gap = true;
+    }
+
+    uint8_t *slot = get_slot(delta);
+    if(_placement_cb) {
+        mbed::Span<uint8_t> placement = _placement_cb(delta * _fragment_size, data.size());
+        if(placement.size() == data.size()) {
+            slot = placement.data();
+            _placed |= bit;
+        }
+    }
+
+    memcpy(slot, data.data(), data.size());
+    _received |= bit;
+
+    if(deferred) {
+        return RECEIVE_ERROR_OK;
+    }
+
+    return release();
+}
+
+int SelectiveRepeatReceiver::resume() {
+    if(_error) {
+        return _error;
+    }
+
+    return release();
+}
+
+uint32_t SelectiveRepeatReceiver::get_missing() const {
+    if(_received == 0) {
+        return 0;
+    }
+
+    /* Only fragments below the highest one received are known to be missing */
+    uint32_t highest = 31;
+    while((_received & ((uint32_t) 1 << highest)) == 0) {
+        highest--;
+    }
+
+    uint32_t mask = (highest == 31) ? 0xFFFFFFFF : (((uint32_t) 1 << (highest + 1)) - 1);
+    return ~_received & mask;
+}
+
+int SelectiveRepeatReceiver::release() {
+    while(_received & 1) {
+        const uint8_t *slot = get_slot(0);
+        size_t size = (_has_end && (_next_index == _end_index)) ? _end_size : _fragment_size;
+        if(_placed & 1) {
+            slot = _placement_cb(0, size).data();
+        }
+
+        /* The fragment stays at the start of the window until it is taken */
+        int err = _output_cb(mbed::make_const_Span(slot, size));
+        if(err == RECEIVE_ERROR_OUTPUT_BUSY) {
+            return RECEIVE_ERROR_OK;
+        }
+
+        /* The slot isn't reused before the next fragment is received */
+        _received >>= 1;
+        _placed >>= 1;
+        _next_index++;
+        _base_slot = (_base_slot + 1) % _window;
+
+        if(err) {
+            _error = err;
+            return err;
+        }
+    }
+
+    return RECEIVE_ERROR_OK;
+}
@@ -0,0 +1,198 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef SELECTIVEREPEATRECEIVER_H_
+#define SELECTIVEREPEATRECEIVER_H_
+
+#include "platform/Callback.h"
+#include "platform/Span.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Reorders indexed binary stream fragments received out of order
+ *
+ * Fragments within a window of the next expected index are placed in the
+ * buffer at the slot for their index, and a bitmap tracks which ones have
+ * been received. Whenever the fragment at the start of the window is there,
+ * it is output and the window slides forward. Anything outside the window
+ * (eg: a retransmission of a fragment already output) is ignored.
+ *
+ * Every fragment of a stream has the same size except the last one, which
+ * may be shorter. The fragment size is chosen per stream (eg: to fit the
+ * ATT MTU), and the window is as many fragments as fit in the buffer.
+ * Fragment indexes are 16-bit and wrap around.
+ *
+ * The missing bitmap tells the sender exactly which fragments to resend,
+ * rather than everything from the first lost one.
+ *
+ * If a placement callback is set, fragments received out of order are
+ * stored wherever it says instead (eg: directly in the page buffers they
+ * will be programmed from), and output from there.
+ *
+ * The output callback can defer a fragment it can't take yet (eg: while the
+ * page buffers are full) by returning RECEIVE_ERROR_OUTPUT_BUSY. The
+ * fragment is then kept in the window, which stops sliding until resume()
+ * outputs it.
+ */
+class SelectiveRepeatReceiver
+{
+public:
+
+    /** Callback for fragments output in order, returns 0 or an error code */
+    typedef mbed::Callback<int(mbed::Span<const uint8_t>)> OutputCallback_t;
+
+    /**
+     * Callback for where to store a fragment that starts the given number of
+     * bytes past the next fragment to be output, returns an empty span to
+     * store it in the buffer
+     *
+     * @note Until the fragment is output, the callback must return the same
+     * location for it (ie: at offset 0 once it is the next one)
+     */
+    typedef mbed::Callback<mbed::Span<uint8_t>(size_t, size_t)> PlacementCallback_t;
+
+    /** Largest window, as the received fragments are tracked in a 32-bit bitmap */
+    static constexpr size_t MAX_WINDOW = 32;
+
+    enum error_t {
+        RECEIVE_ERROR_OK = 0,
+        RECEIVE_ERROR_INVALID_FRAGMENT = -4101,
+        /** Returned by the output callback to have the fragment kept and output again by resume() */
+        RECEIVE_ERROR_OUTPUT_BUSY = -4102,
+    };
+
+public:
+
+    /**
+     * Construct a receiver
+     * @param[in] buffer Buffer fragments are reordered in
+     */
+    SelectiveRepeatReceiver(mbed::Span<uint8_t> buffer);
+
+    /**
+     * Start receiving a new stream, from fragment index 0
+     * @param[in] fragment_size Size of every fragment but the last, at most the buffer size
+     */
+    void reset(size_t fragment_size);
+
+    /**
+     * Receive a fragment, then output whatever can now be output in order
+     *
+     * @retval 0 on success (including ignored fragments),
+     * RECEIVE_ERROR_INVALID_FRAGMENT if the fragment size is invalid,
+     * or the error returned by the output callback
+     */
+    int receive(uint16_t index, mbed::Span<const uint8_t> data);
+
+    /**
+     * Output whatever can be output in order, after the output callback deferred a fragment
+     *
+     * @retval 0 on success (including if the output callback deferred a fragment again),
+     * or the error returned by the output callback
+     */
+    int resume();
+
+    void set_output_callback(OutputCallback_t cb) {
+        _output_cb = cb;
+    }
+
+    void set_placement_callback(PlacementCallback_t cb) {
+        _placement_cb = cb;
+    }
+
+    /**
+     * Index of the next fragment to be output
+     */
+    uint16_t get_next_index() const {
+        return _next_index;
+    }
+
+    /**
+     * Fragments known to be missing, bit i is set if fragment
+     * get_next_index() + i hasn't been received but a later one has
+     */
+    uint32_t get_missing() const;
+
+    /**
+     * Whether a fragment was received past a gap since the last call,
+     * ie: the sender should be told which fragments are missing
+     */
+    bool check_new_gap() {
+        bool new_gap = _new_gap;
+        _new_gap = false;
+        return new_gap;
+    }
+
+    size_t get_fragment_size() const {
+        return _fragment_size;
+    }
+
+    /**
+     * Number of fragments accepted ahead of get_next_index()
+     */
+    size_t get_window() const {
+        return _window;
+    }
+
+protected:
+
+    /** Output the fragments at the start of the window */
+    int release();
+
+    uint8_t *get_slot(uint16_t delta) {
+        return _buffer.data() + (((_base_slot + delta) % _window) * _fragment_size);
+    }
+
+protected:
+
+    mbed::Span<uint8_t> _buffer;
+
+    size_t _fragment_size = 0;
+
+    size_t _window = 0;
+
+    OutputCallback_t _output_cb;
+
+    PlacementCallback_t _placement_cb = nullptr;
+
+    uint16_t _next_index = 0;
+
+    /* Slot of the fragment at the start of the window */
+    size_t _base_slot = 0;
+
+    /* Bit i is set if fragment _next_index + i has been received */
+    uint32_t _received = 0;
+
+    /* Bit i is set if fragment _next_index + i was stored where the placement callback said */
+    uint32_t _placed = 0;
+
+    /* The last (short) fragment, once it has been received */
+    bool _has_end = false;
+    uint16_t _end_index = 0;
+    size_t _end_size = 0;
+
+    bool _new_gap = false;
+
+    int _error = RECEIVE_ERROR_OK;
+
+};
+
+#endif /* SELECTIVEREPEATRECEIVER_H_ */
@@ -0,0 +1,77 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "StreamTransform.h"
+
+#include <string.h>
+
+StreamTransform::StreamTransform(mbed::Span<uint8_t> stash) : _stash(stash) {
+}
+
+void StreamTransform::reset_stream() {
+    _stash_fill = 0;
+    _stash_pos = 0;
+    _output_total = 0;
+    _output_size = 0;
+    _error = TRANSFORM_ERROR_OK;
+}
+
+int StreamTransform::feed(mbed::Span<const uint8_t> data) {
+    if(_error) {
+        return _error;
+    }
+
+    /* Move what's left to the front to make room */
+    if(_stash_pos != 0) {
+        memmove(_stash.data(), _stash.data() + _stash_pos, _stash_fill - _stash_pos);
+        _stash_fill -= _stash_pos;
+        _stash_pos = 0;
+    }
+
+    if((size_t) data.size() > (_stash.size() - _stash_fill)) {
+        return TRANSFORM_ERROR_STASH_FULL;
+    }
+
+    memcpy(_stash.data() + _stash_fill, data.data(), data.size());
+    _stash_fill += data.size();
+
+    return TRANSFORM_ERROR_OK;
+}
+
+int StreamTransform::emit(mbed::Span<const uint8_t> data) {
+    _output_size += data.size();
+
+    int err = _output_cb ? _output_cb(data) : TRANSFORM_ERROR_OK;
+    if(err) {
+        _error = err;
+    }
+
+    return err;
+}
+
+uint16_t StreamTransform::read_u16(size_t offset) const {
+    const uint8_t *p = stash_data() + offset;
+    return ((uint16_t) p[0]) | ((uint16_t) p[1] << 8);
+}
+
+uint32_t StreamTransform::read_u32(size_t offset) const {
+    const uint8_t *p = stash_data() + offset;
+    return ((uint32_t) p[0]) | ((uint32_t) p[1] << 8) |
+            ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
@@ -0,0 +1,146 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef STREAMTRANSFORM_H_
+#define STREAMTRANSFORM_H_
+
+#include "platform/Callback.h"
+#include "platform/Span.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Base class for stages that turn the binary stream into the image to be
+ * programmed (eg: a delta patch or a compressed image).
+ *
+ * Incoming data is appended to a stash with feed() and turned into output
+ * by run(), which produces a bounded amount of output per call. This lets
+ * the caller spread the work over several events and stop producing output
+ * while the destination is busy. Output is passed to the output callback.
+ */
+class StreamTransform
+{
+public:
+
+    enum error_t {
+        TRANSFORM_ERROR_OK = 0,
+        TRANSFORM_ERROR_INVALID_STREAM = -4001,
+        TRANSFORM_ERROR_STASH_FULL = -4002,
+    };
+
+    using OutputCallback_t = mbed::Callback<int(mbed::Span<const uint8_t>)>;
+
+public:
+
+    /**
+     * @param[in] stash Buffer for input that hasn't been transformed yet
+     */
+    StreamTransform(mbed::Span<uint8_t> stash);
+
+    virtual ~StreamTransform() { }
+
+    void set_output_callback(OutputCallback_t cb) {
+        _output_cb = cb;
+    }
+
+    /**
+     * Append input to the stash, it is transformed by run()
+     * @retval 0 on success, TRANSFORM_ERROR_STASH_FULL if it doesn't fit,
+     * or the sticky error of a previous run()
+     */
+    int feed(mbed::Span<const uint8_t> data);
+
+    /**
+     * Transform stashed input
+     * @param[in] budget Maximum number of bytes to output
+     * @retval Number of bytes output, or a negative error code
+     */
+    virtual int run(size_t budget) = 0;
+
+    /**
+     * Whether run() can make progress without more input
+     */
+    virtual bool has_pending_output() const = 0;
+
+    /**
+     * Whether the whole output has been produced
+     */
+    virtual bool is_complete() const = 0;
+
+    size_t get_stash_size() const {
+        return _stash.size();
+    }
+
+    /** Number of input bytes stashed and not transformed yet */
+    size_t get_stash_fill() const {
+        return _stash_fill - _stash_pos;
+    }
+
+    /** Total size of the output, once known from the stream header (0 otherwise) */
+    uint32_t get_output_total() const {
+        return _output_total;
+    }
+
+    /** Number of bytes output so far */
+    uint32_t get_output_size() const {
+        return _output_size;
+    }
+
+protected:
+
+    /** Discard stashed input and any error, to start a new stream */
+    void reset_stream();
+
+    /** Start of the stashed input */
+    const uint8_t *stash_data() const {
+        return _stash.data() + _stash_pos;
+    }
+
+    /** Drop size bytes from the start of the stashed input */
+    void consume(size_t size) {
+        _stash_pos += size;
+    }
+
+    /** Pass output to the callback, errors are sticky */
+    int emit(mbed::Span<const uint8_t> data);
+
+    /** Little-endian integers at the given offset in the stashed input */
+    uint16_t read_u16(size_t offset) const;
+    uint32_t read_u32(size_t offset) const;
+
+protected:
+
+    mbed::Span<uint8_t> _stash;
+
+    /* Valid stash data is [_stash_pos, _stash_fill) */
+    size_t _stash_fill = 0;
+    size_t _stash_pos = 0;
+
+    OutputCallback_t _output_cb = nullptr;
+
+    uint32_t _output_total = 0;
+    uint32_t _output_size = 0;
+
+    /* Sticky error code */
+    int _error = TRANSFORM_ERROR_OK;
+
+};
+
+#endif /* STREAMTRANSFORM_H_ */
@@ -23,37 +23,198 @@
 
 #include "ble_logging.h"
 #include "BlockDeviceFOTAEventHandler.h"
+#include "FOTACheckpointStore.h"
+#include "FOTAExtensionService.h"
+#include "FOTALinkManager.h"
+#include "FOTASlot.h"
+#include "FOTASlotRegistry.h"
+#include "LatencyHistogram.h"
 
 #include "fw_version.h"
 
+#include "drivers/LowPowerTimer.h"
+#include "drivers/Timer.h"
 #include "mbed-trace/mbed_trace.h"
 #include "platform/mbed_power_mgmt.h"
+#include "platform/mbed_toolchain.h"
+#include "rtos/Thread.h"
 
 #include "bootutil/bootutil.h"
 #include "secondary_bd.h"
+#include "system_memory.h"
+
+#include <new>
+#include <string.h>
 
 #define TRACE_GROUP "MAIN"
 
+#ifndef MBED_CONF_APP_FOTA_FLASH_THREAD_STACK_SIZE
+#define MBED_CONF_APP_FOTA_FLASH_THREAD_STACK_SIZE 2048
+#endif
+
 using namespace std::literals::chrono_literals;
 
 const static char DEVICE_NAME[] = "FOTADemo";
 
-static events::EventQueue event_queue(/* event count */ 10 * EVENTS_EVENT_SIZE);
+static events::EventQueue event_queue(/* event count */ 16 * EVENTS_EVENT_SIZE);
+
+/* Erase and program operations run from a lower priority thread, so they don't hold up BLE events */
+static events::EventQueue flash_queue(/* event count */ 8 * EVENTS_EVENT_SIZE);
+MBED_ALIGN(8) static uint8_t flash_thread_stack[MBED_CONF_APP_FOTA_FLASH_THREAD_STACK_SIZE];
+static rtos::Thread flash_thread(osPriorityBelowNormal, sizeof(flash_thread_stack),
+        flash_thread_stack, "flash");
+
+/* Time from the BLE stack signalling events to them being processed. The
+ * low power ticker (around 30 us per tick) is too coarse for the first
+ * buckets, so this runs off the microsecond ticker. That keeps the system
+ * out of deep sleep, so the timer only runs during FOTA sessions.
+ */
+static mbed::Timer ble_dispatch_timer;
+static LatencyHistogram ble_dispatch_latency;
+
 static ChainableGapEventHandler chainable_gap_event_handler;
 static ChainableGattServerEventHandler chainable_gatt_server_event_handler;
 
+/* Startup phases, timed from the start of main() to track time-to-advertise across builds */
+enum startup_phase_t {
+    STARTUP_BLE_INIT,
+    STARTUP_BLE_READY,
+    STARTUP_ADVERTISING,
+    STARTUP_BOOT_CONFIRMED,
+    STARTUP_STORAGE_READY,
+    STARTUP_PHASE_COUNT
+};
+
+static const char *const startup_phase_names[STARTUP_PHASE_COUNT] = {
+    "ble init", "ble ready", "advertising", "boot confirmed", "storage ready"
+};
+
+static mbed::LowPowerTimer startup_timer;
+static std::chrono::microseconds startup_phase_times[STARTUP_PHASE_COUNT];
+
 void initiate_system_reset(void);
 
+/* Called from both the event and flash threads, each phase is only written by one of them */
+void mark_startup_phase(startup_phase_t phase) {
+    startup_phase_times[phase] = startup_timer.elapsed_time();
+}
+
+/* Printed once startup is over, tracing while it is in progress would slow it down */
+void print_startup_phases(void) {
+    tr_info("startup phases (us since main):");
+    for(size_t i = 0; i < STARTUP_PHASE_COUNT; i++) {
+        tr_info("  %-14s %8lu", startup_phase_names[i], (unsigned long) startup_phase_times[i].count());
+    }
+}
+
+void print_ble_dispatch_latency(void) {
+    tr_info("ble event dispatch latency over %lu events (max %lu us):",
+            (unsigned long) ble_dispatch_latency.get_total(),
+            (unsigned long) ble_dispatch_latency.get_max().count());
+    for(size_t i = 0; i < LatencyHistogram::BUCKET_COUNT; i++) {
+        if(i < (LatencyHistogram::BUCKET_COUNT - 1)) {
+            tr_info("  < %6lu us: %lu", (unsigned long) LatencyHistogram::get_bucket_limit(i).count(),
+                    (unsigned long) ble_dispatch_latency.get_count(i));
+        } else {
+            tr_info("  >= %5lu us: %lu", (unsigned long) LatencyHistogram::get_bucket_limit(i - 1).count(),
+                    (unsigned long) ble_dispatch_latency.get_count(i));
+        }
+    }
+}
+
 class FOTADemoEventHandler : public BlockDeviceFOTAEventHandler {
 
 public:
 
-    FOTADemoEventHandler(mbed::BlockDevice &bd, events::EventQueue &queue) :
-        BlockDeviceFOTAEventHandler(bd, queue) { }
+    FOTADemoEventHandler(mbed::BlockDevice &bd, events::EventQueue &queue, events::EventQueue &flash_queue,
+            FOTALinkManager &link) :
+        BlockDeviceFOTAEventHandler(bd, queue, flash_queue), _link(link) { }
+
+    FOTAService::StatusCode_t on_binary_stream_written(FOTAService &svc, mbed::Span<const uint8_t> buffer) override {
+        _link.on_activity();
+        return BlockDeviceFOTAEventHandler::on_binary_stream_written(svc, buffer);
+    }
+
+    void on_fragment_written(FOTAExtensionService &svc, uint16_t index, mbed::Span<const uint8_t> data) override {
+        _link.on_activity();
+        BlockDeviceFOTAEventHandler::on_fragment_written(svc, index, data);
+    }
 
     GattAuthCallbackReply_t on_control_written(FOTAService &svc, mbed::Span<const uint8_t> buffer) override {
+        /* Sessions can't start before the update slot is initialized and the running image is confirmed */
+        if(!_storage_ready && (buffer[0] != FOTAService::FOTA_NO_OP) && (buffer[0] != FOTA_OP_CODE_SYNC)) {
+            return defer_control(svc, buffer);
+        }
+
+        bool was_active = is_session_active();
+        GattAuthCallbackReply_t reply = handle_control(svc, buffer);
+
+        /* Measure how BLE events are held up over the session */
+        if(!was_active && is_session_active()) {
+            ble_dispatch_latency.reset();
+            ble_dispatch_timer.start();
+        } else if(was_active && !is_session_active()) {
+            ble_dispatch_timer.stop();
+            print_ble_dispatch_latency();
+        }
+
+        /* Speed the link up for the transfer, and slow it back down once it's over */
+        _link.set_session_active(is_session_active());
+        return reply;
+    }
+
+    /**
+     * Let control writes through, replaying those deferred while the storage was initialized
+     */
+    void set_storage_ready() {
+        _storage_ready = true;
+
+        for(size_t i = 0; i < _deferred_count; i++) {
+            deferred_control_t &control = _deferred[i];
+            tr_info("replaying deferred fota op code 0x%02X", control.data[0]);
+            GattAuthCallbackReply_t reply = on_control_written(*control.svc,
+                    mbed::make_const_Span(control.data, control.size));
+            if(reply != AUTH_CALLBACK_REPLY_SUCCESS) {
+                /* The write was already acknowledged, so the failure can only be notified */
+                tr_error("deferred fota op code 0x%02X failed: 0x%04X", control.data[0], (unsigned) reply);
+                control.svc->notify_status(FOTAService::FOTA_STATUS_UNSPECIFIED_ERROR);
+            }
+        }
+        _deferred_count = 0;
+    }
+
+private:
+
+    GattAuthCallbackReply_t defer_control(FOTAService &svc, mbed::Span<const uint8_t> buffer) {
+        if((_deferred_count == DEFERRED_CONTROL_COUNT) || ((size_t) buffer.size() > DEFERRED_CONTROL_SIZE)) {
+            tr_warn("can't defer fota op code 0x%02X until the storage is ready", buffer[0]);
+            return AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+        }
+
+        /* The client waits for XON, which the session only sends once it really started */
+        tr_info("fota op code 0x%02X deferred until the storage is ready", buffer[0]);
+        deferred_control_t &control = _deferred[_deferred_count++];
+        control.svc = &svc;
+        control.size = buffer.size();
+        memcpy(control.data, buffer.data(), buffer.size());
+        return AUTH_CALLBACK_REPLY_SUCCESS;
+    }
+
+    GattAuthCallbackReply_t handle_control(FOTAService &svc, mbed::Span<const uint8_t> buffer) {
         /* Capture the FOTA_COMMIT op code */
         if(buffer[0] == FOTAService::FOTA_COMMIT) {
+            /* Let the BlockDeviceFOTAEventHandler flush and verify the image first */
+            GattAuthCallbackReply_t reply = BlockDeviceFOTAEventHandler::on_control_written(svc, buffer);
+            if(reply != AUTH_CALLBACK_REPLY_SUCCESS) {
+                return reply;
+            }
+
+            /* Other images are picked up by whatever uses their slot, the application keeps running */
+            if(get_selected_image_id() != FOTASlotRegistry::DEFAULT_IMAGE_ID) {
+                tr_info("image %u written to its slot", get_selected_image_id());
+                return AUTH_CALLBACK_REPLY_SUCCESS;
+            }
+
             int err = boot_set_pending(false);
             if(err) {
                 tr_error("error setting the update candidate as pending: %d", err);
@@ -71,29 +232,60 @@ public:
         }
     }
 
+private:
+
+    /* Enough for a slot selection, a start (with a wrapped key) and a stop or two */
+    static constexpr size_t DEFERRED_CONTROL_COUNT = 4;
+    static constexpr size_t DEFERRED_CONTROL_SIZE = 1 + MCUbootImageDecryptor::WRAPPED_KEY_SIZE;
+
+    struct deferred_control_t {
+        FOTAService *svc;
+        size_t size;
+        uint8_t data[DEFERRED_CONTROL_SIZE];
+    };
+
+    FOTALinkManager &_link;
+
+    bool _storage_ready = false;
+
+    deferred_control_t _deferred[DEFERRED_CONTROL_COUNT];
+    size_t _deferred_count = 0;
+
 };
 
 class FOTAServiceDemo : ble::Gap::EventHandler {
 
 public:
-    FOTAServiceDemo(BLE &ble, events::EventQueue &event_queue, ChainableGapEventHandler &chainable_gap_eh,
+    FOTAServiceDemo(BLE &ble, events::EventQueue &event_queue, events::EventQueue &flash_queue,
+            ChainableGapEventHandler &chainable_gap_eh,
             ChainableGattServerEventHandler &chainable_gatt_server_eh) :
             _ble(ble),
             _event_queue(event_queue),
+            _flash_queue(flash_queue),
             _chainable_gap_eh(chainable_gap_eh),
             _chainable_gatt_server_eh(chainable_gatt_server_eh),
-            _fota_handler(*get_secondary_bd(), event_queue),
+            _link_manager(_ble, _event_queue, _chainable_gap_eh),
+            _fota_handler(*get_update_bd(), event_queue, flash_queue, _link_manager),
             _fota_service(_ble, _event_queue, _chainable_gap_eh, _chainable_gatt_server_eh,
                     "1.0.0", FW_VERSION, "primary mcu"),
+            _fota_ext_service(_ble, _chainable_gap_eh, _chainable_gatt_server_eh),
+            _checkpoint_store(*get_checkpoint_bd()),
             _adv_data_builder(_adv_buffer)
     {
     }
 
     virtual ~FOTAServiceDemo() {
+        for(size_t i = 0; i < _image_slot_count; i++) {
+            _image_slots[i]->~FOTASlot();
+        }
     }
 
     void start()
     {
+        /* The storage is brought up from the flash thread while the BLE stack initializes */
+        _flash_queue.call(this, &FOTAServiceDemo::init_storage);
+
+        mark_startup_phase(STARTUP_BLE_INIT);
         _ble.init(this, &FOTAServiceDemo::on_init_complete);
 
         _event_queue.dispatch_forever();
@@ -104,6 +296,37 @@ public:
     }
 
 private:
+    /* Runs from the flash thread, QSPI flash bring-up can take a while */
+    void init_storage()
+    {
+        /**
+         *  Do whatever is needed to verify the firmware is okay
+         *  (eg: self test, connect to server, etc)
+         *
+         *  And then mark that the update succeeded
+         */
+        //run_self_test();
+        _boot_confirm_err = boot_set_confirmed();
+        mark_startup_phase(STARTUP_BOOT_CONFIRMED);
+
+        get_secondary_bd()->init();
+        get_update_bd()->init();
+        get_checkpoint_bd()->init();
+        get_primary_bd()->init();
+
+        /* Allows an interrupted transfer to be resumed, even across a reset */
+        _checkpoint_err = _checkpoint_store.init();
+        mark_startup_phase(STARTUP_STORAGE_READY);
+
+        _event_queue.call(this, &FOTAServiceDemo::on_storage_ready);
+    }
+
+    void on_storage_ready()
+    {
+        _storage_ready = true;
+        finish_startup();
+    }
+
     void on_init_complete(BLE::InitializationCompleteCallbackContext *params)
     {
         if (params->error != BLE_ERROR_NONE) {
@@ -111,16 +334,101 @@ private:
             return;
         }
 
+        mark_startup_phase(STARTUP_BLE_READY);
+
         /* The ChainableGapEventHandler allows us to dispatch events from GAP to more than a single event handler */
         _chainable_gap_eh.addEventHandler(this);
         _ble.gap().setEventHandler(&_chainable_gap_eh);
         _ble.gattServer().setEventHandler(&_chainable_gatt_server_eh);
 
+        /* Requests a fast connection while a FOTA session is active */
+        _link_manager.init();
+
         _fota_service.init();
 
         _fota_service.set_event_handler(&_fota_handler);
 
+        ble_error_t error = _fota_ext_service.init();
+        if (error) {
+            ble_log_error(error, "_fota_ext_service.init() failed");
+        } else {
+            _fota_handler.set_extension_service(&_fota_ext_service);
+        }
+
+#ifdef MBED_CONF_APP_FOTA_ENCRYPTION_KEK
+        /* Key the keys of encrypted images are wrapped with */
+        static const uint8_t kek[] = MBED_CONF_APP_FOTA_ENCRYPTION_KEK;
+        _fota_handler.set_encryption_kek(kek);
+#endif
+
+        /* Advertise right away, sessions started before the storage is ready are held back */
         start_advertising();
+        mark_startup_phase(STARTUP_ADVERTISING);
+
+        _ble_ready = true;
+        finish_startup();
+    }
+
+    /* Hands the storage over to the FOTA handler once both it and the BLE stack are up */
+    void finish_startup()
+    {
+        if (!_ble_ready || !_storage_ready) {
+            return;
+        }
+
+        if (_boot_confirm_err == 0) {
+            tr_info("boot confirmed");
+        } else {
+            tr_error("failed to confirm boot: %d", _boot_confirm_err);
+        }
+
+        if (_checkpoint_err) {
+            tr_error("error reading fota checkpoints: %d", _checkpoint_err);
+        } else {
+            _fota_handler.set_checkpoint_store(&_checkpoint_store);
+        }
+
+        /* Delta patches are applied against the running image */
+        _fota_handler.set_delta_source(get_primary_bd());
+
+        /* Other images the board can update, each in its own slot */
+        for(uint8_t image_id = 1; image_id < FOTASlotRegistry::MAX_SLOTS; image_id++) {
+            add_image_slot(image_id);
+        }
+
+        _fota_handler.set_storage_ready();
+
+        print_startup_phases();
+        startup_timer.stop();
+    }
+
+    void add_image_slot(uint8_t image_id)
+    {
+        mbed::BlockDevice *bd = get_image_slot_bd(image_id);
+        if (bd == nullptr) {
+            return;
+        }
+
+        int err = bd->init();
+        if (err) {
+            tr_error("error initializing the slot of image %u: %d", image_id, err);
+            return;
+        }
+
+        if (_image_slot_count == IMAGE_SLOT_STORAGE_COUNT) {
+            return;
+        }
+
+        /* Other images aren't necessarily MCUboot images, so their hash isn't checked */
+        FOTASlot *slot = new (_image_slot_storage[_image_slot_count]) FOTASlot(*bd, _event_queue, _flash_queue);
+        slot->set_verify_image(false);
+        if (!_fota_handler.add_slot(image_id, *slot)) {
+            slot->~FOTASlot();
+            return;
+        }
+
+        _image_slots[_image_slot_count++] = slot;
+        tr_info("fota slot added for image %u, size: %llu", image_id, bd->size());
     }
 
     void start_advertising()
@@ -196,10 +504,7 @@ private:
         tr_info("supervision timeout: %i",
                 event.getSupervisionTimeout().value());
 
-        _ble.gap().acceptConnectionParametersUpdate(event.getConnectionHandle(),
-                event.getMinConnectionInterval(),
-                event.getMaxConnectionInterval(), event.getSlaveLatency(),
-                event.getSupervisionTimeout());
+        /* The FOTALinkManager replies to the request */
     }
 
     void onConnectionParametersUpdateComplete(
@@ -230,21 +535,46 @@ private:
 private:
     BLE &_ble;
     events::EventQueue &_event_queue;
+    events::EventQueue &_flash_queue;
     ChainableGapEventHandler &_chainable_gap_eh;
     ChainableGattServerEventHandler &_chainable_gatt_server_eh;
 
+    FOTALinkManager _link_manager;
     FOTADemoEventHandler _fota_handler;
     FOTAService _fota_service;
+    FOTAExtensionService _fota_ext_service;
+    FOTACheckpointStore _checkpoint_store;
+
+    /* Slots of images other than image 0, constructed in place so nothing is allocated from the heap */
+    static constexpr size_t IMAGE_SLOT_STORAGE_COUNT =
+            (FOTASlotRegistry::MAX_SLOTS > 1) ? (FOTASlotRegistry::MAX_SLOTS - 1) : 1;
+    alignas(FOTASlot) uint8_t _image_slot_storage[IMAGE_SLOT_STORAGE_COUNT][sizeof(FOTASlot)];
+    FOTASlot *_image_slots[IMAGE_SLOT_STORAGE_COUNT];
+    size_t _image_slot_count = 0;
 
     uint8_t _adv_buffer[ble::LEGACY_ADVERTISING_MAX_SIZE];
     ble::AdvertisingDataBuilder _adv_data_builder;
 
     ble::connection_handle_t _connection_handle = 0;
+
+    /* Startup stages, both completed on the event queue */
+    bool _ble_ready = false;
+    bool _storage_ready = false;
+
+    /* Results of the storage initialization, reported once it's over */
+    int _boot_confirm_err = 0;
+    int _checkpoint_err = 0;
 };
 
+void process_ble_events(BLE *ble, std::chrono::microseconds scheduled_time)
+{
+    ble_dispatch_latency.record(ble_dispatch_timer.elapsed_time() - scheduled_time);
+    ble->processEvents();
+}
+
 void schedule_ble_events(BLE::OnEventsToProcessCallbackContext *context)
 {
-    event_queue.call(mbed::Callback<void()>(&context->ble, &BLE::processEvents));
+    event_queue.call(process_ble_events, &context->ble, ble_dispatch_timer.elapsed_time());
 }
 
 void initiate_system_reset(void) {
@@ -254,28 +584,17 @@ void initiate_system_reset(void) {
 
 int main()
 {
+    startup_timer.start();
     mbed_trace_init();
 
-    /**
-     *  Do whatever is needed to verify the firmware is okay
-     *  (eg: self test, connect to server, etc)
-     *
-     *  And then mark that the update succeeded
-     */
-    //run_self_test();
-    int ret = boot_set_confirmed();
-    if (ret == 0) {
-        tr_info("boot confirmed");
-    } else {
-        tr_error("failed to confirm boot: %d", ret);
-    }
-
-    get_secondary_bd()->init();
+    /* Boot confirmation and the storage initialization are queued on it, see FOTAServiceDemo::init_storage() */
+    flash_thread.start(mbed::callback(&flash_queue, &events::EventQueue::dispatch_forever));
 
     BLE &ble = BLE::Instance();
     ble.onEventsToProcess(schedule_ble_events);
 
-    FOTAServiceDemo demo(ble, event_queue, chainable_gap_event_handler,
+    /* Static, so the RAM taken by the FOTA path (all of it sized at compile time) shows up in the map file */
+    static FOTAServiceDemo demo(ble, event_queue, flash_queue, chainable_gap_event_handler,
             chainable_gatt_server_event_handler);
     demo.start();
 
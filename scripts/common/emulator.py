@@ -0,0 +1,239 @@
+# Copyright (c) 2020-2021 Embedded Planet
+# Copyright (c) 2020-2021 ARM Limited
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Client side of the FOTA device emulator (tests/UNITTESTS/FOTAEmulator)
+
+EmulatorClient offers the subset of the BleakClient API the updater uses, so
+it can be swapped in for a board to exercise the transfer logic on a host.
+See FOTAEmulator.h for the frames exchanged with the emulator.
+"""
+
+import asyncio
+import logging
+import struct
+import uuid
+
+from typing import Callable, Dict, Optional, Union
+
+log = logging.getLogger(__name__)
+
+OP_DISCOVER_REQ = 0x01
+OP_DISCOVER_RSP = 0x02
+OP_READ_REQ = 0x03
+OP_READ_RSP = 0x04
+OP_WRITE_REQ = 0x05
+OP_WRITE_RSP = 0x06
+OP_WRITE_CMD = 0x07
+OP_NOTIFY = 0x08
+
+# Handle, properties, service UUID and characteristic UUID
+DISCOVER_ENTRY_FORMAT = '<HB16s16s'
+
+RESPONSE_TIMEOUT = 10.0
+
+
+class EmulatorError(Exception):
+    pass
+
+
+class EmulatorCharacteristic:
+
+    def __init__(self, handle: int, properties: int, char_uuid: str):
+        self.handle = handle
+        self.properties = properties
+        self.uuid = char_uuid
+
+    def get_descriptor(self, desc_uuid: str):
+        # Descriptors aren't emulated
+        return None
+
+
+class EmulatorService:
+
+    def __init__(self, svc_uuid: str):
+        self.uuid = svc_uuid
+        self.characteristics = {}  # type: Dict[str, EmulatorCharacteristic]
+
+    def get_characteristic(self, char_uuid: str) -> Optional[EmulatorCharacteristic]:
+        return self.characteristics.get(char_uuid.lower())
+
+
+class EmulatorServiceCollection:
+
+    def __init__(self):
+        self.services = {}  # type: Dict[str, EmulatorService]
+
+    def get_service(self, svc_uuid: str) -> Optional[EmulatorService]:
+        return self.services.get(svc_uuid.lower())
+
+    def get_characteristic(self, char_uuid: str) -> Optional[EmulatorCharacteristic]:
+        for service in self.services.values():
+            char = service.get_characteristic(char_uuid)
+            if char:
+                return char
+        return None
+
+
+class EmulatorClient:
+    """
+    Stand-in for BleakClient, connected to the FOTA emulator over TCP
+    """
+
+    def __init__(self, host: str, port: int):
+        self.host = host
+        self.port = port
+        self.services = EmulatorServiceCollection()
+        self.mtu_size = 23
+        self._reader = None  # type: Optional[asyncio.StreamReader]
+        self._writer = None  # type: Optional[asyncio.StreamWriter]
+        self._receive_task = None  # type: Optional[asyncio.Task]
+        self._callbacks = {}  # type: Dict[int, Callable[[int, bytearray], None]]
+        # The emulator answers requests in order, one at a time like ATT
+        self._request_lock = asyncio.Lock()
+        self._response = None  # type: Optional[asyncio.Future]
+
+    async def connect(self) -> bool:
+        self._reader, self._writer = await asyncio.open_connection(self.host, self.port)
+        self._receive_task = asyncio.ensure_future(self._receive())
+
+        data = await self._request(OP_DISCOVER_REQ, b'', OP_DISCOVER_RSP)
+        self.mtu_size, = struct.unpack_from('<H', data)
+        for offset in range(2, len(data), struct.calcsize(DISCOVER_ENTRY_FORMAT)):
+            handle, properties, svc_uuid, char_uuid = struct.unpack_from(DISCOVER_ENTRY_FORMAT, data, offset)
+            svc_uuid = str(uuid.UUID(bytes=svc_uuid))
+            service = self.services.services.setdefault(svc_uuid, EmulatorService(svc_uuid))
+            char = EmulatorCharacteristic(handle, properties, str(uuid.UUID(bytes=char_uuid)))
+            service.characteristics[char.uuid] = char
+
+        log.info(f'Connected to FOTA emulator at {self.host}:{self.port}, ATT MTU: {self.mtu_size}')
+        return True
+
+    async def disconnect(self) -> bool:
+        if self._writer:
+            self._writer.close()
+            self._writer = None
+        if self._receive_task:
+            self._receive_task.cancel()
+            self._receive_task = None
+        return True
+
+    async def is_connected(self) -> bool:
+        return self._writer is not None
+
+    async def read_gatt_char(self, char_specifier: Union[EmulatorCharacteristic, str]) -> bytearray:
+        handle = self._get_handle(char_specifier)
+        data = await self._request(OP_READ_REQ, struct.pack('<H', handle), OP_READ_RSP)
+        self._check_error(handle, data[2])
+        return bytearray(data[3:])
+
+    async def write_gatt_char(self, char_specifier: Union[EmulatorCharacteristic, str], data: bytes,
+                              response: bool = False):
+        handle = self._get_handle(char_specifier)
+        payload = struct.pack('<H', handle) + bytes(data)
+        if not response:
+            await self._send(OP_WRITE_CMD, payload)
+            return
+
+        rsp = await self._request(OP_WRITE_REQ, payload, OP_WRITE_RSP)
+        self._check_error(handle, rsp[2])
+
+    async def start_notify(self, char_specifier: Union[EmulatorCharacteristic, str],
+                           callback: Callable[[int, bytearray], None]):
+        self._callbacks[self._get_handle(char_specifier)] = callback
+
+    async def stop_notify(self, char_specifier: Union[EmulatorCharacteristic, str]):
+        self._callbacks.pop(self._get_handle(char_specifier), None)
+
+    async def read_gatt_descriptor(self, handle: int) -> bytearray:
+        raise EmulatorError('descriptors are not emulated')
+
+    def _get_handle(self, char_specifier: Union[EmulatorCharacteristic, str]) -> int:
+        if isinstance(char_specifier, EmulatorCharacteristic):
+            return char_specifier.handle
+        char = self.services.get_characteristic(char_specifier)
+        if not char:
+            raise EmulatorError(f'characteristic {char_specifier} not found')
+        return char.handle
+
+    @staticmethod
+    def _check_error(handle: int, error: int):
+        if error:
+            raise EmulatorError(f'ATT error 0x{error:02X} on handle {handle}')
+
+    async def _send(self, op: int, payload: bytes):
+        if not self._writer:
+            raise EmulatorError('not connected')
+        self._writer.write(struct.pack('<HB', len(payload) + 1, op) + payload)
+        await self._writer.drain()
+
+    async def _request(self, op: int, payload: bytes, response_op: int) -> bytes:
+        async with self._request_lock:
+            self._response = asyncio.get_event_loop().create_future()
+            await self._send(op, payload)
+            rsp_op, data = await asyncio.wait_for(self._response, RESPONSE_TIMEOUT)
+            if rsp_op != response_op:
+                raise EmulatorError(f'unexpected response 0x{rsp_op:02X} to request 0x{op:02X}')
+            return data
+
+    async def _receive(self):
+        try:
+            while True:
+                header = await self._reader.readexactly(3)
+                length, op = struct.unpack('<HB', header)
+                data = await self._reader.readexactly(length - 1)
+                if op == OP_NOTIFY:
+                    handle, = struct.unpack_from('<H', data)
+                    callback = self._callbacks.get(handle)
+                    if callback:
+                        callback(handle, bytearray(data[2:]))
+                elif self._response and not self._response.done():
+                    self._response.set_result((op, data))
+                else:
+                    log.warning(f'Unexpected frame 0x{op:02X} from the FOTA emulator')
+        except asyncio.IncompleteReadError:
+            log.info('FOTA emulator closed the connection')
+            self._writer = None
+            if self._response and not self._response.done():
+                self._response.set_exception(EmulatorError('connection closed'))
+
+
+class EmulatorClientAllocator:
+    """
+    Same interface as ClientAllocator, connecting to the FOTA emulator instead of scanning for a board
+    """
+
+    def __init__(self, address: str):
+        host, _, port = address.rpartition(':')
+        self.host = host or 'localhost'
+        self.port = int(port)
+        self.client = None  # type: Optional[EmulatorClient]
+
+    async def allocate(self, name: str) -> Optional[EmulatorClient]:
+        if self.client is None:
+            client = EmulatorClient(self.host, self.port)
+            try:
+                await client.connect()
+            except OSError as e:
+                log.error(f'Could not connect to the FOTA emulator: {e}')
+                return None
+            self.client = client
+        return self.client
+
+    async def release(self, client: EmulatorClient) -> None:
+        if self.client == client and self.client is not None:
+            await client.disconnect()
+            self.client = None
@@ -0,0 +1,178 @@
+# Copyright (c) 2020-2021 Embedded Planet
+# Copyright (c) 2020-2021 ARM Limited
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License
+
+"""
+Compresses a signed image for a compressed FOTA session (see LZDecompressor.h for the format).
+
+usage: compress_image.py [--window SIZE] SIGNED_BIN OUTPUT
+
+The window must not be larger than the device's app.fota-compression-window-size.
+"""
+
+import argparse
+import struct
+import sys
+
+STREAM_MAGIC = b'FLZ1'
+MIN_MATCH = 4
+LENGTH_EXTENDED = 15
+
+DEFAULT_WINDOW_SIZE = 4096
+
+# Number of earlier positions tried per match, trades compression ratio for speed
+MAX_CHAIN = 32
+
+
+def match_length(data: bytes, src: int, dst: int) -> int:
+    length = 0
+    limit = len(data) - dst
+    while length < limit and data[src+length] == data[dst+length]:
+        length += 1
+    return length
+
+
+def encode_length(length: int) -> bytes:
+    out = bytearray()
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+    return bytes(out)
+
+
+def encode_sequence(literals: bytes, offset: int = 0, length: int = 0) -> bytes:
+    out = bytearray()
+    literal_nibble = min(len(literals), LENGTH_EXTENDED)
+    match_nibble = min(length - MIN_MATCH, LENGTH_EXTENDED) if length else 0
+    out.append((literal_nibble << 4) | match_nibble)
+    if literal_nibble == LENGTH_EXTENDED:
+        out += encode_length(len(literals) - LENGTH_EXTENDED)
+    out += literals
+    if length:
+        out += struct.pack('<H', offset)
+        if match_nibble == LENGTH_EXTENDED:
+            out += encode_length(length - MIN_MATCH - LENGTH_EXTENDED)
+    return bytes(out)
+
+
+def compress(data: bytes, window_size: int = DEFAULT_WINDOW_SIZE) -> bytes:
+    out = bytearray(STREAM_MAGIC + struct.pack('<II', len(data), window_size))
+    chains = {}
+
+    def insert(position):
+        chain = chains.setdefault(data[position:position+MIN_MATCH], [])
+        chain.append(position)
+        if len(chain) > 2 * MAX_CHAIN:
+            del chain[:MAX_CHAIN]
+
+    literal_start = 0
+    i = 0
+    while i < len(data):
+        best_length, best_offset = 0, 0
+        if i + MIN_MATCH <= len(data):
+            for position in reversed(chains.get(data[i:i+MIN_MATCH], [])[-MAX_CHAIN:]):
+                if i - position > window_size:
+                    break
+                length = match_length(data, position, i)
+                if length > best_length:
+                    best_length, best_offset = length, i - position
+
+        if best_length >= MIN_MATCH:
+            out += encode_sequence(data[literal_start:i], best_offset, best_length)
+            for position in range(i, min(i + best_length, len(data) - MIN_MATCH + 1)):
+                insert(position)
+            i += best_length
+            literal_start = i
+        else:
+            if i + MIN_MATCH <= len(data):
+                insert(i)
+            i += 1
+
+    # The stream may end with literals only
+    if literal_start < len(data):
+        out += encode_sequence(data[literal_start:])
+
+    return bytes(out)
+
+
+def decompress(stream: bytes) -> bytes:
+    """
+    Reference implementation of the device side, used to check the output
+    """
+    if stream[0:4] != STREAM_MAGIC:
+        raise ValueError("bad stream magic")
+    size, window_size = struct.unpack_from('<II', stream, 4)
+    offset = 12
+    out = bytearray()
+
+    def read_length(length):
+        nonlocal offset
+        if length == LENGTH_EXTENDED:
+            while True:
+                extra = stream[offset]
+                offset += 1
+                length += extra
+                if extra != 255:
+                    break
+        return length
+
+    while len(out) < size:
+        token = stream[offset]
+        offset += 1
+        literal_length = read_length(token >> 4)
+        out += stream[offset:offset+literal_length]
+        offset += literal_length
+        if len(out) == size:
+            break
+        match_offset, = struct.unpack_from('<H', stream, offset)
+        offset += 2
+        if match_offset == 0 or match_offset > window_size:
+            raise ValueError(f"bad match offset {match_offset}")
+        length = read_length(token & 0x0F) + MIN_MATCH
+        for _ in range(length):
+            out.append(out[-match_offset])
+
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compress a signed image for a compressed FOTA session")
+    parser.add_argument("--window", type=int, default=DEFAULT_WINDOW_SIZE,
+                        help="largest match offset, must fit in the device's history buffer")
+    parser.add_argument("image", help="signed update image")
+    parser.add_argument("output", help="output file")
+    args = parser.parse_args()
+
+    if not 1 <= args.window <= 0xFFFF:
+        parser.error("the window must fit in a 16-bit match offset")
+
+    with open(args.image, 'rb') as f:
+        data = f.read()
+
+    stream = compress(data, args.window)
+
+    if decompress(stream) != data:
+        print("error: compressed stream doesn't reproduce the image", file=sys.stderr)
+        sys.exit(1)
+
+    with open(args.output, 'wb') as f:
+        f.write(stream)
+
+    print(f"compressed {len(data)} bytes to {len(stream)} bytes ({len(data) / len(stream):.2f}x)")
+
+
+if __name__ == '__main__':
+    main()
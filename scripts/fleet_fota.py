@@ -0,0 +1,374 @@
+# Copyright (c) 2020-2021 Embedded Planet
+# Copyright (c) 2020-2021 ARM Limited
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License
+
+"""
+Updates a fleet of FOTADemo devices in parallel from one host.
+
+usage: fleet_fota.py [update options, see test_fota.py] [--concurrency N] [--attempts N] [--report FILE]
+                     (--device ADDRESS ... | --scan NAME | --emulator HOST:PORT ...)
+
+Every device runs its own FOTASession. The number of devices connected at
+once is bounded by --concurrency, as adapters only keep a few connections
+going at full speed. A device is released while it reboots into the update,
+so another one can be updated meanwhile.
+"""
+
+import argparse
+import asyncio
+import json
+import logging
+import random
+import time
+
+from bleak import BleakClient, BleakScanner, BleakError
+from common.emulator import EmulatorClientAllocator, EmulatorError
+from typing import Dict, List, Optional
+
+from test_fota import FOTASession, FOTASessionError, MAXIMUM_RETRIES, add_update_arguments, get_wrapped_key, read_image, send_update, \
+    start_update
+
+log = logging.getLogger(__name__)
+
+# Reconnection backoff, doubled on every failed attempt up to the maximum
+BACKOFF_INITIAL = 1.0
+BACKOFF_MAXIMUM = 30.0
+
+# Time the device takes to reboot into the update before the first reconnection attempt
+REBOOT_DELAY = 5.0
+
+# Failures of a device or its link, anything else is a bug and stops the fleet
+DEVICE_ERRORS = (asyncio.TimeoutError, BleakError, EmulatorError, FOTASessionError, OSError, EOFError)
+
+
+class AddressClientAllocator:
+    """
+    Same interface as ClientAllocator, connecting to a device by address instead of scanning for it
+    """
+
+    def __init__(self, address: str):
+        self.address = address
+        self.client = None  # type: Optional[BleakClient]
+
+    async def allocate(self, name: str) -> Optional[BleakClient]:
+        if self.client is None:
+            client = BleakClient(self.address)
+            try:
+                if await client.connect():
+                    self.client = client
+            except BleakError as e:
+                log.debug(f'{self.address}: {e}')
+        return self.client
+
+    async def release(self, client: BleakClient) -> None:
+        if self.client == client and self.client is not None:
+            try:
+                await client.disconnect()
+            except BleakError:
+                pass
+            self.client = None
+
+
+class DeviceReport:
+    """
+    Progress and outcome of the update of one device
+    """
+
+    def __init__(self, address: str):
+        self.address = address
+        self.state = 'pending'
+        self.error = None  # type: Optional[str]
+        self.attempts = 0
+        self.old_revision = None  # type: Optional[str]
+        self.new_revision = None  # type: Optional[str]
+        self.bytes_sent = 0
+        self.total_size = 0
+        # Time spent sending the update, over every attempt
+        self.transfer_time = 0.0
+        self.start_time = None  # type: Optional[float]
+        self.end_time = None  # type: Optional[float]
+        self.session = None  # type: Optional[FOTASession]
+        self.transfer_start = None  # type: Optional[float]
+
+    @property
+    def done(self) -> bool:
+        return self.state in ('updated', 'unchanged', 'failed')
+
+    def elapsed(self) -> float:
+        if self.start_time is None:
+            return 0.0
+        return (self.end_time or time.time()) - self.start_time
+
+    def update_progress(self):
+        if self.session:
+            self.bytes_sent = self.session.bytes_sent
+            self.total_size = self.session.total_size
+
+    def throughput(self) -> float:
+        """
+        :return: average transfer rate in bytes/s, time spent connecting or rebooting isn't counted
+        """
+        transfer_time = self.transfer_time
+        if self.transfer_start is not None:
+            transfer_time += time.time() - self.transfer_start
+        return self.bytes_sent / transfer_time if transfer_time > 0 else 0.0
+
+    def to_dict(self) -> dict:
+        return {
+            'address': self.address,
+            'state': self.state,
+            'error': self.error,
+            'attempts': self.attempts,
+            'old_revision': self.old_revision,
+            'new_revision': self.new_revision,
+            'bytes_sent': self.bytes_sent,
+            'total_size': self.total_size,
+            'transfer_time': round(self.transfer_time, 3),
+            'elapsed': round(self.elapsed(), 3),
+            'throughput': round(self.throughput(), 1),
+        }
+
+
+class FleetUpdater:
+
+    def __init__(self, args, allocators: Dict[str, object]):
+        self.args = args
+        self.allocators = allocators
+        self.reports = {address: DeviceReport(address) for address in allocators}
+        # Bounds the connections open at once on the adapter
+        self.adapter = asyncio.Semaphore(args.concurrency)
+
+    async def run(self) -> List[DeviceReport]:
+        progress = asyncio.ensure_future(self.log_progress())
+        await asyncio.gather(*(self.update_device(address) for address in self.allocators))
+        progress.cancel()
+        return list(self.reports.values())
+
+    async def connect(self, report: DeviceReport):
+        """
+        Connects to the device, backing off between attempts
+
+        The adapter slot is only held while connected, the caller gives it
+        back with disconnect().
+
+        :return: the connected client, or None
+        """
+        allocator = self.allocators[report.address]
+        for attempt in range(MAXIMUM_RETRIES):
+            await self.adapter.acquire()
+            try:
+                client = await allocator.allocate("FOTADemo")
+            except DEVICE_ERRORS:
+                client = None
+            if client:
+                return client
+            self.adapter.release()
+            delay = min(BACKOFF_INITIAL * 2**attempt, BACKOFF_MAXIMUM)
+            # Jitter keeps devices that failed together from retrying together
+            delay *= random.uniform(0.5, 1.0)
+            log.info(f'{report.address}: failed to connect (retry {attempt + 1}/{MAXIMUM_RETRIES} in {delay:.1f} s)')
+            await asyncio.sleep(delay)
+        return None
+
+    async def disconnect(self, report: DeviceReport, client):
+        try:
+            await self.allocators[report.address].release(client)
+        finally:
+            self.adapter.release()
+
+    async def update_device(self, address: str):
+        report = self.reports[address]
+        report.start_time = time.time()
+        for attempt in range(self.args.attempts):
+            report.attempts = attempt + 1
+            report.error = None
+            try:
+                committed = await self.send_to_device(report)
+            except DEVICE_ERRORS as e:
+                report.error = f'{type(e).__name__}: {e}' if str(e) else type(e).__name__
+                committed = False
+
+            if committed:
+                await self.check_revision(report)
+                break
+
+            log.warning(f'{address}: attempt {attempt + 1}/{self.args.attempts} failed'
+                        f'{": " + report.error if report.error else ""}')
+            if attempt + 1 < self.args.attempts:
+                report.state = 'backoff'
+                await asyncio.sleep(min(BACKOFF_INITIAL * 2**attempt, BACKOFF_MAXIMUM))
+        else:
+            report.state = 'failed'
+
+        report.end_time = time.time()
+        log.info(f'{address}: {report.state} in {report.elapsed():.1f} s')
+
+    async def send_to_device(self, report: DeviceReport) -> bool:
+        """
+        Sends and commits the update
+
+        :return: True if the update was committed
+        """
+        report.state = 'connecting'
+        client = await self.connect(report)
+        if not client:
+            report.error = 'could not connect'
+            return False
+
+        try:
+            session = FOTASession(client)
+            fw_rev, _ = await session.get_firmware_revision()
+            report.old_revision = report.old_revision or fw_rev.decode('utf-8')
+
+            report.state = 'starting'
+            offset = await start_update(session, self.args)
+
+            report.state = 'transferring'
+            report.session = session
+            report.transfer_start = time.time()
+            try:
+                committed = await send_update(session, self.args, offset)
+            finally:
+                report.update_progress()
+                report.transfer_time += time.time() - report.transfer_start
+                report.transfer_start = None
+                report.session = None
+            if not committed:
+                report.error = 'transfer failed'
+            return committed
+        finally:
+            await self.disconnect(report, client)
+
+    async def check_revision(self, report: DeviceReport):
+        """
+        Waits for the device to come back from applying the update and compares its firmware revision
+        """
+        if self.args.slot:
+            # The application keeps running, there is no new firmware revision to check
+            report.state = 'updated'
+            return
+
+        report.state = 'rebooting'
+        await asyncio.sleep(REBOOT_DELAY)
+
+        report.state = 'verifying'
+        client = await self.connect(report)
+        if not client:
+            # The update is committed, sending it again wouldn't help
+            report.state = 'failed'
+            report.error = 'did not reconnect after the update'
+            return
+
+        try:
+            fw_rev, _ = await FOTASession(client).get_firmware_revision()
+            report.new_revision = fw_rev.decode('utf-8')
+        except DEVICE_ERRORS as e:
+            report.state = 'failed'
+            report.error = f'could not read the new firmware revision: {e}'
+            return
+        finally:
+            await self.disconnect(report, client)
+
+        report.state = 'updated' if report.new_revision != report.old_revision else 'unchanged'
+
+    async def log_progress(self):
+        while True:
+            await asyncio.sleep(self.args.progress_interval)
+            active = [r for r in self.reports.values() if not r.done and r.state != 'pending']
+            done = sum(r.done for r in self.reports.values())
+            log.info(f'{done}/{len(self.reports)} devices done, {len(active)} active')
+            for report in active:
+                report.update_progress()
+                percent = 100 * report.bytes_sent / report.total_size if report.total_size else 0
+                log.info(f'  {report.address}: {report.state}, {percent:.0f}% '
+                         f'({report.bytes_sent}/{report.total_size} bytes, {report.throughput()/1000:.2f} kB/s)')
+
+
+def log_summary(reports: List[DeviceReport], elapsed: float):
+    log.info(f'{"device":<24} {"result":<10} {"attempts":>8} {"revision":<24} {"bytes":>10} {"kB/s":>8} {"time (s)":>9}')
+    for r in reports:
+        revision = f'{r.old_revision} -> {r.new_revision}' if r.new_revision else (r.old_revision or '?')
+        log.info(f'{r.address:<24} {r.state:<10} {r.attempts:>8} {revision:<24} {r.bytes_sent:>10} '
+                 f'{r.throughput()/1000:>8.2f} {r.elapsed():>9.1f}' + (f'  ({r.error})' if r.error else ''))
+
+    updated = sum(r.state == 'updated' for r in reports)
+    total_bytes = sum(r.bytes_sent for r in reports)
+    log.info(f'{updated}/{len(reports)} devices updated in {elapsed:.1f} s, {total_bytes} bytes sent, '
+             f'aggregate {total_bytes/elapsed/1000 if elapsed else 0:.2f} kB/s')
+
+
+async def find_devices(name: str) -> List[str]:
+    devices = await BleakScanner.discover()
+    return [d.address for d in devices if d.name == name]
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="Update a fleet of FOTADemo devices in parallel")
+    add_update_arguments(parser)
+    devices = parser.add_mutually_exclusive_group(required=True)
+    devices.add_argument("--device", metavar="ADDRESS", action='append',
+                         help="address of a device to update, may be repeated")
+    devices.add_argument("--scan", metavar="NAME", help="update every device advertising this name")
+    devices.add_argument("--emulator", metavar="HOST:PORT", action='append',
+                         help="update a host emulator (see tests/UNITTESTS/FOTAEmulator), may be repeated")
+    parser.add_argument("--concurrency", type=int, default=4,
+                        help="devices connected at once, bounded by what the adapter sustains")
+    parser.add_argument("--attempts", type=int, default=3,
+                        help="updates attempted per device before giving up")
+    parser.add_argument("--progress-interval", type=float, default=5.0,
+                        help="seconds between progress reports")
+    parser.add_argument("--report", help="write the per-device results to this JSON file")
+    parser.add_argument("--verbose", action='store_true', help="log the sessions of every device")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+    if not args.verbose:
+        # The sessions log every packet, that is unreadable once interleaved
+        logging.getLogger('test_fota').setLevel(logging.WARNING)
+        logging.getLogger('common.emulator').setLevel(logging.WARNING)
+
+    # Load what is sent once up front, the sessions share it
+    for filename in (args.image, args.patch, args.compressed):
+        if filename:
+            read_image(filename)
+    if args.encrypted:
+        try:
+            get_wrapped_key(read_image(args.image))
+        except ValueError as e:
+            log.error(f'can not send {args.image} encrypted: {e}')
+            return
+
+    if args.emulator:
+        allocators = {address: EmulatorClientAllocator(address) for address in args.emulator}
+    else:
+        addresses = args.device or await find_devices(args.scan)
+        allocators = {address: AddressClientAllocator(address) for address in addresses}
+    if not allocators:
+        log.error('no devices to update')
+        return
+
+    log.info(f'Updating {len(allocators)} devices, {args.concurrency} at a time')
+    start_time = time.time()
+    reports = await FleetUpdater(args, allocators).run()
+    log_summary(reports, time.time() - start_time)
+
+    if args.report:
+        with open(args.report, 'w') as f:
+            json.dump([r.to_dict() for r in reports], f, indent=2)
+
+
+if __name__ == '__main__':
+    loop = asyncio.get_event_loop()
+    loop.run_until_complete(main())
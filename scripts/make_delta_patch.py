@@ -0,0 +1,175 @@
+# Copyright (c) 2020-2021 Embedded Planet
+# Copyright (c) 2020-2021 ARM Limited
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License
+
+"""
+Generates a delta patch that rebuilds a new signed image from the image
+currently in the device's primary slot (see DeltaPatchApplier.h for the format).
+
+usage: make_delta_patch.py OLD_SIGNED_BIN NEW_SIGNED_BIN PATCH
+
+The old image must be the signed binary that is installed on the device, the
+patch is only valid against that exact image.
+"""
+
+import argparse
+import struct
+import sys
+
+PATCH_MAGIC = b'FDLT'
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+COPY_OP_SIZE = 9
+INSERT_OP_SIZE = 5
+
+# Length of the blocks used to look up matches in the old image
+BLOCK_SIZE = 16
+
+# Matches shorter than this cost more as a COPY than as literals
+MIN_COPY_SIZE = 2 * COPY_OP_SIZE
+
+# Number of candidate positions kept per block, bounds the time spent on repetitive data
+MAX_CANDIDATES = 8
+
+
+def build_index(old: bytes) -> dict:
+    index = {}
+    for i in range(0, len(old) - BLOCK_SIZE + 1):
+        positions = index.setdefault(old[i:i+BLOCK_SIZE], [])
+        if len(positions) < MAX_CANDIDATES:
+            positions.append(i)
+    return index
+
+
+def match_length(old: bytes, src: int, new: bytes, dst: int) -> int:
+    length = 0
+    limit = min(len(old) - src, len(new) - dst)
+    # Compare in large steps first, then narrow down on the mismatch
+    step = 256
+    while step:
+        while length + step <= limit and old[src+length:src+length+step] == new[dst+length:dst+length+step]:
+            length += step
+        step //= 4
+    while length < limit and old[src+length] == new[dst+length]:
+        length += 1
+    return length
+
+
+def diff(old: bytes, new: bytes) -> list:
+    """
+    Greedily splits the new image into ("copy", src, length) and ("insert", data) ops
+    """
+    index = build_index(old)
+    ops = []
+    literal_start = 0
+    next_src = None
+    i = 0
+    while i < len(new):
+        candidates = []
+        # Code that hasn't changed usually continues right where the last copy ended
+        if next_src is not None and next_src < len(old):
+            candidates.append(next_src)
+        candidates += index.get(new[i:i+BLOCK_SIZE], [])
+
+        best_src, best_len = None, 0
+        for src in candidates:
+            length = match_length(old, src, new, i)
+            if length > best_len:
+                best_src, best_len = src, length
+
+        if best_len >= MIN_COPY_SIZE:
+            if literal_start < i:
+                ops.append(("insert", new[literal_start:i]))
+            ops.append(("copy", best_src, best_len))
+            i += best_len
+            literal_start = i
+            next_src = best_src + best_len
+        else:
+            i += 1
+            if next_src is not None:
+                next_src += 1
+
+    if literal_start < len(new):
+        ops.append(("insert", new[literal_start:]))
+
+    return ops
+
+
+def encode(ops: list, new_size: int) -> bytes:
+    patch = bytearray(PATCH_MAGIC + struct.pack('<I', new_size))
+    for op in ops:
+        if op[0] == "copy":
+            patch += struct.pack('<BII', OP_COPY, op[1], op[2])
+        else:
+            patch += struct.pack('<BI', OP_INSERT, len(op[1]))
+            patch += op[1]
+    return bytes(patch)
+
+
+def apply(old: bytes, patch: bytes) -> bytes:
+    """
+    Reference implementation of the device side, used to check generated patches
+    """
+    if patch[0:4] != PATCH_MAGIC:
+        raise ValueError("bad patch magic")
+    new_size, = struct.unpack_from('<I', patch, 4)
+    offset = 8
+    new = bytearray()
+    while len(new) < new_size:
+        op = patch[offset]
+        if op == OP_COPY:
+            src, length = struct.unpack_from('<II', patch, offset + 1)
+            new += old[src:src+length]
+            offset += COPY_OP_SIZE
+        elif op == OP_INSERT:
+            length, = struct.unpack_from('<I', patch, offset + 1)
+            offset += INSERT_OP_SIZE
+            new += patch[offset:offset+length]
+            offset += length
+        else:
+            raise ValueError(f"unknown op 0x{op:02x} at offset {offset}")
+    return bytes(new)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a delta patch between two signed images")
+    parser.add_argument("old", help="signed image installed in the primary slot")
+    parser.add_argument("new", help="signed update image")
+    parser.add_argument("patch", help="output patch file")
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    ops = diff(old, new)
+    patch = encode(ops, len(new))
+
+    if apply(old, patch) != new:
+        print("error: patch doesn't reproduce the new image", file=sys.stderr)
+        sys.exit(1)
+
+    with open(args.patch, 'wb') as f:
+        f.write(patch)
+
+    copied = sum(op[2] for op in ops if op[0] == "copy")
+    print(f"{len(ops)} ops, {copied} of {len(new)} bytes copied from the old image")
+    print(f"patch size: {len(patch)} bytes ({100.0 * len(patch) / len(new):.1f}% of the new image)")
+
+
+if __name__ == '__main__':
+    main()
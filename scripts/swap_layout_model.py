@@ -0,0 +1,184 @@
+# Copyright (c) 2020-2021 Embedded Planet
+# Copyright (c) 2020-2021 ARM Limited
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License
+
+"""
+Models the sector erases and copies MCUboot does to install an update with each swap layout.
+
+usage: swap_layout_model.py [--image SIGNED_BIN | --image-size SIZE] [--sector-size SIZE]
+                            [--scratch-size SIZE] [--trailer-size SIZE]
+
+swap-scratch: the image is swapped a scratch-sized chunk at a time, through the scratch area.
+swap-move:    the primary slot has a spare sector, the image is first moved up one sector.
+swap-offset:  the secondary slot has a spare sector the image is written after
+              (app.fota-slot-image-offset), so no move pass is needed.
+
+Only the sectors holding the image are swapped. Status writes to the trailers are not counted.
+The default sizes and timings are those of the NRF52840_DK: primary slot in internal flash,
+secondary slot in the external QSPI flash (typical datasheet values, not measured).
+"""
+
+import argparse
+import math
+import os
+
+DEFAULT_SLOT_SIZE = 0xC0000
+DEFAULT_SECTOR_SIZE = 0x1000
+DEFAULT_SCRATCH_SIZE = 0x20000
+DEFAULT_TRAILER_SIZE = 0x2000
+
+# Typical time (ms) to erase and program one sector, and to read it back
+INTERNAL_TIMINGS = {'erase': 85.0, 'program': 42.0, 'read': 0.1}
+QSPI_TIMINGS = {'erase': 40.0, 'program': 14.0, 'read': 1.0}
+
+
+class Flash:
+    """Erase and copy counts of the sectors of one region"""
+
+    def __init__(self, name: str, sectors: int, timings: dict):
+        self.name = name
+        self.erases = [0] * sectors
+        self.timings = timings
+
+    def erase(self, sector: int):
+        self.erases[sector] += 1
+
+
+class Model:
+
+    def __init__(self, regions: dict):
+        self.regions = regions
+        self.copies = 0
+        self.time_ms = 0.0
+
+    def erase(self, region: str, sector: int):
+        flash = self.regions[region]
+        flash.erase(sector)
+        self.time_ms += flash.timings['erase']
+
+    def copy(self, src: str, src_sector: int, dst: str, dst_sector: int):
+        """Erase a sector and program it with another sector's contents"""
+        self.erase(dst, dst_sector)
+        self.copies += 1
+        self.time_ms += self.regions[src].timings['read'] + self.regions[dst].timings['program']
+
+
+def swap_scratch(sectors: int, scratch_sectors: int) -> Model:
+    model = Model({
+        'primary': Flash('primary', sectors, INTERNAL_TIMINGS),
+        'secondary': Flash('secondary', sectors, QSPI_TIMINGS),
+        'scratch': Flash('scratch', scratch_sectors, INTERNAL_TIMINGS),
+    })
+
+    # Chunks are swapped from the end of the image
+    end = sectors
+    while end > 0:
+        start = max(0, end - scratch_sectors)
+        for i in range(start, end):
+            model.copy('secondary', i, 'scratch', i - start)
+        for i in range(start, end):
+            model.copy('primary', i, 'secondary', i)
+        for i in range(start, end):
+            model.copy('scratch', i - start, 'primary', i)
+        end = start
+
+    return model
+
+
+def swap_move(sectors: int) -> Model:
+    model = Model({
+        'primary': Flash('primary', sectors + 1, INTERNAL_TIMINGS),
+        'secondary': Flash('secondary', sectors, QSPI_TIMINGS),
+    })
+
+    # Move the running image up one sector, into the spare one
+    for i in reversed(range(sectors)):
+        model.copy('primary', i, 'primary', i + 1)
+
+    for i in range(sectors):
+        model.copy('secondary', i, 'primary', i)
+        model.copy('primary', i + 1, 'secondary', i)
+
+    return model
+
+
+def swap_offset(sectors: int) -> Model:
+    model = Model({
+        'primary': Flash('primary', sectors, INTERNAL_TIMINGS),
+        'secondary': Flash('secondary', sectors + 1, QSPI_TIMINGS),
+    })
+
+    # The new image starts at the second sector of the secondary slot, each
+    # primary sector goes in the one just below it
+    for i in range(sectors):
+        model.copy('primary', i, 'secondary', i)
+        model.copy('secondary', i + 1, 'primary', i)
+
+    return model
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Model the erases and copies of each MCUboot swap layout")
+    size_group = parser.add_mutually_exclusive_group()
+    size_group.add_argument("--image", help="signed update image, its size is used")
+    size_group.add_argument("--image-size", type=lambda s: int(s, 0),
+                            help="size of the update image (default: the whole slot less the trailer)")
+    parser.add_argument("--slot-size", type=lambda s: int(s, 0), default=DEFAULT_SLOT_SIZE,
+                        help="size of the primary slot (default: %(default)#x)")
+    parser.add_argument("--sector-size", type=lambda s: int(s, 0), default=DEFAULT_SECTOR_SIZE,
+                        help="erase sector size, the same in both slots (default: %(default)#x)")
+    parser.add_argument("--scratch-size", type=lambda s: int(s, 0), default=DEFAULT_SCRATCH_SIZE,
+                        help="size of the scratch area for swap-scratch (default: %(default)#x)")
+    parser.add_argument("--trailer-size", type=lambda s: int(s, 0), default=DEFAULT_TRAILER_SIZE,
+                        help="space reserved for the MCUboot trailer (default: %(default)#x)")
+    args = parser.parse_args()
+
+    if args.image:
+        image_size = os.path.getsize(args.image)
+    elif args.image_size is not None:
+        image_size = args.image_size
+    else:
+        image_size = args.slot_size - args.trailer_size
+
+    if image_size > args.slot_size - args.trailer_size:
+        parser.error("the image doesn't fit in the slot")
+    if args.scratch_size < args.sector_size:
+        parser.error("the scratch area must hold at least one sector")
+
+    sectors = math.ceil(image_size / args.sector_size)
+    models = {
+        'swap-scratch': swap_scratch(sectors, args.scratch_size // args.sector_size),
+        'swap-move': swap_move(sectors),
+        'swap-offset': swap_offset(sectors),
+    }
+
+    print(f"image: {image_size} bytes, {sectors} sectors of {args.sector_size} bytes")
+    print()
+    print(f"{'layout':<14}{'erases':>8}{'copies':>8}{'max wear':>10}{'time (s)':>10}  erases per region")
+    for name, model in models.items():
+        erases = sum(sum(flash.erases) for flash in model.regions.values())
+        # Most erases any one sector takes per upgrade
+        wear = max(max(flash.erases) for flash in model.regions.values())
+        per_region = ", ".join(f"{flash.name} {sum(flash.erases)}" for flash in model.regions.values())
+        print(f"{name:<14}{erases:>8}{model.copies:>8}{wear:>10}{model.time_ms / 1000:>10.1f}  {per_region}")
+
+    slot_overhead = args.sector_size
+    print()
+    print(f"swap-scratch reserves {args.scratch_size:#x} bytes of scratch, "
+          f"swap-move and swap-offset reserve one extra sector ({slot_overhead:#x} bytes) instead")
+
+
+if __name__ == '__main__':
+    main()
@@ -16,15 +16,21 @@
 # TODO figure out how to include/install the common dependencies from the mbed-os-experimental-ble-services TESTS folder
 
 import platform
+import argparse
 import asyncio
+import functools
 from common.fixtures import BoardAllocator, ClientAllocator
 from common.device import Device
+from common.emulator import EmulatorClientAllocator
 from os import urandom
 from bleak.uuids import uuid16_dict
 from bleak import BleakClient
 from typing import Optional, Union
 import logging
 import time
+import hashlib
+import struct
+import zlib
 
 log = logging.getLogger(__name__)
 
@@ -53,6 +59,13 @@ UUID_BINARY_STREAM_CHAR = "53880001-65fd-4651-ba8e-91527f06c887"
 UUID_CONTROL_CHAR = "53880002-65fd-4651-ba8e-91527f06c887"
 UUID_STATUS_CHAR = "53880003-65fd-4651-ba8e-91527f06c887"
 UUID_VERSION_CHAR = "53880004-65fd-4651-ba8e-91527f06c887"
+UUID_FOTA_EXTENSION_SERVICE = "53880100-65fd-4651-ba8e-91527f06c887"
+UUID_SESSION_INFO_CHAR = "53880101-65fd-4651-ba8e-91527f06c887"
+UUID_FRAGMENT_STREAM_CHAR = "53880102-65fd-4651-ba8e-91527f06c887"
+UUID_FRAGMENT_STATUS_CHAR = "53880103-65fd-4651-ba8e-91527f06c887"
+UUID_TRANSFER_STATUS_CHAR = "53880104-65fd-4651-ba8e-91527f06c887"
+UUID_SESSION_STATS_CHAR = "53880105-65fd-4651-ba8e-91527f06c887"
+UUID_STREAM_CREDIT_CHAR = "53880106-65fd-4651-ba8e-91527f06c887"
 UUID_FIRMWARE_REVISION_STRING_CHAR = short_bt_sig_uuid_to_long(uuid16_dict.get("Firmware Revision String"))
 UUID_DEVICE_INFORMATION_SERVICE_UUID = short_bt_sig_uuid_to_long(uuid16_dict.get("Device Information"))
 UUID_DESCRIPTOR_CUDD = short_bt_sig_uuid_to_long(uuid16_dict.get("Characteristic User Description"))
@@ -76,6 +89,39 @@ FOTA_OP_CODE_COMMIT = bytearray(b'\x03')
 FOTA_OP_CODE_SET_XOFF = bytearray(b'\x41')
 FOTA_OP_CODE_SET_XON = bytearray(b'\x42')
 FOTA_OP_CODE_SET_FRAGMENT_ID = bytearray(b'\x43')
+FOTA_OP_CODE_RESUME = bytearray(b'\x80')
+FOTA_OP_CODE_START_DELTA = bytearray(b'\x81')
+FOTA_OP_CODE_START_COMPRESSED = bytearray(b'\x82')
+FOTA_OP_CODE_SYNC = bytearray(b'\x83')
+FOTA_OP_CODE_SELECT_SLOT = bytearray(b'\x84')
+FOTA_OP_CODE_PREPARE_SLOT = bytearray(b'\x85')
+FOTA_OP_CODE_START_ENCRYPTED = bytearray(b'\x86')
+
+# next_index (uint16), fragment_size (uint16), window (uint8), missing bitmap (uint32)
+FRAGMENT_STATUS_FORMAT = '<HHBI'
+
+# See fota_session_stats_t
+SESSION_STATS_FORMAT = '<IIIIIIIIIHIHH'
+SESSION_STATS_FIELDS = ('duration_ms', 'bytes_received', 'bytes_programmed',
+                        'program_count', 'program_min_us', 'program_avg_us', 'program_max_us',
+                        'erase_count', 'erase_ms', 'xoff_count', 'xoff_ms',
+                        'fragment_gaps', 'invalid_fragments')
+
+# See fota_stream_credit_t: bytes of the binary stream the client may have sent since the session started
+STREAM_CREDIT_FORMAT = '<I'
+
+# Size of the MCUboot image header, the device identifies interrupted sessions by its hash
+IMAGE_HEADER_SIZE = 32
+
+# ih_magic, ih_load_addr, ih_hdr_size, ih_protect_tlv_size, ih_img_size and ih_flags of the MCUboot image header
+IMAGE_HEADER_FORMAT = '<IIHHII'
+IMAGE_F_ENCRYPTED_AES128 = 0x04
+
+# MCUboot TLV info (magic, total size) and TLV header (type, length)
+IMAGE_TLV_INFO_FORMAT = '<HH'
+IMAGE_TLV_FORMAT = '<HH'
+IMAGE_TLV_INFO_MAGIC = 0x6907
+IMAGE_TLV_ENC_KW128 = 0x31
 
 FRAGMENT_SIZE = 128
 
@@ -89,6 +135,40 @@ def chunks(l, n):
         yield l[i:i+n]
 
 
+@functools.lru_cache(maxsize=None)
+def read_image(filename: str) -> bytes:
+    """
+    Reads an image, patch or compressed image once, so sessions to many devices share it
+    """
+    with open(filename, 'rb') as f:
+        return f.read()
+
+
+def get_wrapped_key(image: bytes) -> bytes:
+    """
+    Returns the wrapped key (ENC_KW128 TLV) of an image encrypted by imgtool
+    """
+    _, _, hdr_size, protect_tlv_size, img_size, flags = struct.unpack_from(IMAGE_HEADER_FORMAT, image)
+    if not flags & IMAGE_F_ENCRYPTED_AES128:
+        raise ValueError('the image is not encrypted with AES-128')
+
+    # The key is in the unprotected TLVs, after the protected ones
+    offset = hdr_size + img_size + protect_tlv_size
+    magic, tlv_tot = struct.unpack_from(IMAGE_TLV_INFO_FORMAT, image, offset)
+    if magic != IMAGE_TLV_INFO_MAGIC:
+        raise ValueError('the image has no TLVs')
+
+    end = offset + tlv_tot
+    offset += struct.calcsize(IMAGE_TLV_INFO_FORMAT)
+    while offset < end:
+        tlv_type, tlv_len = struct.unpack_from(IMAGE_TLV_FORMAT, image, offset)
+        offset += struct.calcsize(IMAGE_TLV_FORMAT)
+        if tlv_type == IMAGE_TLV_ENC_KW128:
+            return image[offset:offset + tlv_len]
+        offset += tlv_len
+    raise ValueError('the image has no ENC_KW128 TLV, was it encrypted with an AES key-wrap key?')
+
+
 def get_chunk_n(data, chunksize: int, n: int):
     start = chunksize*n
     end = chunksize*(n+1)
@@ -100,6 +180,26 @@ def get_chunk_n(data, chunksize: int, n: int):
     return data[start:end]
 
 
+async def wait_for_any(events, timeout: float) -> bool:
+    """
+    Waits until one of the events is set
+
+    :return: False if none was set within the timeout
+    """
+    waiters = [asyncio.ensure_future(event.wait()) for event in events]
+    done, pending = await asyncio.wait(waiters, timeout=timeout, return_when=asyncio.FIRST_COMPLETED)
+    for waiter in pending:
+        waiter.cancel()
+    return bool(done)
+
+
+class FOTASessionError(Exception):
+    """
+    The device ended the session with an error status, eg: the data to resume from didn't match its checkpoint
+    """
+    pass
+
+
 class StatusNotificationHandler:
 
     def __init__(self):
@@ -116,13 +216,44 @@ class StatusNotificationHandler:
         self.new_status_event.clear()
 
 
+class FragmentStatusNotificationHandler:
+
+    def __init__(self):
+        self.status = None
+        self.new_status_event = asyncio.Event()
+
+    def handle_fragment_status_notification(self, char_handle: int, data: bytearray):
+        self.status = struct.unpack_from(FRAGMENT_STATUS_FORMAT, data)
+        log.info(f'Fragment status notification: next index {self.status[0]}, missing {self.status[3]:#010x}')
+        self.new_status_event.set()
+
+
+class StreamCreditNotificationHandler:
+
+    def __init__(self):
+        self.limit = 0
+        self.new_credit_event = asyncio.Event()
+
+    def handle_stream_credit_notification(self, char_handle: int, data: bytearray):
+        limit, = struct.unpack_from(STREAM_CREDIT_FORMAT, data)
+        log.debug(f'Stream credit notification: limit {limit}')
+        # The device never takes credit back, an older value read in the meantime may arrive late
+        self.limit = max(self.limit, limit)
+        self.new_credit_event.set()
+
+
 class FOTASession:
 
     def __init__(self, client: BleakClient):
         self.client = client
         self.handler = StatusNotificationHandler()
+        self.fragment_handler = FragmentStatusNotificationHandler()
+        self.credit_handler = StreamCreditNotificationHandler()
         self.fragment_id = 0
         self.rollover_counter = 0
+        # Progress of the transfer, in bytes of the file being sent
+        self.bytes_sent = 0
+        self.total_size = 0
 
     def update_fragment_id(self, fragment_id):
         # Account for rollover
@@ -134,12 +265,95 @@ class FOTASession:
         if self.fragment_id < 0:
             self.fragment_id = 0
 
-    async def start(self):
+    async def get_resume_offset(self, filename: str) -> int:
+        """
+        Checks whether the device has an interrupted FOTA session for the given image
+
+        :return: offset to resume sending the image from, 0 if there is nothing to resume
+        """
+        ext_svc = self.client.services.get_service(UUID_FOTA_EXTENSION_SERVICE)
+        if not ext_svc:
+            return 0
+
+        data = read_image(filename)
+
+        info = await self.client.read_gatt_char(UUID_SESSION_INFO_CHAR)
+        resume_offset, resume_crc = struct.unpack_from('<II', info)
+        header_hash = bytes(info[8:40])
+        if resume_offset == 0 or resume_offset > len(data):
+            return 0
+
+        if header_hash != hashlib.sha256(data[:IMAGE_HEADER_SIZE]).digest() or \
+                resume_crc != zlib.crc32(data[:resume_offset]):
+            log.info('Interrupted FOTA session was for a different image, starting over')
+            return 0
+
+        return resume_offset
+
+    async def verify_transfer(self, image_filename: str) -> bool:
+        """
+        Compares the size and CRC32 of what the device has written with the image
+
+        For delta and compressed sessions the device may still be rebuilding the
+        image from what was sent, so the transfer status is polled until it has
+        caught up.
+
+        :return: False if the device wrote something else than the image
+        """
+        ext_svc = self.client.services.get_service(UUID_FOTA_EXTENSION_SERVICE)
+        if not ext_svc or not ext_svc.get_characteristic(UUID_TRANSFER_STATUS_CHAR):
+            return True
+
+        image = read_image(image_filename)
+
+        size = crc = 0
+        for _ in range(MAXIMUM_RETRIES):
+            await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_SYNC, True)
+            status = await self.client.read_gatt_char(UUID_TRANSFER_STATUS_CHAR)
+            size, crc = struct.unpack_from('<II', status)
+            if size >= len(image):
+                break
+            await asyncio.sleep(0.5)
+
+        if size != len(image) or crc != zlib.crc32(image):
+            log.error(f'Device wrote {size} bytes with CRC32 0x{crc:08X}, '
+                      f'expected {len(image)} bytes with CRC32 0x{zlib.crc32(image):08X}')
+            return False
+
+        log.info(f'Device wrote {size} bytes with matching CRC32 0x{crc:08X}')
+        await self.log_session_stats()
+        return True
+
+    async def log_session_stats(self):
+        """
+        Logs the device's performance counters for the session, as of the last SYNC
+        """
+        ext_svc = self.client.services.get_service(UUID_FOTA_EXTENSION_SERVICE)
+        if not ext_svc or not ext_svc.get_characteristic(UUID_SESSION_STATS_CHAR):
+            return
+
+        data = await self.client.read_gatt_char(UUID_SESSION_STATS_CHAR)
+        stats = dict(zip(SESSION_STATS_FIELDS, struct.unpack_from(SESSION_STATS_FORMAT, data)))
+        log.info('Session stats: ' + ', '.join(f'{name}={value}' for name, value in stats.items()))
+
+    async def select_slot(self, image_id: int):
+        """
+        Selects the slot (by image ID) the next session writes to, image 0 being the application
+        """
+        await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_SELECT_SLOT + bytes([image_id]), True)
+
+    async def prepare_slot(self, image_id: int):
+        """
+        Makes the device start erasing a slot, so a later session to it can start right away
+        """
+        await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_PREPARE_SLOT + bytes([image_id]), True)
+
+    async def start(self, op_code: bytearray = FOTA_OP_CODE_START):
         # Subscribe to notifications from the status characteristic
         await self.client.start_notify(UUID_STATUS_CHAR, self.handler.handle_status_notification)
 
-        # Start a FOTA session
-        await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_START, True)
+        # Start (or resume) a FOTA session
+        await self.client.write_gatt_char(UUID_CONTROL_CHAR, op_code, True)
 
         # Wait for the client to write XON to the status characteristic
         timeout_counter = 0
@@ -153,6 +367,9 @@ class FOTASession:
                     break
                 elif status_code == FOTA_STATUS_XOFF:
                     log.info(f'Received XOFF status notification')
+                elif status_code[0] >= FOTA_STATUS_UNSPECIFIED_ERROR[0]:
+                    # A resumed session is only started once the data already written is checked
+                    raise FOTASessionError(f'FOTA session failed to start (status {status_code[0]})')
                 else:
                     log.warning(f'Received unknown type of status notification ({status_code[0]})')
             except asyncio.TimeoutError:
@@ -164,12 +381,46 @@ class FOTASession:
 
         # FOTA session started
 
-    async def transfer_binary(self, filename: str):
+    async def transfer_binary(self, filename: str, offset: int = 0, image_filename: str = None) -> bool:
         start_time = time.time()
-        data = None
-        with open(filename, 'rb') as f:
-            data = f.read()
+        data = read_image(filename)
+
+        # Fragment IDs restart from 0 at the resume offset
+        total_size = len(data)
+        data = data[offset:]
+        self.total_size = total_size
+        self.bytes_sent = offset
+
+        ext_svc = self.client.services.get_service(UUID_FOTA_EXTENSION_SERVICE)
+        if ext_svc and ext_svc.get_characteristic(UUID_STREAM_CREDIT_CHAR):
+            if not await self.send_binary_with_credits(data, offset, total_size, start_time):
+                return False
+        else:
+            await self.send_binary_paced(data, offset, total_size, start_time)
+
+        # Send is "complete" now, explicitly read the status characteristic
+        # to check for an out-of-sync condition before we commit the update
+        status = await self.client.read_gatt_char(UUID_STATUS_CHAR)
+        # The status stays SYNC LOST once the stream was rewound, what matters is the fragment ID expected
+        if status[0:1] == FOTA_STATUS_SYNC_LOST and status[1] != self.fragment_id:
+            log.warning(f'Transfer ended with sync lost condition!')
+            self.update_fragment_id(status[1])
+            # TODO restart binary transfer from sync lost fragment ID
+
+        if not await self.verify_transfer(image_filename or filename):
+            log.error('Transfer verification failed, not committing')
+            await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_STOP, True)
+            return False
 
+        # Now we're actually done, commit the update
+        await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_COMMIT, True)
+        return True
+
+    async def send_binary_paced(self, data: bytes, offset: int, total_size: int, start_time: float):
+        """
+        Sends the binary stream to devices that don't grant stream credit,
+        pausing between packets and on XOFF
+        """
         send_complete = False
         flow_paused = False
         while not send_complete:
@@ -196,13 +447,15 @@ class FOTASession:
                     self.update_fragment_id(fragment_id)
 
             if flow_paused:
+                # Let the notifications come in
+                await asyncio.sleep(0.01)
                 continue
 
             # Send the next packet
             packet_number = 256*self.rollover_counter + self.fragment_id
             binary_data = bytearray(get_chunk_n(data, FRAGMENT_SIZE, packet_number))
-            bytes_sent = (packet_number)*FRAGMENT_SIZE + len(binary_data)
-            log.info(f'Sending packet #{packet_number} (bytes sent: {bytes_sent}/{len(data)}, '
+            bytes_sent = offset + (packet_number)*FRAGMENT_SIZE + len(binary_data)
+            log.info(f'Sending packet #{packet_number} (bytes sent: {bytes_sent}/{total_size}, '
                      f'elapsed time: {(time.time() - start_time)*1000} ms)')
             # Prepend the fragment ID
             payload = bytearray([self.fragment_id])
@@ -217,6 +470,7 @@ class FOTASession:
             try:
                 await asyncio.wait_for(self.client.write_gatt_char(UUID_BINARY_STREAM_CHAR, payload, False),
                                        timeout=0.025)
+                self.bytes_sent = bytes_sent
                 await asyncio.sleep(0.075)
             except asyncio.TimeoutError as e:
                 log.warning(f'timeout error occurred while writing bds char')
@@ -227,16 +481,197 @@ class FOTASession:
                 self.rollover_counter += 1
                 self.fragment_id = 0
 
-        # Send is "complete" now, explicitly read the status characteristic
-        # to check for an out-of-sync condition before we commit the update
+    async def send_binary_with_credits(self, data: bytes, offset: int, total_size: int, start_time: float) -> bool:
+        """
+        Sends the binary stream, keeping as many packets in flight as the device has granted credit for
+
+        The device sizes the credit from the free space in its staging buffers, so
+        packets are written back to back without waiting for a response, and the
+        sender only waits when it has used up its credit.
+        """
+        await self.client.start_notify(UUID_STREAM_CREDIT_CHAR, self.credit_handler.handle_stream_credit_notification)
+        self.credit_handler.handle_stream_credit_notification(
+            0, await self.client.read_gatt_char(UUID_STREAM_CREDIT_CHAR))
+
+        while True:
+            if self.handler.new_status_event.is_set():
+                self.handler.new_status_event.clear()
+                # XON and XOFF are superseded by the credit, only an out of sync stream or an error matter
+                status_code = self.handler.status_val[0:1]
+                if status_code == FOTA_STATUS_SYNC_LOST:
+                    fragment_id = self.handler.status_val[1]
+                    log.info(f'Received FOTA status SYNC LOST notification (sync lost at fragment ID: '
+                             f'{fragment_id})')
+                    self.update_fragment_id(fragment_id)
+                elif status_code not in (FOTA_STATUS_OK, FOTA_STATUS_XOFF, FOTA_STATUS_XON):
+                    log.error(f'Received FOTA status {status_code[0]}, aborting')
+                    return False
+
+            # Credit is counted in bytes of the stream, without the fragment IDs
+            packet_number = 256*self.rollover_counter + self.fragment_id
+            binary_data = bytearray(get_chunk_n(data, FRAGMENT_SIZE, packet_number))
+            if len(binary_data) == 0:
+                # Nothing comes after the last packets to show the device they were lost
+                if await self.resync_binary_stream():
+                    continue
+                return True
+
+            sent = packet_number*FRAGMENT_SIZE
+            if sent + len(binary_data) > self.credit_handler.limit:
+                self.credit_handler.new_credit_event.clear()
+                # A SYNC LOST notification rewinds the stream, the credit won't grow until it's handled
+                if not await wait_for_any((self.credit_handler.new_credit_event, self.handler.new_status_event),
+                                          timeout=1.0):
+                    # In case a notification was missed, or the packets in flight were all lost
+                    log.warning(f'No stream credit after {sent} bytes, reading it again')
+                    self.credit_handler.handle_stream_credit_notification(
+                        0, await self.client.read_gatt_char(UUID_STREAM_CREDIT_CHAR))
+                    await self.resync_binary_stream()
+                continue
+
+            log.debug(f'Sending packet #{packet_number} (bytes sent: {offset + sent + len(binary_data)}/{total_size}, '
+                      f'credit: {self.credit_handler.limit}, elapsed time: {(time.time() - start_time)*1000} ms)')
+            payload = bytearray([self.fragment_id])
+            payload += binary_data
+            await self.client.write_gatt_char(UUID_BINARY_STREAM_CHAR, payload, False)
+            self.bytes_sent = offset + sent + len(binary_data)
+
+            self.fragment_id += 1
+            if self.fragment_id >= 256:
+                self.rollover_counter += 1
+                self.fragment_id = 0
+
+    async def resync_binary_stream(self) -> bool:
+        """
+        Rewinds the binary stream to the fragment ID the device expects, if it isn't the next one to send
+
+        :return: True if the stream was rewound
+        """
         status = await self.client.read_gatt_char(UUID_STATUS_CHAR)
-        if status[0:1] == FOTA_STATUS_SYNC_LOST:
-            log.warning(f'Transfer ended with sync lost condition!')
-            self.update_fragment_id(status[1])
-            # TODO restart binary transfer from sync lost fragment ID
+        if status[1] == self.fragment_id:
+            return False
+
+        log.info(f'Device expects fragment ID {status[1]}, resending from there')
+        self.update_fragment_id(status[1])
+        return True
+
+    async def transfer_fragments(self, filename: str, offset: int = 0, image_filename: str = None) -> bool:
+        """
+        Sends the binary as indexed fragments through the FOTA extension service
+
+        Fragments the device reports missing are resent as soon as it notices the
+        gap, rather than rewinding the whole stream. Before committing, the device
+        is asked for its fragment status until it has received every fragment.
+        """
+        start_time = time.time()
+        data = read_image(filename)
+
+        # Fragment indexes restart from 0 at the resume offset
+        total_size = len(data)
+        data = data[offset:]
+        self.total_size = total_size
+        self.bytes_sent = offset
+
+        status = await self.client.read_gatt_char(UUID_FRAGMENT_STATUS_CHAR)
+        # The device picks the fragment size from the negotiated ATT MTU and data length
+        self.fragment_handler.status = struct.unpack_from(FRAGMENT_STATUS_FORMAT, status)
+        _, fragment_size, window, _ = self.fragment_handler.status
+        log.info(f'ATT MTU: {self.client.mtu_size}, fragment size: {fragment_size}, window: {window}')
+        fragments = list(chunks(data, fragment_size))
+        await self.client.start_notify(UUID_FRAGMENT_STATUS_CHAR,
+                                       self.fragment_handler.handle_fragment_status_notification)
+
+        async def send_fragment(n: int):
+            payload = struct.pack('<H', n & 0xFFFF) + fragments[n]
+            await self.client.write_gatt_char(UUID_FRAGMENT_STREAM_CHAR, payload, False)
+
+        def next_fragment(sent: int, next_index: int) -> int:
+            # The device only reports the low 16 bits of the index, which can't be ahead of what was sent
+            return sent - ((sent - next_index) & 0xFFFF)
+
+        async def resend_missing(sent: int):
+            next_index, _, _, missing = self.fragment_handler.status
+            base = next_fragment(sent, next_index)
+            for bit in range(missing.bit_length()):
+                if missing & (1 << bit) and base + bit < len(fragments):
+                    log.info(f'Resending fragment #{base + bit}')
+                    await send_fragment(base + bit)
+
+        async def sync_fragments(sent: int) -> Optional[int]:
+            """
+            Asks the device for its fragment status, and resends the window it is missing
+
+            :return: the next fragment the device expects, None if it didn't answer
+            """
+            self.fragment_handler.new_status_event.clear()
+            await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_SYNC, True)
+            try:
+                await asyncio.wait_for(self.fragment_handler.new_status_event.wait(), timeout=1.0)
+            except asyncio.TimeoutError:
+                return None
+            self.fragment_handler.new_status_event.clear()
+
+            base = next_fragment(sent, self.fragment_handler.status[0])
+            if base < sent:
+                # Fragments after the highest one received aren't in the bitmap, resend the whole window
+                log.info(f'Device is missing fragments from #{base}, resending them')
+                for m in range(base, min(base + window, sent)):
+                    await send_fragment(m)
+            return base
+
+        n = 0
+        flow_paused = False
+        while n < len(fragments):
+            if self.handler.new_status_event.is_set():
+                self.handler.new_status_event.clear()
+                if self.handler.status_val[0:1] == FOTA_STATUS_XOFF:
+                    log.info('Received FOTA status XOFF notification')
+                    flow_paused = True
+                elif self.handler.status_val[0:1] == FOTA_STATUS_XON:
+                    log.info('Received FOTA status XON notification')
+                    flow_paused = False
+                elif self.handler.status_val[0:1] != FOTA_STATUS_OK:
+                    log.error(f'Received FOTA status {self.handler.status_val[0]}, aborting')
+                    return False
+
+            if self.fragment_handler.new_status_event.is_set():
+                self.fragment_handler.new_status_event.clear()
+                await resend_missing(n)
+
+            if flow_paused:
+                await asyncio.sleep(0.01)
+                continue
+
+            # Fragments past the window are dropped, the device notifies its status as the window slides
+            if n >= next_fragment(n, self.fragment_handler.status[0]) + window:
+                if not await wait_for_any((self.fragment_handler.new_status_event, self.handler.new_status_event),
+                                          timeout=1.0):
+                    # The fragments in flight may all have been lost, leaving the device no gap to report
+                    await sync_fragments(n)
+                continue
+
+            log.info(f'Sending fragment #{n} (bytes sent: {offset + n*fragment_size + len(fragments[n])}/{total_size}, '
+                     f'elapsed time: {(time.time() - start_time)*1000} ms)')
+            await send_fragment(n)
+            self.bytes_sent = offset + n*fragment_size + len(fragments[n])
+            n += 1
+
+        # Make sure the last fragments made it before committing
+        for _ in range(MAXIMUM_RETRIES):
+            base = await sync_fragments(n)
+            if base is not None and base >= len(fragments):
+                break
+        else:
+            log.error('Device did not receive every fragment, not committing')
+            return False
+
+        if not await self.verify_transfer(image_filename or filename):
+            log.error('Transfer verification failed, not committing')
+            await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_STOP, True)
+            return False
 
-        # Now we're actually done, commit the update
         await self.client.write_gatt_char(UUID_CONTROL_CHAR, FOTA_OP_CODE_COMMIT, True)
+        return True
 
     async def get_firmware_revision(self) -> (str, Union[str, None]):
         """
@@ -266,10 +701,86 @@ class FOTASession:
         return fw_rev_str, fw_rev_desc_str
 
 
+def add_update_arguments(parser: argparse.ArgumentParser):
+    """
+    Adds the options selecting what is sent to the device and how
+    """
+    parser.add_argument("--image", default='../OUTPUTS/signed-update.bin', help="signed update image, delta and compressed transfers are checked against it")
+    stream = parser.add_mutually_exclusive_group()
+    stream.add_argument("--patch", help="send a delta patch (see make_delta_patch.py) instead of the full image")
+    stream.add_argument("--compressed", help="send a compressed image (see compress_image.py) instead of the full image")
+    stream.add_argument("--encrypted", action='store_true',
+                        help="the image is encrypted (imgtool sign --encrypt), the device decrypts it to verify it")
+    parser.add_argument("--selective-repeat", action='store_true',
+                        help="send indexed fragments through the FOTA extension service, only resending lost ones")
+    parser.add_argument("--slot", type=int, default=0,
+                        help="image ID of the slot to update, 0 being the application")
+    parser.add_argument("--prepare-slot", type=int, action='append', default=[],
+                        help="image ID of a slot to erase while this image is sent, eg: the next one to update")
+
+
+async def start_update(session: FOTASession, args) -> int:
+    """
+    Starts the FOTA session selected by the update arguments
+
+    :return: offset the image is sent from, non-zero when an interrupted session is resumed
+    :raises asyncio.TimeoutError: if the device did not start the session
+    :raises ValueError: if an encrypted session is requested for an image that isn't
+    """
+    update_filename = args.patch or args.compressed or args.image
+    # Encrypted sessions are started and resumed with the key the image was encrypted with
+    wrapped_key = get_wrapped_key(read_image(args.image)) if args.encrypted else b''
+    # Only sessions of the application image can be resumed
+    resume_offset = 0 if (args.patch or args.compressed or args.slot) else \
+        await session.get_resume_offset(update_filename)
+
+    if args.slot:
+        log.info(f'Selecting the slot of image {args.slot}')
+        await session.select_slot(args.slot)
+    if args.patch:
+        log.info('Starting delta FOTA session')
+        await session.start(FOTA_OP_CODE_START_DELTA)
+    elif args.compressed:
+        log.info('Starting compressed FOTA session')
+        await session.start(FOTA_OP_CODE_START_COMPRESSED)
+    elif resume_offset:
+        log.info(f'Resuming interrupted FOTA session at offset {resume_offset}')
+        await session.start(FOTA_OP_CODE_RESUME + wrapped_key)
+    elif args.encrypted:
+        log.info('Starting encrypted FOTA session')
+        await session.start(FOTA_OP_CODE_START_ENCRYPTED + wrapped_key)
+    else:
+        await session.start()
+
+    for image_id in args.prepare_slot:
+        log.info(f'Preparing the slot of image {image_id}')
+        await session.prepare_slot(image_id)
+
+    return resume_offset
+
+
+async def send_update(session: FOTASession, args, offset: int) -> bool:
+    """
+    Sends the update selected by the update arguments and commits it
+
+    :return: False if the update was not committed
+    """
+    update_filename = args.patch or args.compressed or args.image
+    if args.selective_repeat:
+        return await session.transfer_fragments(update_filename, offset, args.image)
+    return await session.transfer_binary(update_filename, offset, args.image)
+
+
 # TODO handle multiple FOTA services on one server
 async def main():
+    parser = argparse.ArgumentParser(description="Update FOTADemo over BLE")
+    add_update_arguments(parser)
+    parser.add_argument("--emulator", metavar="HOST:PORT",
+                        help="update the host emulator (see tests/UNITTESTS/FOTAEmulator) instead of a board")
+    args = parser.parse_args()
+
     logging.basicConfig(level=logging.DEBUG)
-    client_allocator = ClientAllocator()
+    client_allocator = EmulatorClientAllocator(args.emulator) if args.emulator else ClientAllocator()
     client = await client_allocator.allocate("FOTADemo")
     if not client:
         log.error("could not connect to FOTADemo")
@@ -281,18 +792,30 @@ async def main():
             (f' for device "{dev_str.decode("utf-8")}"' if dev_str else ''))
 
     try:
-        await session.start()
+        resume_offset = await start_update(session, args)
     except asyncio.TimeoutError:
         log.error("FOTA session failed to start within timeout period")
         await client_allocator.release(client)
         return
+    except ValueError as e:
+        log.error(f"can not send {args.image} encrypted: {e}")
+        await client_allocator.release(client)
+        return
+    except FOTASessionError as e:
+        log.error(e)
+        await client_allocator.release(client)
+        return
 
     log.info("FOTA session started successfully")
 
     # Send the binary
     log.info("starting firmware binary transfer")
-    await session.transfer_binary('../OUTPUTS/signed-update.bin')
+    await send_update(session, args, resume_offset)
     await client_allocator.release(client)
+    if args.slot:
+        # The application keeps running, there is no new firmware revision to check
+        log.info(f'FOTA session complete, image {args.slot} written to its slot')
+        return
     log.info("FOTA session complete, waiting for device to apply update...")
     for i in range(0, MAXIMUM_RETRIES):
         await asyncio.sleep(5.0)
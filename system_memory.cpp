@@ -18,15 +18,48 @@
  */
 
 #include "secondary_bd.h"
+#include "system_memory.h"
 
 #include "blockdevice/SlicingBlockDevice.h"
+#include "FlashIAP/FlashIAPBlockDevice.h"
+#include "platform/mbed_toolchain.h"
+
+/* Size of the secondary slot, one sector larger than the primary slot with swap-offset */
+#define SECONDARY_SLOT_SIZE (MCUBOOT_SLOT_SIZE + MBED_CONF_APP_FOTA_SLOT_IMAGE_OFFSET)
 
 /* mcuboot update BlockDevice hook */
 mbed::BlockDevice* get_secondary_bd(void) {
     mbed::BlockDevice* default_bd = mbed::BlockDevice::get_default_instance();
-    static mbed::SlicingBlockDevice sliced_bd(default_bd, 0x0, MCUBOOT_SLOT_SIZE);
+    static mbed::SlicingBlockDevice sliced_bd(default_bd, 0x0, SECONDARY_SLOT_SIZE);
     return &sliced_bd;
 }
 
+/* Where the FOTA handler writes the image, past the spare sector with swap-offset */
+mbed::BlockDevice* get_update_bd(void) {
+#if MBED_CONF_APP_FOTA_SLOT_IMAGE_OFFSET
+    static mbed::SlicingBlockDevice sliced_bd(get_secondary_bd(),
+            MBED_CONF_APP_FOTA_SLOT_IMAGE_OFFSET, SECONDARY_SLOT_SIZE);
+    return &sliced_bd;
+#else
+    return get_secondary_bd();
+#endif
+}
 
+/* Primary slot BlockDevice, delta patches copy from the running image */
+mbed::BlockDevice* get_primary_bd(void) {
+    static FlashIAPBlockDevice primary_bd(MCUBOOT_PRIMARY_SLOT_ADDRESS, MCUBOOT_SLOT_SIZE);
+    return &primary_bd;
+}
 
+/* FOTA checkpoint BlockDevice, right after the update slot */
+mbed::BlockDevice* get_checkpoint_bd(void) {
+    mbed::BlockDevice* default_bd = mbed::BlockDevice::get_default_instance();
+    static mbed::SlicingBlockDevice sliced_bd(default_bd, SECONDARY_SLOT_SIZE,
+            SECONDARY_SLOT_SIZE + MBED_CONF_APP_FOTA_CHECKPOINT_SIZE);
+    return &sliced_bd;
+}
+
+/* Update slots of other images, none unless the board overrides this */
+MBED_WEAK mbed::BlockDevice* get_image_slot_bd(uint8_t image_id) {
+    return nullptr;
+}
@@ -0,0 +1,66 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef SYSTEM_MEMORY_H_
+#define SYSTEM_MEMORY_H_
+
+#include "blockdevice/BlockDevice.h"
+
+#include <stdint.h>
+
+#ifndef MBED_CONF_APP_FOTA_CHECKPOINT_SIZE
+#define MBED_CONF_APP_FOTA_CHECKPOINT_SIZE 0x1000
+#endif
+
+#ifndef MBED_CONF_APP_FOTA_SLOT_IMAGE_OFFSET
+#define MBED_CONF_APP_FOTA_SLOT_IMAGE_OFFSET 0
+#endif
+
+/**
+ * Region of the secondary slot the update image is written to
+ *
+ * With MCUboot's swap-offset layout (no scratch area), the secondary slot
+ * is one sector larger than the primary slot and the image starts at its
+ * second sector. Otherwise this is the whole secondary slot. Either way, the
+ * MCUboot trailer is at the end of it.
+ */
+mbed::BlockDevice* get_update_bd(void);
+
+/**
+ * Primary (running) slot in internal flash, the source delta patches are applied against
+ */
+mbed::BlockDevice* get_primary_bd(void);
+
+/**
+ * Region reserved for FOTA session checkpoints, placed right after the
+ * secondary (update) slot on the default BlockDevice
+ *
+ * @note Checkpoints record addresses in the update BlockDevice
+ */
+mbed::BlockDevice* get_checkpoint_bd(void);
+
+/**
+ * Update slot of an image other than the application (image 0), eg: a
+ * co-processor image or an asset partition
+ *
+ * Returns nullptr by default, boards with other images override it.
+ */
+mbed::BlockDevice* get_image_slot_bd(uint8_t image_id);
+
+#endif /* SYSTEM_MEMORY_H_ */
@@ -0,0 +1,386 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "BlockDeviceFOTAEventHandler.h"
+#include "FOTACheckpointStore.h"
+#include "FOTAExtensionService.h"
+#include "ble-service-fota/FOTAService.h"
+#include "events/EventQueue.h"
+#include "blockdevice/HeapBlockDevice.h"
+#include "platform/Span.h"
+
+#include "bootutil/image.h"
+#include "mbedtls/sha256.h"
+
+#include <string.h>
+#include <vector>
+
+#define SLOT_SIZE 0x40000
+#define CHECKPOINT_BD_SIZE 0x1000
+#define BD_READ_SIZE 1
+#define BD_PROGRAM_SIZE 4
+#define BD_ERASE_SIZE 0x1000
+#define BD_ERASE_VALUE 0xFF
+
+/* Past the first checkpoint, which is taken at the checkpoint interval */
+#define IMAGE_BODY_SIZE (MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL + 0x8000)
+#define INTERRUPTED_SIZE (MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL + 0x4000)
+
+/* Binary stream payload of each write */
+#define PACKET_SIZE 128
+
+/**
+ * HeapBlockDevice that actually erases
+ */
+class ErasingBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+    ErasingBlockDevice(bd_size_t size) :
+        mbed::HeapBlockDevice(size, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE) {
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override {
+        uint8_t blank[BD_ERASE_SIZE];
+        memset(blank, BD_ERASE_VALUE, sizeof(blank));
+        for(bd_size_t offset = 0; offset < size; offset += BD_ERASE_SIZE) {
+            int err = mbed::HeapBlockDevice::program(blank, addr + offset, BD_ERASE_SIZE);
+            if(err) {
+                return err;
+            }
+        }
+        return BD_ERROR_OK;
+    }
+
+    int get_erase_value() const override {
+        return BD_ERASE_VALUE;
+    }
+};
+
+/**
+ * FOTAExtensionService whose link parameters are set by the test
+ */
+class TestFOTAExtensionService : public FOTAExtensionService
+{
+public:
+    TestFOTAExtensionService(ChainableGapEventHandler &chainable_gap_eh,
+            ChainableGattServerEventHandler &chainable_gatt_server_eh) :
+            FOTAExtensionService(BLE::Instance(), chainable_gap_eh, chainable_gatt_server_eh) {
+    }
+
+    /** Negotiate the given ATT MTU, with the largest LL data length */
+    void negotiate(uint16_t att_mtu) {
+        onAttMtuChange(0, att_mtu);
+        onDataLengthChange(0, 251, 251);
+    }
+
+    const fota_fragment_status_t &get_fragment_status() const {
+        return _fragment_status;
+    }
+};
+
+class TestBlockDeviceFOTAEventHandler : public testing::Test {
+
+protected:
+
+    TestBlockDeviceFOTAEventHandler() : bd(SLOT_SIZE), checkpoint_bd(CHECKPOINT_BD_SIZE),
+            checkpoint_store(checkpoint_bd), ext_svc(chainable_gap_eh, chainable_gatt_server_eh),
+            handler(bd, queue, flash_queue) {
+    }
+
+    virtual void SetUp()
+    {
+        bd.init();
+        checkpoint_bd.init();
+        checkpoint_bd.erase(0, CHECKPOINT_BD_SIZE);
+        ASSERT_EQ(checkpoint_store.init(), 0);
+        handler.set_checkpoint_store(&checkpoint_store);
+        image = make_image();
+    }
+
+    virtual void TearDown()
+    {
+        checkpoint_bd.deinit();
+        bd.deinit();
+    }
+
+    /** MCUboot image with a SHA-256 TLV */
+    std::vector<uint8_t> make_image() {
+        struct image_header header;
+        memset(&header, 0, sizeof(header));
+        header.ih_magic = IMAGE_MAGIC;
+        header.ih_hdr_size = sizeof(header);
+        header.ih_img_size = IMAGE_BODY_SIZE;
+
+        std::vector<uint8_t> image(sizeof(header) + IMAGE_BODY_SIZE);
+        memcpy(image.data(), &header, sizeof(header));
+        for(size_t i = sizeof(header); i < image.size(); i++) {
+            image[i] = (uint8_t) ((i * 11) ^ (i >> 10));
+        }
+
+        uint8_t hash[32];
+        mbedtls_sha256_ret(image.data(), image.size(), hash, 0);
+
+        struct image_tlv_info info = { IMAGE_TLV_INFO_MAGIC, sizeof(struct image_tlv_info) + sizeof(struct image_tlv) + sizeof(hash) };
+        struct image_tlv tlv = { IMAGE_TLV_SHA256, sizeof(hash) };
+        image.insert(image.end(), (uint8_t *) &info, (uint8_t *) &info + sizeof(info));
+        image.insert(image.end(), (uint8_t *) &tlv, (uint8_t *) &tlv + sizeof(tlv));
+        image.insert(image.end(), hash, hash + sizeof(hash));
+        return image;
+    }
+
+    GattAuthCallbackReply_t control(uint8_t op) {
+        return handler.on_control_written(svc, mbed::make_const_Span(&op, 1));
+    }
+
+    /** Dispatch both queues until neither has anything left to do */
+    void run_events() {
+        while(!queue.empty() || !flash_queue.empty()) {
+            flash_queue.dispatch_once();
+            queue.dispatch_once();
+        }
+    }
+
+    /** Send part of the image, waiting for XON the way the client does */
+    void send(size_t from, size_t to) {
+        for(size_t offset = from; offset < to; offset += PACKET_SIZE) {
+            while(svc.xoff && (!queue.empty() || !flash_queue.empty())) {
+                flash_queue.dispatch_once();
+                queue.dispatch_once();
+            }
+            ASSERT_FALSE(svc.xoff) << "stuck in XOFF at " << offset;
+
+            size_t size = ((to - offset) < PACKET_SIZE) ? (to - offset) : PACKET_SIZE;
+            ASSERT_EQ(handler.on_binary_stream_written(svc, mbed::make_const_Span(image.data() + offset, size)),
+                    FOTAService::FOTA_STATUS_OK);
+        }
+        run_events();
+    }
+
+    /** Send the start of the image and drop the session, leaving a checkpoint behind */
+    void interrupt_session() {
+        ASSERT_EQ(control(FOTAService::FOTA_START), AUTH_CALLBACK_REPLY_SUCCESS);
+        send(0, INTERRUPTED_SIZE);
+        ASSERT_EQ(control(FOTAService::FOTA_STOP), AUTH_CALLBACK_REPLY_SUCCESS);
+        run_events();
+
+        fota_checkpoint_t checkpoint;
+        ASSERT_TRUE(checkpoint_store.load(checkpoint));
+        ASSERT_EQ(checkpoint.committed, (uint32_t) MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL);
+    }
+
+    events::EventQueue queue;
+    events::EventQueue flash_queue;
+    ErasingBlockDevice bd;
+    ErasingBlockDevice checkpoint_bd;
+    FOTACheckpointStore checkpoint_store;
+    FOTAService svc;
+    ChainableGapEventHandler chainable_gap_eh;
+    ChainableGattServerEventHandler chainable_gatt_server_eh;
+    TestFOTAExtensionService ext_svc;
+    BlockDeviceFOTAEventHandler handler;
+    std::vector<uint8_t> image;
+};
+
+/**
+ * The RESUME write is acknowledged straight away, the checkpointed data is
+ * read back from the flash queue a page at a time before XON is sent
+ */
+TEST_F(TestBlockDeviceFOTAEventHandler, test_resume)
+{
+    interrupt_session();
+
+    ASSERT_EQ(control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME), AUTH_CALLBACK_REPLY_SUCCESS);
+    ASSERT_TRUE(svc.session_started);
+    ASSERT_TRUE(handler.is_session_active());
+    ASSERT_TRUE(svc.xoff);
+
+    /* Nothing is accepted until the checkpointed data is checked */
+    ASSERT_NE(handler.on_binary_stream_written(svc,
+            mbed::make_const_Span(image.data() + MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL, PACKET_SIZE)),
+            FOTAService::FOTA_STATUS_OK);
+
+    unsigned flash_events = 0;
+    while(svc.xoff && !flash_queue.empty()) {
+        flash_queue.dispatch_once();
+        flash_events++;
+        queue.dispatch_once();
+    }
+    ASSERT_GE(flash_events, (unsigned) (MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL / MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE));
+    run_events();
+    ASSERT_FALSE(svc.xoff);
+
+    send(MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL, image.size());
+    ASSERT_EQ(control(FOTAService::FOTA_COMMIT), AUTH_CALLBACK_REPLY_SUCCESS);
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_OK);
+
+    std::vector<uint8_t> readback(image.size());
+    ASSERT_EQ(bd.read(readback.data(), 0, readback.size()), 0);
+    ASSERT_EQ(readback, image);
+}
+
+/**
+ * The session ends with a validation failure if the data doesn't match the
+ * checkpoint, which is then discarded
+ */
+TEST_F(TestBlockDeviceFOTAEventHandler, test_resume_mismatch)
+{
+    interrupt_session();
+
+    uint8_t corrupt[BD_PROGRAM_SIZE];
+    memcpy(corrupt, image.data() + 0x100, sizeof(corrupt));
+    corrupt[0] ^= 0xFF;
+    ASSERT_EQ(bd.program(corrupt, 0x100, sizeof(corrupt)), 0);
+
+    ASSERT_EQ(control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME), AUTH_CALLBACK_REPLY_SUCCESS);
+    unsigned xon_count = svc.xon_count;
+    run_events();
+
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_VALIDATION_FAILURE);
+    ASSERT_EQ(svc.xon_count, xon_count);
+    ASSERT_FALSE(svc.session_started);
+    ASSERT_FALSE(handler.is_session_active());
+
+    fota_checkpoint_t checkpoint;
+    ASSERT_FALSE(checkpoint_store.load(checkpoint));
+}
+
+/**
+ * Stopping the session while the checkpointed data is read back drops the
+ * reads in flight, and the checkpoint is kept for another attempt
+ */
+TEST_F(TestBlockDeviceFOTAEventHandler, test_stop_during_replay)
+{
+    interrupt_session();
+
+    ASSERT_EQ(control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME), AUTH_CALLBACK_REPLY_SUCCESS);
+    flash_queue.dispatch_once();
+    queue.dispatch_once();
+
+    ASSERT_EQ(control(FOTAService::FOTA_STOP), AUTH_CALLBACK_REPLY_SUCCESS);
+    unsigned xon_count = svc.xon_count;
+    run_events();
+
+    ASSERT_EQ(svc.xon_count, xon_count);
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_OK);
+
+    fota_checkpoint_t checkpoint;
+    ASSERT_TRUE(checkpoint_store.load(checkpoint));
+
+    /* A fresh session isn't disturbed by what the replay left behind */
+    ASSERT_EQ(control(FOTAService::FOTA_START), AUTH_CALLBACK_REPLY_SUCCESS);
+    send(0, image.size());
+    ASSERT_EQ(control(FOTAService::FOTA_COMMIT), AUTH_CALLBACK_REPLY_SUCCESS);
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_OK);
+}
+
+/**
+ * Committing before the session resumed fails without discarding the checkpoint
+ */
+TEST_F(TestBlockDeviceFOTAEventHandler, test_commit_during_replay)
+{
+    interrupt_session();
+
+    ASSERT_EQ(control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME), AUTH_CALLBACK_REPLY_SUCCESS);
+    ASSERT_NE(control(FOTAService::FOTA_COMMIT), AUTH_CALLBACK_REPLY_SUCCESS);
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_VALIDATION_FAILURE);
+    run_events();
+
+    fota_checkpoint_t checkpoint;
+    ASSERT_TRUE(checkpoint_store.load(checkpoint));
+
+    /* It can be resumed again */
+    ASSERT_EQ(control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME), AUTH_CALLBACK_REPLY_SUCCESS);
+    run_events();
+    ASSERT_FALSE(svc.xoff);
+    send(MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL, image.size());
+    ASSERT_EQ(control(FOTAService::FOTA_COMMIT), AUTH_CALLBACK_REPLY_SUCCESS);
+
+    std::vector<uint8_t> readback(image.size());
+    ASSERT_EQ(bd.read(readback.data(), 0, readback.size()), 0);
+    ASSERT_EQ(readback, image);
+}
+
+/**
+ * Data still in flight when the staging buffers fill up is held until pages
+ * are programmed from the flash queue, rather than programmed on the spot or lost
+ */
+TEST_F(TestBlockDeviceFOTAEventHandler, test_staging_buffers_full)
+{
+    ASSERT_EQ(control(FOTAService::FOTA_START), AUTH_CALLBACK_REPLY_SUCCESS);
+    run_events();
+    ASSERT_FALSE(svc.xoff);
+
+    /* The client doesn't stop on XOFF straight away, and nothing is dispatched meanwhile */
+    size_t in_flight = (MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE * MBED_CONF_APP_FOTA_PAGE_BUFFER_COUNT) +
+            (MBED_CONF_APP_FOTA_STREAM_STASH_SIZE / 2);
+    for(size_t offset = 0; offset < in_flight; offset += PACKET_SIZE) {
+        ASSERT_EQ(handler.on_binary_stream_written(svc, mbed::make_const_Span(image.data() + offset, PACKET_SIZE)),
+                FOTAService::FOTA_STATUS_OK);
+    }
+    ASSERT_TRUE(svc.xoff);
+
+    std::vector<uint8_t> readback(image.size());
+    ASSERT_EQ(bd.read(readback.data(), 0, PACKET_SIZE), 0);
+    ASSERT_NE(memcmp(readback.data(), image.data(), PACKET_SIZE), 0);
+
+    send(in_flight, image.size());
+    ASSERT_EQ(control(FOTAService::FOTA_COMMIT), AUTH_CALLBACK_REPLY_SUCCESS);
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_OK);
+
+    ASSERT_EQ(bd.read(readback.data(), 0, readback.size()), 0);
+    ASSERT_EQ(readback, image);
+}
+
+/**
+ * Fragments are placed by their index, so a smaller ATT MTU negotiated
+ * during a session restarts the fragment stream at the new fragment size
+ * if none was received yet, and ends the session otherwise
+ */
+TEST_F(TestBlockDeviceFOTAEventHandler, test_mtu_change)
+{
+    handler.set_extension_service(&ext_svc);
+    ext_svc.negotiate(247);
+    ASSERT_EQ(control(FOTAService::FOTA_START), AUTH_CALLBACK_REPLY_SUCCESS);
+    run_events();
+    ASSERT_EQ(ext_svc.get_fragment_status().fragment_size, ext_svc.get_max_fragment_size());
+
+    ext_svc.negotiate(100);
+    uint16_t fragment_size = ext_svc.get_max_fragment_size();
+    ASSERT_EQ(ext_svc.get_fragment_status().fragment_size, fragment_size);
+
+    /* The fragment size of the session still fits a larger MTU */
+    ext_svc.negotiate(247);
+    ASSERT_EQ(ext_svc.get_fragment_status().fragment_size, fragment_size);
+
+    for(uint16_t index = 0; index < 2; index++) {
+        handler.on_fragment_written(ext_svc, index,
+                mbed::make_const_Span(image.data() + (index * fragment_size), fragment_size));
+    }
+    run_events();
+    fota_session_stats_t stats;
+    handler.get_session_stats(stats);
+    ASSERT_EQ(stats.bytes_received, 2u * fragment_size);
+
+    ext_svc.negotiate(50);
+    ASSERT_FALSE(handler.is_session_active());
+    ASSERT_FALSE(svc.session_started);
+    ASSERT_EQ(svc.last_status, FOTAService::FOTA_STATUS_UNSPECIFIED_ERROR);
+}
@@ -0,0 +1,53 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  fakes/
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/platform/mbed-trace/include/
+  ../mbed-os/storage/blockdevice/include/
+  ../mbed-os/events/include
+  ../mbed-os/drivers/include
+  ../mbed-os/connectivity/FEATURE_BLE/include
+  ../mbed-os/connectivity/mbedtls/include
+  ../mcuboot/boot/bootutil/include
+)
+
+set(unittest-sources
+  ../BlockDeviceFOTAEventHandler.cpp
+  ../FOTASlot.cpp
+  ../FOTASlotRegistry.cpp
+  ../PagedBlockDeviceWriter.cpp
+  ../PeriodicBlockDeviceEraser.cpp
+  ../MCUbootImageVerifier.cpp
+  ../MCUbootImageDecryptor.cpp
+  ../FOTACheckpointStore.cpp
+  ../FOTAExtensionService.cpp
+  ../StreamTransform.cpp
+  ../DeltaPatchApplier.cpp
+  ../LZDecompressor.cpp
+  ../SelectiveRepeatReceiver.cpp
+  ../mbed-os/drivers/source/MbedCRC.cpp
+  ../mbed-os/connectivity/mbedtls/source/sha256.c
+  ../mbed-os/connectivity/mbedtls/source/aes.c
+  ../mbed-os/connectivity/mbedtls/source/aesni.c
+  ../mbed-os/connectivity/mbedtls/source/platform_util.c
+)
+
+set(unittest-test-sources
+  BlockDeviceFOTAEventHandler/test_BlockDeviceFOTAEventHandler.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-fakes-event-queue
+      mbed-fakes-ble
+      mbed-stubs-drivers
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
@@ -0,0 +1,270 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "DeltaPatchApplier.h"
+#include "blockdevice/HeapBlockDevice.h"
+#include "platform/Span.h"
+
+#include <string.h>
+#include <vector>
+
+#define SLOT_SIZE 0x4000
+#define OLD_IMAGE_SIZE 0x3000
+#define WINDOW_SIZE 64
+#define STASH_SIZE 512
+
+/**
+ * HeapBlockDevice standing in for the primary slot, records the largest read
+ */
+class SourceBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+    SourceBlockDevice() : mbed::HeapBlockDevice(SLOT_SIZE, 1, 1, 0x1000) {
+    }
+
+    int read(void *buffer, bd_addr_t addr, bd_size_t size) override {
+        if(size > max_read_size) {
+            max_read_size = size;
+        }
+        return mbed::HeapBlockDevice::read(buffer, addr, size);
+    }
+
+    bd_size_t max_read_size = 0;
+};
+
+/**
+ * Builds patches in the format DeltaPatchApplier expects
+ */
+class PatchBuilder
+{
+public:
+    PatchBuilder &header(uint32_t new_size) {
+        put_u32(DeltaPatchApplier::PATCH_MAGIC);
+        put_u32(new_size);
+        return *this;
+    }
+
+    PatchBuilder &copy(uint32_t src, uint32_t length) {
+        patch.push_back(DeltaPatchApplier::OP_COPY);
+        put_u32(src);
+        put_u32(length);
+        return *this;
+    }
+
+    PatchBuilder &insert(const uint8_t *data, uint32_t length) {
+        patch.push_back(DeltaPatchApplier::OP_INSERT);
+        put_u32(length);
+        patch.insert(patch.end(), data, data + length);
+        return *this;
+    }
+
+    void put_u32(uint32_t value) {
+        for(int i = 0; i < 4; i++) {
+            patch.push_back((uint8_t) (value >> (8 * i)));
+        }
+    }
+
+    std::vector<uint8_t> patch;
+};
+
+class TestDeltaPatchApplier : public testing::Test {
+
+protected:
+
+    virtual void SetUp()
+    {
+        primary.init();
+        secondary.init();
+
+        old_image.resize(OLD_IMAGE_SIZE);
+        for(size_t i = 0; i < old_image.size(); i++) {
+            old_image[i] = (uint8_t) ((i * 31) ^ (i >> 8));
+        }
+        primary.program(old_image.data(), 0, old_image.size());
+
+        applier.set_output_callback(mbed::callback(this, &TestDeltaPatchApplier::on_output));
+        applier.reset(primary);
+    }
+
+    virtual void TearDown()
+    {
+        primary.deinit();
+        secondary.deinit();
+    }
+
+    int on_output(mbed::Span<const uint8_t> data) {
+        EXPECT_LE((size_t) data.size(), (size_t) WINDOW_SIZE);
+        int err = secondary.program(data.data(), output_addr, data.size());
+        output_addr += data.size();
+        return err;
+    }
+
+    /**
+     * Feed the patch in fragment_size chunks, applying it one window at a time
+     * the way the event handler does between binary stream writes
+     */
+    int apply(const std::vector<uint8_t> &patch, size_t fragment_size) {
+        for(size_t offset = 0; offset < patch.size(); offset += fragment_size) {
+            size_t chunk = (patch.size() - offset) < fragment_size ? (patch.size() - offset) : fragment_size;
+            int err = applier.feed(mbed::make_const_Span(patch.data() + offset, chunk));
+            if(err) {
+                return err;
+            }
+
+            while(applier.has_pending_output()) {
+                int produced = applier.run(WINDOW_SIZE);
+                if(produced < 0) {
+                    return produced;
+                }
+                EXPECT_LE((size_t) produced, (size_t) WINDOW_SIZE);
+            }
+        }
+
+        return 0;
+    }
+
+    /** Build a new image from the old one: an insertion, a changed region and moved blocks */
+    std::vector<uint8_t> make_new_image(PatchBuilder &builder) {
+        static const uint8_t inserted[] = "new code and data";
+        std::vector<uint8_t> changed(300);
+        for(size_t i = 0; i < changed.size(); i++) {
+            changed[i] = (uint8_t) (0xA5 ^ i);
+        }
+
+        std::vector<uint8_t> image;
+        image.insert(image.end(), old_image.begin(), old_image.begin() + 0x800);
+        image.insert(image.end(), inserted, inserted + sizeof(inserted));
+        image.insert(image.end(), old_image.begin() + 0x800, old_image.begin() + 0x1800);
+        image.insert(image.end(), changed.begin(), changed.end());
+        image.insert(image.end(), old_image.begin() + 0x2000, old_image.end());
+        image.insert(image.end(), old_image.begin() + 0x100, old_image.begin() + 0x200);
+
+        builder.header(image.size())
+                .copy(0, 0x800)
+                .insert(inserted, sizeof(inserted))
+                .copy(0x800, 0x1000)
+                .insert(changed.data(), changed.size())
+                .copy(0x2000, OLD_IMAGE_SIZE - 0x2000)
+                .copy(0x100, 0x100);
+
+        return image;
+    }
+
+    SourceBlockDevice primary;
+    mbed::HeapBlockDevice secondary = mbed::HeapBlockDevice(SLOT_SIZE, 1, 1, 0x1000);
+    uint8_t window[WINDOW_SIZE];
+    uint8_t stash[STASH_SIZE];
+    DeltaPatchApplier applier = DeltaPatchApplier(window, stash);
+    bd_addr_t output_addr = 0;
+    std::vector<uint8_t> old_image;
+};
+
+/**
+ * The rebuilt image must match the new image whatever the fragment size
+ */
+TEST_F(TestDeltaPatchApplier, test_round_trip)
+{
+    const size_t fragment_sizes[] = { 1, 7, 128, 244 };
+
+    for(size_t fragment_size : fragment_sizes) {
+        PatchBuilder builder;
+        std::vector<uint8_t> new_image = make_new_image(builder);
+
+        applier.reset(primary);
+        output_addr = 0;
+
+        ASSERT_EQ(apply(builder.patch, fragment_size), 0) << "fragment size " << fragment_size;
+        ASSERT_TRUE(applier.is_complete());
+        ASSERT_FALSE(applier.has_pending_output());
+        ASSERT_EQ(applier.get_output_size(), new_image.size());
+
+        std::vector<uint8_t> readback(new_image.size());
+        ASSERT_EQ(secondary.read(readback.data(), 0, readback.size()), 0);
+        ASSERT_EQ(readback, new_image) << "fragment size " << fragment_size;
+
+        ASSERT_LT(builder.patch.size(), new_image.size() / 10) << "patch size: " << builder.patch.size()
+                << " bytes for a " << new_image.size() << " byte image";
+    }
+
+    /* The source is only ever read through the window */
+    ASSERT_LE(primary.max_read_size, (bd_size_t) WINDOW_SIZE);
+}
+
+/**
+ * A long copy is only carried out as run() is called, one budget at a time
+ */
+TEST_F(TestDeltaPatchApplier, test_copy_is_paced)
+{
+    PatchBuilder builder;
+    builder.header(OLD_IMAGE_SIZE).copy(0, OLD_IMAGE_SIZE);
+
+    ASSERT_EQ(applier.feed(mbed::make_const_Span(builder.patch.data(), builder.patch.size())), 0);
+    ASSERT_EQ(output_addr, 0);
+
+    int runs = 0;
+    while(applier.has_pending_output()) {
+        ASSERT_EQ(applier.run(WINDOW_SIZE), WINDOW_SIZE);
+        runs++;
+    }
+
+    ASSERT_EQ(runs, OLD_IMAGE_SIZE / WINDOW_SIZE);
+    ASSERT_TRUE(applier.is_complete());
+}
+
+TEST_F(TestDeltaPatchApplier, test_bad_magic)
+{
+    PatchBuilder builder;
+    builder.put_u32(0x12345678);
+    builder.put_u32(OLD_IMAGE_SIZE);
+
+    ASSERT_EQ(apply(builder.patch, 128), DeltaPatchApplier::TRANSFORM_ERROR_INVALID_STREAM);
+    ASSERT_FALSE(applier.is_complete());
+}
+
+TEST_F(TestDeltaPatchApplier, test_copy_out_of_bounds)
+{
+    PatchBuilder builder;
+    builder.header(0x100).copy(SLOT_SIZE - 0x80, 0x100);
+
+    ASSERT_EQ(apply(builder.patch, 128), DeltaPatchApplier::TRANSFORM_ERROR_INVALID_STREAM);
+    ASSERT_EQ(output_addr, 0);
+}
+
+TEST_F(TestDeltaPatchApplier, test_op_past_new_size)
+{
+    uint8_t literals[0x20] = { 0 };
+    PatchBuilder builder;
+    builder.header(0x10).insert(literals, sizeof(literals));
+
+    ASSERT_EQ(apply(builder.patch, 128), DeltaPatchApplier::TRANSFORM_ERROR_INVALID_STREAM);
+}
+
+TEST_F(TestDeltaPatchApplier, test_stash_full)
+{
+    uint8_t literals[STASH_SIZE] = { 0 };
+    PatchBuilder builder;
+    builder.header(sizeof(literals)).insert(literals, sizeof(literals));
+
+    /* Nothing is applied, so the stash overflows */
+    ASSERT_EQ(applier.feed(mbed::make_const_Span(builder.patch.data(), STASH_SIZE)), 0);
+    ASSERT_EQ(applier.feed(mbed::make_const_Span(builder.patch.data() + STASH_SIZE, 1)),
+            DeltaPatchApplier::TRANSFORM_ERROR_STASH_FULL);
+}
@@ -0,0 +1,27 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/storage/blockdevice/include/
+)
+
+set(unittest-sources
+  ../StreamTransform.cpp
+  ../DeltaPatchApplier.cpp
+)
+
+set(unittest-test-sources
+  DeltaPatchApplier/test_DeltaPatchApplier.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
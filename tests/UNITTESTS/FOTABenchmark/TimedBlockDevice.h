@@ -0,0 +1,114 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef TIMEDBLOCKDEVICE_H_
+#define TIMEDBLOCKDEVICE_H_
+
+#include "blockdevice/HeapBlockDevice.h"
+
+#include <chrono>
+#include <string.h>
+
+/**
+ * HeapBlockDevice that models the time flash operations take
+ *
+ * Operations still complete immediately, but each one adds its modelled
+ * duration to the time the device has been busy. As operations block the
+ * caller on internal flash, this is also the time the event queue was held.
+ */
+class TimedBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+
+    struct profile_t {
+        /* Program size of the flash */
+        bd_size_t program_size;
+
+        /* Time to program one program unit (eg: a 32-bit word) */
+        std::chrono::nanoseconds program_unit;
+
+        /* Time to erase one sector */
+        std::chrono::nanoseconds erase_sector;
+
+        /* Time to read one byte */
+        std::chrono::nanoseconds read_byte;
+    };
+
+public:
+
+    TimedBlockDevice(bd_size_t size, bd_size_t erase_size, const profile_t &profile) :
+            mbed::HeapBlockDevice(size, 1, profile.program_size, erase_size), _profile(profile) {
+    }
+
+    int read(void *buffer, bd_addr_t addr, bd_size_t size) override {
+        reads++;
+        busy_time += _profile.read_byte * size;
+        return mbed::HeapBlockDevice::read(buffer, addr, size);
+    }
+
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override {
+        programs++;
+        busy_time += _profile.program_unit * (size / get_program_size());
+        return mbed::HeapBlockDevice::program(buffer, addr, size);
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override {
+        int err = mbed::HeapBlockDevice::erase(addr, size);
+        if(err) {
+            return err;
+        }
+
+        erases += size / get_erase_size();
+        busy_time += _profile.erase_sector * (size / get_erase_size());
+
+        /* Unlike flash, HeapBlockDevice leaves erased blocks untouched */
+        uint8_t blank[256];
+        memset(blank, 0xFF, sizeof(blank));
+        for(bd_size_t offset = 0; offset < size; offset += sizeof(blank)) {
+            bd_size_t chunk = ((size - offset) < sizeof(blank)) ? (size - offset) : sizeof(blank);
+            mbed::HeapBlockDevice::program(blank, addr + offset, chunk);
+        }
+
+        return mbed::BD_ERROR_OK;
+    }
+
+    int get_erase_value() const override {
+        return 0xFF;
+    }
+
+    /** Number of operations, the erase count is in sectors */
+    unsigned long ops() const {
+        return reads + programs + erases;
+    }
+
+public:
+
+    std::chrono::nanoseconds busy_time{0};
+
+    unsigned long reads = 0;
+    unsigned long programs = 0;
+    unsigned long erases = 0;
+
+protected:
+
+    profile_t _profile;
+
+};
+
+#endif /* TIMEDBLOCKDEVICE_H_ */
@@ -0,0 +1,580 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "BlockDeviceFOTAEventHandler.h"
+#include "LZDecompressor.h"
+#include "MCUbootImageDecryptor.h"
+#include "TimedBlockDevice.h"
+
+#include "ble-service-fota/FOTAService.h"
+#include "bootutil/image.h"
+#include "events/EventQueue.h"
+#include "mbedtls/aes.h"
+#if defined(MBEDTLS_AESNI_C)
+#include "mbedtls/aesni.h"
+#endif
+#include "mbedtls/sha256.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace std::chrono;
+
+#define SLOT_SIZE 0xC0000
+#define IMAGE_BODY_SIZE 0x4D000
+
+/* RFC 3394 4.1: the key-encryption key, the image key and the key wrapped with it */
+static const uint8_t KEK[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+static const uint8_t IMAGE_KEY[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+};
+static const uint8_t WRAPPED_KEY[24] = {
+    0x1F, 0xA6, 0x8B, 0x0A, 0x81, 0x12, 0xB4, 0x47, 0xAE, 0xF3, 0x4B, 0xD8, 0xFB, 0x5A, 0x7B, 0x82,
+    0x9D, 0x3E, 0x86, 0x23, 0x71, 0xD2, 0xCF, 0xE5
+};
+
+/* Fragment size the decryptor is fed with, as on a 2M PHY link */
+#define DECRYPT_FRAGMENT_SIZE 244
+
+/* Hash chain length searched for matches when compressing, as scripts/compress_image.py */
+#define LZ_MAX_CHAIN 32
+
+/* The queue is considered idle after this many events without flash operations */
+#define IDLE_SPIN_LIMIT 16
+
+/** External QSPI flash (MX25R6435F, as on the nRF52840_DK), typical timings */
+static const TimedBlockDevice::profile_t QSPI_FLASH = {
+    1,
+    nanoseconds(3320),       /* 0.85ms page program / 256 bytes */
+    microseconds(40000),
+    nanoseconds(30)
+};
+
+/** Internal flash (nRF52840 NVMC) */
+static const TimedBlockDevice::profile_t INTERNAL_FLASH = {
+    4,
+    microseconds(41),        /* per 32-bit word */
+    microseconds(85000),
+    nanoseconds(16)
+};
+
+/**
+ * Model of the BLE link: fragments of a given size, sent back to back
+ * at a fixed interval while the server hasn't sent XOFF
+ */
+struct link_model_t {
+    size_t fragment_size;
+    nanoseconds fragment_interval;
+};
+
+/** 2M PHY, 247 byte ATT MTU, 6 packets per 7.5ms connection interval */
+static const link_model_t FAST_LINK = { 244, microseconds(1250) };
+
+/** 1M PHY, default 23 byte ATT MTU, 4 packets per 7.5ms connection interval */
+static const link_model_t SLOW_LINK = { 20, microseconds(1875) };
+
+struct benchmark_report_t {
+    /* From FOTA_START until the first XON */
+    nanoseconds start_latency{0};
+
+    /* From the first XON until the last fragment was written */
+    nanoseconds transfer_time{0};
+
+    /* Time spent in XOFF after the first XON */
+    nanoseconds xoff_time{0};
+
+    /* FOTA_COMMIT (flushing and verifying) */
+    nanoseconds commit_time{0};
+
+    double bytes_per_second = 0;
+
+    unsigned long reads = 0;
+    unsigned long programs = 0;
+    unsigned long erases = 0;
+    unsigned xoffs = 0;
+
+    GattAuthCallbackReply_t commit_reply = AUTH_CALLBACK_REPLY_ATTERR_UNLIKELY_ERROR;
+};
+
+/**
+ * Replays an image through BlockDeviceFOTAEventHandler against a timing
+ * modelled BlockDevice, the way the FOTAService would deliver it.
+ *
+ * Time is simulated: it advances with the modelled duration of the flash
+ * operations each event makes, and with the link while the queue is idle.
+ */
+class TestFOTABenchmark : public testing::Test {
+
+protected:
+
+    /**
+     * Dispatch events until the given time, or until the queue is idle
+     * @retval false if the queue went idle
+     */
+    bool run_events(TimedBlockDevice &bd, events::EventQueue &queue, nanoseconds until) {
+        unsigned idle = 0;
+        while(now < until) {
+            unsigned long ops = bd.ops();
+            queue.dispatch_once();
+            account(bd);
+
+            /* Events that don't touch the flash are too short to model */
+            if(bd.ops() == ops) {
+                if(++idle >= IDLE_SPIN_LIMIT) {
+                    return false;
+                }
+            } else {
+                idle = 0;
+            }
+        }
+
+        return true;
+    }
+
+    /** Account for operations the handler made synchronously */
+    void account(TimedBlockDevice &bd) {
+        now += bd.busy_time - accounted;
+        accounted = bd.busy_time;
+    }
+
+    /**
+     * @param encrypted start an encrypted session, the image being encrypted with IMAGE_KEY
+     */
+    benchmark_report_t run_session(const std::vector<uint8_t> &image,
+            const TimedBlockDevice::profile_t &flash, const link_model_t &link, bool encrypted = false) {
+        benchmark_report_t report;
+        TimedBlockDevice bd(SLOT_SIZE, 0x1000, flash);
+        events::EventQueue queue;
+        FOTAService svc;
+        EXPECT_EQ(bd.init(), 0);
+
+        now = nanoseconds(0);
+        accounted = nanoseconds(0);
+
+        {
+            BlockDeviceFOTAEventHandler handler(bd, queue);
+
+            std::vector<uint8_t> start = { FOTAService::FOTA_START };
+            if(encrypted) {
+                EXPECT_TRUE(handler.set_encryption_kek(KEK));
+                start = { BlockDeviceFOTAEventHandler::FOTA_OP_CODE_START_ENCRYPTED };
+                start.insert(start.end(), WRAPPED_KEY, WRAPPED_KEY + sizeof(WRAPPED_KEY));
+            }
+            EXPECT_EQ(handler.on_control_written(svc, mbed::make_const_Span(start.data(), start.size())),
+                    AUTH_CALLBACK_REPLY_SUCCESS);
+            account(bd);
+
+            while(svc.xoff) {
+                nanoseconds before = now;
+                if(!run_events(bd, queue, nanoseconds::max()) && (now == before)) {
+                    ADD_FAILURE() << "no XON after FOTA_START";
+                    return report;
+                }
+            }
+            report.start_latency = now;
+
+            unsigned xoffs = svc.xoff_count;
+            nanoseconds next_fragment = now;
+            for(size_t offset = 0; offset < image.size(); ) {
+                /* The handler runs its events between fragments */
+                if(!run_events(bd, queue, next_fragment)) {
+                    now = next_fragment;
+                }
+
+                if(svc.xoff) {
+                    nanoseconds xoff_start = now;
+                    while(svc.xoff) {
+                        nanoseconds before = now;
+                        if(!run_events(bd, queue, nanoseconds::max()) && (now == before)) {
+                            ADD_FAILURE() << "stuck in XOFF at offset " << offset;
+                            return report;
+                        }
+                    }
+                    report.xoff_time += now - xoff_start;
+                    next_fragment = now + link.fragment_interval;
+                    continue;
+                }
+
+                size_t chunk = ((image.size() - offset) < link.fragment_size) ? (image.size() - offset) : link.fragment_size;
+                EXPECT_EQ(handler.on_binary_stream_written(svc, mbed::make_const_Span(image.data() + offset, chunk)),
+                        FOTAService::FOTA_STATUS_OK);
+                account(bd);
+
+                offset += chunk;
+                next_fragment = now + link.fragment_interval;
+            }
+
+            report.transfer_time = now - report.start_latency;
+            report.xoffs = svc.xoff_count - xoffs;
+
+            const uint8_t commit = FOTAService::FOTA_COMMIT;
+            nanoseconds commit_start = now;
+            report.commit_reply = handler.on_control_written(svc, mbed::make_const_Span(&commit, 1));
+            account(bd);
+            report.commit_time = now - commit_start;
+        }
+
+        report.bytes_per_second = image.size() / duration<double>(report.transfer_time).count();
+        report.reads = bd.reads;
+        report.programs = bd.programs;
+        report.erases = bd.erases;
+
+        std::vector<uint8_t> readback(image.size());
+        EXPECT_EQ(bd.read(readback.data(), 0, readback.size()), 0);
+        EXPECT_EQ(readback, image);
+
+        bd.deinit();
+        return report;
+    }
+
+    void print_report(const char *name, const benchmark_report_t &report) {
+        printf("%s: start %.1f ms, %.0f bytes/s, XOFF %.1f ms (%u), commit %.1f ms, "
+                "%lu reads, %lu programs, %lu sector erases\r\n", name,
+                duration<double, std::milli>(report.start_latency).count(),
+                report.bytes_per_second,
+                duration<double, std::milli>(report.xoff_time).count(), report.xoffs,
+                duration<double, std::milli>(report.commit_time).count(),
+                report.reads, report.programs, report.erases);
+    }
+
+    /**
+     * The image to replay: FOTA_BENCHMARK_IMAGE if set (eg: a signed update
+     * from OUTPUTS), otherwise a synthetic MCUboot image
+     */
+    std::vector<uint8_t> load_image(bool encrypted = false) {
+        std::vector<uint8_t> image;
+        const char *path = getenv("FOTA_BENCHMARK_IMAGE");
+        if(path && !encrypted) {
+            FILE *file = fopen(path, "rb");
+            if(file) {
+                int c;
+                while((c = fgetc(file)) != EOF) {
+                    image.push_back((uint8_t) c);
+                }
+                fclose(file);
+                return image;
+            }
+        }
+
+        struct image_header header;
+        memset(&header, 0, sizeof(header));
+        header.ih_magic = IMAGE_MAGIC;
+        header.ih_hdr_size = sizeof(header);
+        header.ih_img_size = IMAGE_BODY_SIZE;
+        header.ih_flags = encrypted ? IMAGE_F_ENCRYPTED_AES128 : 0;
+
+        image.resize(sizeof(header) + IMAGE_BODY_SIZE);
+        memcpy(image.data(), &header, sizeof(header));
+        for(size_t i = sizeof(header); i < image.size(); i++) {
+            image[i] = (uint8_t) ((i * 7) ^ (i >> 9));
+        }
+
+        /* The hash is over the plaintext */
+        uint8_t hash[32];
+        mbedtls_sha256_ret(image.data(), image.size(), hash, 0);
+
+        if(encrypted) {
+            /* As imgtool: AES-128-CTR from a zero counter at the start of the body */
+            mbedtls_aes_context aes;
+            uint8_t counter[16] = { 0 };
+            uint8_t block[16];
+            size_t nc_off = 0;
+            mbedtls_aes_init(&aes);
+            mbedtls_aes_setkey_enc(&aes, IMAGE_KEY, 128);
+            mbedtls_aes_crypt_ctr(&aes, IMAGE_BODY_SIZE, &nc_off, counter, block,
+                    image.data() + sizeof(header), image.data() + sizeof(header));
+            mbedtls_aes_free(&aes);
+        }
+
+        struct image_tlv_info info = { IMAGE_TLV_INFO_MAGIC, sizeof(struct image_tlv_info) + sizeof(struct image_tlv) + sizeof(hash) };
+        if(encrypted) {
+            info.it_tlv_tot += sizeof(struct image_tlv) + sizeof(WRAPPED_KEY);
+        }
+        struct image_tlv tlv = { IMAGE_TLV_SHA256, sizeof(hash) };
+        image.insert(image.end(), (uint8_t *) &info, (uint8_t *) &info + sizeof(info));
+        image.insert(image.end(), (uint8_t *) &tlv, (uint8_t *) &tlv + sizeof(tlv));
+        image.insert(image.end(), hash, hash + sizeof(hash));
+        if(encrypted) {
+            struct image_tlv key_tlv = { IMAGE_TLV_ENC_KW128, sizeof(WRAPPED_KEY) };
+            image.insert(image.end(), (uint8_t *) &key_tlv, (uint8_t *) &key_tlv + sizeof(key_tlv));
+            image.insert(image.end(), WRAPPED_KEY, WRAPPED_KEY + sizeof(WRAPPED_KEY));
+        }
+        return image;
+    }
+
+    /** Host core clock from FOTA_BENCHMARK_CPU_MHZ or /proc/cpuinfo, 0 if unknown */
+    double get_host_cpu_mhz() {
+        double cpu_mhz = 0;
+        const char *env = getenv("FOTA_BENCHMARK_CPU_MHZ");
+        if(env) {
+            return atof(env);
+        }
+
+        FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+        if(cpuinfo) {
+            char line[256];
+            while(fgets(line, sizeof(line), cpuinfo) && (sscanf(line, "cpu MHz : %lf", &cpu_mhz) != 1)) {
+            }
+            fclose(cpuinfo);
+        }
+        return cpu_mhz;
+    }
+
+    /**
+     * Compress data in the LZDecompressor format, with the hash chains of
+     * scripts/compress_image.py
+     */
+    std::vector<uint8_t> compress(const std::vector<uint8_t> &data, uint32_t window) {
+        std::vector<uint8_t> stream;
+        auto put_u32 = [&](uint32_t value) {
+            for(int i = 0; i < 4; i++) {
+                stream.push_back((uint8_t) (value >> (8 * i)));
+            }
+        };
+        auto put_length = [&](size_t length) {
+            while(length >= 255) {
+                stream.push_back(255);
+                length -= 255;
+            }
+            stream.push_back((uint8_t) length);
+        };
+        auto put_sequence = [&](size_t literal_start, size_t literal_length, size_t offset, size_t length) {
+            size_t match_code = length ? (length - LZDecompressor::MIN_MATCH) : 0;
+            stream.push_back((uint8_t) ((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15)));
+            if(literal_length >= 15) {
+                put_length(literal_length - 15);
+            }
+            stream.insert(stream.end(), data.begin() + literal_start, data.begin() + literal_start + literal_length);
+            if(length) {
+                stream.push_back((uint8_t) offset);
+                stream.push_back((uint8_t) (offset >> 8));
+                if(match_code >= 15) {
+                    put_length(match_code - 15);
+                }
+            }
+        };
+
+        put_u32(LZDecompressor::STREAM_MAGIC);
+        put_u32(data.size());
+        put_u32(window);
+
+        /* Most recent position of each 4-byte hash, and the previous one with the same hash */
+        std::vector<int64_t> head(1 << 16, -1);
+        std::vector<int64_t> prev(data.size(), -1);
+        auto hash = [&](size_t pos) {
+            uint32_t value;
+            memcpy(&value, &data[pos], sizeof(value));
+            return (value * 2654435761u) >> 16;
+        };
+        auto insert = [&](size_t pos) {
+            if((pos + LZDecompressor::MIN_MATCH) <= data.size()) {
+                uint32_t h = hash(pos);
+                prev[pos] = head[h];
+                head[h] = pos;
+            }
+        };
+
+        size_t literal_start = 0;
+        size_t pos = 0;
+        while(pos < data.size()) {
+            size_t best_length = 0;
+            size_t best_offset = 0;
+            if((pos + LZDecompressor::MIN_MATCH) <= data.size()) {
+                int64_t candidate = head[hash(pos)];
+                for(int chain = 0; (chain < LZ_MAX_CHAIN) && (candidate >= 0) && ((pos - candidate) <= window); chain++) {
+                    size_t length = 0;
+                    while(((pos + length) < data.size()) && (data[candidate + length] == data[pos + length])) {
+                        length++;
+                    }
+                    if(length > best_length) {
+                        best_length = length;
+                        best_offset = pos - candidate;
+                    }
+                    candidate = prev[candidate];
+                }
+            }
+
+            if(best_length < LZDecompressor::MIN_MATCH) {
+                insert(pos);
+                pos++;
+                continue;
+            }
+
+            put_sequence(literal_start, pos - literal_start, best_offset, best_length);
+            for(size_t end = pos + best_length; pos < end; pos++) {
+                insert(pos);
+            }
+            literal_start = pos;
+        }
+
+        /* The stream may end with literals only */
+        if(literal_start < data.size()) {
+            put_sequence(literal_start, data.size() - literal_start, 0, 0);
+        }
+        return stream;
+    }
+
+public:
+
+    void on_decrypted_output(mbed::Span<const uint8_t> data) {
+        decrypted.insert(decrypted.end(), data.begin(), data.end());
+    }
+
+    int on_decompressed_output(mbed::Span<const uint8_t> data) {
+        decompressed.insert(decompressed.end(), data.begin(), data.end());
+        return 0;
+    }
+
+protected:
+
+    /* Output of the decryptor and decompressor throughput benchmarks */
+    std::vector<uint8_t> decrypted;
+    std::vector<uint8_t> decompressed;
+
+    /* Simulated time */
+    nanoseconds now{0};
+
+    /* BlockDevice busy time already added to now */
+    nanoseconds accounted{0};
+};
+
+TEST_F(TestFOTABenchmark, test_qspi_flash_fast_link)
+{
+    benchmark_report_t report = run_session(load_image(), QSPI_FLASH, FAST_LINK);
+    print_report("QSPI flash, 244 byte fragments", report);
+    ASSERT_EQ(report.commit_reply, AUTH_CALLBACK_REPLY_SUCCESS);
+}
+
+TEST_F(TestFOTABenchmark, test_qspi_flash_slow_link)
+{
+    benchmark_report_t report = run_session(load_image(), QSPI_FLASH, SLOW_LINK);
+    print_report("QSPI flash, 20 byte fragments", report);
+    ASSERT_EQ(report.commit_reply, AUTH_CALLBACK_REPLY_SUCCESS);
+}
+
+TEST_F(TestFOTABenchmark, test_internal_flash_fast_link)
+{
+    benchmark_report_t report = run_session(load_image(), INTERNAL_FLASH, FAST_LINK);
+    print_report("internal flash, 244 byte fragments", report);
+    ASSERT_EQ(report.commit_reply, AUTH_CALLBACK_REPLY_SUCCESS);
+}
+
+TEST_F(TestFOTABenchmark, test_internal_flash_fast_link_encrypted)
+{
+    benchmark_report_t report = run_session(load_image(true), INTERNAL_FLASH, FAST_LINK, true);
+    print_report("internal flash, 244 byte fragments, encrypted", report);
+    ASSERT_EQ(report.commit_reply, AUTH_CALLBACK_REPLY_SUCCESS);
+}
+
+/**
+ * Host throughput of MCUbootImageDecryptor, in cycles per byte when the host
+ * clock is known (set FOTA_BENCHMARK_CPU_MHZ otherwise). This is wall-clock
+ * time on the host and is only reported: with AES-NI it says nothing about
+ * the software AES the target runs.
+ */
+TEST_F(TestFOTABenchmark, test_decryptor_throughput)
+{
+    std::vector<uint8_t> plaintext = load_image(false);
+    std::vector<uint8_t> encrypted = load_image(true);
+    size_t body_start = sizeof(struct image_header);
+
+    static uint8_t keystream[MBED_CONF_APP_FOTA_KEYSTREAM_SIZE];
+    MCUbootImageDecryptor decryptor(keystream);
+    decryptor.set_output_callback(mbed::callback((TestFOTABenchmark *) this, &TestFOTABenchmark::on_decrypted_output));
+    ASSERT_TRUE(decryptor.set_kek(KEK));
+    ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+
+    auto start = steady_clock::now();
+    for(size_t offset = 0; offset < encrypted.size(); offset += DECRYPT_FRAGMENT_SIZE) {
+        size_t chunk = std::min((size_t) DECRYPT_FRAGMENT_SIZE, encrypted.size() - offset);
+        /* The handler tops the keystream up from events between fragments */
+        decryptor.precompute(MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE);
+        ASSERT_EQ(decryptor.update(mbed::make_const_Span(encrypted.data() + offset, chunk)), 0);
+    }
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+    decryptor.stop();
+
+    ASSERT_EQ(decrypted.size(), encrypted.size());
+    ASSERT_TRUE(std::equal(plaintext.begin() + body_start, plaintext.begin() + body_start + IMAGE_BODY_SIZE,
+            decrypted.begin() + body_start));
+
+    bool aesni = false;
+#if defined(MBEDTLS_AESNI_C)
+    aesni = mbedtls_aesni_has_support(MBEDTLS_AESNI_AES);
+#endif
+
+    double bytes_per_second = (elapsed > 0) ? (encrypted.size() / elapsed) : 0.0;
+    double cpu_mhz = get_host_cpu_mhz();
+    printf("decryptor: %.1f MB/s on the host%s, RAM: %u bytes (%u keystream + %u state)\r\n",
+            bytes_per_second / 1e6, aesni ? " (AES-NI)" : "",
+            (unsigned) (sizeof(keystream) + sizeof(decryptor)), (unsigned) sizeof(keystream),
+            (unsigned) sizeof(decryptor));
+    if((cpu_mhz > 0) && (bytes_per_second > 0)) {
+        printf("decryptor: %.1f cycles/byte at %.0f MHz\r\n", cpu_mhz * 1e6 / bytes_per_second, cpu_mhz);
+    }
+}
+
+/**
+ * Host throughput of LZDecompressor, fed the way the handler feeds it: one
+ * fragment at a time, decompressed a page buffer at a time before the next.
+ * Like the decryptor's, this is wall-clock time on the host and is only
+ * reported.
+ */
+TEST_F(TestFOTABenchmark, test_decompressor_throughput)
+{
+    std::vector<uint8_t> image = load_image(false);
+    std::vector<uint8_t> stream = compress(image, MBED_CONF_APP_FOTA_COMPRESSION_WINDOW_SIZE);
+
+    static uint8_t history[MBED_CONF_APP_FOTA_COMPRESSION_WINDOW_SIZE];
+    static uint8_t stash[MBED_CONF_APP_FOTA_STREAM_STASH_SIZE];
+    LZDecompressor decompressor(history, stash);
+    decompressor.set_output_callback(mbed::callback((TestFOTABenchmark *) this, &TestFOTABenchmark::on_decompressed_output));
+    decompressor.reset();
+
+    auto start = steady_clock::now();
+    for(size_t offset = 0; offset < stream.size(); offset += FAST_LINK.fragment_size) {
+        size_t chunk = std::min(FAST_LINK.fragment_size, stream.size() - offset);
+        ASSERT_EQ(decompressor.feed(mbed::make_const_Span(stream.data() + offset, chunk)), 0);
+        while(decompressor.has_pending_output()) {
+            ASSERT_GE(decompressor.run(MBED_CONF_APP_FOTA_PAGE_BUFFER_SIZE), 0);
+        }
+    }
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    ASSERT_TRUE(decompressor.is_complete());
+    ASSERT_EQ(decompressed, image);
+
+    double bytes_per_second = (elapsed > 0) ? (image.size() / elapsed) : 0.0;
+    double cpu_mhz = get_host_cpu_mhz();
+    printf("decompressor: %.1f MB/s of output on the host, ratio %.2f, RAM: %u bytes (%u history + %u stash + %u state)\r\n",
+            bytes_per_second / 1e6, (double) image.size() / stream.size(),
+            (unsigned) (sizeof(history) + sizeof(stash) + sizeof(decompressor)), (unsigned) sizeof(history),
+            (unsigned) sizeof(stash), (unsigned) sizeof(decompressor));
+    if((cpu_mhz > 0) && (bytes_per_second > 0)) {
+        printf("decompressor: %.1f cycles/byte at %.0f MHz\r\n", cpu_mhz * 1e6 / bytes_per_second, cpu_mhz);
+    }
+}
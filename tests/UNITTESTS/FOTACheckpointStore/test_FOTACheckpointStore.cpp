@@ -0,0 +1,182 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "FOTACheckpointStore.h"
+#include "blockdevice/HeapBlockDevice.h"
+
+#include <string.h>
+
+#define BD_SIZE 0x1000
+#define BD_READ_SIZE 1
+#define BD_PROGRAM_SIZE 4
+#define BD_ERASE_SIZE 0x1000
+#define BD_ERASE_VALUE 0xFF
+
+/**
+ * HeapBlockDevice that counts the number of erase() calls made to it,
+ * and actually sets erased blocks to the erase value
+ */
+class EraseCountingBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+    EraseCountingBlockDevice() :
+        mbed::HeapBlockDevice(BD_SIZE, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE) {
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override {
+        erase_count++;
+        int err = mbed::HeapBlockDevice::erase(addr, size);
+        if(err) {
+            return err;
+        }
+
+        uint8_t erased[BD_ERASE_SIZE];
+        memset(erased, BD_ERASE_VALUE, sizeof(erased));
+        for(bd_addr_t block = addr; block < (addr + size); block += BD_ERASE_SIZE) {
+            mbed::HeapBlockDevice::program(erased, block, BD_ERASE_SIZE);
+        }
+        return mbed::BD_ERROR_OK;
+    }
+
+    int get_erase_value() const override {
+        return BD_ERASE_VALUE;
+    }
+
+    int erase_count = 0;
+};
+
+class TestFOTACheckpointStore : public testing::Test {
+protected:
+
+    void SetUp() override {
+        bd.init();
+        bd.erase(0, BD_SIZE);
+        bd.erase_count = 0;
+    }
+
+    void TearDown() override {
+        bd.deinit();
+    }
+
+    static fota_checkpoint_t make_checkpoint(uint32_t committed) {
+        fota_checkpoint_t checkpoint;
+        memset(checkpoint.header_hash, 0xA5, sizeof(checkpoint.header_hash));
+        checkpoint.committed = committed;
+        checkpoint.crc_state = ~committed;
+        return checkpoint;
+    }
+
+    EraseCountingBlockDevice bd;
+};
+
+TEST_F(TestFOTACheckpointStore, test_empty)
+{
+    FOTACheckpointStore store(bd);
+    EXPECT_EQ(store.init(), 0);
+
+    fota_checkpoint_t checkpoint;
+    EXPECT_FALSE(store.load(checkpoint));
+}
+
+TEST_F(TestFOTACheckpointStore, test_latest_checkpoint_survives_init)
+{
+    {
+        FOTACheckpointStore store(bd);
+        ASSERT_EQ(store.init(), 0);
+        for(uint32_t i = 1; i <= 10; i++) {
+            ASSERT_EQ(store.save(make_checkpoint(i * 0x10000)), 0);
+        }
+    }
+
+    /* Saving doesn't erase anything until the log is full */
+    EXPECT_EQ(bd.erase_count, 0);
+
+    FOTACheckpointStore store(bd);
+    ASSERT_EQ(store.init(), 0);
+
+    fota_checkpoint_t checkpoint;
+    ASSERT_TRUE(store.load(checkpoint));
+    EXPECT_EQ(checkpoint.committed, 10 * 0x10000);
+    EXPECT_EQ(checkpoint.crc_state, ~((uint32_t) 10 * 0x10000));
+}
+
+TEST_F(TestFOTACheckpointStore, test_corrupt_record_is_skipped)
+{
+    FOTACheckpointStore store(bd);
+    ASSERT_EQ(store.init(), 0);
+    ASSERT_EQ(store.save(make_checkpoint(0x10000)), 0);
+    ASSERT_EQ(store.save(make_checkpoint(0x20000)), 0);
+
+    /* Flip bits in the committed field of the second record, as if programming it was interrupted */
+    uint8_t slot[48];
+    ASSERT_EQ(bd.read(slot, sizeof(slot), sizeof(slot)), 0);
+    slot[4 + 32 + 2] = 0x00;
+    ASSERT_EQ(bd.mbed::HeapBlockDevice::program(slot, sizeof(slot), sizeof(slot)), 0);
+
+    FOTACheckpointStore reloaded(bd);
+    ASSERT_EQ(reloaded.init(), 0);
+
+    fota_checkpoint_t checkpoint;
+    ASSERT_TRUE(reloaded.load(checkpoint));
+    EXPECT_EQ(checkpoint.committed, 0x10000);
+}
+
+TEST_F(TestFOTACheckpointStore, test_log_wraps_when_full)
+{
+    FOTACheckpointStore store(bd);
+    ASSERT_EQ(store.init(), 0);
+
+    /* Far more checkpoints than fit in the region */
+    for(uint32_t i = 1; i <= 500; i++) {
+        ASSERT_EQ(store.save(make_checkpoint(i)), 0);
+    }
+
+    EXPECT_GT(bd.erase_count, 0);
+    EXPECT_LT(bd.erase_count, 10);
+
+    FOTACheckpointStore reloaded(bd);
+    ASSERT_EQ(reloaded.init(), 0);
+
+    fota_checkpoint_t checkpoint;
+    ASSERT_TRUE(reloaded.load(checkpoint));
+    EXPECT_EQ(checkpoint.committed, 500);
+}
+
+TEST_F(TestFOTACheckpointStore, test_clear)
+{
+    FOTACheckpointStore store(bd);
+    ASSERT_EQ(store.init(), 0);
+
+    /* Clearing an empty log doesn't erase anything */
+    EXPECT_EQ(store.clear(), 0);
+    EXPECT_EQ(bd.erase_count, 0);
+
+    ASSERT_EQ(store.save(make_checkpoint(0x10000)), 0);
+    EXPECT_EQ(store.clear(), 0);
+    EXPECT_EQ(bd.erase_count, 1);
+
+    fota_checkpoint_t checkpoint;
+    EXPECT_FALSE(store.load(checkpoint));
+
+    FOTACheckpointStore reloaded(bd);
+    ASSERT_EQ(reloaded.init(), 0);
+    EXPECT_FALSE(reloaded.load(checkpoint));
+}
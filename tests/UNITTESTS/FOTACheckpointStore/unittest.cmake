@@ -0,0 +1,27 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/storage/blockdevice/include/
+  ../mbed-os/drivers/include
+)
+
+set(unittest-sources
+  ../FOTACheckpointStore.cpp
+)
+
+set(unittest-test-sources
+  FOTACheckpointStore/test_FOTACheckpointStore.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
@@ -0,0 +1,495 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#include "FOTAEmulator.h"
+#include "MCUbootImageVerifier.h"
+
+#include "bootutil/image.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+/* The queue is considered idle after this many events without flash operations */
+#define IDLE_SPIN_LIMIT 16
+
+/* Longest the serving loop sleeps, events that don't touch the flash still get to run */
+#define POLL_INTERVAL_MS 10
+
+/* ATT write command or notification opcode and handle */
+#define ATT_HEADER_SIZE 3
+
+/* GATT characteristic properties */
+#define PROPERTY_READ                       0x02
+#define PROPERTY_WRITE_WITHOUT_RESPONSE     0x04
+#define PROPERTY_WRITE                      0x08
+#define PROPERTY_NOTIFY                     0x10
+
+namespace {
+
+struct characteristic_t {
+    uint16_t handle;
+    uint8_t properties;
+    const char *service_uuid;
+    const char *uuid;
+};
+
+const char UUID_FOTA_SERVICE[] = "53880000-65fd-4651-ba8e-91527f06c887";
+
+const characteristic_t CHARACTERISTICS[] = {
+    { FOTAEmulator::HANDLE_BINARY_STREAM, PROPERTY_WRITE_WITHOUT_RESPONSE,
+            UUID_FOTA_SERVICE, "53880001-65fd-4651-ba8e-91527f06c887" },
+    { FOTAEmulator::HANDLE_CONTROL, PROPERTY_WRITE,
+            UUID_FOTA_SERVICE, "53880002-65fd-4651-ba8e-91527f06c887" },
+    { FOTAEmulator::HANDLE_STATUS, PROPERTY_READ | PROPERTY_NOTIFY,
+            UUID_FOTA_SERVICE, "53880003-65fd-4651-ba8e-91527f06c887" },
+    /* Firmware Revision String */
+    { FOTAEmulator::HANDLE_FIRMWARE_REVISION, PROPERTY_READ,
+            UUID_FOTA_SERVICE, "00002a26-0000-1000-8000-00805f9b34fb" },
+    { FOTAEmulator::HANDLE_SESSION_INFO, PROPERTY_READ,
+            FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE, FOTAExtensionService::UUID_SESSION_INFO_CHAR },
+    { FOTAEmulator::HANDLE_FRAGMENT_STREAM, PROPERTY_WRITE_WITHOUT_RESPONSE,
+            FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE, FOTAExtensionService::UUID_FRAGMENT_STREAM_CHAR },
+    { FOTAEmulator::HANDLE_FRAGMENT_STATUS, PROPERTY_READ | PROPERTY_NOTIFY,
+            FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE, FOTAExtensionService::UUID_FRAGMENT_STATUS_CHAR },
+    { FOTAEmulator::HANDLE_TRANSFER_STATUS, PROPERTY_READ,
+            FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE, FOTAExtensionService::UUID_TRANSFER_STATUS_CHAR },
+    { FOTAEmulator::HANDLE_SESSION_STATS, PROPERTY_READ,
+            FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE, FOTAExtensionService::UUID_SESSION_STATS_CHAR },
+    { FOTAEmulator::HANDLE_STREAM_CREDIT, PROPERTY_READ | PROPERTY_NOTIFY,
+            FOTAExtensionService::UUID_FOTA_EXTENSION_SERVICE, FOTAExtensionService::UUID_STREAM_CREDIT_CHAR }
+};
+
+void append_u16(std::vector<uint8_t> &frame, uint16_t value) {
+    frame.push_back((uint8_t) value);
+    frame.push_back((uint8_t) (value >> 8));
+}
+
+uint16_t get_u16(const uint8_t *data) {
+    return (uint16_t) (data[0] | (data[1] << 8));
+}
+
+void append_uuid(std::vector<uint8_t> &frame, const char *uuid) {
+    for(const char *c = uuid; c[0] && c[1]; ) {
+        if(*c == '-') {
+            c++;
+            continue;
+        }
+        unsigned byte;
+        sscanf(c, "%2x", &byte);
+        frame.push_back((uint8_t) byte);
+        c += 2;
+    }
+}
+
+bool is_start_op(uint8_t op) {
+    return (op == FOTAService::FOTA_START) ||
+            (op == BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME) ||
+            (op == BlockDeviceFOTAEventHandler::FOTA_OP_CODE_START_DELTA) ||
+            (op == BlockDeviceFOTAEventHandler::FOTA_OP_CODE_START_COMPRESSED) ||
+            (op == BlockDeviceFOTAEventHandler::FOTA_OP_CODE_START_ENCRYPTED);
+}
+
+}
+
+FOTAEmulator::FOTAEmulator(FileBlockDevice &bd, mbed::BlockDevice &checkpoint_bd, const link_model_t &link,
+        uint32_t seed) : _bd(bd),
+        _link(link),
+        _rng(seed),
+        _ext_svc(BLE::Instance(), _chainable_gap_eh, _chainable_gatt_server_eh),
+        _checkpoint_store(checkpoint_bd),
+        _handler(bd, _queue),
+        _firmware_revision("0.0.0") {
+    if(_link.att_mtu > MAX_ATT_MTU) {
+        _link.att_mtu = MAX_ATT_MTU;
+    }
+    _svc.status_cb = mbed::callback(this, &FOTAEmulator::on_status);
+    _handler.set_extension_service(&_ext_svc);
+
+    /* Sessions just can't be resumed without it */
+    int err = _checkpoint_store.init();
+    if(err == 0) {
+        _handler.set_checkpoint_store(&_checkpoint_store);
+    }
+
+    update_firmware_revision();
+}
+
+int FOTAEmulator::serve(int fd) {
+    _inbound.clear();
+    _outbound.clear();
+    _rx.clear();
+
+    /* The new client only learns the notified values by reading them */
+    _ext_svc.connect(_link.att_mtu);
+    _fragment_status_notified.assign(_ext_svc.get_fragment_status().begin(), _ext_svc.get_fragment_status().end());
+    _stream_credit_notified.assign(_ext_svc.get_stream_credit().begin(), _ext_svc.get_stream_credit().end());
+
+    for(;;) {
+        steady_clock::time_point now = steady_clock::now();
+
+        /* Deliver what the link has carried so far */
+        while(!_inbound.empty() && (_inbound.front().due <= now)) {
+            frame_t frame = std::move(_inbound.front());
+            _inbound.pop_front();
+            on_frame(frame.data);
+            run_events();
+            notify_changes();
+        }
+        run_events();
+        notify_changes();
+
+        int err = flush(fd);
+        if(err) {
+            return err;
+        }
+
+        /* Sleep until the next frame is due, or more data comes in */
+        milliseconds timeout(POLL_INTERVAL_MS);
+        for(const std::deque<frame_t> *frames : { &_inbound, &_outbound }) {
+            if(!frames->empty()) {
+                milliseconds due = duration_cast<milliseconds>(frames->front().due - now);
+                if(due < timeout) {
+                    timeout = (due.count() > 0) ? due : milliseconds(0);
+                }
+            }
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout.count());
+        if(ready < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if(ready == 0) {
+            continue;
+        }
+
+        uint8_t buffer[1024];
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if(size == 0) {
+            return 0;
+        }
+        if(size < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        _rx.insert(_rx.end(), buffer, buffer + size);
+
+        /* Put complete frames on the link */
+        size_t offset = 0;
+        while((_rx.size() - offset) >= FRAME_HEADER_SIZE) {
+            size_t length = get_u16(&_rx[offset]);
+            if((length == 0) || (length > (MAX_ATT_MTU + FRAME_HEADER_SIZE))) {
+                return -EPROTO;
+            }
+            if((_rx.size() - offset) < (2 + length)) {
+                break;
+            }
+
+            frame_t frame;
+            frame.due = now + _link.latency;
+            frame.data.assign(_rx.begin() + offset, _rx.begin() + offset + 2 + length);
+            offset += 2 + length;
+
+            if((frame.data[2] == OP_WRITE_CMD) &&
+                    (std::uniform_int_distribution<unsigned>(0, 99)(_rng) < _link.loss_percent)) {
+                _dropped++;
+                continue;
+            }
+            _inbound.push_back(std::move(frame));
+        }
+        _rx.erase(_rx.begin(), _rx.begin() + offset);
+    }
+}
+
+void FOTAEmulator::on_frame(const std::vector<uint8_t> &frame) {
+    uint8_t op = frame[2];
+
+    if(op == OP_DISCOVER_REQ) {
+        /* The MTU goes where other frames have the handle */
+        std::vector<uint8_t> response = make_frame(OP_DISCOVER_RSP, _link.att_mtu);
+        for(const characteristic_t &characteristic : CHARACTERISTICS) {
+            append_u16(response, characteristic.handle);
+            response.push_back(characteristic.properties);
+            append_uuid(response, characteristic.service_uuid);
+            append_uuid(response, characteristic.uuid);
+        }
+        send(std::move(response));
+        return;
+    }
+
+    /* Everything else starts with a handle */
+    if(frame.size() < (FRAME_HEADER_SIZE + 2)) {
+        return;
+    }
+    uint16_t handle = get_u16(&frame[FRAME_HEADER_SIZE]);
+    mbed::Span<const uint8_t> value(frame.data() + FRAME_HEADER_SIZE + 2, frame.size() - FRAME_HEADER_SIZE - 2);
+
+    switch(op) {
+    case OP_READ_REQ:
+        on_read(handle);
+        break;
+
+    case OP_WRITE_REQ:
+    {
+        uint8_t error = ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+        if((size_t) value.size() <= (size_t) (_link.att_mtu - ATT_HEADER_SIZE)) {
+            error = (handle == HANDLE_BINARY_STREAM) ? ATT_ERROR_WRITE_NOT_PERMITTED : on_write(handle, value);
+        }
+        std::vector<uint8_t> response = make_frame(OP_WRITE_RSP, handle);
+        response.push_back(error);
+        send(std::move(response));
+        break;
+    }
+
+    case OP_WRITE_CMD:
+        /* Too long to fit an ATT write command, it would never make it to the server */
+        if(((handle != HANDLE_BINARY_STREAM) && (handle != HANDLE_FRAGMENT_STREAM)) ||
+                ((size_t) value.size() > (size_t) (_link.att_mtu - ATT_HEADER_SIZE))) {
+            _dropped++;
+            break;
+        }
+        if(handle == HANDLE_FRAGMENT_STREAM) {
+            _ext_svc.write_fragment(value);
+        } else {
+            on_binary_stream_written(value);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+void FOTAEmulator::on_read(uint16_t handle) {
+    std::vector<uint8_t> response = make_frame(OP_READ_RSP, handle);
+    switch(handle) {
+    case HANDLE_STATUS:
+        /* Reads return the fragment ID currently expected */
+        response.push_back(ATT_ERROR_NONE);
+        response.push_back(_status[0]);
+        response.push_back(_fragment_id);
+        break;
+
+    case HANDLE_FIRMWARE_REVISION:
+        response.push_back(ATT_ERROR_NONE);
+        response.insert(response.end(), _firmware_revision.begin(), _firmware_revision.end());
+        break;
+
+    case HANDLE_SESSION_INFO:
+    case HANDLE_FRAGMENT_STATUS:
+    case HANDLE_TRANSFER_STATUS:
+    case HANDLE_SESSION_STATS:
+    case HANDLE_STREAM_CREDIT:
+    {
+        mbed::Span<const uint8_t> value =
+                (handle == HANDLE_SESSION_INFO) ? _ext_svc.get_session_info() :
+                (handle == HANDLE_FRAGMENT_STATUS) ? _ext_svc.get_fragment_status() :
+                (handle == HANDLE_TRANSFER_STATUS) ? _ext_svc.get_transfer_status() :
+                (handle == HANDLE_SESSION_STATS) ? _ext_svc.get_session_stats() : _ext_svc.get_stream_credit();
+        response.push_back(ATT_ERROR_NONE);
+        response.insert(response.end(), value.begin(), value.end());
+        break;
+    }
+
+    case HANDLE_BINARY_STREAM:
+    case HANDLE_CONTROL:
+    case HANDLE_FRAGMENT_STREAM:
+        response.push_back(ATT_ERROR_READ_NOT_PERMITTED);
+        break;
+
+    default:
+        response.push_back(ATT_ERROR_INVALID_HANDLE);
+        break;
+    }
+
+    /* Long reads aren't emulated, the value is truncated to what fits one response */
+    if(response.size() > (FRAME_HEADER_SIZE + 2 + 1 + _link.att_mtu - 1)) {
+        response.resize(FRAME_HEADER_SIZE + 2 + 1 + _link.att_mtu - 1);
+    }
+    send(std::move(response));
+}
+
+uint8_t FOTAEmulator::on_write(uint16_t handle, mbed::Span<const uint8_t> value) {
+    if(handle != HANDLE_CONTROL) {
+        return (handle <= HANDLE_STREAM_CREDIT) ? ATT_ERROR_WRITE_NOT_PERMITTED : ATT_ERROR_INVALID_HANDLE;
+    }
+    if(value.empty()) {
+        return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+    }
+
+    /* Fragment IDs restart with every session */
+    if(is_start_op(value[0])) {
+        _fragment_id = 0;
+        _sync_lost = false;
+    }
+
+    GattAuthCallbackReply_t reply = _handler.on_control_written(_svc, value);
+    if(reply != AUTH_CALLBACK_REPLY_SUCCESS) {
+        return (uint8_t) (reply & 0xFF);
+    }
+
+    if(value[0] == FOTAService::FOTA_COMMIT) {
+        update_firmware_revision();
+    }
+
+    /* The device notifies the fragment status on SYNC, even if it didn't change */
+    if(value[0] == BlockDeviceFOTAEventHandler::FOTA_OP_CODE_SYNC) {
+        _fragment_status_notified.clear();
+    }
+
+    return ATT_ERROR_NONE;
+}
+
+void FOTAEmulator::on_binary_stream_written(mbed::Span<const uint8_t> value) {
+    if(value.empty()) {
+        return;
+    }
+
+    if(!_svc.session_started) {
+        on_status(FOTAService::FOTA_STATUS_NO_FOTA_SESSION);
+        return;
+    }
+
+    /* Like the FOTAService, everything is dropped until the expected fragment comes */
+    if(value[0] != _fragment_id) {
+        if(!_sync_lost) {
+            _sync_lost = true;
+            on_status(FOTAService::FOTA_STATUS_SYNC_LOST);
+        }
+        return;
+    }
+    _sync_lost = false;
+    _fragment_id++;
+
+    FOTAService::StatusCode_t status = _handler.on_binary_stream_written(_svc, value.subspan(1));
+    if(status != FOTAService::FOTA_STATUS_OK) {
+        _svc.notify_status(status);
+    }
+}
+
+void FOTAEmulator::on_status(FOTAService::StatusCode_t status) {
+    _status[0] = status;
+    _status[1] = _fragment_id;
+
+    std::vector<uint8_t> notification = make_frame(OP_NOTIFY, HANDLE_STATUS);
+    notification.insert(notification.end(), _status, _status + sizeof(_status));
+    send(std::move(notification));
+}
+
+void FOTAEmulator::notify_changes() {
+    notify_change(HANDLE_FRAGMENT_STATUS, _ext_svc.get_fragment_status(), _fragment_status_notified);
+    notify_change(HANDLE_STREAM_CREDIT, _ext_svc.get_stream_credit(), _stream_credit_notified);
+}
+
+void FOTAEmulator::notify_change(uint16_t handle, mbed::Span<const uint8_t> value, std::vector<uint8_t> &notified) {
+    if((notified.size() == (size_t) value.size()) && std::equal(value.begin(), value.end(), notified.begin())) {
+        return;
+    }
+
+    notified.assign(value.begin(), value.end());
+    std::vector<uint8_t> notification = make_frame(OP_NOTIFY, handle);
+    notification.insert(notification.end(), value.begin(), value.end());
+    send(std::move(notification));
+}
+
+std::vector<uint8_t> FOTAEmulator::make_frame(op_code_t op, uint16_t handle) {
+    std::vector<uint8_t> frame;
+    append_u16(frame, 0);
+    frame.push_back(op);
+    append_u16(frame, handle);
+    return frame;
+}
+
+void FOTAEmulator::send(std::vector<uint8_t> &&frame) {
+    size_t length = frame.size() - 2;
+    frame[0] = (uint8_t) length;
+    frame[1] = (uint8_t) (length >> 8);
+    _outbound.push_back({ steady_clock::now() + _link.latency, std::move(frame) });
+}
+
+int FOTAEmulator::flush(int fd) {
+    steady_clock::time_point now = steady_clock::now();
+    while(!_outbound.empty() && (_outbound.front().due <= now)) {
+        const std::vector<uint8_t> &frame = _outbound.front().data;
+        for(size_t offset = 0; offset < frame.size(); ) {
+            ssize_t sent = ::send(fd, frame.data() + offset, frame.size() - offset, MSG_NOSIGNAL);
+            if(sent < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            offset += sent;
+        }
+        _outbound.pop_front();
+    }
+
+    return 0;
+}
+
+void FOTAEmulator::run_events() {
+    unsigned idle = 0;
+    while(idle < IDLE_SPIN_LIMIT) {
+        unsigned long ops = _bd.ops();
+        _queue.dispatch_once();
+        idle = (_bd.ops() == ops) ? (idle + 1) : 0;
+    }
+}
+
+void FOTAEmulator::update_firmware_revision() {
+    /* Like MCUboot, only install a complete image whose hash matches, not
+     * what an interrupted or failed session left in the slot
+     */
+    MCUbootImageVerifier verifier;
+    uint8_t buffer[1024];
+    for(bd_addr_t addr = 0; !verifier.is_complete() && ((addr + sizeof(buffer)) <= _bd.size());
+            addr += sizeof(buffer)) {
+        if(_bd.read(buffer, addr, sizeof(buffer))) {
+            return;
+        }
+        verifier.update(mbed::make_const_Span(buffer, sizeof(buffer)));
+        if(!verifier.has_header()) {
+            return;
+        }
+    }
+
+    /* Encrypted images are hashed before encryption, MCUboot checks them while decrypting them */
+    const struct image_header &header = verifier.get_header();
+    bool encrypted = (header.ih_flags & IMAGE_F_ENCRYPTED_AES128) != 0;
+    if(!verifier.is_complete() || (!encrypted && !verifier.verify())) {
+        return;
+    }
+
+    char revision[32];
+    snprintf(revision, sizeof(revision), "%u.%u.%u", (unsigned) header.ih_ver.iv_major,
+            (unsigned) header.ih_ver.iv_minor, (unsigned) header.ih_ver.iv_revision);
+    _firmware_revision = revision;
+}
@@ -0,0 +1,297 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#ifndef FOTAEMULATOR_H_
+#define FOTAEMULATOR_H_
+
+#include "BlockDeviceFOTAEventHandler.h"
+#include "FOTACheckpointStore.h"
+#include "FOTAExtensionService.h"
+#include "FileBlockDevice.h"
+
+#include "ble-service-fota/FOTAService.h"
+#include "events/EventQueue.h"
+#include "platform/Span.h"
+
+#include <chrono>
+#include <deque>
+#include <random>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * FOTAExtensionService whose characteristic values are served by the emulator
+ *
+ * It is never registered with a GattServer, so updating a value only
+ * stores it, and the emulator reads it back to answer reads and send
+ * notifications.
+ */
+class EmulatedFOTAExtensionService : public FOTAExtensionService
+{
+public:
+
+    EmulatedFOTAExtensionService(BLE &ble, ChainableGapEventHandler &chainable_gap_eh,
+            ChainableGattServerEventHandler &chainable_gatt_server_eh) :
+            FOTAExtensionService(ble, chainable_gap_eh, chainable_gatt_server_eh) {
+    }
+
+    /** A client connected with the given ATT MTU, and the largest LL data length */
+    void connect(uint16_t att_mtu) {
+        onAttMtuChange(0, att_mtu);
+        onDataLengthChange(0, MAX_DATA_LENGTH, MAX_DATA_LENGTH);
+    }
+
+    /** Write to the fragment stream characteristic */
+    void write_fragment(mbed::Span<const uint8_t> value) {
+        GattWriteCallbackParams params;
+        memset(&params, 0, sizeof(params));
+        params.handle = _fragment_stream_char.getValueHandle();
+        params.writeOp = GattWriteCallbackParams::OP_WRITE_CMD;
+        params.len = value.size();
+        params.data = value.data();
+        onDataWritten(params);
+    }
+
+    mbed::Span<const uint8_t> get_session_info() const {
+        return mbed::make_const_Span((const uint8_t *) &_session_info, sizeof(_session_info));
+    }
+
+    mbed::Span<const uint8_t> get_fragment_status() const {
+        return mbed::make_const_Span((const uint8_t *) &_fragment_status, sizeof(_fragment_status));
+    }
+
+    mbed::Span<const uint8_t> get_transfer_status() const {
+        return mbed::make_const_Span((const uint8_t *) &_transfer_status, sizeof(_transfer_status));
+    }
+
+    mbed::Span<const uint8_t> get_session_stats() const {
+        return mbed::make_const_Span((const uint8_t *) &_session_stats, sizeof(_session_stats));
+    }
+
+    mbed::Span<const uint8_t> get_stream_credit() const {
+        return mbed::make_const_Span((const uint8_t *) &_stream_credit, sizeof(_stream_credit));
+    }
+
+    /** Largest LL payload with the data length extension */
+    static constexpr uint16_t MAX_DATA_LENGTH = 251;
+};
+
+/**
+ * Runs BlockDeviceFOTAEventHandler on the host, with a socket standing in
+ * for the GATT server of the FOTA demo
+ *
+ * This lets the updater scripts (see scripts/common/emulator.py) and their
+ * pipelining and retransmission logic be exercised without a board or a
+ * radio. The FOTAService characteristics are exposed (binary stream,
+ * control and status, along with the firmware revision string), and so are
+ * those of the FOTAExtensionService. Those the device notifies (fragment
+ * status and stream credit) are notified whenever their value changes, and
+ * the fragment status also after every FOTA_OP_CODE_SYNC. Checkpoints are
+ * saved to their own BlockDevice, so sessions can be resumed by the next
+ * client.
+ *
+ * Frames are exchanged over a stream socket, each being a little-endian
+ * 16-bit length (of what follows), an op code and its payload:
+ *  - OP_DISCOVER_REQ, answered with OP_DISCOVER_RSP: ATT MTU (16-bit)
+ *    followed by, for each characteristic, its handle (16-bit), its GATT
+ *    properties (8-bit), then the 128-bit UUIDs of its service and itself
+ *  - OP_READ_REQ: handle, answered with OP_READ_RSP: handle, ATT error, value
+ *  - OP_WRITE_REQ: handle and value, answered with OP_WRITE_RSP: handle, ATT error
+ *  - OP_WRITE_CMD: handle and value, not answered
+ *  - OP_NOTIFY: handle and value, from the emulator
+ *
+ * UUIDs are sent in the order they are written in (big-endian). The link
+ * model delays every frame, and drops some write commands the way a
+ * congested link drops binary stream packets.
+ */
+class FOTAEmulator
+{
+public:
+
+    enum op_code_t : uint8_t {
+        OP_DISCOVER_REQ = 0x01,
+        OP_DISCOVER_RSP = 0x02,
+        OP_READ_REQ = 0x03,
+        OP_READ_RSP = 0x04,
+        OP_WRITE_REQ = 0x05,
+        OP_WRITE_RSP = 0x06,
+        OP_WRITE_CMD = 0x07,
+        OP_NOTIFY = 0x08
+    };
+
+    /** Handles of the emulated characteristics */
+    enum : uint16_t {
+        HANDLE_BINARY_STREAM = 1,
+        HANDLE_CONTROL = 2,
+        HANDLE_STATUS = 3,
+        HANDLE_FIRMWARE_REVISION = 4,
+        HANDLE_SESSION_INFO = 5,
+        HANDLE_FRAGMENT_STREAM = 6,
+        HANDLE_FRAGMENT_STATUS = 7,
+        HANDLE_TRANSFER_STATUS = 8,
+        HANDLE_SESSION_STATS = 9,
+        HANDLE_STREAM_CREDIT = 10
+    };
+
+    static constexpr uint8_t ATT_ERROR_NONE = 0x00;
+    static constexpr uint8_t ATT_ERROR_INVALID_HANDLE = 0x01;
+    static constexpr uint8_t ATT_ERROR_READ_NOT_PERMITTED = 0x02;
+    static constexpr uint8_t ATT_ERROR_WRITE_NOT_PERMITTED = 0x03;
+    static constexpr uint8_t ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH = 0x0D;
+
+    /** Length and op code */
+    static constexpr size_t FRAME_HEADER_SIZE = 3;
+
+    /** Largest ATT MTU that can be emulated */
+    static constexpr uint16_t MAX_ATT_MTU = 517;
+
+    struct link_model_t {
+        /* One-way latency of every frame */
+        std::chrono::milliseconds latency;
+
+        /* Percentage of write commands that are dropped */
+        unsigned loss_percent;
+
+        /* Writes and notifications carry up to att_mtu - 3 bytes */
+        uint16_t att_mtu;
+    };
+
+public:
+
+    /**
+     * @param bd Update BlockDevice, must already be initialized
+     * @param checkpoint_bd BlockDevice checkpoints are saved to, must already be initialized
+     * @param seed Seed of the link loss, so lossy runs can be reproduced
+     */
+    FOTAEmulator(FileBlockDevice &bd, mbed::BlockDevice &checkpoint_bd, const link_model_t &link,
+            uint32_t seed = 1);
+
+    /**
+     * Serve a connected client until it disconnects
+     *
+     * The handler keeps its state between clients, like a device that
+     * stays powered while centrals come and go.
+     *
+     * @param fd Connected stream socket
+     * @retval 0 once the client disconnected, or a negative errno
+     */
+    int serve(int fd);
+
+    /** Number of write commands dropped by the link model, or for exceeding the MTU */
+    unsigned get_dropped() const {
+        return _dropped;
+    }
+
+    /** Firmware revision reported to clients, that of the last image committed */
+    const std::string &get_firmware_revision() const {
+        return _firmware_revision;
+    }
+
+protected:
+
+    struct frame_t {
+        /* When the link delivers the frame */
+        std::chrono::steady_clock::time_point due;
+
+        std::vector<uint8_t> data;
+    };
+
+    /** Handle a frame the link has delivered */
+    void on_frame(const std::vector<uint8_t> &frame);
+
+    void on_read(uint16_t handle);
+
+    /** @retval the ATT error to respond with */
+    uint8_t on_write(uint16_t handle, mbed::Span<const uint8_t> value);
+
+    void on_binary_stream_written(mbed::Span<const uint8_t> value);
+
+    /** FOTAService status notification */
+    void on_status(FOTAService::StatusCode_t status);
+
+    /** Notify the extension service characteristics whose value changed */
+    void notify_changes();
+
+    /** Notify a value if it differs from the last one notified */
+    void notify_change(uint16_t handle, mbed::Span<const uint8_t> value, std::vector<uint8_t> &notified);
+
+    /** Start a frame, the length is filled in by send() */
+    static std::vector<uint8_t> make_frame(op_code_t op, uint16_t handle);
+
+    void send(std::vector<uint8_t> &&frame);
+
+    /** Write the frames the link has delivered to the socket */
+    int flush(int fd);
+
+    /** Run the handler's events until it goes idle */
+    void run_events();
+
+    /** Read the version of the committed image */
+    void update_firmware_revision();
+
+protected:
+
+    FileBlockDevice &_bd;
+
+    link_model_t _link;
+
+    std::minstd_rand _rng;
+
+    events::EventQueue _queue;
+
+    FOTAService _svc;
+
+    ChainableGapEventHandler _chainable_gap_eh;
+
+    ChainableGattServerEventHandler _chainable_gatt_server_eh;
+
+    EmulatedFOTAExtensionService _ext_svc;
+
+    FOTACheckpointStore _checkpoint_store;
+
+    BlockDeviceFOTAEventHandler _handler;
+
+    /* Values of the fragment status and stream credit last notified */
+    std::vector<uint8_t> _fragment_status_notified;
+    std::vector<uint8_t> _stream_credit_notified;
+
+    /* Frames on their way to the handler and to the client */
+    std::deque<frame_t> _inbound;
+    std::deque<frame_t> _outbound;
+
+    /* Bytes received that don't make a whole frame yet */
+    std::vector<uint8_t> _rx;
+
+    /* Fragment ID of the next binary stream packet expected, and whether SYNC_LOST was sent for it */
+    uint8_t _fragment_id = 0;
+    bool _sync_lost = false;
+
+    /* Value of the status characteristic */
+    uint8_t _status[2] = { FOTAService::FOTA_STATUS_OK, 0 };
+
+    unsigned _dropped = 0;
+
+    std::string _firmware_revision;
+
+};
+
+#endif /* FOTAEMULATOR_H_ */
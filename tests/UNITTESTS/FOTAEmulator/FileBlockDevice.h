@@ -0,0 +1,186 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#ifndef FILEBLOCKDEVICE_H_
+#define FILEBLOCKDEVICE_H_
+
+#include "blockdevice/BlockDevice.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * BlockDevice backed by a file on the host, so its content outlives the process
+ *
+ * The file is created (blank) if it doesn't exist. Every program and erase
+ * is flushed to the file, so killing the process is as close as it gets to
+ * losing power on the device.
+ */
+class FileBlockDevice : public mbed::BlockDevice
+{
+public:
+
+    FileBlockDevice(const char *path, bd_size_t size, bd_size_t erase_size, bd_size_t program_size = 4) :
+            _path(path), _size(size), _erase_size(erase_size), _program_size(program_size) {
+    }
+
+    ~FileBlockDevice() {
+        deinit();
+    }
+
+    int init() override {
+        if(_file) {
+            return mbed::BD_ERROR_OK;
+        }
+
+        _file = fopen(_path, "r+b");
+        if(_file == nullptr) {
+            _file = fopen(_path, "w+b");
+        }
+        if(_file == nullptr) {
+            return mbed::BD_ERROR_DEVICE_ERROR;
+        }
+
+        /* Blank whatever the file doesn't cover yet */
+        fseek(_file, 0, SEEK_END);
+        long end = ftell(_file);
+        uint8_t blank[256];
+        memset(blank, ERASE_VALUE, sizeof(blank));
+        for(bd_size_t offset = (end > 0) ? end : 0; offset < _size; ) {
+            bd_size_t chunk = ((_size - offset) < sizeof(blank)) ? (_size - offset) : sizeof(blank);
+            if(fwrite(blank, 1, chunk, _file) != chunk) {
+                return mbed::BD_ERROR_DEVICE_ERROR;
+            }
+            offset += chunk;
+        }
+
+        return (fflush(_file) == 0) ? mbed::BD_ERROR_OK : mbed::BD_ERROR_DEVICE_ERROR;
+    }
+
+    int deinit() override {
+        if(_file) {
+            fclose(_file);
+            _file = nullptr;
+        }
+        return mbed::BD_ERROR_OK;
+    }
+
+    int read(void *buffer, bd_addr_t addr, bd_size_t size) override {
+        reads++;
+        if(!_file || !is_valid_read(addr, size) || fseek(_file, addr, SEEK_SET)) {
+            return mbed::BD_ERROR_DEVICE_ERROR;
+        }
+        return (fread(buffer, 1, size, _file) == size) ? mbed::BD_ERROR_OK : mbed::BD_ERROR_DEVICE_ERROR;
+    }
+
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override {
+        programs++;
+        if(!is_valid_program(addr, size)) {
+            return mbed::BD_ERROR_DEVICE_ERROR;
+        }
+        return write(buffer, addr, size);
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override {
+        if(!is_valid_erase(addr, size)) {
+            return mbed::BD_ERROR_DEVICE_ERROR;
+        }
+
+        erases += size / _erase_size;
+
+        uint8_t blank[256];
+        memset(blank, ERASE_VALUE, sizeof(blank));
+        for(bd_size_t offset = 0; offset < size; offset += sizeof(blank)) {
+            bd_size_t chunk = ((size - offset) < sizeof(blank)) ? (size - offset) : sizeof(blank);
+            int err = write(blank, addr + offset, chunk);
+            if(err) {
+                return err;
+            }
+        }
+
+        return mbed::BD_ERROR_OK;
+    }
+
+    bd_size_t get_read_size() const override {
+        return 1;
+    }
+
+    bd_size_t get_program_size() const override {
+        return _program_size;
+    }
+
+    bd_size_t get_erase_size() const override {
+        return _erase_size;
+    }
+
+    bd_size_t get_erase_size(bd_addr_t addr) const override {
+        return _erase_size;
+    }
+
+    int get_erase_value() const override {
+        return ERASE_VALUE;
+    }
+
+    bd_size_t size() const override {
+        return _size;
+    }
+
+    const char *get_type() const override {
+        return "FILE";
+    }
+
+    /** Number of operations, the erase count is in sectors */
+    unsigned long ops() const {
+        return reads + programs + erases;
+    }
+
+public:
+
+    unsigned long reads = 0;
+    unsigned long programs = 0;
+    unsigned long erases = 0;
+
+protected:
+
+    static constexpr uint8_t ERASE_VALUE = 0xFF;
+
+    int write(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        if(!_file || (addr + size) > _size || fseek(_file, addr, SEEK_SET)) {
+            return mbed::BD_ERROR_DEVICE_ERROR;
+        }
+        if(fwrite(buffer, 1, size, _file) != size) {
+            return mbed::BD_ERROR_DEVICE_ERROR;
+        }
+        return (fflush(_file) == 0) ? mbed::BD_ERROR_OK : mbed::BD_ERROR_DEVICE_ERROR;
+    }
+
+protected:
+
+    const char *_path;
+
+    bd_size_t _size;
+    bd_size_t _erase_size;
+    bd_size_t _program_size;
+
+    FILE *_file = nullptr;
+
+};
+
+#endif /* FILEBLOCKDEVICE_H_ */
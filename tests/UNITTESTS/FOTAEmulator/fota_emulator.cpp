@@ -0,0 +1,201 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+/*
+ * Standalone FOTA emulator, serving the updater scripts over TCP
+ *
+ * eg: fota-emulator --port 5555 --latency 15 --loss 1
+ * then: python test_fota.py --emulator localhost:5555
+ *
+ * Clients are served one after the other, until the emulator is killed.
+ */
+
+#include "FOTAEmulator.h"
+#include "FileBlockDevice.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOT_SIZE 0xC0000
+#define ERASE_SIZE 0x1000
+#define CHECKPOINT_BD_SIZE (2 * ERASE_SIZE)
+
+#define DEFAULT_PORT 5555
+#define DEFAULT_FLASH_PATH "fota-emulator-flash.bin"
+#define DEFAULT_LINK_ATT_MTU 247
+
+namespace {
+
+void print_usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p, --port PORT         TCP port to listen on, on the loopback interface (%u)\n"
+            "  -f, --flash PATH        file backing the update BlockDevice (%s),\n"
+            "                          checkpoints are saved next to it, to PATH.checkpoint\n"
+            "  -l, --latency MS        one-way latency of the link (0)\n"
+            "  -d, --loss PERCENT      write commands dropped by the link (0)\n"
+            "  -m, --mtu MTU           ATT MTU (%u)\n"
+            "  -s, --seed SEED         seed of the link loss (the current time)\n"
+            "  -h, --help              show this help\n",
+            name, DEFAULT_PORT, DEFAULT_FLASH_PATH, DEFAULT_LINK_ATT_MTU);
+}
+
+bool parse_unsigned(const char *arg, unsigned max, unsigned &value) {
+    char *end;
+    unsigned long parsed = strtoul(arg, &end, 0);
+    if((*arg == '\0') || (*end != '\0') || (parsed > max)) {
+        return false;
+    }
+    value = (unsigned) parsed;
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "port", required_argument, nullptr, 'p' },
+        { "flash", required_argument, nullptr, 'f' },
+        { "latency", required_argument, nullptr, 'l' },
+        { "loss", required_argument, nullptr, 'd' },
+        { "mtu", required_argument, nullptr, 'm' },
+        { "seed", required_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    unsigned port = DEFAULT_PORT;
+    std::string flash_path = DEFAULT_FLASH_PATH;
+    unsigned latency_ms = 0;
+    unsigned loss_percent = 0;
+    unsigned att_mtu = DEFAULT_LINK_ATT_MTU;
+    unsigned seed = (unsigned) time(nullptr);
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "p:f:l:d:m:s:h", options, nullptr)) != -1) {
+        bool valid = true;
+        switch(opt) {
+        case 'p':
+            valid = parse_unsigned(optarg, 0xFFFF, port) && (port != 0);
+            break;
+        case 'f':
+            flash_path = optarg;
+            break;
+        case 'l':
+            valid = parse_unsigned(optarg, 60000, latency_ms);
+            break;
+        case 'd':
+            valid = parse_unsigned(optarg, 100, loss_percent);
+            break;
+        case 'm':
+            valid = parse_unsigned(optarg, FOTAEmulator::MAX_ATT_MTU, att_mtu) &&
+                    (att_mtu >= FOTAExtensionService::DEFAULT_ATT_MTU);
+            break;
+        case 's':
+            valid = parse_unsigned(optarg, 0xFFFFFFFF, seed);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            valid = false;
+            break;
+        }
+
+        if(!valid) {
+            if(optarg) {
+                fprintf(stderr, "%s: invalid value '%s'\n", argv[0], optarg);
+            }
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if(optind < argc) {
+        fprintf(stderr, "%s: unexpected argument '%s'\n", argv[0], argv[optind]);
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    FileBlockDevice bd(flash_path.c_str(), SLOT_SIZE, ERASE_SIZE);
+    std::string checkpoint_path = flash_path + ".checkpoint";
+    FileBlockDevice checkpoint_bd(checkpoint_path.c_str(), CHECKPOINT_BD_SIZE, ERASE_SIZE);
+    if(bd.init() || checkpoint_bd.init()) {
+        fprintf(stderr, "%s: can't open %s or %s\n", argv[0], flash_path.c_str(), checkpoint_path.c_str());
+        return 1;
+    }
+
+    FOTAEmulator::link_model_t link = {
+        std::chrono::milliseconds(latency_ms),
+        loss_percent,
+        (uint16_t) att_mtu
+    };
+    FOTAEmulator emulator(bd, checkpoint_bd, link, seed);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if((bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) || (listen(listen_fd, 1) != 0)) {
+        perror("bind");
+        close(listen_fd);
+        return 1;
+    }
+
+    printf("FOTA emulator listening on port %u, firmware revision %s\n", port,
+            emulator.get_firmware_revision().c_str());
+    printf("link: %u ms latency, %u%% loss, ATT MTU %u, seed %u\n", latency_ms, loss_percent, att_mtu, seed);
+    fflush(stdout);
+
+    for(;;) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if(fd < 0) {
+            perror("accept");
+            break;
+        }
+
+        printf("client connected\n");
+        fflush(stdout);
+        int err = emulator.serve(fd);
+        close(fd);
+        printf("client disconnected (%s), %u write commands dropped, firmware revision %s\n",
+                err ? strerror(-err) : "ok", emulator.get_dropped(), emulator.get_firmware_revision().c_str());
+        fflush(stdout);
+    }
+
+    close(listen_fd);
+    return 1;
+}
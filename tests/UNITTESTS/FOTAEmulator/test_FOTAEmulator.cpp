@@ -0,0 +1,693 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#include "gtest/gtest.h"
+
+#include "FOTAEmulator.h"
+#include "FileBlockDevice.h"
+
+#include "bootutil/image.h"
+#include "mbedtls/sha256.h"
+
+#include <functional>
+#include <poll.h>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono;
+
+#define SLOT_SIZE 0xC0000
+#define ERASE_SIZE 0x1000
+#define CHECKPOINT_BD_SIZE (2 * ERASE_SIZE)
+#define IMAGE_BODY_SIZE 0x8000
+
+/* Binary stream payload of each packet, as sent by test_fota.py */
+#define PACKET_SIZE 128
+
+/*
+ * Packets sent between reads of the status characteristic. As reads are
+ * handled in order, this bounds the packets in flight below the 256 the
+ * 8-bit fragment ID can tell apart.
+ */
+#define SYNC_INTERVAL 32
+
+/* Longest the client waits for a frame */
+#define RESPONSE_TIMEOUT_MS 5000
+
+/* How long the fragment stream may stall before the client asks for the fragment status */
+#define FRAGMENT_STALL_TIMEOUT_MS 100
+
+/* Rounds of SYNC and resends before the client gives up on the fragment stream */
+#define FRAGMENT_RETRIES 50
+
+/**
+ * Runs the emulator on one end of a socket pair, and plays the client on the other
+ *
+ * The client mirrors test_fota.py: the paced binary stream, the binary
+ * stream within the stream credit, and the selective repeat fragment stream.
+ */
+class TestFOTAEmulator : public testing::Test {
+
+protected:
+
+    typedef std::function<std::string()> client_t;
+
+    virtual void SetUp()
+    {
+        snprintf(flash_path, sizeof(flash_path), "/tmp/fota-emulator-test-%d.bin", (int) getpid());
+        snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.checkpoint", flash_path);
+        unlink(flash_path);
+        unlink(checkpoint_path);
+    }
+
+    virtual void TearDown()
+    {
+        unlink(flash_path);
+        unlink(checkpoint_path);
+    }
+
+    /**
+     * Run a client against an emulator with the given link, as if the device was just reset
+     * @retval what the client returns
+     */
+    std::string run_session(const FOTAEmulator::link_model_t &link, const client_t &client,
+            unsigned *dropped = nullptr) {
+        FileBlockDevice bd(flash_path, SLOT_SIZE, ERASE_SIZE);
+        FileBlockDevice checkpoint_bd(checkpoint_path, CHECKPOINT_BD_SIZE, ERASE_SIZE);
+        EXPECT_EQ(bd.init(), 0);
+        EXPECT_EQ(checkpoint_bd.init(), 0);
+
+        int fds[2];
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        client_fd = fds[1];
+        notifications.clear();
+        xoff = false;
+        sync_lost = false;
+        fragment_status_updated = false;
+        credit_updates = 0;
+
+        FOTAEmulator emulator(bd, checkpoint_bd, link);
+        int served = -1;
+        std::thread server([&]() {
+            served = emulator.serve(fds[0]);
+        });
+
+        std::string result = client();
+
+        close(client_fd);
+        server.join();
+        close(fds[0]);
+        EXPECT_EQ(served, 0);
+
+        if(dropped) {
+            *dropped = emulator.get_dropped();
+        }
+        return result;
+    }
+
+    std::vector<uint8_t> read_flash(size_t size) {
+        FileBlockDevice bd(flash_path, SLOT_SIZE, ERASE_SIZE);
+        std::vector<uint8_t> data(size);
+        EXPECT_EQ(bd.init(), 0);
+        EXPECT_EQ(bd.read(data.data(), 0, data.size()), 0);
+        return data;
+    }
+
+    bool discover() {
+        std::vector<uint8_t> frame;
+        send_frame(FOTAEmulator::OP_DISCOVER_REQ);
+        if(!receive_response(FOTAEmulator::OP_DISCOVER_RSP, frame)) {
+            ADD_FAILURE() << "no discovery response";
+            return false;
+        }
+        /* MTU, then the handle, properties and UUIDs of each characteristic */
+        EXPECT_EQ(frame.size(), 2u + 10 * (2 + 1 + 16 + 16));
+        return true;
+    }
+
+    bool control(uint8_t op) {
+        if(write(FOTAEmulator::HANDLE_CONTROL, &op, 1) != FOTAEmulator::ATT_ERROR_NONE) {
+            ADD_FAILURE() << "control op 0x" << std::hex << (unsigned) op << " rejected";
+            return false;
+        }
+        return true;
+    }
+
+    /** Commit the session, the firmware revision is returned */
+    std::string commit() {
+        std::vector<uint8_t> frame;
+        if(!control(FOTAService::FOTA_COMMIT) || !read(FOTAEmulator::HANDLE_FIRMWARE_REVISION, frame)) {
+            ADD_FAILURE() << "firmware revision read failed";
+            return "";
+        }
+        return std::string(frame.begin(), frame.end());
+    }
+
+    std::string run_client(const std::vector<uint8_t> &image) {
+        if(!discover() || !control(FOTAService::FOTA_START) || !send_paced(image, 0, image.size())) {
+            return "";
+        }
+        return commit();
+    }
+
+    /**
+     * Send image[offset, end) through the binary stream, reading the status every SYNC_INTERVAL packets
+     *
+     * Fragment IDs start from 0 at offset.
+     */
+    bool send_paced(const std::vector<uint8_t> &image, size_t offset, size_t end) {
+        std::vector<uint8_t> frame;
+        size_t packet_count = (end - offset + PACKET_SIZE - 1) / PACKET_SIZE;
+        size_t packet = 0;
+        while(packet < packet_count) {
+            /* Catch up with the notifications, waiting for XON if needed */
+            while(receive_notification(xoff ? RESPONSE_TIMEOUT_MS : 0)) {
+            }
+            if(xoff) {
+                ADD_FAILURE() << "stuck in XOFF at packet " << packet;
+                return false;
+            }
+            if(sync_lost) {
+                /* Fragment IDs are 8-bit, the one expected can't be ahead of what was sent */
+                packet -= (uint8_t) (packet - fragment_id);
+                sync_lost = false;
+                continue;
+            }
+
+            send_packet(image, offset, end, packet);
+            packet++;
+
+            /* A packet dropped at the end isn't followed by one that shows the gap, ask for the fragment ID */
+            if(((packet % SYNC_INTERVAL) == 0) || (packet == packet_count)) {
+                if(!read(FOTAEmulator::HANDLE_STATUS, frame) || (frame.size() < 2)) {
+                    ADD_FAILURE() << "status read failed";
+                    return false;
+                }
+                packet -= (uint8_t) (packet - frame[1]);
+                sync_lost = false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Send the image through the binary stream, as long as the stream credit allows
+     *
+     * Packets are sent back to back, without reading the status, and the
+     * client only waits once it has used up its credit.
+     */
+    bool send_with_credit(const std::vector<uint8_t> &image) {
+        std::vector<uint8_t> frame;
+        if(!read(FOTAEmulator::HANDLE_STREAM_CREDIT, frame) || (frame.size() != sizeof(fota_stream_credit_t))) {
+            ADD_FAILURE() << "stream credit read failed";
+            return false;
+        }
+        on_stream_credit(frame.data());
+
+        size_t packet_count = (image.size() + PACKET_SIZE - 1) / PACKET_SIZE;
+        size_t packet = 0;
+        while(packet < packet_count) {
+            while(receive_notification(0)) {
+            }
+            if(sync_lost) {
+                packet -= (uint8_t) (packet - fragment_id);
+                sync_lost = false;
+                continue;
+            }
+
+            size_t sent = packet * PACKET_SIZE;
+            size_t size = std::min<size_t>(image.size() - sent, PACKET_SIZE);
+            if((sent + size) > credit_limit) {
+                if(!receive_notification(RESPONSE_TIMEOUT_MS)) {
+                    ADD_FAILURE() << "no stream credit after " << sent << " bytes";
+                    return false;
+                }
+                continue;
+            }
+
+            send_packet(image, 0, image.size(), packet);
+            packet++;
+        }
+        return true;
+    }
+
+    void send_packet(const std::vector<uint8_t> &image, size_t offset, size_t end, size_t packet) {
+        size_t start = offset + packet * PACKET_SIZE;
+        size_t size = std::min<size_t>(end - start, PACKET_SIZE);
+        std::vector<uint8_t> payload(1, (uint8_t) packet);
+        payload.insert(payload.end(), image.begin() + start, image.begin() + start + size);
+        send_frame(FOTAEmulator::OP_WRITE_CMD, FOTAEmulator::HANDLE_BINARY_STREAM, payload);
+    }
+
+    /**
+     * Send the image through the fragment stream, resending the fragments reported missing
+     *
+     * At most a window of fragments is in flight. If the stream stalls, or
+     * once every fragment has been sent, the client writes SYNC to get the
+     * fragment status notified, and resends what the device is missing.
+     */
+    bool send_fragments(const std::vector<uint8_t> &image) {
+        std::vector<uint8_t> frame;
+        if(!read(FOTAEmulator::HANDLE_FRAGMENT_STATUS, frame) || (frame.size() != sizeof(fota_fragment_status_t))) {
+            ADD_FAILURE() << "fragment status read failed";
+            return false;
+        }
+        on_fragment_status(frame.data());
+        fragment_status_updated = false;
+
+        /* The device picks the fragment size from the negotiated ATT MTU and data length */
+        size_t fragment_size = fragment_status.fragment_size;
+        size_t window = fragment_status.window;
+        if((fragment_size == 0) || (window == 0)) {
+            ADD_FAILURE() << "no fragment size or window";
+            return false;
+        }
+        size_t fragment_count = (image.size() + fragment_size - 1) / fragment_size;
+
+        std::set<size_t> resent;
+        size_t sent = 0;
+        for(unsigned retries = 0; retries < FRAGMENT_RETRIES; ) {
+            while(receive_notification(0)) {
+            }
+            if(xoff) {
+                if(!receive_notification(RESPONSE_TIMEOUT_MS)) {
+                    ADD_FAILURE() << "stuck in XOFF at fragment " << sent;
+                    return false;
+                }
+                continue;
+            }
+
+            /* The device only reports the low 16 bits of the index, which can't be ahead of what was sent */
+            size_t base = sent - (uint16_t) (sent - fragment_status.next_index);
+            if(base >= fragment_count) {
+                return true;
+            }
+
+            if(fragment_status_updated) {
+                /* Resend the fragments newly reported missing */
+                fragment_status_updated = false;
+                resent.erase(resent.begin(), resent.lower_bound(base));
+                for(size_t bit = 0; bit < 32; bit++) {
+                    size_t index = base + bit;
+                    if((fragment_status.missing & (1u << bit)) && (index < sent) && resent.insert(index).second) {
+                        send_fragment(image, fragment_size, index);
+                    }
+                }
+            }
+
+            if((sent < fragment_count) && (sent < (base + window))) {
+                send_fragment(image, fragment_size, sent);
+                sent++;
+                continue;
+            }
+
+            /* The window is full or everything was sent, wait for the fragment status to move */
+            if(receive_notification(FRAGMENT_STALL_TIMEOUT_MS)) {
+                continue;
+            }
+
+            /* Resends may have been dropped too, get the fragment status and resend what's missing */
+            retries++;
+            fragment_status_updated = false;
+            if(!control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_SYNC)) {
+                return false;
+            }
+            while(!fragment_status_updated && receive_notification(RESPONSE_TIMEOUT_MS)) {
+            }
+            if(!fragment_status_updated) {
+                ADD_FAILURE() << "no fragment status after SYNC";
+                return false;
+            }
+            fragment_status_updated = false;
+
+            base = sent - (uint16_t) (sent - fragment_status.next_index);
+            resent.clear();
+            for(size_t index = base; index < sent; index++) {
+                /* Fragments after the highest one received aren't in the bitmap */
+                size_t bit = index - base;
+                if((bit >= 32) || (fragment_status.missing & (1u << bit)) ||
+                        ((fragment_status.missing >> bit) == 0)) {
+                    send_fragment(image, fragment_size, index);
+                }
+            }
+        }
+
+        ADD_FAILURE() << "the fragment stream didn't complete";
+        return false;
+    }
+
+    void send_fragment(const std::vector<uint8_t> &image, size_t fragment_size, size_t index) {
+        size_t start = index * fragment_size;
+        size_t size = std::min(image.size() - start, fragment_size);
+        std::vector<uint8_t> payload = { (uint8_t) index, (uint8_t) (index >> 8) };
+        payload.insert(payload.end(), image.begin() + start, image.begin() + start + size);
+        send_frame(FOTAEmulator::OP_WRITE_CMD, FOTAEmulator::HANDLE_FRAGMENT_STREAM, payload);
+    }
+
+    void send_frame(uint8_t op, uint16_t handle = 0, const std::vector<uint8_t> &value = std::vector<uint8_t>()) {
+        std::vector<uint8_t> frame;
+        size_t length = (op == FOTAEmulator::OP_DISCOVER_REQ) ? 1 : (3 + value.size());
+        frame.push_back((uint8_t) length);
+        frame.push_back((uint8_t) (length >> 8));
+        frame.push_back(op);
+        if(op != FOTAEmulator::OP_DISCOVER_REQ) {
+            frame.push_back((uint8_t) handle);
+            frame.push_back((uint8_t) (handle >> 8));
+            frame.insert(frame.end(), value.begin(), value.end());
+        }
+        ASSERT_EQ(::send(client_fd, frame.data(), frame.size(), 0), (ssize_t) frame.size());
+    }
+
+    /**
+     * Receive the next frame, queueing notifications that come first
+     * @retval false if nothing came within the timeout
+     */
+    bool receive_frame(std::vector<uint8_t> &frame, int timeout_ms) {
+        uint8_t header[2];
+        struct pollfd pfd = { client_fd, POLLIN, 0 };
+        if((poll(&pfd, 1, timeout_ms) <= 0) || !receive_all(header, sizeof(header))) {
+            return false;
+        }
+        frame.resize(header[0] | (header[1] << 8));
+        return receive_all(frame.data(), frame.size());
+    }
+
+    bool receive_all(uint8_t *buffer, size_t size) {
+        for(size_t offset = 0; offset < size; ) {
+            ssize_t received = recv(client_fd, buffer + offset, size - offset, 0);
+            if(received <= 0) {
+                return false;
+            }
+            offset += received;
+        }
+        return true;
+    }
+
+    /** Receive frames until the response with the given op code, its payload is returned */
+    bool receive_response(uint8_t op, std::vector<uint8_t> &payload) {
+        std::vector<uint8_t> frame;
+        while(receive_frame(frame, RESPONSE_TIMEOUT_MS)) {
+            if(frame[0] == FOTAEmulator::OP_NOTIFY) {
+                notifications.push_back(frame);
+                continue;
+            }
+            if(frame[0] != op) {
+                return false;
+            }
+            payload.assign(frame.begin() + 1, frame.end());
+            return true;
+        }
+        return false;
+    }
+
+    bool receive_notification(int timeout_ms) {
+        std::vector<uint8_t> frame;
+        if(!receive_frame(frame, timeout_ms)) {
+            return false;
+        }
+        EXPECT_EQ(frame[0], FOTAEmulator::OP_NOTIFY);
+        notifications.push_back(frame);
+        process_notifications();
+        return true;
+    }
+
+    void process_notifications() {
+        for(const std::vector<uint8_t> &frame : notifications) {
+            ASSERT_GE(frame.size(), 3u);
+            uint16_t handle = frame[1] | (frame[2] << 8);
+            const uint8_t *value = frame.data() + 3;
+            size_t size = frame.size() - 3;
+            if(handle == FOTAEmulator::HANDLE_STATUS) {
+                ASSERT_EQ(size, 2u);
+                on_status(value);
+            } else if(handle == FOTAEmulator::HANDLE_FRAGMENT_STATUS) {
+                ASSERT_EQ(size, sizeof(fota_fragment_status_t));
+                on_fragment_status(value);
+            } else if(handle == FOTAEmulator::HANDLE_STREAM_CREDIT) {
+                ASSERT_EQ(size, sizeof(fota_stream_credit_t));
+                on_stream_credit(value);
+                credit_updates++;
+            } else {
+                ADD_FAILURE() << "notification of handle " << handle;
+            }
+        }
+        notifications.clear();
+    }
+
+    void on_status(const uint8_t *value) {
+        uint8_t status = value[0];
+        if(status == FOTAService::FOTA_STATUS_XOFF) {
+            xoff = true;
+        } else if(status == FOTAService::FOTA_STATUS_XON) {
+            xoff = false;
+        } else if(status == FOTAService::FOTA_STATUS_SYNC_LOST) {
+            sync_lost = true;
+            fragment_id = value[1];
+        } else {
+            ADD_FAILURE() << "status " << (unsigned) status;
+        }
+    }
+
+    void on_fragment_status(const uint8_t *value) {
+        memcpy(&fragment_status, value, sizeof(fragment_status));
+        fragment_status_updated = true;
+    }
+
+    void on_stream_credit(const uint8_t *value) {
+        fota_stream_credit_t credit;
+        memcpy(&credit, value, sizeof(credit));
+        /* The credit never decreases, an older value read in the meantime may arrive late */
+        credit_limit = std::max<size_t>(credit_limit, credit.limit);
+    }
+
+    /** @retval the ATT error */
+    uint8_t write(uint16_t handle, const uint8_t *value, size_t size) {
+        std::vector<uint8_t> payload;
+        send_frame(FOTAEmulator::OP_WRITE_REQ, handle, std::vector<uint8_t>(value, value + size));
+        if(!receive_response(FOTAEmulator::OP_WRITE_RSP, payload) || (payload.size() != 3)) {
+            return 0xFF;
+        }
+        process_notifications();
+        return payload[2];
+    }
+
+    /** Read a value, without the handle and ATT error */
+    bool read(uint16_t handle, std::vector<uint8_t> &value) {
+        std::vector<uint8_t> payload;
+        send_frame(FOTAEmulator::OP_READ_REQ, handle);
+        if(!receive_response(FOTAEmulator::OP_READ_RSP, payload) || (payload.size() < 3) ||
+                (payload[2] != FOTAEmulator::ATT_ERROR_NONE)) {
+            return false;
+        }
+        process_notifications();
+        value.assign(payload.begin() + 3, payload.end());
+        return true;
+    }
+
+    /** MCUboot image with a SHA-256 TLV, version 1.2.3 */
+    std::vector<uint8_t> make_image(size_t body_size = IMAGE_BODY_SIZE) {
+        struct image_header header;
+        memset(&header, 0, sizeof(header));
+        header.ih_magic = IMAGE_MAGIC;
+        header.ih_hdr_size = sizeof(header);
+        header.ih_img_size = body_size;
+        header.ih_ver.iv_major = 1;
+        header.ih_ver.iv_minor = 2;
+        header.ih_ver.iv_revision = 3;
+
+        std::vector<uint8_t> image(sizeof(header) + body_size);
+        memcpy(image.data(), &header, sizeof(header));
+        for(size_t i = sizeof(header); i < image.size(); i++) {
+            image[i] = (uint8_t) ((i * 7) ^ (i >> 9));
+        }
+
+        uint8_t hash[32];
+        mbedtls_sha256_ret(image.data(), image.size(), hash, 0);
+
+        struct image_tlv_info info = { IMAGE_TLV_INFO_MAGIC, sizeof(struct image_tlv_info) + sizeof(struct image_tlv) + sizeof(hash) };
+        struct image_tlv tlv = { IMAGE_TLV_SHA256, sizeof(hash) };
+        image.insert(image.end(), (uint8_t *) &info, (uint8_t *) &info + sizeof(info));
+        image.insert(image.end(), (uint8_t *) &tlv, (uint8_t *) &tlv + sizeof(tlv));
+        image.insert(image.end(), hash, hash + sizeof(hash));
+        return image;
+    }
+
+    char flash_path[64];
+    char checkpoint_path[80];
+
+    int client_fd = -1;
+
+    std::vector<std::vector<uint8_t>> notifications;
+
+    bool xoff = false;
+    bool sync_lost = false;
+    uint8_t fragment_id = 0;
+
+    fota_fragment_status_t fragment_status;
+    bool fragment_status_updated = false;
+
+    size_t credit_limit = 0;
+    unsigned credit_updates = 0;
+};
+
+TEST_F(TestFOTAEmulator, test_transfer)
+{
+    FOTAEmulator::link_model_t link = { milliseconds(0), 0, 247 };
+    std::vector<uint8_t> image = make_image();
+    ASSERT_EQ(run_session(link, [&]() { return run_client(image); }), "1.2.3");
+    ASSERT_EQ(read_flash(image.size()), image);
+}
+
+/**
+ * Dropped packets are sent again from the fragment ID reported with SYNC_LOST
+ */
+TEST_F(TestFOTAEmulator, test_lossy_transfer)
+{
+    FOTAEmulator::link_model_t link = { milliseconds(1), 5, 247 };
+    std::vector<uint8_t> image = make_image();
+    unsigned dropped = 0;
+    ASSERT_EQ(run_session(link, [&]() { return run_client(image); }, &dropped), "1.2.3");
+    ASSERT_EQ(read_flash(image.size()), image);
+    ASSERT_GT(dropped, 0u);
+}
+
+/**
+ * The binary stream is pipelined within the stream credit, which is notified as the device frees its buffers
+ */
+TEST_F(TestFOTAEmulator, test_credit_transfer)
+{
+    FOTAEmulator::link_model_t link = { milliseconds(2), 0, 247 };
+    std::vector<uint8_t> image = make_image();
+    std::string revision = run_session(link, [&]() -> std::string {
+        if(!discover() || !control(FOTAService::FOTA_START) || !send_with_credit(image)) {
+            return "";
+        }
+        return commit();
+    });
+    ASSERT_EQ(revision, "1.2.3");
+    ASSERT_EQ(read_flash(image.size()), image);
+
+    /* The initial credit doesn't cover the image, the rest came from notifications */
+    ASSERT_GT(credit_updates, 0u);
+}
+
+/**
+ * Only the fragments lost by the link are resent, and the transfer status matches the image before committing
+ */
+TEST_F(TestFOTAEmulator, test_selective_repeat)
+{
+    FOTAEmulator::link_model_t link = { milliseconds(1), 5, 247 };
+    std::vector<uint8_t> image = make_image();
+    unsigned dropped = 0;
+    std::string revision = run_session(link, [&]() -> std::string {
+        std::vector<uint8_t> status;
+        if(!discover() || !control(FOTAService::FOTA_START) || !send_fragments(image) ||
+                !control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_SYNC) ||
+                !read(FOTAEmulator::HANDLE_TRANSFER_STATUS, status)) {
+            return "";
+        }
+
+        fota_transfer_status_t transfer_status;
+        EXPECT_EQ(status.size(), sizeof(transfer_status));
+        memcpy(&transfer_status, status.data(), sizeof(transfer_status));
+        EXPECT_EQ(transfer_status.size, image.size());
+        return commit();
+    }, &dropped);
+    ASSERT_EQ(revision, "1.2.3");
+    ASSERT_EQ(read_flash(image.size()), image);
+    ASSERT_GT(dropped, 0u);
+}
+
+/**
+ * A session interrupted by a reset is resumed from its checkpoint, once the device has checked it
+ */
+TEST_F(TestFOTAEmulator, test_resume)
+{
+    FOTAEmulator::link_model_t link = { milliseconds(0), 0, 247 };
+    std::vector<uint8_t> image = make_image(MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL + IMAGE_BODY_SIZE);
+
+    /* Stop well past the first checkpoint, leaving the pages in flight time to be programmed */
+    size_t interrupted_at = MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL + (IMAGE_BODY_SIZE / 2);
+    run_session(link, [&]() -> std::string {
+        if(discover() && control(FOTAService::FOTA_START)) {
+            send_paced(image, 0, interrupted_at);
+        }
+        return "";
+    });
+
+    std::string revision = run_session(link, [&]() -> std::string {
+        /* The interrupted image isn't installed */
+        std::vector<uint8_t> value;
+        if(!discover() || !read(FOTAEmulator::HANDLE_FIRMWARE_REVISION, value)) {
+            ADD_FAILURE() << "firmware revision read failed";
+            return "";
+        }
+        EXPECT_EQ(std::string(value.begin(), value.end()), "0.0.0");
+
+        if(!read(FOTAEmulator::HANDLE_SESSION_INFO, value) ||
+                (value.size() != sizeof(fota_session_info_t))) {
+            ADD_FAILURE() << "session info read failed";
+            return "";
+        }
+
+        fota_session_info_t info;
+        memcpy(&info, value.data(), sizeof(info));
+        EXPECT_EQ(info.resume_offset, (uint32_t) MBED_CONF_APP_FOTA_CHECKPOINT_INTERVAL);
+
+        uint8_t header_hash[32];
+        mbedtls_sha256_ret(image.data(), sizeof(struct image_header), header_hash, 0);
+        EXPECT_EQ(memcmp(info.header_hash, header_hash, sizeof(header_hash)), 0);
+
+        /* Nothing may be sent until the checkpointed data has been checked */
+        if(!control(BlockDeviceFOTAEventHandler::FOTA_OP_CODE_RESUME) ||
+                !send_paced(image, info.resume_offset, image.size())) {
+            return "";
+        }
+        return commit();
+    });
+    ASSERT_EQ(revision, "1.2.3");
+    ASSERT_EQ(read_flash(image.size()), image);
+}
+
+/**
+ * Packets that don't fit the MTU never make it
+ */
+TEST_F(TestFOTAEmulator, test_mtu)
+{
+    FOTAEmulator::link_model_t link = { milliseconds(0), 0, 23 };
+    unsigned dropped = 0;
+    run_session(link, [&]() -> std::string {
+        /* One byte more than fits */
+        std::vector<uint8_t> value(21, FOTAService::FOTA_START);
+        EXPECT_EQ(write(FOTAEmulator::HANDLE_CONTROL, value.data(), value.size()),
+                FOTAEmulator::ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH);
+
+        send_frame(FOTAEmulator::OP_WRITE_CMD, FOTAEmulator::HANDLE_BINARY_STREAM, value);
+        std::vector<uint8_t> revision;
+        EXPECT_TRUE(read(FOTAEmulator::HANDLE_FIRMWARE_REVISION, revision));
+        return "";
+    }, &dropped);
+    ASSERT_EQ(dropped, 1u);
+}
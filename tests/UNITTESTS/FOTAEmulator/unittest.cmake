@@ -0,0 +1,80 @@
+####################
+# UNIT TESTS
+####################
+
+# Host emulator of the FOTA demo, serving the updater scripts over a socket.
+# The tests play the client over a socket pair, the fota-emulator executable
+# serves test_fota.py and fleet_fota.py over TCP (see fota_emulator.cpp)
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  fakes/
+  FOTAEmulator/
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/platform/mbed-trace/include/
+  ../mbed-os/storage/blockdevice/include/
+  ../mbed-os/events/include
+  ../mbed-os/drivers/include
+  ../mbed-os/connectivity/FEATURE_BLE/include
+  ../mbed-os/connectivity/mbedtls/include
+  ../mcuboot/boot/bootutil/include
+)
+
+set(unittest-sources
+  ../BlockDeviceFOTAEventHandler.cpp
+  ../FOTASlot.cpp
+  ../FOTASlotRegistry.cpp
+  ../PagedBlockDeviceWriter.cpp
+  ../PeriodicBlockDeviceEraser.cpp
+  ../MCUbootImageVerifier.cpp
+  ../MCUbootImageDecryptor.cpp
+  ../FOTACheckpointStore.cpp
+  ../FOTAExtensionService.cpp
+  ../StreamTransform.cpp
+  ../DeltaPatchApplier.cpp
+  ../LZDecompressor.cpp
+  ../SelectiveRepeatReceiver.cpp
+  ../mbed-os/drivers/source/MbedCRC.cpp
+  ../mbed-os/connectivity/mbedtls/source/sha256.c
+  ../mbed-os/connectivity/mbedtls/source/aes.c
+  ../mbed-os/connectivity/mbedtls/source/aesni.c
+  ../mbed-os/connectivity/mbedtls/source/platform_util.c
+)
+
+set(unittest-test-sources
+  FOTAEmulator/FOTAEmulator.cpp
+  FOTAEmulator/test_FOTAEmulator.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-fakes-event-queue
+      mbed-fakes-ble
+      mbed-stubs-drivers
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
+
+# Standalone emulator, run with --help for its options
+add_executable(fota-emulator
+  ${unittest-sources}
+  FOTAEmulator/FOTAEmulator.cpp
+  FOTAEmulator/fota_emulator.cpp
+)
+
+target_include_directories(fota-emulator
+  PRIVATE
+      ${unittest-includes}
+)
+
+target_link_libraries(fota-emulator
+  PRIVATE
+      mbed-fakes-event-queue
+      mbed-fakes-ble
+      mbed-stubs-drivers
+      mbed-headers-base
+      mbed-headers-platform
+)
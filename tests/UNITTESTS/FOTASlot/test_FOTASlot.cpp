@@ -0,0 +1,315 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "FOTASlot.h"
+#include "FOTASlotRegistry.h"
+#include "events/EventQueue.h"
+#include "blockdevice/HeapBlockDevice.h"
+#include "platform/Span.h"
+
+#include <string.h>
+
+#define BD_SIZE 0x8000
+#define BD_READ_SIZE 1
+#define BD_PROGRAM_SIZE 4
+#define BD_ERASE_SIZE 0x400
+#define BD_ERASE_VALUE 0xFF
+
+#define WRITE_CHUNK_SIZE 128
+
+/**
+ * HeapBlockDevice that actually erases, and counts the erase() calls made to it
+ */
+class ErasingBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+    ErasingBlockDevice() :
+        mbed::HeapBlockDevice(BD_SIZE, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE) {
+    }
+
+    int erase(bd_addr_t addr, bd_size_t size) override {
+        erase_count++;
+        uint8_t blank[BD_ERASE_SIZE];
+        memset(blank, BD_ERASE_VALUE, sizeof(blank));
+        for(bd_size_t offset = 0; offset < size; offset += BD_ERASE_SIZE) {
+            int err = mbed::HeapBlockDevice::program(blank, addr + offset, BD_ERASE_SIZE);
+            if(err) {
+                return err;
+            }
+        }
+        return BD_ERROR_OK;
+    }
+
+    int get_erase_value() const override {
+        return BD_ERASE_VALUE;
+    }
+
+    int erase_count = 0;
+};
+
+class TestFOTASlot : public testing::Test {
+
+protected:
+
+    virtual void SetUp()
+    {
+        bd.init();
+
+        /* Start from a dirty BlockDevice so the blank check doesn't skip anything */
+        uint8_t dirty[BD_ERASE_SIZE];
+        memset(dirty, 0, sizeof(dirty));
+        for(bd_addr_t addr = 0; addr < BD_SIZE; addr += BD_ERASE_SIZE) {
+            bd.program(dirty, addr, sizeof(dirty));
+        }
+    }
+
+    virtual void TearDown()
+    {
+        bd.deinit();
+    }
+
+    bool is_erased(bd_addr_t addr, bd_size_t size) {
+        uint8_t buf[BD_ERASE_SIZE];
+        for(bd_addr_t offset = 0; offset < size; offset += sizeof(buf)) {
+            bd.read(buf, addr + offset, sizeof(buf));
+            for(size_t i = 0; i < sizeof(buf); i++) {
+                if(buf[i] != BD_ERASE_VALUE) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Write data to the slot the way the handler does, waiting for the queue
+     * whenever the staging buffers are full
+     */
+    void write(FOTASlot &slot, const uint8_t *data, size_t size) {
+        size_t offset = 0;
+        while(offset < size) {
+            size_t chunk = (size - offset) < WRITE_CHUNK_SIZE ? (size - offset) : WRITE_CHUNK_SIZE;
+            int err = slot.get_writer().write(mbed::make_const_Span(data + offset, chunk));
+            if(err == PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL) {
+                queue.dispatch_once();
+                continue;
+            }
+            ASSERT_EQ(err, BD_ERROR_OK);
+            offset += chunk;
+            slot.erase_ahead();
+        }
+    }
+
+    events::EventQueue queue;
+    ErasingBlockDevice bd;
+};
+
+/**
+ * A session only waits for the start of the slot to be erased, the rest is
+ * erased ahead of the write address
+ */
+TEST_F(TestFOTASlot, test_begin)
+{
+    FOTASlot slot(bd, queue, queue);
+    int erased = 0;
+    slot.set_erase_callback([&](int result) {
+        ASSERT_EQ(result, BD_ERROR_OK);
+        erased++;
+    });
+
+    ASSERT_EQ(slot.get_writer().reset(0), 0);
+    slot.begin(0);
+    ASSERT_FALSE(slot.is_ready());
+
+    while(!slot.is_ready()) {
+        queue.dispatch_once();
+    }
+
+    /* The trailer is erased up front, then the start of the slot */
+    bd_size_t trailer_size = slot.get_trailer_size();
+    ASSERT_GT(trailer_size, 0);
+    ASSERT_TRUE(is_erased(BD_SIZE - trailer_size, trailer_size));
+    ASSERT_TRUE(is_erased(0, BD_ERASE_SIZE));
+    ASSERT_FALSE(is_erased(BD_SIZE - trailer_size - BD_ERASE_SIZE, BD_ERASE_SIZE));
+    ASSERT_EQ(erased, 2);
+
+    /* Whatever is left is erased synchronously when flushing */
+    uint8_t data[BD_ERASE_SIZE];
+    memset(data, 0x5A, sizeof(data));
+    ASSERT_EQ(slot.get_writer().write(mbed::make_const_Span(data, sizeof(data))), BD_ERROR_OK);
+    ASSERT_TRUE(slot.flush());
+
+    uint8_t readback[BD_ERASE_SIZE];
+    bd.read(readback, 0, sizeof(readback));
+    ASSERT_EQ(memcmp(readback, data, sizeof(data)), 0);
+}
+
+/**
+ * Data arriving faster than the slot is erased ahead of it (the queue isn't
+ * dispatched) waits in the staging buffers until the erase catches up
+ */
+TEST_F(TestFOTASlot, test_write_past_erase)
+{
+    FOTASlot slot(bd, queue, queue);
+
+    ASSERT_EQ(slot.get_writer().reset(0), 0);
+    slot.begin(0);
+    while(!slot.is_ready()) {
+        queue.dispatch_once();
+    }
+
+    static uint8_t data[BD_SIZE / 2];
+    for(size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (i * 3);
+    }
+    ASSERT_EQ(slot.get_writer().write(mbed::make_const_Span(data, sizeof(data))),
+            PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL);
+    ASSERT_EQ(slot.get_writer().get_programmed_address(), 0u);
+
+    write(slot, data, sizeof(data));
+    ASSERT_TRUE(slot.flush());
+
+    static uint8_t readback[sizeof(data)];
+    bd.read(readback, 0, sizeof(readback));
+    ASSERT_EQ(memcmp(readback, data, sizeof(data)), 0);
+}
+
+/**
+ * A prepared slot is erased in the background up to the trailer, and a
+ * session started at its beginning carries on from there
+ */
+TEST_F(TestFOTASlot, test_prepare)
+{
+    FOTASlot slot(bd, queue, queue);
+
+    slot.prepare();
+    ASSERT_TRUE(slot.is_prepared());
+    while(!slot.is_ready()) {
+        queue.dispatch_once();
+    }
+
+    /* Nothing is written to the slot, but erasing carries on */
+    while(!is_erased(0, BD_SIZE)) {
+        queue.dispatch_once();
+    }
+    int erase_count = bd.erase_count;
+
+    ASSERT_EQ(slot.get_writer().reset(0), 0);
+    slot.begin(0);
+    ASSERT_FALSE(slot.is_prepared());
+    ASSERT_TRUE(slot.is_ready());
+
+    uint8_t data[BD_SIZE / 2];
+    memset(data, 0xA5, sizeof(data));
+    write(slot, data, sizeof(data));
+    while(!queue.empty()) {
+        queue.dispatch_once();
+    }
+    ASSERT_TRUE(slot.flush());
+
+    ASSERT_EQ(bd.erase_count, erase_count);
+    uint8_t readback[BD_SIZE / 2];
+    bd.read(readback, 0, sizeof(readback));
+    ASSERT_EQ(memcmp(readback, data, sizeof(data)), 0);
+}
+
+/**
+ * Starting a session while the slot is still being prepared restarts the
+ * erase from the session's address, with the same (embedded) eraser
+ */
+TEST_F(TestFOTASlot, test_restart_erase)
+{
+    FOTASlot slot(bd, queue, queue);
+    int erased = 0;
+    slot.set_erase_callback([&](int result) {
+        ASSERT_EQ(result, BD_ERROR_OK);
+        erased++;
+    });
+
+    slot.prepare();
+    queue.dispatch_once();
+
+    bd_addr_t resume_addr = 4 * BD_ERASE_SIZE;
+    ASSERT_EQ(slot.get_writer().reset(resume_addr), 0);
+    slot.begin(resume_addr);
+    ASSERT_FALSE(slot.is_ready());
+
+    while(!slot.is_ready()) {
+        queue.dispatch_once();
+    }
+
+    ASSERT_TRUE(is_erased(resume_addr, BD_ERASE_SIZE));
+    ASSERT_EQ(slot.get_writer().get_programmed_address(), resume_addr);
+
+    /* Only the restarted erase reports, trailer first then the start of the session */
+    ASSERT_EQ(erased, 2);
+}
+
+/**
+ * A session that doesn't start at the beginning of a prepared slot erases it again
+ */
+TEST_F(TestFOTASlot, test_prepare_resume)
+{
+    FOTASlot slot(bd, queue, queue);
+
+    slot.prepare();
+    while(!queue.empty()) {
+        queue.dispatch_once();
+    }
+
+    /* Something else was written to the slot in the meantime */
+    uint8_t dirty[BD_ERASE_SIZE];
+    memset(dirty, 0, sizeof(dirty));
+    bd.program(dirty, BD_ERASE_SIZE, sizeof(dirty));
+
+    ASSERT_EQ(slot.get_writer().resume(BD_ERASE_SIZE, 0), 0);
+    slot.begin(BD_ERASE_SIZE);
+    ASSERT_FALSE(slot.is_prepared());
+    ASSERT_FALSE(slot.is_ready());
+    while(!slot.is_ready()) {
+        queue.dispatch_once();
+    }
+    ASSERT_TRUE(is_erased(BD_ERASE_SIZE, BD_ERASE_SIZE));
+}
+
+TEST(TestFOTASlotRegistry, test_add_find)
+{
+    events::EventQueue queue;
+    ErasingBlockDevice bd;
+    FOTASlot slots[FOTASlotRegistry::MAX_SLOTS + 1] = {
+        { bd, queue, queue }, { bd, queue, queue }, { bd, queue, queue }, { bd, queue, queue }
+    };
+    FOTASlotRegistry registry;
+
+    ASSERT_EQ(registry.find(FOTASlotRegistry::DEFAULT_IMAGE_ID), nullptr);
+
+    for(size_t i = 0; i < FOTASlotRegistry::MAX_SLOTS; i++) {
+        ASSERT_TRUE(registry.add(i * 2, slots[i]));
+    }
+
+    /* IDs are unique, and the registry is bounded */
+    ASSERT_FALSE(registry.add(FOTASlotRegistry::MAX_SLOTS * 2, slots[FOTASlotRegistry::MAX_SLOTS]));
+    ASSERT_EQ(registry.get_count(), FOTASlotRegistry::MAX_SLOTS);
+
+    ASSERT_EQ(registry.find(2), &slots[1]);
+    ASSERT_EQ(registry.find(3), nullptr);
+    ASSERT_EQ(registry.get_image_id(1), 2);
+}
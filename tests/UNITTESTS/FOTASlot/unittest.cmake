@@ -0,0 +1,35 @@
+
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/platform/mbed-trace/include/
+  ../mbed-os/storage/blockdevice/include/
+  ../mbed-os/events/include
+  ../mbed-os/drivers/include
+)
+
+set(unittest-sources
+  ../FOTASlot.cpp
+  ../FOTASlotRegistry.cpp
+  ../PagedBlockDeviceWriter.cpp
+  ../PeriodicBlockDeviceEraser.cpp
+)
+
+set(unittest-test-sources
+  FOTASlot/test_FOTASlot.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-fakes-event-queue
+      mbed-stubs-drivers
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
@@ -0,0 +1,297 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "LZDecompressor.h"
+#include "platform/Span.h"
+
+#include <string.h>
+#include <vector>
+
+#define HISTORY_SIZE 4096
+#define STASH_SIZE 1024
+#define BUDGET 256
+#define IMAGE_SIZE 0x10000
+
+/**
+ * Greedy reference compressor producing the format LZDecompressor expects
+ * (the same scheme as scripts/compress_image.py)
+ */
+class StreamBuilder
+{
+public:
+    std::vector<uint8_t> compress(const std::vector<uint8_t> &data, uint32_t window) {
+        stream.clear();
+        put_u32(LZDecompressor::STREAM_MAGIC);
+        put_u32(data.size());
+        put_u32(window);
+
+        size_t pos = 0;
+        size_t literal_start = 0;
+        while(pos < data.size()) {
+            size_t best_length = 0;
+            size_t best_offset = 0;
+            size_t first = (pos > window) ? (pos - window) : 0;
+            for(size_t candidate = first; candidate < pos; candidate++) {
+                size_t length = 0;
+                while(((pos + length) < data.size()) && (data[candidate + length] == data[pos + length])) {
+                    length++;
+                }
+                if(length > best_length) {
+                    best_length = length;
+                    best_offset = pos - candidate;
+                }
+            }
+
+            if(best_length < LZDecompressor::MIN_MATCH) {
+                pos++;
+                continue;
+            }
+
+            sequence(data, literal_start, pos - literal_start, best_offset, best_length);
+            pos += best_length;
+            literal_start = pos;
+        }
+
+        /* The last sequence only has literals */
+        sequence(data, literal_start, data.size() - literal_start, 0, 0);
+        return stream;
+    }
+
+    void sequence(const std::vector<uint8_t> &data, size_t literal_start, size_t literal_length,
+            size_t offset, size_t match_length) {
+        size_t match_code = (match_length != 0) ? (match_length - LZDecompressor::MIN_MATCH) : 0;
+        stream.push_back((uint8_t) (((literal_length < 15 ? literal_length : 15) << 4) |
+                (match_code < 15 ? match_code : 15)));
+        if(literal_length >= 15) {
+            put_length(literal_length - 15);
+        }
+        stream.insert(stream.end(), data.begin() + literal_start, data.begin() + literal_start + literal_length);
+
+        if(match_length != 0) {
+            stream.push_back((uint8_t) offset);
+            stream.push_back((uint8_t) (offset >> 8));
+            if(match_code >= 15) {
+                put_length(match_code - 15);
+            }
+        }
+    }
+
+    void put_length(size_t length) {
+        while(length >= 255) {
+            stream.push_back(255);
+            length -= 255;
+        }
+        stream.push_back((uint8_t) length);
+    }
+
+    void put_u32(uint32_t value) {
+        for(int i = 0; i < 4; i++) {
+            stream.push_back((uint8_t) (value >> (8 * i)));
+        }
+    }
+
+    std::vector<uint8_t> stream;
+};
+
+class TestLZDecompressor : public testing::Test {
+
+protected:
+
+    virtual void SetUp()
+    {
+        decompressor.set_output_callback(mbed::callback(this, &TestLZDecompressor::on_output));
+        decompressor.reset();
+    }
+
+    int on_output(mbed::Span<const uint8_t> data) {
+        EXPECT_LE((size_t) data.size(), (size_t) BUDGET);
+        output.insert(output.end(), data.begin(), data.end());
+        return 0;
+    }
+
+    /**
+     * Feed the stream in fragment_size chunks, decompressing it one budget
+     * at a time the way the event handler does between binary stream writes
+     */
+    int decompress(const std::vector<uint8_t> &stream, size_t fragment_size) {
+        for(size_t offset = 0; offset < stream.size(); offset += fragment_size) {
+            size_t chunk = (stream.size() - offset) < fragment_size ? (stream.size() - offset) : fragment_size;
+            int err = decompressor.feed(mbed::make_const_Span(stream.data() + offset, chunk));
+            if(err) {
+                return err;
+            }
+
+            while(decompressor.has_pending_output()) {
+                int produced = decompressor.run(BUDGET);
+                if(produced < 0) {
+                    return produced;
+                }
+                EXPECT_LE((size_t) produced, (size_t) BUDGET);
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * Firmware-like data: repeated instruction patterns with varying
+     * operands, a constant table and erased (0xFF) padding
+     */
+    std::vector<uint8_t> make_image(size_t size) {
+        std::vector<uint8_t> image(size);
+        uint32_t lfsr = 0xACE1u;
+        for(size_t i = 0; i < size; i += 4) {
+            lfsr = (lfsr >> 1) ^ (-(lfsr & 1u) & 0xB400u);
+            if((i % 0x4000) >= 0x3C00) {
+                memset(&image[i], 0xFF, 4);
+            } else if((lfsr & 3) == 0) {
+                image[i] = (uint8_t) lfsr;
+                image[i + 1] = (uint8_t) (lfsr >> 8);
+                image[i + 2] = (uint8_t) (i >> 4);
+                image[i + 3] = 0x20;
+            } else {
+                static const uint8_t opcodes[][4] = {
+                    { 0x00, 0x28, 0x02, 0xD0 }, { 0x10, 0xB5, 0x04, 0x46 },
+                    { 0x70, 0x47, 0x00, 0xBF }, { 0xFF, 0xF7, 0x00, 0xF8 },
+                };
+                memcpy(&image[i], opcodes[lfsr % 4], 4);
+                image[i + 2] = (uint8_t) (lfsr & 0x0F);
+            }
+        }
+        return image;
+    }
+
+    uint8_t history[HISTORY_SIZE];
+    uint8_t stash[STASH_SIZE];
+    LZDecompressor decompressor = LZDecompressor(history, stash);
+    std::vector<uint8_t> output;
+};
+
+/**
+ * The output must match the original data whatever the fragment size
+ */
+TEST_F(TestLZDecompressor, test_round_trip)
+{
+    const size_t fragment_sizes[] = { 1, 7, 128, 244 };
+
+    std::vector<uint8_t> image = make_image(0x4000);
+    StreamBuilder builder;
+    std::vector<uint8_t> stream = builder.compress(image, HISTORY_SIZE);
+
+    for(size_t fragment_size : fragment_sizes) {
+        decompressor.reset();
+        output.clear();
+
+        ASSERT_EQ(decompress(stream, fragment_size), 0) << "fragment size " << fragment_size;
+        ASSERT_TRUE(decompressor.is_complete());
+        ASSERT_FALSE(decompressor.has_pending_output());
+        ASSERT_EQ(decompressor.get_output_size(), image.size());
+        ASSERT_EQ(output, image) << "fragment size " << fragment_size;
+    }
+
+    ASSERT_LT(stream.size(), image.size()) << "compressed size: " << stream.size()
+            << " bytes for a " << image.size() << " byte image";
+}
+
+/**
+ * Long runs are encoded as overlapping matches with extended lengths
+ */
+TEST_F(TestLZDecompressor, test_long_run)
+{
+    std::vector<uint8_t> image(5000, 0xFF);
+    image[0] = 0x12;
+    StreamBuilder builder;
+    std::vector<uint8_t> stream = builder.compress(image, HISTORY_SIZE);
+    ASSERT_LT(stream.size(), (size_t) 64);
+
+    ASSERT_EQ(decompress(stream, 244), 0);
+    ASSERT_TRUE(decompressor.is_complete());
+    ASSERT_EQ(output, image);
+}
+
+TEST_F(TestLZDecompressor, test_bad_magic)
+{
+    StreamBuilder builder;
+    builder.put_u32(0x12345678);
+    builder.put_u32(16);
+    builder.put_u32(HISTORY_SIZE);
+
+    ASSERT_EQ(decompress(builder.stream, 128), LZDecompressor::TRANSFORM_ERROR_INVALID_STREAM);
+    ASSERT_FALSE(decompressor.is_complete());
+}
+
+TEST_F(TestLZDecompressor, test_window_too_large)
+{
+    StreamBuilder builder;
+    builder.put_u32(LZDecompressor::STREAM_MAGIC);
+    builder.put_u32(16);
+    builder.put_u32(HISTORY_SIZE * 2);
+
+    ASSERT_EQ(decompress(builder.stream, 128), LZDecompressor::TRANSFORM_ERROR_INVALID_STREAM);
+}
+
+TEST_F(TestLZDecompressor, test_offset_before_start)
+{
+    const uint8_t literals[] = { 1, 2, 3, 4 };
+    StreamBuilder builder;
+    builder.put_u32(LZDecompressor::STREAM_MAGIC);
+    builder.put_u32(16);
+    builder.put_u32(HISTORY_SIZE);
+    /* 4 literals, then a match reaching 8 bytes back */
+    builder.stream.push_back(0x40);
+    builder.stream.insert(builder.stream.end(), literals, literals + sizeof(literals));
+    builder.stream.push_back(8);
+    builder.stream.push_back(0);
+
+    ASSERT_EQ(decompress(builder.stream, 128), LZDecompressor::TRANSFORM_ERROR_INVALID_STREAM);
+    ASSERT_EQ(output.size(), sizeof(literals));
+}
+
+TEST_F(TestLZDecompressor, test_match_past_output_size)
+{
+    const uint8_t literals[] = { 1, 2, 3, 4 };
+    StreamBuilder builder;
+    builder.put_u32(LZDecompressor::STREAM_MAGIC);
+    builder.put_u32(8);
+    builder.put_u32(HISTORY_SIZE);
+    /* 4 literals, then a 6 byte match where only 4 bytes are left */
+    builder.stream.push_back(0x42);
+    builder.stream.insert(builder.stream.end(), literals, literals + sizeof(literals));
+    builder.stream.push_back(1);
+    builder.stream.push_back(0);
+
+    ASSERT_EQ(decompress(builder.stream, 128), LZDecompressor::TRANSFORM_ERROR_INVALID_STREAM);
+}
+
+/**
+ * A whole image worth of stream, fed as a 2M PHY link would
+ * (throughput and RAM are reported by FOTABenchmark)
+ */
+TEST_F(TestLZDecompressor, test_large_image)
+{
+    std::vector<uint8_t> image = make_image(IMAGE_SIZE);
+    StreamBuilder builder;
+    std::vector<uint8_t> stream = builder.compress(image, HISTORY_SIZE);
+
+    ASSERT_EQ(decompress(stream, 244), 0);
+    ASSERT_TRUE(decompressor.is_complete());
+    ASSERT_EQ(output, image);
+}
@@ -0,0 +1,26 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+)
+
+set(unittest-sources
+  ../StreamTransform.cpp
+  ../LZDecompressor.cpp
+)
+
+set(unittest-test-sources
+  LZDecompressor/test_LZDecompressor.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
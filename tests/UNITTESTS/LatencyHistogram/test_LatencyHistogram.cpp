@@ -0,0 +1,62 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "LatencyHistogram.h"
+
+using namespace std::chrono;
+
+/**
+ * Latencies land in the bucket whose range covers them, the last bucket takes the rest
+ */
+TEST(TestLatencyHistogram, test_buckets)
+{
+    LatencyHistogram histogram;
+
+    histogram.record(microseconds(0));
+    histogram.record(microseconds(249));
+    histogram.record(microseconds(250));
+    histogram.record(microseconds(999));
+    histogram.record(microseconds(1000));
+    histogram.record(seconds(1));
+
+    ASSERT_EQ(histogram.get_count(0), 2);
+    ASSERT_EQ(histogram.get_count(1), 1);
+    ASSERT_EQ(histogram.get_count(2), 1);
+    ASSERT_EQ(histogram.get_count(3), 1);
+    ASSERT_EQ(histogram.get_count(LatencyHistogram::BUCKET_COUNT - 1), 1);
+    ASSERT_EQ(histogram.get_total(), 6);
+    ASSERT_EQ(histogram.get_max(), seconds(1));
+
+    ASSERT_EQ(LatencyHistogram::get_bucket_limit(2), milliseconds(1));
+}
+
+TEST(TestLatencyHistogram, test_reset)
+{
+    LatencyHistogram histogram;
+    histogram.record(milliseconds(5));
+    histogram.reset();
+
+    for(size_t i = 0; i < LatencyHistogram::BUCKET_COUNT; i++) {
+        ASSERT_EQ(histogram.get_count(i), 0);
+    }
+    ASSERT_EQ(histogram.get_total(), 0);
+    ASSERT_EQ(histogram.get_max().count(), 0);
+}
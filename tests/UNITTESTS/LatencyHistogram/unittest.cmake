@@ -0,0 +1,22 @@
+
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+)
+
+set(unittest-sources
+  ../LatencyHistogram.cpp
+)
+
+set(unittest-test-sources
+  LatencyHistogram/test_LatencyHistogram.cpp
+)
+
+link_libraries(
+  PRIVATE
+      gmock_main
+)
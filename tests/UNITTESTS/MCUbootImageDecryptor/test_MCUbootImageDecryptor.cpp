@@ -0,0 +1,239 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#include "gtest/gtest.h"
+
+#include "MCUbootImageDecryptor.h"
+#include "platform/Span.h"
+
+#include "bootutil/image.h"
+#include "mbedtls/aes.h"
+
+#include <string.h>
+#include <vector>
+
+#define KEYSTREAM_SIZE 512
+#define PAGE_SIZE 256
+#define IMAGE_BODY_SIZE 0x4000
+
+/* RFC 3394 test vector 4.1: 128-bit key data wrapped with a 128-bit KEK */
+static const uint8_t KEK[] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+static const uint8_t IMAGE_KEY[] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+};
+static const uint8_t WRAPPED_KEY[] = {
+    0x1F, 0xA6, 0x8B, 0x0A, 0x81, 0x12, 0xB4, 0x47, 0xAE, 0xF3, 0x4B, 0xD8,
+    0xFB, 0x5A, 0x7B, 0x82, 0x9D, 0x3E, 0x86, 0x23, 0x71, 0xD2, 0xCF, 0xE5
+};
+
+class TestMCUbootImageDecryptor : public testing::Test {
+
+protected:
+
+    virtual void SetUp()
+    {
+        decryptor.set_output_callback(mbed::callback(this, &TestMCUbootImageDecryptor::on_output));
+        ASSERT_TRUE(decryptor.set_kek(KEK));
+    }
+
+    void on_output(mbed::Span<const uint8_t> data) {
+        output.insert(output.end(), data.begin(), data.end());
+    }
+
+    /**
+     * Build a plaintext MCUboot image the way imgtool does for an encrypted
+     * one: the header is flagged, and the ENC_KW128 TLV holds the wrapped key
+     */
+    std::vector<uint8_t> make_image(size_t body_size, uint16_t hdr_size, uint32_t flags) {
+        struct image_header header;
+        memset(&header, 0, sizeof(header));
+        header.ih_magic = IMAGE_MAGIC;
+        header.ih_hdr_size = hdr_size;
+        header.ih_img_size = body_size;
+        header.ih_flags = flags;
+
+        std::vector<uint8_t> image(hdr_size + body_size, 0);
+        memcpy(image.data(), &header, sizeof(header));
+        for(size_t i = hdr_size; i < image.size(); i++) {
+            image[i] = (uint8_t) ((i * 7) ^ (i >> 9));
+        }
+
+        struct image_tlv_info info = { IMAGE_TLV_INFO_MAGIC,
+                sizeof(struct image_tlv_info) + sizeof(struct image_tlv) + sizeof(WRAPPED_KEY) };
+        struct image_tlv tlv = { IMAGE_TLV_ENC_KW128, sizeof(WRAPPED_KEY) };
+        image.insert(image.end(), (uint8_t *) &info, (uint8_t *) &info + sizeof(info));
+        image.insert(image.end(), (uint8_t *) &tlv, (uint8_t *) &tlv + sizeof(tlv));
+        image.insert(image.end(), WRAPPED_KEY, WRAPPED_KEY + sizeof(WRAPPED_KEY));
+        return image;
+    }
+
+    /** Encrypt the body as MCUboot expects: AES-128-CTR from a zero counter at the start of the body */
+    std::vector<uint8_t> encrypt(const std::vector<uint8_t> &image) {
+        struct image_header header;
+        memcpy(&header, image.data(), sizeof(header));
+
+        std::vector<uint8_t> encrypted = image;
+        mbedtls_aes_context aes;
+        mbedtls_aes_init(&aes);
+        mbedtls_aes_setkey_enc(&aes, IMAGE_KEY, 128);
+        uint8_t counter[16] = { 0 };
+        uint8_t stream_block[16];
+        size_t nc_off = 0;
+        mbedtls_aes_crypt_ctr(&aes, header.ih_img_size, &nc_off, counter, stream_block,
+                image.data() + header.ih_hdr_size, encrypted.data() + header.ih_hdr_size);
+        mbedtls_aes_free(&aes);
+        return encrypted;
+    }
+
+    /**
+     * Feed the image in fragment_size chunks, precomputing a page of
+     * keystream after every page worth of data if requested
+     */
+    int decrypt(const std::vector<uint8_t> &image, size_t fragment_size, bool precompute) {
+        size_t next_page = 0;
+        for(size_t offset = 0; offset < image.size(); offset += fragment_size) {
+            if(precompute && (offset >= next_page)) {
+                decryptor.precompute(PAGE_SIZE);
+                next_page += PAGE_SIZE;
+            }
+
+            size_t chunk = (image.size() - offset) < fragment_size ? (image.size() - offset) : fragment_size;
+            int err = decryptor.update(mbed::make_const_Span(image.data() + offset, chunk));
+            if(err) {
+                return err;
+            }
+        }
+
+        return 0;
+    }
+
+    uint8_t keystream[KEYSTREAM_SIZE];
+    MCUbootImageDecryptor decryptor = MCUbootImageDecryptor(keystream);
+    std::vector<uint8_t> output;
+};
+
+TEST_F(TestMCUbootImageDecryptor, test_unwrap_key)
+{
+    ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+    ASSERT_TRUE(decryptor.is_active());
+
+    /* The unwrapped key must be the one the test vector wraps */
+    std::vector<uint8_t> image = make_image(64, sizeof(struct image_header), IMAGE_F_ENCRYPTED_AES128);
+    ASSERT_EQ(decrypt(encrypt(image), 64, false), 0);
+    ASSERT_EQ(output, image);
+}
+
+TEST_F(TestMCUbootImageDecryptor, test_invalid_wrapped_key)
+{
+    uint8_t wrapped_key[sizeof(WRAPPED_KEY)];
+    memcpy(wrapped_key, WRAPPED_KEY, sizeof(wrapped_key));
+    wrapped_key[10] ^= 0x01;
+
+    ASSERT_EQ(decryptor.start(wrapped_key), MCUbootImageDecryptor::DECRYPT_ERROR_INVALID_KEY);
+    ASSERT_FALSE(decryptor.is_active());
+
+    ASSERT_EQ(decryptor.start(mbed::make_const_Span(WRAPPED_KEY, 16)), MCUbootImageDecryptor::DECRYPT_ERROR_INVALID_KEY);
+}
+
+TEST_F(TestMCUbootImageDecryptor, test_no_kek)
+{
+    uint8_t other_keystream[KEYSTREAM_SIZE];
+    MCUbootImageDecryptor other(other_keystream);
+    ASSERT_FALSE(other.set_kek(mbed::make_const_Span(KEK, 8)));
+    ASSERT_EQ(other.start(WRAPPED_KEY), MCUbootImageDecryptor::DECRYPT_ERROR_NO_KEK);
+}
+
+/**
+ * The output must match the plaintext image whatever the fragment size,
+ * with the header padding and TLV area passed through
+ */
+TEST_F(TestMCUbootImageDecryptor, test_decrypt)
+{
+    const size_t fragment_sizes[] = { 1, 7, 128, 244 };
+
+    std::vector<uint8_t> image = make_image(IMAGE_BODY_SIZE + 5, 0x200, IMAGE_F_ENCRYPTED_AES128);
+    std::vector<uint8_t> encrypted = encrypt(image);
+    ASSERT_NE(encrypted, image);
+
+    for(size_t fragment_size : fragment_sizes) {
+        for(bool precompute : { false, true }) {
+            output.clear();
+            ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+            ASSERT_EQ(decrypt(encrypted, fragment_size, precompute), 0) << "fragment size " << fragment_size;
+            ASSERT_EQ(output, image) << "fragment size " << fragment_size << (precompute ? ", precomputed" : "");
+        }
+    }
+}
+
+/**
+ * Keystream precomputed ahead of each page is enough to never stall
+ */
+TEST_F(TestMCUbootImageDecryptor, test_precompute)
+{
+    std::vector<uint8_t> encrypted = encrypt(make_image(IMAGE_BODY_SIZE, 0x200, IMAGE_F_ENCRYPTED_AES128));
+
+    ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+    ASSERT_EQ(decryptor.precompute(KEYSTREAM_SIZE * 2), (size_t) KEYSTREAM_SIZE);
+    ASSERT_EQ(decryptor.get_precompute_space(), (size_t) 0);
+    ASSERT_EQ(decryptor.precompute(PAGE_SIZE), (size_t) 0);
+
+    ASSERT_EQ(decrypt(encrypted, 244, true), 0);
+    ASSERT_EQ(decryptor.get_stalled_blocks(), 0u);
+
+    output.clear();
+    ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+    ASSERT_EQ(decrypt(encrypted, 244, false), 0);
+    ASSERT_EQ(decryptor.get_stalled_blocks(), (uint32_t) (IMAGE_BODY_SIZE / MCUbootImageDecryptor::BLOCK_SIZE));
+}
+
+TEST_F(TestMCUbootImageDecryptor, test_not_encrypted)
+{
+    std::vector<uint8_t> image = make_image(IMAGE_BODY_SIZE, sizeof(struct image_header), 0);
+
+    ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+    ASSERT_EQ(decrypt(image, 128, false), MCUbootImageDecryptor::DECRYPT_ERROR_NOT_ENCRYPTED);
+
+    /* Nothing past the header is output */
+    ASSERT_EQ(output.size(), sizeof(struct image_header));
+}
+
+TEST_F(TestMCUbootImageDecryptor, test_stop)
+{
+    std::vector<uint8_t> image = make_image(IMAGE_BODY_SIZE, sizeof(struct image_header), IMAGE_F_ENCRYPTED_AES128);
+
+    ASSERT_EQ(decryptor.start(WRAPPED_KEY), 0);
+    decryptor.precompute(PAGE_SIZE);
+    decryptor.stop();
+    ASSERT_FALSE(decryptor.is_active());
+    ASSERT_EQ(decryptor.get_precomputed(), (size_t) 0);
+
+    ASSERT_EQ(decrypt(encrypt(image), 128, false), 0);
+    ASSERT_TRUE(output.empty());
+
+    /* While stopped, the keystream buffer may hold something else */
+    memset(keystream, 0xA5, sizeof(keystream));
+    decryptor.stop();
+    ASSERT_EQ(decryptor.start(mbed::make_const_Span(WRAPPED_KEY, 16)), MCUbootImageDecryptor::DECRYPT_ERROR_INVALID_KEY);
+    for(uint8_t byte : keystream) {
+        ASSERT_EQ(byte, 0xA5);
+    }
+}
@@ -0,0 +1,30 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/connectivity/mbedtls/include
+  ../mcuboot/boot/bootutil/include
+)
+
+set(unittest-sources
+  ../MCUbootImageDecryptor.cpp
+  ../mbed-os/connectivity/mbedtls/source/aes.c
+  ../mbed-os/connectivity/mbedtls/source/aesni.c
+  ../mbed-os/connectivity/mbedtls/source/platform_util.c
+)
+
+set(unittest-test-sources
+  MCUbootImageDecryptor/test_MCUbootImageDecryptor.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
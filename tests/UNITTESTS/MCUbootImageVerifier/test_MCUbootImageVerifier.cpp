@@ -0,0 +1,277 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+
+#include "gtest/gtest.h"
+
+#include "MCUbootImageVerifier.h"
+#include "platform/Span.h"
+
+#include "bootutil/image.h"
+#include "mbedtls/sha256.h"
+
+#include <string.h>
+#include <vector>
+
+#define IMAGE_BODY_SIZE 0x1000
+
+/* Protected TLV carried by the test images, as imgtool adds for the security counter */
+#define PROTECTED_TLV_TYPE 0x50
+
+/* Signature TLV, longer than the verifier buffers fields */
+#define SIGNATURE_TLV_TYPE 0x20
+#define SIGNATURE_SIZE 72
+
+class TestMCUbootImageVerifier : public testing::Test {
+
+protected:
+
+    /**
+     * Build an MCUboot image the way imgtool lays it out: header (padded to
+     * hdr_size), body, optional protected TLVs, then the unprotected TLVs
+     * holding the SHA-256 of everything before them and a signature
+     */
+    std::vector<uint8_t> make_image(uint16_t hdr_size, bool protected_tlvs) {
+        std::vector<uint8_t> protected_area;
+        if(protected_tlvs) {
+            const uint8_t value[] = { 1, 0, 0, 0 };
+            struct image_tlv_info info = {
+                IMAGE_TLV_PROT_INFO_MAGIC, sizeof(struct image_tlv_info) + sizeof(struct image_tlv) + sizeof(value)
+            };
+            struct image_tlv tlv = { PROTECTED_TLV_TYPE, sizeof(value) };
+            append(protected_area, &info, sizeof(info));
+            append(protected_area, &tlv, sizeof(tlv));
+            append(protected_area, value, sizeof(value));
+        }
+
+        struct image_header header;
+        memset(&header, 0, sizeof(header));
+        header.ih_magic = IMAGE_MAGIC;
+        header.ih_hdr_size = hdr_size;
+        header.ih_img_size = IMAGE_BODY_SIZE;
+        header.ih_protect_tlv_size = protected_area.size();
+
+        std::vector<uint8_t> image(hdr_size + IMAGE_BODY_SIZE);
+        memcpy(image.data(), &header, sizeof(header));
+        for(size_t i = hdr_size; i < image.size(); i++) {
+            image[i] = (uint8_t) ((i * 13) ^ (i >> 8));
+        }
+        image.insert(image.end(), protected_area.begin(), protected_area.end());
+
+        uint8_t hash[MCUbootImageVerifier::HASH_SIZE];
+        mbedtls_sha256_ret(image.data(), image.size(), hash, 0);
+
+        uint8_t signature[SIGNATURE_SIZE];
+        memset(signature, 0xA5, sizeof(signature));
+
+        struct image_tlv_info info = { IMAGE_TLV_INFO_MAGIC, sizeof(struct image_tlv_info) +
+                sizeof(struct image_tlv) + sizeof(hash) + sizeof(struct image_tlv) + sizeof(signature) };
+        struct image_tlv hash_tlv = { IMAGE_TLV_SHA256, sizeof(hash) };
+        struct image_tlv signature_tlv = { SIGNATURE_TLV_TYPE, sizeof(signature) };
+        append(image, &info, sizeof(info));
+        append(image, &hash_tlv, sizeof(hash_tlv));
+        append(image, hash, sizeof(hash));
+        append(image, &signature_tlv, sizeof(signature_tlv));
+        append(image, signature, sizeof(signature));
+        return image;
+    }
+
+    void append(std::vector<uint8_t> &data, const void *value, size_t size) {
+        data.insert(data.end(), (const uint8_t *) value, (const uint8_t *) value + size);
+    }
+
+    /** Feed the image to the verifier in fragment_size chunks */
+    void feed(const std::vector<uint8_t> &image, size_t fragment_size) {
+        for(size_t offset = 0; offset < image.size(); offset += fragment_size) {
+            size_t chunk = ((image.size() - offset) < fragment_size) ? (image.size() - offset) : fragment_size;
+            verifier.update(mbed::make_const_Span(image.data() + offset, chunk));
+        }
+    }
+
+    /** Offset of the unprotected TLV info, right after the hashed region */
+    size_t tlv_info_offset(const std::vector<uint8_t> &image) {
+        struct image_header header;
+        memcpy(&header, image.data(), sizeof(header));
+        return header.ih_hdr_size + header.ih_img_size + header.ih_protect_tlv_size;
+    }
+
+    MCUbootImageVerifier verifier;
+};
+
+/**
+ * A well-formed image verifies whatever the fragment size, and padding past
+ * its end is ignored
+ */
+TEST_F(TestMCUbootImageVerifier, test_valid_image)
+{
+    const size_t fragment_sizes[] = { 1, 7, 128, 244 };
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+
+    for(size_t fragment_size : fragment_sizes) {
+        verifier.reset();
+        feed(image, fragment_size);
+        ASSERT_TRUE(verifier.has_header()) << "fragment size " << fragment_size;
+        ASSERT_TRUE(verifier.is_complete()) << "fragment size " << fragment_size;
+        ASSERT_EQ(verifier.get_image_size(), image.size());
+        ASSERT_TRUE(verifier.verify()) << "fragment size " << fragment_size;
+    }
+
+    std::vector<uint8_t> padding(0x100, 0xFF);
+    verifier.update(mbed::make_const_Span(padding.data(), padding.size()));
+    ASSERT_TRUE(verifier.verify());
+}
+
+/**
+ * A header padded to a larger ih_hdr_size is hashed along with its padding
+ */
+TEST_F(TestMCUbootImageVerifier, test_padded_header)
+{
+    std::vector<uint8_t> image = make_image(0x200, false);
+
+    feed(image, 244);
+    ASSERT_TRUE(verifier.verify());
+}
+
+/**
+ * The header is collected across fragments that split it anywhere
+ */
+TEST_F(TestMCUbootImageVerifier, test_split_header)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+
+    for(size_t split = 1; split < sizeof(struct image_header); split++) {
+        verifier.reset();
+        verifier.update(mbed::make_const_Span(image.data(), split));
+        ASSERT_FALSE(verifier.has_header()) << "split at " << split;
+
+        verifier.update(mbed::make_const_Span(image.data() + split, image.size() - split));
+        ASSERT_TRUE(verifier.has_header()) << "split at " << split;
+        ASSERT_EQ(verifier.get_header().ih_img_size, (uint32_t) IMAGE_BODY_SIZE);
+        ASSERT_TRUE(verifier.verify()) << "split at " << split;
+    }
+}
+
+/**
+ * Protected TLVs are part of the hashed region, the unprotected ones follow them
+ */
+TEST_F(TestMCUbootImageVerifier, test_protected_tlvs)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), true);
+
+    feed(image, 7);
+    ASSERT_TRUE(verifier.is_complete());
+    ASSERT_TRUE(verifier.verify());
+
+    /* Changing a protected TLV changes the hash */
+    std::vector<uint8_t> tampered = image;
+    tampered[sizeof(struct image_header) + IMAGE_BODY_SIZE + sizeof(struct image_tlv_info) +
+            sizeof(struct image_tlv)] ^= 0x01;
+    verifier.reset();
+    feed(tampered, 7);
+    ASSERT_TRUE(verifier.is_complete());
+    ASSERT_FALSE(verifier.verify());
+}
+
+TEST_F(TestMCUbootImageVerifier, test_hash_mismatch)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+    image[sizeof(struct image_header) + (IMAGE_BODY_SIZE / 2)] ^= 0x80;
+
+    feed(image, 128);
+    ASSERT_TRUE(verifier.is_complete());
+    ASSERT_FALSE(verifier.verify());
+}
+
+TEST_F(TestMCUbootImageVerifier, test_bad_header_magic)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+    image[0] ^= 0x01;
+
+    feed(image, 128);
+    ASSERT_FALSE(verifier.has_header());
+    ASSERT_FALSE(verifier.is_complete());
+    ASSERT_FALSE(verifier.verify());
+}
+
+TEST_F(TestMCUbootImageVerifier, test_bad_tlv_info_magic)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+    image[tlv_info_offset(image)] ^= 0x01;
+
+    feed(image, 128);
+    ASSERT_FALSE(verifier.is_complete());
+    ASSERT_FALSE(verifier.verify());
+}
+
+/**
+ * A TLV claiming to extend past the TLV area makes the image invalid
+ */
+TEST_F(TestMCUbootImageVerifier, test_tlv_past_end)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+    struct image_tlv tlv;
+    size_t tlv_offset = tlv_info_offset(image) + sizeof(struct image_tlv_info);
+    memcpy(&tlv, &image[tlv_offset], sizeof(tlv));
+    tlv.it_len = 0x1000;
+    memcpy(&image[tlv_offset], &tlv, sizeof(tlv));
+
+    feed(image, 128);
+    ASSERT_FALSE(verifier.is_complete());
+    ASSERT_FALSE(verifier.verify());
+}
+
+/**
+ * An image cut short anywhere doesn't verify, including right after the hash TLV
+ */
+TEST_F(TestMCUbootImageVerifier, test_truncated_image)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+    const size_t cuts[] = {
+        sizeof(struct image_header) / 2,
+        sizeof(struct image_header) + (IMAGE_BODY_SIZE / 2),
+        tlv_info_offset(image) + 2,
+        tlv_info_offset(image) + sizeof(struct image_tlv_info) + sizeof(struct image_tlv) +
+                MCUbootImageVerifier::HASH_SIZE,
+        image.size() - 1
+    };
+
+    for(size_t cut : cuts) {
+        verifier.reset();
+        verifier.update(mbed::make_const_Span(image.data(), cut));
+        ASSERT_FALSE(verifier.is_complete()) << "cut at " << cut;
+        ASSERT_FALSE(verifier.verify()) << "cut at " << cut;
+    }
+}
+
+/**
+ * An image without a SHA-256 TLV can't be verified
+ */
+TEST_F(TestMCUbootImageVerifier, test_missing_hash_tlv)
+{
+    std::vector<uint8_t> image = make_image(sizeof(struct image_header), false);
+    struct image_tlv tlv;
+    size_t tlv_offset = tlv_info_offset(image) + sizeof(struct image_tlv_info);
+    memcpy(&tlv, &image[tlv_offset], sizeof(tlv));
+    tlv.it_type = SIGNATURE_TLV_TYPE;
+    memcpy(&image[tlv_offset], &tlv, sizeof(tlv));
+
+    feed(image, 128);
+    ASSERT_TRUE(verifier.is_complete());
+    ASSERT_FALSE(verifier.verify());
+}
@@ -0,0 +1,29 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/connectivity/mbedtls/include
+  ../mcuboot/boot/bootutil/include
+)
+
+set(unittest-sources
+  ../MCUbootImageVerifier.cpp
+  ../mbed-os/connectivity/mbedtls/source/sha256.c
+  ../mbed-os/connectivity/mbedtls/source/platform_util.c
+)
+
+set(unittest-test-sources
+  MCUbootImageVerifier/test_MCUbootImageVerifier.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
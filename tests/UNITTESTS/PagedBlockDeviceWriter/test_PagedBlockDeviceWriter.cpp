@@ -0,0 +1,573 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "PagedBlockDeviceWriter.h"
+#include "events/EventQueue.h"
+#include "blockdevice/HeapBlockDevice.h"
+#include "platform/Span.h"
+
+#include <string.h>
+
+#define BD_SIZE 0x1000
+#define BD_READ_SIZE 1
+#define BD_PROGRAM_SIZE 4
+#define BD_ERASE_SIZE 0x1000
+#define BD_ERASE_VALUE 0xFF
+
+#define PAGE_SIZE 256
+#define PAGE_COUNT 4
+#define FRAGMENT_SIZE 128
+#define IMAGE_SIZE 0xA10
+
+/**
+ * HeapBlockDevice that counts the number of program() calls made to it,
+ * and can be made to program one byte wrong
+ */
+class ProgramCountingBlockDevice : public mbed::HeapBlockDevice
+{
+public:
+    ProgramCountingBlockDevice() :
+        mbed::HeapBlockDevice(BD_SIZE, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE) {
+    }
+
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size) override {
+        program_count++;
+        if((corrupt_addr >= addr) && (corrupt_addr < (addr + size))) {
+            uint8_t corrupted[BD_SIZE];
+            memcpy(corrupted, buffer, size);
+            corrupted[corrupt_addr - addr] ^= 0x01;
+            return mbed::HeapBlockDevice::program(corrupted, addr, size);
+        }
+        return mbed::HeapBlockDevice::program(buffer, addr, size);
+    }
+
+    int get_erase_value() const override {
+        return BD_ERASE_VALUE;
+    }
+
+    int program_count = 0;
+
+    /* Address of the byte that doesn't get programmed right */
+    bd_addr_t corrupt_addr = BD_SIZE;
+};
+
+class TestPagedBlockDeviceWriter : public testing::Test {
+
+protected:
+
+    virtual void SetUp()
+    {
+        bd.init();
+        for(int i = 0; i < IMAGE_SIZE; i++) {
+            image[i] = (uint8_t) (i * 7);
+        }
+    }
+
+    virtual void TearDown()
+    {
+        bd.deinit();
+    }
+
+    /**
+     * Write the test image in fragment_size chunks, the way the binary stream delivers it.
+     * The queue is dispatched once between fragments, as if BLE events were interleaved.
+     */
+    void write_image(PagedBlockDeviceWriter &writer, size_t fragment_size) {
+        for(size_t offset = 0; offset < IMAGE_SIZE; offset += fragment_size) {
+            size_t chunk = (IMAGE_SIZE - offset) < fragment_size ? (IMAGE_SIZE - offset) : fragment_size;
+            ASSERT_EQ(writer.write(mbed::make_const_Span(image + offset, chunk)), BD_ERROR_OK);
+            queue.dispatch_once();
+        }
+    }
+
+    /**
+     * Write data in fragment sized chunks as fast as the ring allows, the
+     * queue is only dispatched when a chunk doesn't fit
+     */
+    void write_stream(PagedBlockDeviceWriter &writer, const uint8_t *data, size_t size) {
+        size_t offset = 0;
+        while(offset < size) {
+            size_t chunk = (size - offset) < FRAGMENT_SIZE ? (size - offset) : FRAGMENT_SIZE;
+            int err = writer.write(mbed::make_const_Span(data + offset, chunk));
+            if(err == PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL) {
+                queue.dispatch_once();
+                continue;
+            }
+            ASSERT_EQ(err, BD_ERROR_OK);
+            offset += chunk;
+        }
+    }
+
+    /** Dispatch the queue until all full pages are programmed */
+    void drain(PagedBlockDeviceWriter &writer) {
+        while(writer.get_buffered_size() >= PAGE_SIZE) {
+            queue.dispatch_once();
+        }
+    }
+
+    events::EventQueue queue;
+    ProgramCountingBlockDevice bd;
+    uint8_t page_pool[PAGE_SIZE * PAGE_COUNT];
+    uint8_t image[IMAGE_SIZE];
+};
+
+/**
+ * Programming every fragment directly takes one program() call per fragment,
+ * the writer should only take one per page (plus one for the final partial page)
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_program_count_reduced)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    write_image(writer, FRAGMENT_SIZE);
+    drain(writer);
+    ASSERT_EQ(bd.program_count, IMAGE_SIZE / PAGE_SIZE);
+
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+    ASSERT_EQ(bd.program_count, (IMAGE_SIZE / PAGE_SIZE) + 1);
+
+    int unbuffered_count = (IMAGE_SIZE + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+    ASSERT_LT(bd.program_count, unbuffered_count) << "program() calls: " << bd.program_count
+            << " buffered vs " << unbuffered_count << " unbuffered";
+
+    uint8_t readback[IMAGE_SIZE];
+    ASSERT_EQ(bd.read(readback, 0, IMAGE_SIZE), BD_ERROR_OK);
+    ASSERT_EQ(memcmp(readback, image, IMAGE_SIZE), 0);
+}
+
+/**
+ * Fragments that don't divide the page size must still be programmed in whole pages
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_unaligned_fragments)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    write_image(writer, 100);
+    drain(writer);
+    ASSERT_EQ(writer.get_programmed_address(), (IMAGE_SIZE / PAGE_SIZE) * PAGE_SIZE);
+    ASSERT_EQ(writer.get_address(), IMAGE_SIZE);
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+
+    uint8_t readback[IMAGE_SIZE];
+    ASSERT_EQ(bd.read(readback, 0, IMAGE_SIZE), BD_ERROR_OK);
+    ASSERT_EQ(memcmp(readback, image, IMAGE_SIZE), 0);
+}
+
+/**
+ * A partial final page is padded up to the program size with the erase value
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_flush_partial_page)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, 10)), BD_ERROR_OK);
+    ASSERT_EQ(bd.program_count, 0);
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+    ASSERT_EQ(bd.program_count, 1);
+    ASSERT_EQ(writer.get_programmed_address(), 12);
+
+    uint8_t readback[12];
+    ASSERT_EQ(bd.read(readback, 0, sizeof(readback)), BD_ERROR_OK);
+    ASSERT_EQ(memcmp(readback, image, 10), 0);
+    ASSERT_EQ(readback[10], BD_ERASE_VALUE);
+    ASSERT_EQ(readback[11], BD_ERASE_VALUE);
+
+    /* Flushing an empty page does nothing */
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+    ASSERT_EQ(bd.program_count, 1);
+}
+
+/**
+ * Starting at an address that isn't page-aligned, the first page is shortened
+ * so that every following page is programmed aligned
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_unaligned_start)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(3), 1);
+    ASSERT_EQ(writer.reset(PAGE_SIZE / 2), 0);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE)), BD_ERROR_OK);
+    drain(writer);
+    ASSERT_EQ(bd.program_count, 1);
+    ASSERT_EQ(writer.get_programmed_address(), PAGE_SIZE);
+}
+
+/**
+ * Writes return before anything is programmed, pages are programmed from the queue
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_programming_is_deferred)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, 2 * PAGE_SIZE)), BD_ERROR_OK);
+    ASSERT_EQ(bd.program_count, 0);
+
+    /* One page is programmed per event */
+    queue.dispatch_once();
+    ASSERT_EQ(bd.program_count, 1);
+    queue.dispatch_once();
+    ASSERT_EQ(bd.program_count, 2);
+    ASSERT_EQ(writer.get_buffered_size(), 0);
+}
+
+/**
+ * Backpressure is asserted at the high watermark and released once drained
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_backpressure)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+    writer.set_high_watermark(2);
+
+    int transitions = 0;
+    bool backpressured = false;
+    writer.set_backpressure_callback([&](bool state) {
+        transitions++;
+        backpressured = state;
+    });
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE + 10)), BD_ERROR_OK);
+    ASSERT_FALSE(backpressured);
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE)), BD_ERROR_OK);
+    ASSERT_TRUE(backpressured);
+    ASSERT_TRUE(writer.is_backpressured());
+
+    /* Still backpressured until every full page is programmed */
+    queue.dispatch_once();
+    ASSERT_TRUE(backpressured);
+    queue.dispatch_once();
+    ASSERT_FALSE(backpressured);
+    ASSERT_EQ(transitions, 2);
+}
+
+/**
+ * A write that doesn't fit in the ring fails without writing anything or
+ * programming synchronously, and fits once the queued events made room
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_ring_overflow)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    bool backpressured = false;
+    writer.set_backpressure_callback([&](bool state) {
+        backpressured = state;
+    });
+
+    /* Past the high watermark, which leaves room for data still in flight */
+    writer.set_high_watermark(PAGE_COUNT);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, sizeof(page_pool) - 10)), BD_ERROR_OK);
+    ASSERT_FALSE(backpressured);
+
+    int program_count = bd.program_count;
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + sizeof(page_pool) - 10, 20)),
+            PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL);
+    ASSERT_EQ(bd.program_count, program_count);
+    ASSERT_EQ(writer.get_address(), (bd_addr_t) (sizeof(page_pool) - 10));
+    ASSERT_TRUE(backpressured);
+
+    queue.dispatch_once();
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + sizeof(page_pool) - 10, 20)), BD_ERROR_OK);
+
+    write_stream(writer, image + sizeof(page_pool) + 10, IMAGE_SIZE - sizeof(page_pool) - 10);
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+
+    uint8_t readback[IMAGE_SIZE];
+    ASSERT_EQ(bd.read(readback, 0, IMAGE_SIZE), BD_ERROR_OK);
+    ASSERT_EQ(memcmp(readback, image, IMAGE_SIZE), 0);
+}
+
+/**
+ * A full ring held back by the program limit (eg: an erase that fell behind)
+ * stays full until the limit is raised
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_ring_full_at_program_limit)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+    writer.set_program_limit(0);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, sizeof(page_pool))), BD_ERROR_OK);
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + sizeof(page_pool), 1)),
+            PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL);
+    queue.dispatch_once();
+    ASSERT_EQ(writer.get_free_size(), 0u);
+
+    writer.set_program_limit(PAGE_SIZE);
+    queue.dispatch_once();
+    ASSERT_EQ(writer.get_free_size(), (bd_size_t) PAGE_SIZE);
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + sizeof(page_pool), 1)), BD_ERROR_OK);
+    ASSERT_EQ(writer.get_error(), BD_ERROR_OK);
+}
+
+/**
+ * Full pages can be programmed on the spot to make room, the partial page is kept
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_program_full_pages)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, (2 * PAGE_SIZE) + 10)), BD_ERROR_OK);
+    ASSERT_EQ(writer.program_full_pages(), BD_ERROR_OK);
+    ASSERT_EQ(writer.get_programmed_address(), (bd_addr_t) (2 * PAGE_SIZE));
+    ASSERT_EQ(writer.get_buffered_size(), 10u);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + (2 * PAGE_SIZE) + 10, IMAGE_SIZE - (2 * PAGE_SIZE) - 10)),
+            PagedBlockDeviceWriter::WRITER_ERROR_RING_FULL);
+}
+
+/**
+ * A stream resumed from a page boundary with the CRC state saved there must
+ * end up with the same CRC as an uninterrupted stream
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_resume_crc)
+{
+    PagedBlockDeviceWriter::CRC_t ct;
+    uint32_t expected_crc;
+    ct.compute(image, IMAGE_SIZE, &expected_crc);
+
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    bd_addr_t resume_addr = 0;
+    uint32_t resume_crc_state = 0;
+    writer.set_program_callback([&](bd_addr_t addr, uint32_t crc_state) {
+        if(addr == (2 * PAGE_SIZE)) {
+            resume_addr = addr;
+            resume_crc_state = crc_state;
+        }
+    });
+
+    /* Interrupt the stream part way through the third page */
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, (2 * PAGE_SIZE) + 100)), BD_ERROR_OK);
+    drain(writer);
+    ASSERT_EQ(resume_addr, 2 * PAGE_SIZE);
+
+    ASSERT_EQ(writer.resume(resume_addr, resume_crc_state), 0);
+    write_stream(writer, image + resume_addr, IMAGE_SIZE - resume_addr);
+    drain(writer);
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+
+    ASSERT_EQ(writer.get_crc(), expected_crc);
+
+    uint8_t readback[IMAGE_SIZE];
+    ASSERT_EQ(bd.read(readback, 0, IMAGE_SIZE), BD_ERROR_OK);
+    ASSERT_EQ(memcmp(readback, image, IMAGE_SIZE), 0);
+}
+
+/**
+ * With a callback queue, pages are programmed from the program queue but
+ * callbacks are only run when the callback queue is dispatched, and those
+ * left over from before a reset are dropped
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_callback_queue)
+{
+    events::EventQueue callback_queue;
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    writer.set_callback_queue(&callback_queue);
+    ASSERT_EQ(writer.reset(0), 0);
+    writer.set_high_watermark(1);
+
+    int programmed = 0;
+    bool backpressured = false;
+    writer.set_program_callback([&](bd_addr_t addr, uint32_t crc_state) {
+        programmed++;
+    });
+    writer.set_backpressure_callback([&](bool state) {
+        backpressured = state;
+    });
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE)), BD_ERROR_OK);
+    ASSERT_TRUE(backpressured);
+
+    queue.dispatch_once();
+    ASSERT_EQ(bd.program_count, 1);
+    ASSERT_EQ(writer.get_programmed_address(), PAGE_SIZE);
+    ASSERT_EQ(programmed, 0);
+    ASSERT_TRUE(backpressured);
+
+    /* Backpressure is released on the writing side */
+    callback_queue.dispatch_once();
+    ASSERT_EQ(programmed, 1);
+    ASSERT_FALSE(backpressured);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + PAGE_SIZE, PAGE_SIZE)), BD_ERROR_OK);
+    queue.dispatch_once();
+    ASSERT_EQ(bd.program_count, 2);
+
+    ASSERT_EQ(writer.reset(0), 0);
+    callback_queue.dispatch_once();
+    ASSERT_EQ(programmed, 1);
+}
+
+/**
+ * The written CRC covers buffered data as soon as it is written, and
+ * doesn't change when flush pads the last page
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_written_crc)
+{
+    PagedBlockDeviceWriter::CRC_t ct;
+    uint32_t expected_crc;
+    ct.compute(image, IMAGE_SIZE, &expected_crc);
+
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    write_image(writer, FRAGMENT_SIZE);
+    ASSERT_GT(writer.get_buffered_size(), 0);
+    ASSERT_EQ(writer.get_written_crc(), expected_crc);
+
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+    ASSERT_EQ(writer.get_written_crc(), expected_crc);
+}
+
+/**
+ * With verify enabled, a page that doesn't read back as it was written
+ * fails the writer, and nothing after it is programmed
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_verify)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+    writer.set_verify(true);
+
+    int error = 0;
+    writer.set_error_callback([&](int err) {
+        error = err;
+    });
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE)), BD_ERROR_OK);
+    drain(writer);
+    ASSERT_EQ(writer.get_error(), BD_ERROR_OK);
+
+    bd.corrupt_addr = PAGE_SIZE + 100;
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + PAGE_SIZE, 2 * PAGE_SIZE)), BD_ERROR_OK);
+    queue.dispatch_once();
+
+    ASSERT_EQ(error, PagedBlockDeviceWriter::WRITER_ERROR_VERIFY_FAILED);
+    ASSERT_EQ(writer.get_programmed_address(), PAGE_SIZE);
+    ASSERT_EQ(bd.program_count, 2);
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, FRAGMENT_SIZE)),
+            PagedBlockDeviceWriter::WRITER_ERROR_VERIFY_FAILED);
+}
+
+/**
+ * Data placed in the ring ahead of the write address is programmed once the
+ * data before it is written, without being copied again
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_reserve)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    /* Place the second fragment first */
+    mbed::Span<uint8_t> placement = writer.reserve(FRAGMENT_SIZE, FRAGMENT_SIZE);
+    ASSERT_EQ((size_t) placement.size(), (size_t) FRAGMENT_SIZE);
+    memcpy(placement.data(), image + FRAGMENT_SIZE, FRAGMENT_SIZE);
+    ASSERT_EQ(writer.get_address(), 0u);
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, FRAGMENT_SIZE)), BD_ERROR_OK);
+
+    /* Once it is next, it is at the write address */
+    ASSERT_EQ(writer.reserve(0, FRAGMENT_SIZE).data(), placement.data());
+    ASSERT_EQ(writer.write(placement), BD_ERROR_OK);
+
+    write_stream(writer, image + (2 * FRAGMENT_SIZE), IMAGE_SIZE - (2 * FRAGMENT_SIZE));
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+
+    uint8_t readback[IMAGE_SIZE];
+    ASSERT_EQ(bd.read(readback, 0, IMAGE_SIZE), BD_ERROR_OK);
+    ASSERT_EQ(memcmp(readback, image, IMAGE_SIZE), 0);
+}
+
+/**
+ * Nothing can be placed past what the ring holds, or across its end
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_reserve_limits)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    ASSERT_EQ((size_t) writer.reserve(0, sizeof(page_pool)).size(), sizeof(page_pool));
+    ASSERT_TRUE(writer.reserve(1, sizeof(page_pool)).empty());
+
+    /* The first page isn't programmed yet, so the ring only holds what's left of the pool past it */
+    writer.set_program_limit(0);
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE + 1)), BD_ERROR_OK);
+    ASSERT_TRUE(writer.reserve(sizeof(page_pool) - PAGE_SIZE - 1, 1).empty());
+
+    /* Once it is, the ring wraps around to it */
+    writer.set_program_limit(PAGE_SIZE);
+    queue.dispatch_once();
+    ASSERT_EQ(writer.get_programmed_address(), (bd_addr_t) PAGE_SIZE);
+    ASSERT_EQ(writer.reserve(sizeof(page_pool) - PAGE_SIZE - 1, 1).data(), page_pool);
+    ASSERT_TRUE(writer.reserve(sizeof(page_pool) - PAGE_SIZE - 2, 2).empty());
+}
+
+/**
+ * Every program operation is counted and timed, until the writer is reset
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_program_stats)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+
+    write_image(writer, FRAGMENT_SIZE);
+    ASSERT_EQ(writer.flush(), BD_ERROR_OK);
+
+    PagedBlockDeviceWriter::program_stats_t stats = writer.get_program_stats();
+    ASSERT_EQ(stats.count, (uint32_t) bd.program_count);
+    ASSERT_LE(stats.min, stats.max);
+    ASSERT_GE(stats.total, stats.max);
+
+    ASSERT_EQ(writer.reset(0), 0);
+    ASSERT_EQ(writer.get_program_stats().count, 0u);
+}
+
+/**
+ * The free space shrinks as data is written, and grows back as pages are programmed
+ */
+TEST_F(TestPagedBlockDeviceWriter, test_free_size)
+{
+    PagedBlockDeviceWriter writer(bd, queue, page_pool, PAGE_SIZE);
+    ASSERT_EQ(writer.reset(0), 0);
+    ASSERT_EQ(writer.get_free_size(), (bd_size_t) sizeof(page_pool));
+
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image, PAGE_SIZE + FRAGMENT_SIZE)), BD_ERROR_OK);
+    ASSERT_EQ(writer.get_free_size(), (bd_size_t) (sizeof(page_pool) - PAGE_SIZE - FRAGMENT_SIZE));
+
+    /* Writing exactly the free space doesn't program anything synchronously */
+    int program_count = bd.program_count;
+    bd_size_t free_size = writer.get_free_size();
+    ASSERT_EQ(writer.write(mbed::make_const_Span(image + PAGE_SIZE + FRAGMENT_SIZE, free_size)), BD_ERROR_OK);
+    ASSERT_EQ(bd.program_count, program_count);
+    ASSERT_EQ(writer.get_free_size(), 0u);
+
+    queue.dispatch_once();
+    ASSERT_EQ(writer.get_free_size(), (bd_size_t) PAGE_SIZE);
+}
@@ -0,0 +1,30 @@
+
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+  ../mbed-os/storage/blockdevice/include/
+  ../mbed-os/events/include
+  ../mbed-os/drivers/include
+)
+
+set(unittest-sources
+  ../PagedBlockDeviceWriter.cpp
+)
+
+set(unittest-test-sources
+  PagedBlockDeviceWriter/test_PagedBlockDeviceWriter.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-fakes-event-queue
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
@@ -46,6 +46,7 @@ using namespace std::chrono;
  */
 class HeapBlockDeviceRealErase : public mbed::HeapBlockDevice
 {
+public:
     HeapBlockDeviceRealErase(bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase, uint8_t erase_val = 0xFF) :
         mbed::HeapBlockDevice(size, read, program, erase), _erase_val(erase_val) {
     }
@@ -53,6 +54,8 @@ class HeapBlockDeviceRealErase : public mbed::HeapBlockDevice
 
     virtual int erase(bd_addr_t addr, bd_size_t size) {
 
+        erase_count++;
+
         if (!_is_initialized) {
             return BD_ERROR_DEVICE_ERROR;
         }
@@ -68,10 +71,18 @@ class HeapBlockDeviceRealErase : public mbed::HeapBlockDevice
 
         memset(buf, _erase_val, size);
 
-        return program(buf, addr, size);
+        int err = program(buf, addr, size);
+        free(buf);
+        return err;
+
+    }
 
+    virtual int get_erase_value() const {
+        return _erase_val;
     }
 
+    int erase_count = 0;
+
 protected:
 
     uint8_t _erase_val;
@@ -123,7 +134,7 @@ TEST_F(TestPeriodicBlockDeviceEraser, test_erase)
      *
      * But according to the BlockDevice API, this is the "correct" way to do it.
      */
-    err = eraser.start_erase(0, BD_SIZE, nullptr, BD_ERASE_SIZE);
+    err = eraser.start_erase(0, BD_SIZE, BD_ERASE_SIZE, nullptr);
 
     /* Dispatch the queue until the eraser is done */
     while(!eraser.is_done()) {
@@ -147,18 +158,130 @@ TEST_F(TestPeriodicBlockDeviceEraser, test_erase)
     assert_buffer_equals(readback_buffer, pgm_val);
 
     /* Now, erase the block device again with the PeriodicBlockDeviceEraser */
-    err = eraser.start_erase(0, BD_SIZE, nullptr, BD_ERASE_SIZE);
+    err = eraser.start_erase(0, BD_SIZE, BD_ERASE_SIZE, nullptr);
 
     /* Dispatch the queue until the eraser is done */
     while(!eraser.is_done()) {
         queue.dispatch_once();
     }
 
-    uint8_t test_buffer[BD_SIZE];
     err = bd.read(test_buffer, 0, BD_SIZE);
     ASSERT_EQ(err, BD_ERROR_OK);
     assert_buffer_equals(test_buffer, BD_ERASE_VALUE);
 
 }
 
+/**
+ * Test that blank-checking skips erasing sectors that are already blank
+ */
+TEST_F(TestPeriodicBlockDeviceEraser, test_blank_check)
+{
+    events::EventQueue queue;
+    HeapBlockDeviceRealErase bd(BD_SIZE, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE, BD_ERASE_VALUE);
+    bd.init();
+    PeriodicBlockDeviceEraser eraser(bd, queue);
+    eraser.set_blank_check(true);
+
+    /* Start from a fully erased block device */
+    int err = eraser.start_erase(0, BD_SIZE);
+    ASSERT_EQ(err, 0);
+    while(!eraser.is_done()) {
+        queue.dispatch_once();
+    }
+    int erase_count = bd.erase_count;
+
+    /* Dirty a single byte in the middle of the second sector */
+    uint8_t pgm_val = 0x18;
+    err = bd.program(&pgm_val, BD_ERASE_SIZE + (BD_ERASE_SIZE / 2), 1);
+    ASSERT_EQ(err, BD_ERROR_OK);
+
+    /* Only the dirty sector should be erased */
+    err = eraser.start_erase(0, BD_SIZE);
+    ASSERT_EQ(err, 0);
+    while(!eraser.is_done()) {
+        queue.dispatch_once();
+    }
+    ASSERT_EQ(eraser.get_error(), BD_ERROR_OK);
+    ASSERT_EQ(bd.erase_count, erase_count + 1);
+    ASSERT_EQ(eraser.get_skipped_sectors(), (BD_SIZE / BD_ERASE_SIZE) - 1);
+    ASSERT_EQ(eraser.get_erased_sectors(), 1u);
+
+    uint8_t test_buffer[BD_SIZE];
+    err = bd.read(test_buffer, 0, BD_SIZE);
+    ASSERT_EQ(err, BD_ERROR_OK);
+    assert_buffer_equals(test_buffer, BD_ERASE_VALUE);
+}
+
 
+
+/**
+ * Test time-budget mode and progress reporting
+ */
+TEST_F(TestPeriodicBlockDeviceEraser, test_time_budget)
+{
+    events::EventQueue queue;
+    HeapBlockDeviceRealErase bd(BD_SIZE, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE, BD_ERASE_VALUE);
+    bd.init();
+    PeriodicBlockDeviceEraser eraser(bd, queue);
+    eraser.set_time_budget(10ms, 1ms);
+
+    int err = eraser.start_erase(0, BD_SIZE);
+    ASSERT_EQ(err, 0);
+    ASSERT_EQ(eraser.get_bytes_erased(), 0);
+
+    /* The first slice erases a single region to measure how long it takes */
+    queue.dispatch_once();
+    ASSERT_EQ(eraser.get_bytes_erased(), BD_ERASE_SIZE);
+    ASSERT_GE(eraser.get_batch_size(), 1);
+
+    while(!eraser.is_done()) {
+        queue.dispatch_once();
+    }
+
+    ASSERT_EQ(eraser.get_error(), BD_ERROR_OK);
+    ASSERT_EQ(eraser.get_bytes_erased(), BD_SIZE);
+    ASSERT_EQ(eraser.get_estimated_time_remaining().count(), 0);
+    ASSERT_EQ(bd.erase_count, BD_SIZE / BD_ERASE_SIZE);
+
+    uint8_t test_buffer[BD_SIZE];
+    err = bd.read(test_buffer, 0, BD_SIZE);
+    ASSERT_EQ(err, BD_ERROR_OK);
+    assert_buffer_equals(test_buffer, BD_ERASE_VALUE);
+}
+
+/**
+ * With a callback queue, completion is only reported once that queue is
+ * dispatched, and not at all if the operation was cancelled first
+ */
+TEST_F(TestPeriodicBlockDeviceEraser, test_callback_queue)
+{
+    events::EventQueue queue;
+    events::EventQueue callback_queue;
+    HeapBlockDeviceRealErase bd(BD_SIZE, BD_READ_SIZE, BD_PROGRAM_SIZE, BD_ERASE_SIZE, BD_ERASE_VALUE);
+    bd.init();
+    PeriodicBlockDeviceEraser eraser(bd, queue);
+    eraser.set_callback_queue(&callback_queue);
+
+    int completions = 0;
+    int err = eraser.start_erase(0, BD_ERASE_SIZE, [&](int result) {
+        ASSERT_EQ(result, BD_ERROR_OK);
+        completions++;
+    });
+    ASSERT_EQ(err, 0);
+
+    queue.dispatch_once();
+    ASSERT_TRUE(eraser.is_done());
+    ASSERT_EQ(completions, 0);
+
+    callback_queue.dispatch_once();
+    ASSERT_EQ(completions, 1);
+
+    err = eraser.start_erase(0, BD_ERASE_SIZE, [&](int result) {
+        completions++;
+    });
+    ASSERT_EQ(err, 0);
+    queue.dispatch_once();
+    eraser.cancel();
+    callback_queue.dispatch_once();
+    ASSERT_EQ(completions, 1);
+}
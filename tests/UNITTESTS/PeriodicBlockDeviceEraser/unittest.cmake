@@ -13,6 +13,7 @@ set(unittest-includes ${unittest-includes}
   ../mbed-os/platform/mbed-trace/include/
   ../mbed-os/storage/blockdevice/include/
   ../mbed-os/events/include
+  ../mbed-os/drivers/include
 )
 
 set(unittest-sources
@@ -26,6 +27,7 @@ set(unittest-test-sources
 link_libraries(
   PRIVATE
       mbed-fakes-event-queue
+      mbed-stubs-drivers
       mbed-headers-base
       mbed-headers-platform
       gmock_main
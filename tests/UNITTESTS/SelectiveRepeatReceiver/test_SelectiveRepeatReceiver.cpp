@@ -0,0 +1,306 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#include "gtest/gtest.h"
+
+#include "SelectiveRepeatReceiver.h"
+#include "platform/Span.h"
+
+#include <string.h>
+#include <vector>
+
+#define FRAGMENT_SIZE 16
+#define WINDOW 8
+
+class TestSelectiveRepeatReceiver : public testing::Test {
+
+protected:
+
+    virtual void SetUp()
+    {
+        stream.resize(FRAGMENT_SIZE * 40 + 5);
+        for(size_t i = 0; i < stream.size(); i++) {
+            stream[i] = (uint8_t) (i ^ (i >> 4));
+        }
+
+        receiver.set_output_callback(mbed::callback(this, &TestSelectiveRepeatReceiver::on_output));
+        receiver.reset(FRAGMENT_SIZE);
+    }
+
+    int on_output(mbed::Span<const uint8_t> data) {
+        output.insert(output.end(), data.begin(), data.end());
+        outputs++;
+        return 0;
+    }
+
+    size_t fragment_count() const {
+        return (stream.size() + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+    }
+
+    int send(uint16_t index) {
+        sends++;
+        size_t offset = index * FRAGMENT_SIZE;
+        size_t size = ((stream.size() - offset) < FRAGMENT_SIZE) ? (stream.size() - offset) : FRAGMENT_SIZE;
+        return receiver.receive(index, mbed::make_const_Span(stream.data() + offset, size));
+    }
+
+    std::vector<uint8_t> stream;
+    std::vector<uint8_t> output;
+    size_t outputs = 0;
+    size_t sends = 0;
+    uint8_t buffer[FRAGMENT_SIZE * WINDOW];
+    SelectiveRepeatReceiver receiver = SelectiveRepeatReceiver(buffer);
+};
+
+TEST_F(TestSelectiveRepeatReceiver, test_in_order)
+{
+    for(uint16_t i = 0; i < fragment_count(); i++) {
+        ASSERT_EQ(send(i), 0);
+        ASSERT_FALSE(receiver.check_new_gap());
+    }
+
+    ASSERT_EQ(receiver.get_next_index(), fragment_count());
+    ASSERT_EQ(receiver.get_missing(), 0u);
+    ASSERT_EQ(output, stream);
+}
+
+/**
+ * Only the lost fragments are resent, and the stream still comes out in order
+ */
+TEST_F(TestSelectiveRepeatReceiver, test_lost_fragments_resent)
+{
+    std::vector<uint16_t> lost;
+
+    /* Every 5th fragment is lost the first time around */
+    for(uint16_t i = 0; i < fragment_count(); i++) {
+        if((i % 5) == 2) {
+            lost.push_back(i);
+            continue;
+        }
+
+        ASSERT_EQ(send(i), 0);
+
+        /* The sender resends what the missing bitmap reports once it sees a gap */
+        if(receiver.check_new_gap()) {
+            uint32_t missing = receiver.get_missing();
+            ASSERT_NE(missing, 0u);
+            uint16_t next = receiver.get_next_index();
+            for(uint16_t bit = 0; bit < WINDOW; bit++) {
+                if(missing & (1u << bit)) {
+                    ASSERT_EQ(send(next + bit), 0);
+                }
+            }
+        }
+    }
+
+    ASSERT_EQ(receiver.get_next_index(), fragment_count());
+    ASSERT_EQ(output, stream);
+
+    /* Each fragment was sent exactly once, the lost ones only when resent */
+    ASSERT_EQ(sends, fragment_count());
+    ASSERT_EQ(outputs, fragment_count());
+}
+
+TEST_F(TestSelectiveRepeatReceiver, test_missing_bitmap)
+{
+    ASSERT_EQ(send(0), 0);
+    ASSERT_EQ(send(2), 0);
+    ASSERT_TRUE(receiver.check_new_gap());
+    ASSERT_FALSE(receiver.check_new_gap());
+    ASSERT_EQ(send(3), 0);
+    ASSERT_FALSE(receiver.check_new_gap());
+    ASSERT_EQ(send(6), 0);
+    ASSERT_TRUE(receiver.check_new_gap());
+
+    ASSERT_EQ(receiver.get_next_index(), 1);
+    /* 1, 4 and 5 are missing */
+    ASSERT_EQ(receiver.get_missing(), 0x19u);
+
+    ASSERT_EQ(send(1), 0);
+    ASSERT_EQ(receiver.get_next_index(), 4);
+    ASSERT_EQ(receiver.get_missing(), 0x3u);
+    ASSERT_EQ(output.size(), 4u * FRAGMENT_SIZE);
+}
+
+TEST_F(TestSelectiveRepeatReceiver, test_duplicates_and_out_of_window)
+{
+    ASSERT_EQ(send(0), 0);
+    ASSERT_EQ(send(0), 0);
+    ASSERT_EQ(send(2), 0);
+    ASSERT_EQ(send(2), 0);
+
+    /* Past the window, dropped */
+    ASSERT_EQ(send(1 + WINDOW), 0);
+    ASSERT_EQ(receiver.get_missing(), 0x1u);
+
+    ASSERT_EQ(send(1), 0);
+    ASSERT_EQ(receiver.get_next_index(), 3);
+    ASSERT_EQ(output, std::vector<uint8_t>(stream.begin(), stream.begin() + 3 * FRAGMENT_SIZE));
+}
+
+TEST_F(TestSelectiveRepeatReceiver, test_last_fragment)
+{
+    uint16_t last = fragment_count() - 1;
+    for(uint16_t i = 0; i < last - 2; i++) {
+        ASSERT_EQ(send(i), 0);
+    }
+
+    /* The short last fragment arrives before the two before it */
+    ASSERT_EQ(send(last), 0);
+    ASSERT_EQ(send(last - 1), 0);
+    ASSERT_EQ(send(last - 2), 0);
+    ASSERT_EQ(output, stream);
+
+    /* Nothing can follow the last fragment */
+    receiver.reset(FRAGMENT_SIZE);
+    output.clear();
+    ASSERT_EQ(receiver.receive(3, mbed::make_const_Span(stream.data(), 5)), 0);
+    ASSERT_EQ(send(4), SelectiveRepeatReceiver::RECEIVE_ERROR_INVALID_FRAGMENT);
+}
+
+TEST_F(TestSelectiveRepeatReceiver, test_invalid_size)
+{
+    uint8_t fragment[FRAGMENT_SIZE + 1] = { 0 };
+    ASSERT_EQ(receiver.receive(0, mbed::make_const_Span(fragment, sizeof(fragment))),
+            SelectiveRepeatReceiver::RECEIVE_ERROR_INVALID_FRAGMENT);
+    ASSERT_EQ(receiver.receive(0, mbed::make_const_Span(fragment, 0)),
+            SelectiveRepeatReceiver::RECEIVE_ERROR_INVALID_FRAGMENT);
+    ASSERT_TRUE(output.empty());
+}
+
+/**
+ * Fragment indexes wrap around after 65535
+ */
+TEST_F(TestSelectiveRepeatReceiver, test_index_wraparound)
+{
+    uint8_t fragment[FRAGMENT_SIZE];
+    for(uint32_t i = 0; i < 0x10000; i++) {
+        memset(fragment, (uint8_t) i, sizeof(fragment));
+        ASSERT_EQ(receiver.receive((uint16_t) i, mbed::make_const_Span(fragment, sizeof(fragment))), 0);
+    }
+    output.clear();
+
+    ASSERT_EQ(receiver.get_next_index(), 0);
+    memset(fragment, 1, sizeof(fragment));
+    ASSERT_EQ(receiver.receive(1, mbed::make_const_Span(fragment, sizeof(fragment))), 0);
+    ASSERT_EQ(receiver.get_missing(), 0x1u);
+    memset(fragment, 0, sizeof(fragment));
+    ASSERT_EQ(receiver.receive(0, mbed::make_const_Span(fragment, sizeof(fragment))), 0);
+    ASSERT_EQ(output.size(), 2u * FRAGMENT_SIZE);
+    ASSERT_EQ(output[0], 0);
+    ASSERT_EQ(output[FRAGMENT_SIZE], 1);
+}
+
+/**
+ * Smaller fragments (eg: a small ATT MTU) get a larger window, up to the bitmap size
+ */
+TEST_F(TestSelectiveRepeatReceiver, test_fragment_size)
+{
+    receiver.reset(FRAGMENT_SIZE / 2);
+    ASSERT_EQ(receiver.get_window(), 2u * WINDOW);
+    ASSERT_EQ(receiver.get_fragment_size(), (size_t) FRAGMENT_SIZE / 2);
+
+    receiver.reset(1);
+    ASSERT_EQ(receiver.get_window(), SelectiveRepeatReceiver::MAX_WINDOW);
+
+    ASSERT_EQ(receiver.receive(0, mbed::make_const_Span(stream.data(), 2)),
+            SelectiveRepeatReceiver::RECEIVE_ERROR_INVALID_FRAGMENT);
+    ASSERT_EQ(receiver.receive(1, mbed::make_const_Span(stream.data() + 1, 1)), 0);
+    ASSERT_EQ(receiver.receive(0, mbed::make_const_Span(stream.data(), 1)), 0);
+    ASSERT_EQ(output, std::vector<uint8_t>(stream.begin(), stream.begin() + 2));
+}
+
+/**
+ * Fragments received out of order are stored where the placement callback
+ * says, and output from there
+ */
+TEST_F(TestSelectiveRepeatReceiver, test_placement)
+{
+    /* Stands in for the writer's ring, indexed by stream offset */
+    std::vector<uint8_t> staging(stream.size());
+    size_t placed_outputs = 0;
+
+    receiver.set_placement_callback([&](size_t offset, size_t size) {
+        return mbed::Span<uint8_t>(staging.data() + output.size() + offset, size);
+    });
+    receiver.set_output_callback([&](mbed::Span<const uint8_t> data) {
+        if(data.data() == (staging.data() + output.size())) {
+            placed_outputs++;
+        }
+        output.insert(output.end(), data.begin(), data.end());
+        return 0;
+    });
+
+    /* Send each pair of fragments in reverse order */
+    uint16_t count = fragment_count();
+    for(uint16_t i = 0; i < count; i += 2) {
+        if((i + 1) < count) {
+            ASSERT_EQ(send(i + 1), 0);
+        }
+        ASSERT_EQ(send(i), 0);
+    }
+
+    ASSERT_EQ(output, stream);
+    /* Only the last fragment, which has no pair, is output straight from the fragment written */
+    ASSERT_EQ(count % 2, 1);
+    ASSERT_EQ(placed_outputs, (size_t) (count - 1));
+    ASSERT_EQ(memcmp(staging.data() + FRAGMENT_SIZE, stream.data() + FRAGMENT_SIZE, FRAGMENT_SIZE), 0);
+}
+
+/**
+ * Fragments the output callback can't take yet are kept in the window, and
+ * output in order once resumed
+ */
+TEST_F(TestSelectiveRepeatReceiver, test_output_busy)
+{
+    bool busy = true;
+    receiver.set_output_callback([&](mbed::Span<const uint8_t> data) {
+        if(busy) {
+            return (int) SelectiveRepeatReceiver::RECEIVE_ERROR_OUTPUT_BUSY;
+        }
+        output.insert(output.end(), data.begin(), data.end());
+        return 0;
+    });
+
+    /* In order, then past a gap, while the output is busy */
+    ASSERT_EQ(send(0), 0);
+    ASSERT_EQ(send(1), 0);
+    ASSERT_EQ(send(3), 0);
+    ASSERT_TRUE(receiver.check_new_gap());
+    ASSERT_EQ(receiver.get_next_index(), 0);
+    ASSERT_EQ(receiver.get_missing(), 1u << 2);
+    ASSERT_TRUE(output.empty());
+
+    /* The window doesn't slide past what is kept */
+    ASSERT_EQ(send(WINDOW), 0);
+    ASSERT_EQ(receiver.resume(), 0);
+    ASSERT_TRUE(output.empty());
+
+    busy = false;
+    ASSERT_EQ(receiver.resume(), 0);
+    ASSERT_EQ(receiver.get_next_index(), 2);
+    ASSERT_EQ(send(2), 0);
+
+    for(uint16_t i = 4; i < fragment_count(); i++) {
+        ASSERT_EQ(send(i), 0);
+    }
+
+    ASSERT_EQ(receiver.get_next_index(), fragment_count());
+    ASSERT_EQ(output, stream);
+}
@@ -0,0 +1,25 @@
+####################
+# UNIT TESTS
+####################
+
+set(unittest-includes ${unittest-includes}
+  .
+  ../
+  ../mbed-os/
+  ../mbed-os/platform/include/
+)
+
+set(unittest-sources
+  ../SelectiveRepeatReceiver.cpp
+)
+
+set(unittest-test-sources
+  SelectiveRepeatReceiver/test_SelectiveRepeatReceiver.cpp
+)
+
+link_libraries(
+  PRIVATE
+      mbed-headers-base
+      mbed-headers-platform
+      gmock_main
+)
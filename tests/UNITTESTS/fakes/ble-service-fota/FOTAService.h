@@ -0,0 +1,127 @@
+/*
+ * Mbed-OS Microcontroller Library
+ * Copyright (c) 2020-2021 Embedded Planet
+ * Copyright (c) 2020-2021 ARM Limited
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+#ifndef FAKES_FOTASERVICE_H_
+#define FAKES_FOTASERVICE_H_
+
+#include "ble/gatt/GattCallbackParamTypes.h"
+#include "platform/Callback.h"
+#include "platform/Span.h"
+
+#include <stdint.h>
+
+/**
+ * Host stand-in for the FOTAService of mbed-os-experimental-ble-services
+ *
+ * Only the API used by the event handlers is provided. Rather than sending
+ * notifications to a client, the session and flow control state is recorded
+ * for the test to inspect. The status notifications can also be forwarded
+ * through status_cb (eg: by the FOTA emulator).
+ */
+class FOTAService
+{
+public:
+
+    enum StatusCode_t : uint8_t {
+        FOTA_STATUS_OK = 0,
+        FOTA_STATUS_UPDATE_SUCCESSFUL,
+        FOTA_STATUS_XOFF,
+        FOTA_STATUS_XON,
+        FOTA_STATUS_SYNC_LOST,
+        FOTA_STATUS_UNSPECIFIED_ERROR,
+        FOTA_STATUS_VALIDATION_FAILURE,
+        FOTA_STATUS_INSTALLATION_FAILURE,
+        FOTA_STATUS_OUT_OF_MEMORY,
+        FOTA_STATUS_MEMORY_ERROR,
+        FOTA_STATUS_HARDWARE_ERROR,
+        FOTA_STATUS_NO_FOTA_SESSION
+    };
+
+    enum OpCode_t : uint8_t {
+        FOTA_NO_OP = 0,
+        FOTA_START,
+        FOTA_STOP,
+        FOTA_COMMIT
+    };
+
+    enum {
+        AUTH_CALLBACK_REPLY_ATTERR_UNSUPPORTED_OPCODE = 0x80
+    };
+
+    struct EventHandler {
+        virtual ~EventHandler() { }
+
+        virtual StatusCode_t on_binary_stream_written(FOTAService &svc, mbed::Span<const uint8_t> buffer) {
+            return FOTA_STATUS_OK;
+        }
+
+        virtual GattAuthCallbackReply_t on_control_written(FOTAService &svc, mbed::Span<const uint8_t> buffer) {
+            return AUTH_CALLBACK_REPLY_SUCCESS;
+        }
+    };
+
+public:
+
+    void start_fota_session() {
+        session_started = true;
+    }
+
+    void stop_fota_session() {
+        session_started = false;
+    }
+
+    void set_xoff() {
+        xoff = true;
+        xoff_count++;
+        if(status_cb) {
+            status_cb(FOTA_STATUS_XOFF);
+        }
+    }
+
+    void set_xon() {
+        xoff = false;
+        xon_count++;
+        if(status_cb) {
+            status_cb(FOTA_STATUS_XON);
+        }
+    }
+
+    void notify_status(StatusCode_t status) {
+        last_status = status;
+        if(status_cb) {
+            status_cb(status);
+        }
+    }
+
+public:
+
+    bool session_started = false;
+
+    bool xoff = false;
+    unsigned xoff_count = 0;
+    unsigned xon_count = 0;
+
+    StatusCode_t last_status = FOTA_STATUS_OK;
+
+    /* Called with every status the service would notify the client of */
+    mbed::Callback<void(StatusCode_t)> status_cb;
+
+};
+
+#endif /* FAKES_FOTASERVICE_H_ */